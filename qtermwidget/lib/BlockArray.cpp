@@ -29,151 +29,173 @@
 // System
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <cstdio>
+#include <algorithm>
 
 
 using namespace Konsole;
 
-static int blocksize = 0;
+static size_t blocksize = 0;
 
 BlockArray::BlockArray()
         : size(0),
-        current(size_t(-1)),
-        index(size_t(-1)),
-        lastmap(nullptr),
-        lastmap_index(size_t(-1)),
-        lastblock(nullptr), ion(-1),
-        length(0)
+        first(0),
+        firstSlot(0),
+        length(0),
+        ion(-1),
+        data(nullptr),
+        mappedLength(0),
+        fileSlots(0)
 {
-    // lastmap_index = index = current = size_t(-1);
     if (blocksize == 0) {
-        blocksize = ((sizeof(Block) / getpagesize()) + 1) * getpagesize();
+        // a whole number of pages, so that every block starts on a page
+        const size_t pagesize = getpagesize();
+        blocksize = ((sizeof(Block) + pagesize - 1) / pagesize) * pagesize;
     }
-
 }
 
 BlockArray::~BlockArray()
 {
     setHistorySize(0);
-    Q_ASSERT(!lastblock);
+    Q_ASSERT(!data);
 }
 
-size_t BlockArray::append(Block * block)
+Block * BlockArray::block(size_t i) const
 {
-    if (!size) {
-        return size_t(-1);
-    }
-
-    ++current;
-    if (current >= size) {
-        current = 0;
-    }
+    // the ring has one slot more than its size, for the block being filled
+    const size_t slot = (firstSlot + (i - first)) % (size + 1);
+    return reinterpret_cast<Block *>(data + slot * blocksize);
+}
 
-    int rc;
-    rc = lseek(ion, current * blocksize, SEEK_SET);
-    if (rc < 0) {
-        perror("HistoryBuffer::add.seek");
-        setHistorySize(0);
-        return size_t(-1);
-    }
-    rc = write(ion, block, blocksize);
-    if (rc < 0) {
-        perror("HistoryBuffer::add.write");
-        setHistorySize(0);
+size_t BlockArray::newBlock()
+{
+    if (!size) {
         return size_t(-1);
     }
 
-    length++;
-    if (length > size) {
-        length = size;
+    if (length == size) {
+        // the slot of the oldest block becomes the one to fill next
+        ++first;
+        firstSlot = (firstSlot + 1) % (size + 1);
+    } else {
+        ++length;
     }
 
-    ++index;
+    Block * next = lastBlock();
+    next->size = 0;
+    next->flags = 0;
 
-    delete block;
-    return current;
+    return getCurrent();
 }
 
-size_t BlockArray::newBlock()
+Block * BlockArray::lastBlock() const
 {
     if (!size) {
-        return size_t(-1);
+        return nullptr;
     }
-    append(lastblock);
-
-    lastblock = new Block();
-    return index + 1;
+    return block(first + length);
 }
 
-Block * BlockArray::lastBlock() const
+bool BlockArray::has(size_t i) const
 {
-    return lastblock;
+    return size && i >= first && i - first <= length;
 }
 
-bool BlockArray::has(size_t i) const
+const Block * BlockArray::at(size_t i) const
 {
-    if (i == index + 1) {
-        return true;
+    if (!has(i)) {
+        return nullptr;
     }
+    return block(i);
+}
 
-    if (i > index) {
-        return false;
+void BlockArray::appendExtent(std::vector<Extent> & layout, size_t fileSlot, size_t slots)
+{
+    if (!slots) {
+        return;
     }
-    if (index - i >= length) {
-        return false;
+    if (!layout.empty() && layout.back().fileSlot + layout.back().slots == fileSlot) {
+        layout.back().slots += slots;
+    } else {
+        layout.push_back(Extent{fileSlot, slots});
     }
-    return true;
 }
 
-const Block * BlockArray::at(size_t i)
+void BlockArray::appendRingSlots(std::vector<Extent> & layout, size_t slot, size_t count) const
 {
-    if (i == index + 1) {
-        return lastblock;
+    while (count) {
+        // the slots up to the end of the ring, then the ones it wraps around to
+        size_t n = std::min(count, size + 1 - slot);
+        count -= n;
+
+        size_t start = 0;
+        for (const Extent & extent : extents) {
+            const size_t end = start + extent.slots;
+            if (n && slot < end) {
+                const size_t taken = std::min(n, end - slot);
+                appendExtent(layout, extent.fileSlot + (slot - start), taken);
+                slot += taken;
+                n -= taken;
+            }
+            start = end;
+        }
+        slot = 0;
     }
+}
 
-    if (i == lastmap_index) {
-        return lastmap;
+bool BlockArray::map(const std::vector<Extent> & layout, size_t slots)
+{
+    // reserve the address range first, then map the runs of the file into it
+    const size_t newLength = slots * blocksize;
+    void * reserved = mmap(nullptr, newLength, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        perror("konsole: cannot map history file");
+        return false;
     }
 
-    if (i > index) {
-        qDebug() << "BlockArray::at() i > index\n";
-        return nullptr;
+    char * address = static_cast<char *>(reserved);
+    for (const Extent & extent : layout) {
+        void * mapping = mmap(address, extent.slots * blocksize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_FIXED, ion, off_t(extent.fileSlot * blocksize));
+        if (mapping == MAP_FAILED) {
+            perror("konsole: cannot map history file");
+            munmap(reserved, newLength);
+            return false;
+        }
+        address += extent.slots * blocksize;
     }
 
-//     if (index - i >= length) {
-//         kDebug(1211) << "BlockArray::at() index - i >= length\n";
-//         return 0;
-//     }
-
-    size_t j = i; // (current - (index - i) + (index/size+1)*size) % size ;
-
-    Q_ASSERT(j < size);
     unmap();
+    data = static_cast<char *>(reserved);
+    mappedLength = newLength;
+    return true;
+}
 
-    Block * block = (Block *)mmap(nullptr, blocksize, PROT_READ, MAP_PRIVATE, ion, j * blocksize);
-
-    if (block == (Block *)-1) {
-        perror("mmap");
-        return nullptr;
-    }
-
-    lastmap = block;
-    lastmap_index = i;
-
-    return block;
+void BlockArray::release(const std::vector<Extent> & unused)
+{
+    // the file keeps its length, only its storage is given back
+#ifdef FALLOC_FL_PUNCH_HOLE
+    for (const Extent & extent : unused) {
+        fallocate(ion, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  off_t(extent.fileSlot * blocksize), off_t(extent.slots * blocksize));
+    }
+#else
+    Q_UNUSED(unused)
+#endif
 }
 
 void BlockArray::unmap()
 {
-    if (lastmap) {
-        int res = munmap((char *)lastmap, blocksize);
+    if (data) {
+        int res = munmap(data, mappedLength);
         if (res < 0) {
             perror("munmap");
         }
     }
-    lastmap = nullptr;
-    lastmap_index = size_t(-1);
+    data = nullptr;
+    mappedLength = 0;
 }
 
 bool BlockArray::setSize(size_t newsize)
@@ -189,16 +211,18 @@ bool BlockArray::setHistorySize(size_t newsize)
         return false;
     }
 
-    unmap();
-
     if (!newsize) {
-        delete lastblock;
-        lastblock = nullptr;
+        unmap();
         if (ion >= 0) {
             close(ion);
         }
         ion = -1;
-        current = size_t(-1);
+        extents.clear();
+        fileSlots = 0;
+        first += length;
+        firstSlot = 0;
+        length = 0;
+        size = 0;
         return true;
     }
 
@@ -210,169 +234,69 @@ bool BlockArray::setHistorySize(size_t newsize)
             ion = dup(fileno(tmp));
             if (ion<0) {
                 perror("konsole: cannot dup temp file.\n");
-                fclose(tmp);
             }
+            fclose(tmp);
         }
         if (ion < 0) {
             return false;
         }
-
-        Q_ASSERT(!lastblock);
-
-        lastblock = new Block();
-        size = newsize;
-        return false;
-    }
-
-    if (newsize > size) {
-        increaseBuffer();
-        size = newsize;
-        return false;
-    } else {
-        decreaseBuffer(newsize);
-        ftruncate(ion, length*blocksize);
-        size = newsize;
-
-        return true;
-    }
-}
-
-void moveBlock(FILE * fion, int cursor, int newpos, char * buffer2)
-{
-    int res = fseek(fion, cursor * blocksize, SEEK_SET);
-    if (res) {
-        perror("fseek");
-    }
-    res = fread(buffer2, blocksize, 1, fion);
-    if (res != 1) {
-        perror("fread");
-    }
-
-    res = fseek(fion, newpos * blocksize, SEEK_SET);
-    if (res) {
-        perror("fseek");
-    }
-    res = fwrite(buffer2, blocksize, 1, fion);
-    if (res != 1) {
-        perror("fwrite");
-    }
-    //    printf("moving block %d to %d\n", cursor, newpos);
-}
-
-void BlockArray::decreaseBuffer(size_t newsize)
-{
-    if (index < newsize) { // still fits in whole
-        return;
     }
 
-    int offset = (current - (newsize - 1) + size) % size;
-
-    if (!offset) {
-        return;
-    }
-
-    // The Block constructor could do somthing in future...
-    char * buffer1 = new char[blocksize];
-
-    FILE * fion = fdopen(dup(ion), "w+b");
-    if (!fion) {
-        delete [] buffer1;
-        perror("fdopen/dup");
-        return;
-    }
-
-    int firstblock;
-    if (current <= newsize) {
-        firstblock = current + 1;
-    } else {
-        firstblock = 0;
-    }
-
-    size_t oldpos;
-    for (size_t i = 0, cursor=firstblock; i < newsize; i++) {
-        oldpos = (size + cursor + offset) % size;
-        moveBlock(fion, oldpos, cursor, buffer1);
-        if (oldpos < newsize) {
-            cursor = oldpos;
-        } else {
-            cursor++;
+    const size_t dropped = length > newsize ? length - newsize : 0;
+
+    // the new ring starts with the oldest block which is kept, followed by
+    // the newer ones, the block being filled and the free slots, as many of
+    // them as fit.  the slots which do not fit are given back
+    std::vector<Extent> layout;
+    std::vector<Extent> unused;
+    size_t reused = 0;
+    if (size) {
+        const size_t start = (firstSlot + dropped) % (size + 1);
+        reused = std::min(size + 1, newsize + 1);
+        appendRingSlots(layout, start, reused);
+        appendRingSlots(unused, (start + reused) % (size + 1), size + 1 - reused);
+    }
+
+    // the slots which are missing are added at the end of the file
+    const size_t added = newsize + 1 - reused;
+    if (added) {
+        if (ftruncate(ion, off_t((fileSlots + added) * blocksize)) < 0) {
+            perror("konsole: cannot resize history file");
+            if (!size) {
+                close(ion);
+                ion = -1;
+            }
+            return false;
         }
+        appendExtent(layout, fileSlots, added);
+        fileSlots += added;
     }
 
-    current = newsize - 1;
-    length = newsize;
-
-    delete [] buffer1;
-
-    fclose(fion);
-
-}
-
-void BlockArray::increaseBuffer()
-{
-    if (index < size) { // not even wrapped once
-        return;
-    }
-
-    int offset = (current + size + 1) % size;
-    if (!offset) { // no moving needed
-        return;
-    }
-
-    // The Block constructor could do somthing in future...
-    char * buffer1 = new char[blocksize];
-    char * buffer2 = new char[blocksize];
-
-    int runs = 1;
-    int bpr = size; // blocks per run
-
-    if (size % offset == 0) {
-        bpr = size / offset;
-        runs = offset;
-    }
-
-    FILE * fion = fdopen(dup(ion), "w+b");
-    if (!fion) {
-        perror("fdopen/dup");
-        delete [] buffer1;
-        delete [] buffer2;
-        return;
-    }
-
-    int res;
-    for (int i = 0; i < runs; i++) {
-        // free one block in chain
-        int firstblock = (offset + i) % size;
-        res = fseek(fion, firstblock * blocksize, SEEK_SET);
-        if (res) {
-            perror("fseek");
-        }
-        res = fread(buffer1, blocksize, 1, fion);
-        if (res != 1) {
-            perror("fread");
-        }
-        int newpos = 0;
-        for (int j = 1, cursor=firstblock; j < bpr; j++) {
-            cursor = (cursor + offset) % size;
-            newpos = (cursor - offset + size) % size;
-            moveBlock(fion, cursor, newpos, buffer2);
-        }
-        res = fseek(fion, i * blocksize, SEEK_SET);
-        if (res) {
-            perror("fseek");
-        }
-        res = fwrite(buffer1, blocksize, 1, fion);
-        if (res != 1) {
-            perror("fwrite");
+    if (!map(layout, newsize + 1)) {
+        unmap();
+        if (ion >= 0) {
+            close(ion);
         }
+        ion = -1;
+        extents.clear();
+        fileSlots = 0;
+        first += length;
+        firstSlot = 0;
+        length = 0;
+        size = 0;
+        return true;
     }
-    current = size - 1;
-    length = size;
 
-    delete [] buffer1;
-    delete [] buffer2;
+    release(unused);
+    extents.swap(layout);
+    first += dropped;
+    firstSlot = 0;
+    length -= dropped;
+    size = newsize;
 
-    fclose(fion);
+    Block * next = lastBlock();
+    next->size = 0;
+    next->flags = 0;
 
+    return dropped > 0;
 }
-
@@ -24,70 +24,85 @@
 #define BLOCKARRAY_H
 
 #include <unistd.h>
+#include <vector>
 
 //#error Do not use in KDE 2.1
 
 #define QTERMWIDGET_BLOCKSIZE (1 << 12)
-#define ENTRIES   ((QTERMWIDGET_BLOCKSIZE - sizeof(size_t) ) / sizeof(unsigned char))
+#define ENTRIES   ((QTERMWIDGET_BLOCKSIZE - 2 * sizeof(size_t) ) / sizeof(unsigned char))
 
 namespace Konsole {
 
 struct Block {
     Block() {
         size = 0;
+        flags = 0;
     }
     unsigned char data[ENTRIES];
     size_t size;
+    size_t flags; // free for use by the owner of the array
 };
 
 // ///////////////////////////////////////////////////////
 
+/**
+ * A ring of fixed size blocks, kept in a temporary file which is
+ * mmap'ed as a whole.  Blocks are filled in place and read in place,
+ * so neither adding nor reading a block involves a system call.
+ *
+ * Every block which is added gets a unique, increasing index.  Once the
+ * ring is full, adding a block drops the oldest one.
+ *
+ * The slots of the ring need not be in the order of the file.  Resizing
+ * maps the slots which are kept, and any new ones at the end of the file,
+ * into a new address range in the order of the ring, so no block is moved
+ * and the cost does not depend on the size of the history.
+ */
 class BlockArray {
 public:
     /**
-    * Creates a history file for holding
-    * maximal size blocks. If more blocks
-    * are requested, then it drops earlier
-    * added ones.
+    * Creates an empty array.  No blocks can be added
+    * before setHistorySize() is called.
     */
     BlockArray();
 
     /// destructor
     ~BlockArray();
 
-    /**
-    * adds the Block at the end of history.
-    * This may drop other blocks.
-    *
-    * The ownership on the block is transfered.
-    * An unique index number is returned for accessing
-    * it later (if not yet dropped then)
-    *
-    * Note, that the block may be dropped completely
-    * if history is turned off.
-    */
-    size_t append(Block * block);
-
     /**
     * gets the block at the index. Function may return
     * 0 if the block isn't available any more.
     *
-    * The returned block is strictly readonly as only
-    * maped in memory - and will be invalid on the next
-    * operation on this class.
+    * The returned block points into the mapped file and
+    * is invalid after the next call to newBlock() or
+    * setHistorySize().
     */
-    const Block * at(size_t index);
+    const Block * at(size_t index) const;
 
     /**
-    * reorders blocks as needed. If newsize is null,
-    * the history is emptied completely. The indices
-    * returned on append won't change their semantic,
-    * but they may not be valid after this call.
+    * resizes the ring to hold @p newsize blocks, keeping the
+    * newest blocks. If newsize is null, the history is emptied
+    * completely. The indices of the blocks which are kept do
+    * not change, and neither does their data: only the mapping
+    * of the file is rebuilt.
+    *
+    * Returns true if blocks were dropped.
     */
     bool setHistorySize(size_t newsize);
 
+    /**
+    * Adds the block returned by lastBlock() at the end of
+    * the array, dropping the oldest block if the array is
+    * full, and returns its index.  lastBlock() then returns
+    * a new, empty block.
+    */
     size_t newBlock();
 
+    /**
+    * Returns the block which is being filled.  It lives in
+    * the mapped file, so data can be copied straight into it.
+    * Returns 0 if the array has no size.
+    */
     Block * lastBlock() const;
 
     /**
@@ -102,27 +117,45 @@ public:
 
     bool has(size_t index) const;
 
+    /// returns the index of the last block added
     size_t getCurrent() const {
-        return current;
+        return first + length - 1;
+    }
+
+    /// returns the index of the oldest block
+    size_t firstIndex() const {
+        return first;
     }
 
 private:
+    // a run of slots which are consecutive in the file
+    struct Extent {
+        size_t fileSlot;
+        size_t slots;
+    };
+
+    Block * block(size_t index) const;
+    // appends a run of file slots to 'layout', merging it with the last one
+    static void appendExtent(std::vector<Extent> & layout, size_t fileSlot, size_t slots);
+    // appends the file slots of 'count' slots of the ring from 'slot' on
+    void appendRingSlots(std::vector<Extent> & layout, size_t slot, size_t count) const;
+    // maps the file slots of 'layout' into a new address range, in that order
+    bool map(const std::vector<Extent> & layout, size_t slots);
     void unmap();
-    void increaseBuffer();
-    void decreaseBuffer(size_t newsize);
+    void release(const std::vector<Extent> & unused);
 
     size_t size;
-    // current always shows to the last inserted block
-    size_t current;
-    size_t index;
-
-    Block * lastmap;
-    size_t lastmap_index;
-    Block * lastblock;
-
-    int ion;
+    // index and slot in the ring of the oldest block
+    size_t first;
+    size_t firstSlot;
     size_t length;
 
+    int ion;
+    char * data;
+    size_t mappedLength;
+    // the file slots which the slots of the ring are mapped from, in order
+    std::vector<Extent> extents;
+    size_t fileSlots;
 };
 
 }
@@ -25,6 +25,8 @@
 
 // Qt
 #include <QHash>
+#include <QSet>
+#include <QVector>
 
 // Local
 #include "CharacterColor.h"
@@ -72,7 +74,7 @@ public:
   inline Character(quint16 _c = ' ',
             CharacterColor  _f = CharacterColor(COLOR_SPACE_DEFAULT,DEFAULT_FORE_COLOR),
             CharacterColor  _b = CharacterColor(COLOR_SPACE_DEFAULT,DEFAULT_BACK_COLOR),
-            quint8  _r = DEFAULT_RENDITION)
+            quint16 _r = DEFAULT_RENDITION)
        : character(_c), rendition(_r), foregroundColor(_f), backgroundColor(_b) {}
 
   union
@@ -90,7 +92,7 @@ public:
   };
 
   /** A combination of RENDITION flags which specify options for drawing the character. */
-  quint8  rendition;
+  quint16 rendition;
 
   /** The foreground color used to draw this character. */
   CharacterColor  foregroundColor;
@@ -168,6 +170,143 @@ inline ColorEntry::FontWeight Character::fontWeight(const ColorEntry* base) cons
         return ColorEntry::UseCurrentFormat;
 }
 
+class Screen;
+
+/**
+ * A table which stores the combinations of foreground and background colors
+ * used by PackedCharacter, referenced by style ids.  Like ExtendedCharTable,
+ * a single instance is shared by all screens and must only be used from the
+ * GUI thread.
+ *
+ * A program cycling through many true color combinations would make the
+ * table grow without limit, so the screens register themselves with it, and
+ * once it has grown enough, reclaimUnusedStyles() asks them which styles
+ * their images and histories still use and gives the ids of the others out
+ * again.
+ */
+class CharacterStyleTable
+{
+public:
+    /** The id of the default foreground and background colors. */
+    static const quint32 DEFAULT_STYLE = 0;
+
+    /**
+     * The number of styles the table may hold before unused ones are
+     * reclaimed.  After that, the table may grow to twice the number of
+     * styles which were in use the last time.
+     */
+    static const int RECLAIM_THRESHOLD = 65536;
+
+    CharacterStyleTable();
+
+    /**
+     * Returns the id of the style with the colors @p foreground and
+     * @p background, adding it to the table if it is not there yet.
+     */
+    quint32 styleId(const CharacterColor& foreground, const CharacterColor& background);
+
+    /** Returns the foreground color of the style @p id */
+    const CharacterColor& foregroundColor(quint32 id) const { return _styles[id].foreground; }
+    /** Returns the background color of the style @p id */
+    const CharacterColor& backgroundColor(quint32 id) const { return _styles[id].background; }
+
+    /** Returns the number of styles in the table. */
+    int count() const { return _styles.count() - _freeIds.count(); }
+
+    /** Adds @p screen to the screens whose styles are kept by reclaimUnusedStyles() */
+    void addScreen(Screen* screen) { _screens.insert(screen); }
+    /** Removes @p screen from the screens whose styles are kept */
+    void removeScreen(Screen* screen) { _screens.remove(screen); }
+
+    /**
+     * Frees the styles which none of the screens uses any more, if the table
+     * has grown past its limit.  This must only be called between batches of
+     * output, when every packed cell is held by a screen or its history.
+     */
+    void reclaimUnusedStyles();
+
+    /** The global CharacterStyleTable instance. */
+    static CharacterStyleTable instance;
+
+private:
+    struct Style
+    {
+        CharacterColor foreground;
+        CharacterColor background;
+    };
+
+    static quint64 styleKey(const CharacterColor& foreground, const CharacterColor& background);
+
+    QVector<Style> _styles;
+    QHash<quint64,quint32> _ids;
+    // ids of reclaimed styles, given out again before the table grows
+    QVector<quint32> _freeIds;
+    // the size the table may grow to before styles are reclaimed
+    int _reclaimAt;
+    QSet<Screen*> _screens;
+};
+
+/**
+ * The form in which characters are stored by the screen and the history.
+ *
+ * The unicode character value (21 bits) and the rendition flags (11 bits)
+ * share one 32 bit word, and the colors are replaced by the id of a style
+ * in CharacterStyleTable::instance, which brings a cell down to 8 bytes
+ * from the 16 of a Character.  Two cells are equal if both words are.
+ */
+class PackedCharacter
+{
+public:
+  /** Constructs a space with the default colors and rendition. */
+  PackedCharacter()
+      : _data(' '), _style(CharacterStyleTable::DEFAULT_STYLE) {}
+
+  /** Constructs a cell from @p c, @p rendition and the style @p style */
+  PackedCharacter(wchar_t c, quint16 rendition, quint32 style)
+      : _data(pack(c, rendition)), _style(style) {}
+
+  /** Packs @p character, looking up the style of its colors. */
+  explicit PackedCharacter(const Character& character)
+      : _data(pack(character.character, character.rendition)),
+        _style(CharacterStyleTable::instance.styleId(character.foregroundColor,
+                                                      character.backgroundColor)) {}
+
+  /** Returns the unicode character value, or the hash of an extended character. */
+  wchar_t character() const { return _data & CHARACTER_MASK; }
+  /** Replaces the unicode character value. */
+  void setCharacter(wchar_t c) { _data = (_data & ~CHARACTER_MASK) | (quint32(c) & CHARACTER_MASK); }
+  /** Returns the rendition flags. */
+  quint16 rendition() const { return _data >> RENDITION_SHIFT; }
+  /** Returns the id of the colors in CharacterStyleTable::instance */
+  quint32 style() const { return _style; }
+
+  /** Returns the full Character, with the colors looked up. */
+  Character unpack() const
+  {
+    Character result(' ', CharacterStyleTable::instance.foregroundColor(_style),
+                          CharacterStyleTable::instance.backgroundColor(_style),
+                          rendition());
+    // the constructor only takes 16 bit characters
+    result.character = character();
+    return result;
+  }
+
+  friend bool operator == (const PackedCharacter& a, const PackedCharacter& b)
+  { return a._data == b._data && a._style == b._style; }
+  friend bool operator != (const PackedCharacter& a, const PackedCharacter& b)
+  { return !(a == b); }
+
+private:
+  static const quint32 CHARACTER_MASK = 0x1fffff;
+  static const int RENDITION_SHIFT = 21;
+
+  static quint32 pack(wchar_t c, quint16 rendition)
+  { return (quint32(c) & CHARACTER_MASK) | (quint32(rendition) << RENDITION_SHIFT); }
+
+  quint32 _data;
+  quint32 _style;
+};
+
 extern unsigned short vt100_graphics[32];
 
 
@@ -224,6 +363,7 @@ private:
 
 }
 Q_DECLARE_TYPEINFO(Konsole::Character, Q_MOVABLE_TYPE);
+Q_DECLARE_TYPEINFO(Konsole::PackedCharacter, Q_MOVABLE_TYPE);
 
 #endif // CHARACTER_H
 
@@ -138,6 +138,7 @@ extern const ColorEntry base_color_table[TABLE_COLORS] KDE_NO_EXPORT;
 class CharacterColor
 {
     friend class Character;
+    friend class CharacterStyleTable;
 
 public:
   /** Constructs a new CharacterColor whoose color and color space are undefined. */
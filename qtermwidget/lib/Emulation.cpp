@@ -26,13 +26,16 @@
 #include <cstdio>
 #include <cstdlib>
 #include <unistd.h>
+#include <cstring>
 #include <string>
 
 // Qt
 #include <QApplication>
+#include <QBitArray>
 #include <QClipboard>
 #include <QHash>
 #include <QKeyEvent>
+#include <QMetaMethod>
 #include <QRegExp>
 #include <QTextStream>
 #include <QThread>
@@ -50,21 +53,34 @@
 
 using namespace Konsole;
 
+const int Emulation::DEFAULT_FRAME_INTERVAL;
+
 Emulation::Emulation() :
   _currentScreen(nullptr),
   _codec(nullptr),
   _decoder(nullptr),
   _keyTranslator(nullptr),
   _usesMouse(false),
-  _bracketedPasteMode(false)
+  _bracketedPasteMode(false),
+  _utf8CodePoint(0),
+  _utf8Minimum(0),
+  _utf8Pending(0),
+  _frameInterval(DEFAULT_FRAME_INTERVAL),
+  _updatesSuspended(false),
+  _updatePending(false),
+  _updateCount(0),
+  _coalescedUpdates(0),
+  _skippedUpdates(0),
+  _receiveBufferAllocations(0)
 {
   // create screens with a default size
   _screen[0] = new Screen(40,80);
   _screen[1] = new Screen(40,80);
   _currentScreen = _screen[0];
 
-  QObject::connect(&_bulkTimer1, SIGNAL(timeout()), this, SLOT(showBulk()) );
-  QObject::connect(&_bulkTimer2, SIGNAL(timeout()), this, SLOT(showBulk()) );
+  _updateTimer.setSingleShot(true);
+  _updateTimer.setTimerType(Qt::PreciseTimer);
+  QObject::connect(&_updateTimer, SIGNAL(timeout()), this, SLOT(showBulk()) );
 
   // listen for mouse status changes
   connect(this , SIGNAL(programUsesMouseChanged(bool)) ,
@@ -98,6 +114,26 @@ void Emulation::bracketedPasteModeChanged(bool bracketedPasteMode)
     _bracketedPasteMode = bracketedPasteMode;
 }
 
+quint64 Emulation::receiveBufferAllocations() const
+{
+    return _receiveBufferAllocations;
+}
+
+quint64 Emulation::updateCount() const
+{
+    return _updateCount;
+}
+
+quint64 Emulation::coalescedUpdateCount() const
+{
+    return _coalescedUpdates;
+}
+
+quint64 Emulation::skippedUpdateCount() const
+{
+    return _skippedUpdates;
+}
+
 ScreenWindow* Emulation::createWindow()
 {
     ScreenWindow* window = new ScreenWindow();
@@ -115,6 +151,11 @@ ScreenWindow* Emulation::createWindow()
     connect(this, &Emulation::outputFromKeypressEvent,
             window, &ScreenWindow::scrollToEnd);
 
+    connect(window, SIGNAL(presentationChanged()),
+            this, SLOT(updateFramePacing()));
+
+    updateFramePacing();
+
     return window;
 }
 
@@ -169,6 +210,7 @@ void Emulation::setCodec(const QTextCodec * qtc)
 
   delete _decoder;
   _decoder = _codec->makeDecoder();
+  resetUtf8Decoder();
 
   emit useUtf8Request(utf8());
 }
@@ -212,6 +254,12 @@ void Emulation::receiveChar(wchar_t c)
   };
 }
 
+void Emulation::receiveChars(const wchar_t* text, int length)
+{
+  for (int i = 0; i < length; i++)
+    receiveChar(text[i]);
+}
+
 void Emulation::sendKeyEvent(QKeyEvent* ev, bool)
 {
   emit stateSet(NOTIFYNORMAL);
@@ -245,29 +293,160 @@ void Emulation::receiveData(const char* text, int length)
 
     bufferedUpdate();
 
-    /* XXX: the following code involves encoding & decoding of "UTF-16
-     * surrogate pairs", which does not work with characters higher than
-     * U+10FFFF
-     * https://unicodebook.readthedocs.io/unicode_encodings.html#surrogates
-     */
-    QString utf16Text = _decoder->toUnicode(text,length);
-    std::wstring unicodeText = utf16Text.toStdWString();
+    wchar_t* unicodeText;
+    int unicodeLength;
+
+    if (utf8())
+    {
+        // a chunk of n bytes never decodes to more than n+1 characters,
+        // the extra one being a sequence left incomplete by the last chunk
+        unicodeText = reserveReceiveBuffer(length + 1);
+        unicodeLength = decodeUtf8(text, length, unicodeText);
+    }
+    else
+    {
+        const QString utf16Text = _decoder->toUnicode(text,length);
+        unicodeText = reserveReceiveBuffer(utf16Text.length());
+        unicodeLength = 0;
+
+        // combine UTF-16 surrogate pairs, which would otherwise reach
+        // receiveChar() as two separate halves
+        const QChar* utf16 = utf16Text.constData();
+        for (int i = 0; i < utf16Text.length(); i++)
+        {
+            if (utf16[i].isHighSurrogate() && i + 1 < utf16Text.length() &&
+                utf16[i+1].isLowSurrogate())
+            {
+                unicodeText[unicodeLength++] = QChar::surrogateToUcs4(utf16[i], utf16[i+1]);
+                i++;
+            }
+            else
+            {
+                unicodeText[unicodeLength++] = utf16[i].unicode();
+            }
+        }
+    }
+
+    // the text is only kept for receivedText() while something listens to it
+    static const QMetaMethod receivedTextSignal = QMetaMethod::fromSignal(&Emulation::receivedText);
+    if (isSignalConnected(receivedTextSignal))
+    {
+        _receivedText.reserve(_receivedText.length() + unicodeLength);
+        for (int i = 0; i < unicodeLength; i++)
+        {
+            const uint c = unicodeText[i];
+            if (QChar::requiresSurrogates(c))
+            {
+                _receivedText.append(QChar(QChar::highSurrogate(c)));
+                _receivedText.append(QChar(QChar::lowSurrogate(c)));
+            }
+            else
+            {
+                _receivedText.append(QChar(c));
+            }
+        }
+    }
 
     //send characters to terminal emulator
-    for (size_t i=0;i<unicodeText.length();i++)
-        receiveChar(unicodeText[i]);
+    receiveChars(unicodeText, unicodeLength);
+
+    // lines scrolled into the history by this batch are added in one go
+    _screen[0]->flushHistory();
+    _screen[1]->flushHistory();
+
+    // all cells are on a screen or in a history now
+    CharacterStyleTable::instance.reclaimUnusedStyles();
 
     //look for z-modem indicator
     //-- someone who understands more about z-modems that I do may be able to move
     //this check into the above for loop?
-    for (int i=0;i<length;i++)
+    const char* end = text + length;
+    for (const char* p = text; (p = static_cast<const char*>(memchr(p, '\030', end - p))); p++)
+    {
+        if ((end-p-1 > 3) && (strncmp(p+1, "B00", 3) == 0))
+            emit zmodemDetected();
+    }
+}
+
+wchar_t* Emulation::reserveReceiveBuffer(int size)
+{
+    if (static_cast<int>(_receiveBuffer.size()) < size)
     {
-        if (text[i] == '\030')
+        _receiveBuffer.resize(size);
+        _receiveBufferAllocations++;
+    }
+    return _receiveBuffer.data();
+}
+
+void Emulation::resetUtf8Decoder()
+{
+    _utf8CodePoint = 0;
+    _utf8Minimum = 0;
+    _utf8Pending = 0;
+}
+
+int Emulation::decodeUtf8(const char* text, int length, wchar_t* dest)
+{
+    static const wchar_t REPLACEMENT_CHARACTER = 0xfffd;
+
+    wchar_t* out = dest;
+
+    for (int i = 0; i < length; i++)
+    {
+        const uchar byte = text[i];
+
+        if (_utf8Pending > 0)
+        {
+            if ((byte & 0xc0) == 0x80)
+            {
+                _utf8CodePoint = (_utf8CodePoint << 6) | (byte & 0x3f);
+                if (--_utf8Pending == 0)
+                {
+                    // reject overlong forms, surrogates and values beyond U+10FFFF
+                    if (_utf8CodePoint < _utf8Minimum || _utf8CodePoint > 0x10ffff ||
+                        (_utf8CodePoint >= 0xd800 && _utf8CodePoint <= 0xdfff))
+                        *out++ = REPLACEMENT_CHARACTER;
+                    else
+                        *out++ = _utf8CodePoint;
+                }
+                continue;
+            }
+
+            // the sequence was cut short; the current byte starts a new one
+            _utf8Pending = 0;
+            *out++ = REPLACEMENT_CHARACTER;
+        }
+
+        if (byte < 0x80)
+        {
+            *out++ = byte;
+        }
+        else if ((byte & 0xe0) == 0xc0)
+        {
+            _utf8CodePoint = byte & 0x1f;
+            _utf8Minimum = 0x80;
+            _utf8Pending = 1;
+        }
+        else if ((byte & 0xf0) == 0xe0)
+        {
+            _utf8CodePoint = byte & 0x0f;
+            _utf8Minimum = 0x800;
+            _utf8Pending = 2;
+        }
+        else if ((byte & 0xf8) == 0xf0)
+        {
+            _utf8CodePoint = byte & 0x07;
+            _utf8Minimum = 0x10000;
+            _utf8Pending = 3;
+        }
+        else
         {
-            if ((length-i-1 > 3) && (strncmp(text+i+1, "B00", 3) == 0))
-                emit zmodemDetected();
+            // stray continuation byte or invalid lead byte
+            *out++ = REPLACEMENT_CHARACTER;
         }
     }
+
+    return out - dest;
 }
 
 //OLDER VERSION
@@ -326,19 +505,45 @@ void Emulation::writeToStream( TerminalCharacterDecoder* _decoder ,
   _currentScreen->writeLinesToStream(_decoder,startLine,endLine);
 }
 
+bool Emulation::appendLineCells(int line, QVector<Character>& cells) const
+{
+    return _currentScreen->appendLineCells(line, cells) & LINE_WRAPPED;
+}
+
+const HistoryIndex* Emulation::historyIndex() const
+{
+    return &_currentScreen->historyIndex();
+}
+
 int Emulation::lineCount() const
 {
     // sum number of lines currently on _screen plus number of lines in history
     return _currentScreen->getLines() + _currentScreen->getHistLines();
 }
 
-#define BULK_TIMEOUT1 10
-#define BULK_TIMEOUT2 40
-
 void Emulation::showBulk()
 {
-    _bulkTimer1.stop();
-    _bulkTimer2.stop();
+    _updateTimer.stop();
+
+    if (!_receivedText.isEmpty())
+    {
+        QString text;
+        text.swap(_receivedText);
+        emit receivedText(text);
+    }
+
+    if (_updatesSuspended)
+    {
+        // the scrolled and dropped lines keep adding up until the update
+        // is shown
+        _updatePending = true;
+        _skippedUpdates++;
+        return;
+    }
+
+    _updatePending = false;
+    _updateCount++;
+    _lastUpdate.start();
 
     emit outputChanged();
 
@@ -348,13 +553,49 @@ void Emulation::showBulk()
 
 void Emulation::bufferedUpdate()
 {
-   _bulkTimer1.setSingleShot(true);
-   _bulkTimer1.start(BULK_TIMEOUT1);
-   if (!_bulkTimer2.isActive())
+   if (_updateTimer.isActive())
+   {
+      _coalescedUpdates++;
+      return;
+   }
+
+   // receivedText() is still emitted while the windows are hidden
+   if (_updatesSuspended && _receivedText.isEmpty())
    {
-      _bulkTimer2.setSingleShot(true);
-      _bulkTimer2.start(BULK_TIMEOUT2);
+      _updatePending = true;
+      _skippedUpdates++;
+      return;
    }
+
+   // show the update as soon as a frame has passed since the last one
+   int delay = 0;
+   if (_lastUpdate.isValid())
+      delay = qMax<qint64>(0, _frameInterval - _lastUpdate.elapsed());
+   _updateTimer.start(delay);
+}
+
+void Emulation::updateFramePacing()
+{
+   // the output is shown as usual while there is no window to look at it
+   bool visible = _windows.isEmpty();
+   qreal refreshRate = 0;
+   for (ScreenWindow* window : qAsConst(_windows))
+   {
+      if (!window->isVisible())
+         continue;
+      visible = true;
+      refreshRate = qMax(refreshRate, window->refreshRate());
+   }
+
+   _frameInterval = refreshRate > 0 ? qMax(1, qRound(1000 / refreshRate))
+                                    : DEFAULT_FRAME_INTERVAL;
+
+   const bool resumed = _updatesSuspended && visible;
+   _updatesSuspended = !visible;
+
+   // the window which has been shown catches up at once
+   if (resumed && _updatePending)
+      showBulk();
 }
 
 char Emulation::eraseChar() const
@@ -485,6 +726,88 @@ ExtendedCharTable::~ExtendedCharTable()
 // global instance
 ExtendedCharTable ExtendedCharTable::instance;
 
+const quint32 CharacterStyleTable::DEFAULT_STYLE;
+const int CharacterStyleTable::RECLAIM_THRESHOLD;
+
+CharacterStyleTable::CharacterStyleTable()
+    : _reclaimAt(RECLAIM_THRESHOLD)
+{
+    // the default colors get DEFAULT_STYLE, which PackedCharacter uses without a lookup
+    styleId(CharacterColor(COLOR_SPACE_DEFAULT,DEFAULT_FORE_COLOR),
+            CharacterColor(COLOR_SPACE_DEFAULT,DEFAULT_BACK_COLOR));
+}
+
+quint64 CharacterStyleTable::styleKey(const CharacterColor& foreground, const CharacterColor& background)
+{
+    const quint32 fore = (quint32(foreground._colorSpace) << 24) | (quint32(foreground._u) << 16) |
+                         (quint32(foreground._v) << 8) | foreground._w;
+    const quint32 back = (quint32(background._colorSpace) << 24) | (quint32(background._u) << 16) |
+                         (quint32(background._v) << 8) | background._w;
+    return (quint64(fore) << 32) | back;
+}
+
+quint32 CharacterStyleTable::styleId(const CharacterColor& foreground, const CharacterColor& background)
+{
+    const quint64 key = styleKey(foreground, background);
+
+    QHash<quint64,quint32>::const_iterator iter = _ids.constFind(key);
+    if (iter != _ids.constEnd())
+        return iter.value();
+
+    Style style;
+    style.foreground = foreground;
+    style.background = background;
+
+    quint32 id;
+    if (!_freeIds.isEmpty())
+    {
+        id = _freeIds.takeLast();
+        _styles[id] = style;
+    }
+    else
+    {
+        id = _styles.count();
+        _styles.append(style);
+    }
+    _ids.insert(key, id);
+    return id;
+}
+
+void CharacterStyleTable::reclaimUnusedStyles()
+{
+    // while there are free ids, the table does not grow
+    if (!_freeIds.isEmpty() || _styles.count() < _reclaimAt)
+        return;
+
+    QBitArray used(_styles.count());
+    used.setBit(DEFAULT_STYLE);
+    for (Screen* screen : qAsConst(_screens))
+        screen->markUsedStyles(used);
+
+    // every style is in _ids here, since none was free.  Unused styles at the
+    // end of the table are dropped, the others are kept for reuse, lowest first
+    int size = _styles.count();
+    for (int id = size - 1; id > (int)DEFAULT_STYLE; id--)
+    {
+        if (used.testBit(id))
+            continue;
+
+        _ids.remove(styleKey(_styles[id].foreground, _styles[id].background));
+        if (id == size - 1)
+            size--;
+        else
+            _freeIds.append(id);
+    }
+    _styles.resize(size);
+    _styles.squeeze();
+    _ids.squeeze();
+
+    _reclaimAt = qMax(RECLAIM_THRESHOLD, 2 * count());
+}
+
+// global instance
+CharacterStyleTable CharacterStyleTable::instance;
+
 
 //#include "Emulation.moc"
 
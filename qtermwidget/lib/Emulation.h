@@ -25,13 +25,16 @@
 
 // System
 #include <cstdio>
+#include <vector>
 
 // Qt
+#include <QElapsedTimer>
 #include <QKeyEvent>
 //#include <QPointer>
 #include <QTextCodec>
 #include <QTextStream>
 #include <QTimer>
+#include <QVector>
 
 #include "qtermwidget_export.h"
 #include "KeyboardTranslator.h"
@@ -39,6 +42,8 @@
 namespace Konsole
 {
 
+class Character;
+class HistoryIndex;
 class HistoryType;
 class Screen;
 class ScreenWindow;
@@ -176,6 +181,8 @@ public:
   const HistoryType& history() const;
   /** Clears the history scroll. */
   void clearHistory();
+  /** Returns the search index of the history of the current screen. */
+  const HistoryIndex* historyIndex() const;
 
   /**
    * Copies the output history from @p startLine to @p endLine
@@ -190,6 +197,13 @@ public:
    */
   virtual void writeToStream(TerminalCharacterDecoder* decoder,int startLine,int endLine);
 
+  /**
+   * Appends the characters of @p line, where 0 is the first line in the
+   * history, to @p cells and returns true if the line wraps into the next one.
+   * Used to export the output without decoding it into text.
+   */
+  bool appendLineCells(int line, QVector<Character>& cells) const;
+
   /** Returns the codec used to decode incoming characters.  See setCodec() */
   const QTextCodec* codec() const { return _codec; }
   /** Sets the codec used to decode incoming characters.  */
@@ -238,6 +252,30 @@ public:
 
   bool programBracketedPasteMode() const;
 
+  /**
+   * Returns the number of times the buffer which receiveData() decodes
+   * incoming bytes into had to grow.  Under sustained output this stays
+   * flat once the buffer has reached the size of the largest chunk read
+   * from the terminal.
+   */
+  quint64 receiveBufferAllocations() const;
+
+  /**
+   * Returns the number of times outputChanged() has been emitted to update
+   * the views.  See bufferedUpdate()
+   */
+  quint64 updateCount() const;
+  /**
+   * Returns the number of requests for an update which were merged into an
+   * update which was already scheduled.
+   */
+  quint64 coalescedUpdateCount() const;
+  /**
+   * Returns the number of updates which were skipped because none of the
+   * windows of the emulation was visible.
+   */
+  quint64 skippedUpdateCount() const;
+
 public slots:
 
   /** Change the size of the emulation's image */
@@ -272,12 +310,15 @@ public slots:
 
   /**
    * Processes an incoming stream of characters.  receiveData() decodes the incoming
-   * character buffer using the current codec(), and then calls receiveChar() for
-   * each unicode character in the resulting buffer.
+   * character buffer using the current codec(), and then passes the resulting
+   * unicode characters to receiveChars().
    *
-   * receiveData() also starts a timer which causes the outputChanged() signal
-   * to be emitted when it expires.  The timer allows multiple updates in quick
-   * succession to be buffered into a single outputChanged() signal emission.
+   * @p buffer may end in the middle of a multi-byte sequence; the remainder is
+   * picked up by the next call.  When the codec is UTF-8 the bytes are decoded
+   * directly into a buffer which is reused between calls, so no memory is
+   * allocated per chunk.  See receiveBufferAllocations()
+   *
+   * receiveData() also schedules an update of the views, see bufferedUpdate().
    *
    * @param buffer A string of characters received from the terminal program.
    * @param len The length of @p buffer
@@ -361,6 +402,14 @@ signals:
    */
   void outputChanged();
 
+  /**
+   * Emitted before outputChanged() with the text which receiveData() decoded
+   * since the last emission, so that it is emitted once per bulk update
+   * rather than once per chunk of output.  The text is only collected while
+   * this signal is connected.
+   */
+  void receivedText(const QString& text);
+
   /**
    * Emitted when the program running in the terminal wishes to update the
    * session's title.  This also allows terminal programs to customize other
@@ -455,6 +504,16 @@ protected:
    */
   virtual void receiveChar(wchar_t ch);
 
+  /**
+   * Processes a buffer of incoming characters.  See receiveData()
+   * The default implementation calls receiveChar() for each character,
+   * emulations can reimplement it to handle runs of characters at once.
+   *
+   * @p text A buffer of unicode character codes.
+   * @p length The number of characters in @p text
+   */
+  virtual void receiveChars(const wchar_t* text, int length);
+
   /**
    * Sets the active screen.  The terminal has two screens, primary and alternate.
    * The primary screen is used by default.  When certain interactive programs such
@@ -492,8 +551,13 @@ protected:
 protected slots:
   /**
    * Schedules an update of attached views.
-   * Repeated calls to bufferedUpdate() in close succession will result in only a single update,
-   * much like the Qt buffered update of widgets.
+   *
+   * The views are updated at most once per frame of the screen they are shown
+   * on.  A request made when no update has been shown for a frame, such as
+   * the echo of a key press, is shown on the next pass of the event loop,
+   * while the requests made during a flood of output are merged into one
+   * update per frame.  No updates are made while none of the windows is
+   * visible, the output received meanwhile is shown once one is.
    */
   void bufferedUpdate();
 
@@ -503,15 +567,50 @@ private slots:
   // view
   void showBulk();
 
+  // takes the frame interval and the visibility from the windows
+  void updateFramePacing();
+
   void usesMouseChanged(bool usesMouse);
 
   void bracketedPasteModeChanged(bool bracketedPasteMode);
 
 private:
+  // decodes 'length' bytes of UTF-8 from 'text' into 'dest', which must have
+  // room for length+1 characters, and returns the number of characters written.
+  // Incomplete sequences at the end of 'text' are carried over to the next call.
+  int decodeUtf8(const char* text, int length, wchar_t* dest);
+  // resets the state of decodeUtf8()
+  void resetUtf8Decoder();
+  // makes sure _receiveBuffer can hold at least 'size' characters
+  wchar_t* reserveReceiveBuffer(int size);
+
   bool _usesMouse;
   bool _bracketedPasteMode;
-  QTimer _bulkTimer1;
-  QTimer _bulkTimer2;
+
+  // the frame interval used until a window reports its refresh rate, 60 Hz
+  static const int DEFAULT_FRAME_INTERVAL = 16;
+
+  // the scheduled update, see bufferedUpdate()
+  QTimer _updateTimer;
+  QElapsedTimer _lastUpdate;
+  int _frameInterval;     // in milliseconds
+  bool _updatesSuspended; // none of the windows is visible
+  bool _updatePending;    // an update was skipped while suspended
+  quint64 _updateCount;
+  quint64 _coalescedUpdates;
+  quint64 _skippedUpdates;
+
+  // state of the incremental UTF-8 decoder
+  uint _utf8CodePoint;  // code point assembled so far
+  uint _utf8Minimum;    // smallest code point the current sequence may encode
+  int _utf8Pending;     // number of continuation bytes still expected
+
+  // decoded characters of the chunk currently being processed
+  std::vector<wchar_t> _receiveBuffer;
+  quint64 _receiveBufferAllocations;
+
+  // text decoded since the last bulk update, for receivedText()
+  QString _receivedText;
 
 };
 
@@ -21,6 +21,7 @@
 #include "Filter.h"
 
 // System
+#include <algorithm>
 #include <iostream>
 
 // Qt
@@ -33,7 +34,11 @@
 #include <QSharedData>
 #include <QFile>
 #include <QDesktopServices>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QSettings>
 #include <QUrl>
+#include <QtDebug>
 
 // KDE
 //#include <KLocale>
@@ -45,6 +50,11 @@
 
 using namespace Konsole;
 
+FilterChain::FilterChain()
+: _buffer(nullptr)
+{
+}
+
 FilterChain::~FilterChain()
 {
     QMutableListIterator<Filter*> iter(*this);
@@ -77,15 +87,148 @@ void FilterChain::reset()
 }
 void FilterChain::setBuffer(const QString* buffer , const QList<int>* linePositions)
 {
+    _buffer = buffer;
+
     QListIterator<Filter*> iter(*this);
     while (iter.hasNext())
         iter.next()->setBuffer(buffer,linePositions);
 }
+bool FilterChain::updateCombinedRegExp()
+{
+    QList<RegExpFilter*> filters;
+    QList<QRegExp> regExps;
+
+    QListIterator<Filter*> iter(*this);
+    while (iter.hasNext())
+    {
+        RegExpFilter* filter = dynamic_cast<RegExpFilter*>(iter.next());
+        if (filter)
+        {
+            filters << filter;
+            regExps << filter->regExp();
+        }
+    }
+
+    if (filters == _regExpFilters && regExps == _regExps)
+        return false;
+
+    _regExpFilters = filters;
+    _regExps = regExps;
+    _combinedFilters.clear();
+    _combinedGroups.clear();
+
+    // back references would refer to the wrong groups once the capture groups
+    // of the other regular expressions are counted in
+    static const QRegularExpression backReference(QStringLiteral("\\\\[1-9]"));
+    static const QString emptyString;
+
+    QString pattern;
+    int group = 1;
+    for (int i = 0; i < filters.count(); i++)
+    {
+        // regular expressions which match the empty string are left to
+        // RegExpFilter::process(), which ignores them
+        bool ok = false;
+        const QRegularExpression regExp = RegExpFilter::toRegularExpression(regExps[i], &ok);
+        if (!ok || regExps[i].exactMatch(emptyString) || regExp.pattern().contains(backReference))
+            continue;
+
+        if (!pattern.isEmpty())
+            pattern += QLatin1Char('|');
+        if (regExp.patternOptions() & QRegularExpression::CaseInsensitiveOption)
+            pattern += QLatin1String("((?i)") + regExp.pattern() + QLatin1Char(')');
+        else
+            pattern += QLatin1Char('(') + regExp.pattern() + QLatin1Char(')');
+
+        _combinedFilters << filters[i];
+        _combinedGroups << group;
+        group += 1 + regExp.captureCount();
+    }
+    _combinedGroups << group;
+
+    _combinedRegExp = QRegularExpression(pattern, QRegularExpression::UseUnicodePropertiesOption);
+    _combinedRegExp.optimize();
+    return true;
+}
 void FilterChain::process()
 {
+    updateCombinedRegExp();
+
+    QListIterator<Filter*> iter(*this);
+    while (iter.hasNext())
+    {
+        Filter* filter = iter.next();
+        if (!_combinedFilters.contains(dynamic_cast<RegExpFilter*>(filter)))
+            filter->process();
+    }
+
+    if (!_combinedFilters.isEmpty())
+    {
+        Q_ASSERT( _buffer );
+        matchCombined(0, _buffer->length());
+    }
+}
+void FilterChain::processChanges(const QVector<int>& lineMap, const QVector<QPair<int,int> >& changedRanges)
+{
+    if (updateCombinedRegExp())
+    {
+        reset();
+        FilterChain::process();
+        return;
+    }
+
     QListIterator<Filter*> iter(*this);
     while (iter.hasNext())
-        iter.next()->process();
+    {
+        Filter* filter = iter.next();
+        if (_combinedFilters.contains(dynamic_cast<RegExpFilter*>(filter)))
+        {
+            filter->moveHotSpots(lineMap);
+        }
+        else
+        {
+            filter->reset();
+            filter->process();
+        }
+    }
+
+    for (const QPair<int,int>& range : changedRanges)
+        matchCombined(range.first, range.second);
+}
+void FilterChain::matchCombined(int start, int end)
+{
+    if (_combinedFilters.isEmpty())
+        return;
+
+    int position = start;
+    while (position < end)
+    {
+        const QRegularExpressionMatch match = _combinedRegExp.match(*_buffer, position);
+        if (!match.hasMatch() || match.capturedStart() >= end)
+            break;
+
+        position = match.capturedEnd();
+        if (match.capturedLength() == 0)
+        {
+            position++;
+            continue;
+        }
+
+        // the first filter whose group took part in the match is the one which matched
+        for (int i = 0; i < _combinedFilters.count(); i++)
+        {
+            const int group = _combinedGroups[i];
+            if (match.capturedStart(group) == -1)
+                continue;
+
+            QStringList capturedTexts;
+            for (int j = group; j < _combinedGroups[i+1]; j++)
+                capturedTexts << match.captured(j);
+
+            _combinedFilters[i]->addMatch(match.capturedStart(), match.capturedLength(), capturedTexts);
+            break;
+        }
+    }
 }
 void FilterChain::clear()
 {
@@ -121,8 +264,11 @@ QList<Filter::HotSpot*> FilterChain::hotSpots() const
 //QList<Filter::HotSpot*> FilterChain::hotSpotsAtLine(int line) const;
 
 TerminalImageFilterChain::TerminalImageFilterChain()
-: _buffer(nullptr)
-, _linePositions(nullptr)
+: _buffer(new QString())
+, _linePositions(new QList<int>())
+, _columns(0)
+, _processAll(true)
+, _imagePending(false)
 {
 }
 
@@ -137,46 +283,132 @@ void TerminalImageFilterChain::setImage(const Character* const image , int lines
     if (empty())
         return;
 
-    // reset all filters and hotspots
-    reset();
+    // the filters only know the previous image if it was processed
+    _processAll = _processAll || _imagePending || columns != _columns;
+    _imagePending = true;
+
+    // the characters are all that the filters see of the image
+    QVector<wchar_t> characters(lines * columns);
+    for (int i = 0; i < characters.count(); i++)
+        characters[i] = image[i].character;
+
+    // pretend that each line ends with a newline character, unless it is wrapped.
+    // this prevents a link that occurs at the end of one line
+    // being treated as part of a link that occurs at the start of the next line
+    //
+    // the downside is that links which are spread over more than one line
+    // are only highlighted if the lines were wrapped by the terminal.
+    QVector<Paragraph> paragraphs;
+    for (int line = 0; line < lines;)
+    {
+        Paragraph paragraph;
+        paragraph.firstLine = line;
+        while (line < lines - 1 && (lineProperties.value(line,LINE_DEFAULT) & LINE_WRAPPED))
+            line++;
+        paragraph.newline = !(lineProperties.value(line,LINE_DEFAULT) & LINE_WRAPPED);
+        line++;
+        paragraph.lineCount = line - paragraph.firstLine;
+        paragraph.hash = qHashBits(characters.constData() + paragraph.firstLine * columns,
+                                   paragraph.lineCount * columns * sizeof(wchar_t), paragraph.newline);
+        paragraphs << paragraph;
+    }
+
+    // the paragraphs of the previous image which may have moved into this one
+    QMultiHash<uint,int> previousParagraphs;
+    if (!_processAll)
+    {
+        for (int i = 0; i < _paragraphs.count(); i++)
+            previousParagraphs.insert(_paragraphs[i].hash, i);
+    }
+    const int previousLines = _paragraphs.isEmpty() ? 0 : _paragraphs.last().firstLine + _paragraphs.last().lineCount;
+    _lineMap.fill(-1, previousLines);
+    _changedRanges.clear();
+
+    // keep the previous text to copy unchanged paragraphs from, and reuse the
+    // buffers which the filters already point to
+    _previousBuffer.swap(*_buffer);
+    _previousLinePositions.swap(*_linePositions);
+    _buffer->resize(0);
+    _linePositions->clear();
+    setBuffer( _buffer , _linePositions );
 
     PlainTextDecoder decoder;
     decoder.setTrailingWhitespace(false);
 
-    // setup new shared buffers for the filters to process on
-    QString* newBuffer = new QString();
-    QList<int>* newLinePositions = new QList<int>();
-    setBuffer( newBuffer , newLinePositions );
-
-    // free the old buffers
-    delete _buffer;
-    delete _linePositions;
-
-    _buffer = newBuffer;
-    _linePositions = newLinePositions;
-
     QTextStream lineStream(_buffer);
     decoder.begin(&lineStream);
 
-    for (int i=0 ; i < lines ; i++)
+    for (const Paragraph& paragraph : qAsConst(paragraphs))
     {
-        _linePositions->append(_buffer->length());
-        decoder.decodeLine(image + i*columns,columns,LINE_DEFAULT);
-
-        // pretend that each line ends with a newline character.
-        // this prevents a link that occurs at the end of one line
-        // being treated as part of a link that occurs at the start of the next line
-        //
-        // the downside is that links which are spread over more than one line are not
-        // highlighted.
-        //
-        // TODO - Use the "line wrapped" attribute associated with lines in a
-        // terminal image to avoid adding this imaginary character for wrapped
-        // lines
-        if ( !(lineProperties.value(i,LINE_DEFAULT) & LINE_WRAPPED) )
+        int previous = -1;
+        QMultiHash<uint,int>::iterator it = previousParagraphs.find(paragraph.hash);
+        for (; it != previousParagraphs.end() && it.key() == paragraph.hash; ++it)
+        {
+            const Paragraph& candidate = _paragraphs.at(it.value());
+            if (candidate.lineCount == paragraph.lineCount && candidate.newline == paragraph.newline &&
+                std::equal(characters.constBegin() + paragraph.firstLine * columns,
+                           characters.constBegin() + (paragraph.firstLine + paragraph.lineCount) * columns,
+                           _characters.constBegin() + candidate.firstLine * columns))
+            {
+                previous = it.value();
+                // the hotspots of a previous paragraph can only be handed on once
+                previousParagraphs.erase(it);
+                break;
+            }
+        }
+
+        if (previous != -1)
+        {
+            const Paragraph& source = _paragraphs.at(previous);
+            const int endLine = source.firstLine + source.lineCount;
+            const int start = _previousLinePositions.at(source.firstLine);
+            const int end = endLine < _previousLinePositions.count() ? _previousLinePositions.at(endLine)
+                                                                    : _previousBuffer.length();
+            for (int i = 0; i < paragraph.lineCount; i++)
+            {
+                _linePositions->append(_buffer->length() + _previousLinePositions.at(source.firstLine + i) - start);
+                _lineMap[source.firstLine + i] = paragraph.firstLine + i;
+            }
+            lineStream << _previousBuffer.midRef(start, end - start);
+            continue;
+        }
+
+        const int start = _buffer->length();
+        for (int line = paragraph.firstLine; line < paragraph.firstLine + paragraph.lineCount; line++)
+        {
+            _linePositions->append(_buffer->length());
+            decoder.decodeLine(image + line*columns,columns,LINE_DEFAULT);
+        }
+        if (paragraph.newline)
             lineStream << QLatin1Char('\n');
+
+        // adjacent changed paragraphs are matched as one range
+        if (!_changedRanges.isEmpty() && _changedRanges.last().second == start)
+            _changedRanges.last().second = _buffer->length();
+        else
+            _changedRanges.append(qMakePair(start, _buffer->length()));
     }
     decoder.end();
+
+    _characters = characters;
+    _paragraphs = paragraphs;
+    _columns = columns;
+}
+
+void TerminalImageFilterChain::process()
+{
+    if (_processAll)
+    {
+        reset();
+        FilterChain::process();
+    }
+    else
+    {
+        processChanges(_lineMap, _changedRanges);
+    }
+
+    _processAll = false;
+    _imagePending = false;
 }
 
 Filter::Filter() :
@@ -203,28 +435,47 @@ void Filter::setBuffer(const QString* buffer , const QList<int>* linePositions)
     _linePositions = linePositions;
 }
 
+void Filter::moveHotSpots(const QVector<int>& lineMap)
+{
+    QList<HotSpot*> spots;
+    spots.swap(_hotspotList);
+    _hotspots.clear();
+
+    QListIterator<HotSpot*> iter(spots);
+    while (iter.hasNext())
+    {
+        HotSpot* spot = iter.next();
+        const int line = lineMap.value(spot->startLine(), -1);
+        if (line < 0)
+        {
+            delete spot;
+            continue;
+        }
+
+        spot->_endLine += line - spot->_startLine;
+        spot->_startLine = line;
+        addHotSpot(spot);
+    }
+}
+
 void Filter::getLineColumn(int position , int& startLine , int& startColumn)
 {
     Q_ASSERT( _linePositions );
     Q_ASSERT( _buffer );
 
 
-    for (int i = 0 ; i < _linePositions->count() ; i++)
-    {
-        int nextLine = 0;
+    if ( position > _buffer->length() )
+        return;
 
-        if ( i == _linePositions->count()-1 )
-            nextLine = _buffer->length() + 1;
-        else
-            nextLine = _linePositions->value(i+1);
+    // the last line which starts at or before position
+    const int line = std::upper_bound(_linePositions->constBegin(), _linePositions->constEnd(), position)
+                     - _linePositions->constBegin() - 1;
+    if ( line < 0 )
+        return;
 
-        if ( _linePositions->value(i) <= position && position < nextLine )
-        {
-            startLine = i;
-            startColumn = string_width(buffer()->mid(_linePositions->value(i),position - _linePositions->value(i)).toStdWString());
-            return;
-        }
-    }
+    const int lineStart = _linePositions->at(line);
+    startLine = line;
+    startColumn = string_width(buffer()->mid(lineStart,position - lineStart).toStdWString());
 }
 
 
@@ -346,6 +597,34 @@ QRegExp RegExpFilter::regExp() const
 {
     return _searchText;
 }
+QRegularExpression RegExpFilter::toRegularExpression(const QRegExp& regExp, bool* ok)
+{
+    // QRegExp's character classes and word boundaries are Unicode aware
+    QRegularExpression::PatternOptions options = QRegularExpression::UseUnicodePropertiesOption;
+    if ( regExp.caseSensitivity() == Qt::CaseInsensitive )
+        options |= QRegularExpression::CaseInsensitiveOption;
+
+    bool converted = !regExp.isMinimal();
+    QString pattern;
+    switch ( regExp.patternSyntax() )
+    {
+        case QRegExp::RegExp:
+        case QRegExp::RegExp2:
+            pattern = regExp.pattern();
+            break;
+        case QRegExp::FixedString:
+            pattern = QRegularExpression::escape(regExp.pattern());
+            break;
+        default:
+            converted = false;
+            break;
+    }
+
+    const QRegularExpression result(pattern, options);
+    if ( ok )
+        *ok = converted && result.isValid();
+    return result;
+}
 /*void RegExpFilter::reset(int)
 {
     _buffer = QString();
@@ -369,19 +648,7 @@ void RegExpFilter::process()
 
         if ( pos >= 0 )
         {
-            int startLine = 0;
-            int endLine = 0;
-            int startColumn = 0;
-            int endColumn = 0;
-
-            getLineColumn(pos,startLine,startColumn);
-            getLineColumn(pos + _searchText.matchedLength(),endLine,endColumn);
-
-            RegExpFilter::HotSpot* spot = newHotSpot(startLine,startColumn,
-                                           endLine,endColumn);
-            spot->setCapturedTexts(_searchText.capturedTexts());
-
-            addHotSpot( spot );
+            addMatch(pos,_searchText.matchedLength(),_searchText.capturedTexts());
             pos += _searchText.matchedLength();
 
             // if matchedLength == 0, the program will get stuck in an infinite loop
@@ -391,6 +658,23 @@ void RegExpFilter::process()
     }
 }
 
+void RegExpFilter::addMatch(int position, int length, const QStringList& capturedTexts)
+{
+    int startLine = 0;
+    int endLine = 0;
+    int startColumn = 0;
+    int endColumn = 0;
+
+    getLineColumn(position,startLine,startColumn);
+    getLineColumn(position + length,endLine,endColumn);
+
+    RegExpFilter::HotSpot* spot = newHotSpot(startLine,startColumn,
+                                   endLine,endColumn);
+    spot->setCapturedTexts(capturedTexts);
+
+    addHotSpot( spot );
+}
+
 RegExpFilter::HotSpot* RegExpFilter::newHotSpot(int startLine,int startColumn,
                                                 int endLine,int endColumn)
 {
@@ -536,4 +820,268 @@ QList<QAction*> UrlFilter::HotSpot::actions()
     return list;
 }
 
+const int HighlightFilter::MATCH_LIMIT;
+const int HighlightFilter::DEFAULT_TIME_BUDGET;
+
+HighlightFilter::Rule::Rule()
+    : bold(false)
+    , italic(false)
+    , underline(false)
+{
+}
+
+HighlightFilter::HotSpot::HotSpot(int startLine, int startColumn, int endLine, int endColumn,
+                                  const Rule& rule)
+    : Filter::HotSpot(startLine,startColumn,endLine,endColumn)
+    , _rule(rule)
+{
+    setType(Highlight);
+}
+
+void HighlightFilter::HotSpot::activate(const QString&)
+{
+}
+
+const HighlightFilter::Rule& HighlightFilter::HotSpot::rule() const
+{
+    return _rule;
+}
+
+HighlightFilter::HighlightFilter()
+    : _timeBudget(DEFAULT_TIME_BUDGET)
+    , _profiling(false)
+    , _exceededBudgets(0)
+{
+}
+
+// reads a color as written in color schemes, either "r,g,b" or "#rrggbb",
+// or a color name
+static QColor readHighlightColor(const QVariant& value)
+{
+    // QSettings returns values with commas as string lists
+    if (value.type() == QVariant::StringList)
+    {
+        const QStringList rgb = value.toStringList();
+        if (rgb.count() != 3)
+            return QColor();
+        return QColor(rgb[0].toInt(), rgb[1].toInt(), rgb[2].toInt());
+    }
+
+    const QString name = value.toString();
+    return name.isEmpty() ? QColor() : QColor(name);
+}
+
+bool HighlightFilter::load(const QString& fileName)
+{
+    if (!QFileInfo(fileName).isReadable())
+        return false;
+
+    QSettings s(fileName, QSettings::IniFormat);
+    if (s.status() != QSettings::NoError)
+        return false;
+
+    // QSettings reads the keys of the [General] group as top-level keys
+    setTimeBudget(s.value(QLatin1String("TimeBudget"), DEFAULT_TIME_BUDGET).toInt());
+
+    QList<Rule> rules;
+    const QStringList groups = s.childGroups();
+    for (const QString& group : groups)
+    {
+        if (group == QLatin1String("General"))
+            continue;
+
+        s.beginGroup(group);
+
+        // patterns with commas are string lists as well, unless they are quoted
+        const QVariant pattern = s.value(QLatin1String("Pattern"));
+        QRegularExpression::PatternOptions options = QRegularExpression::NoPatternOption;
+        if (!s.value(QLatin1String("CaseSensitive"), true).toBool())
+            options |= QRegularExpression::CaseInsensitiveOption;
+
+        Rule rule;
+        rule.name = group;
+        rule.pattern = QRegularExpression(pattern.type() == QVariant::StringList
+                                          ? pattern.toStringList().join(QLatin1Char(','))
+                                          : pattern.toString(), options);
+        rule.foreground = readHighlightColor(s.value(QLatin1String("Foreground")));
+        rule.background = readHighlightColor(s.value(QLatin1String("Background")));
+        rule.bold = s.value(QLatin1String("Bold"), false).toBool();
+        rule.italic = s.value(QLatin1String("Italic"), false).toBool();
+        rule.underline = s.value(QLatin1String("Underline"), false).toBool();
+
+        s.endGroup();
+
+        rules << rule;
+    }
+
+    setRules(rules);
+    return true;
+}
+
+void HighlightFilter::setRules(const QList<Rule>& rules)
+{
+    _rules.clear();
+    _groups.clear();
+    _rulePatterns.clear();
+    _statistics.clear();
+
+    // limits the work of matching one line
+    const QString limit = QStringLiteral("(*LIMIT_MATCH=%1)").arg(MATCH_LIMIT);
+
+    QString pattern;
+    int group = 1;
+    for (const Rule& rule : rules)
+    {
+        if (rule.pattern.pattern().isEmpty() || !rule.pattern.isValid())
+        {
+            qWarning() << "Invalid pattern" << rule.pattern.pattern() << "for highlighting rule"
+                       << rule.name << ":" << rule.pattern.errorString();
+            continue;
+        }
+
+        QString rulePattern = rule.pattern.pattern();
+        if (rule.pattern.patternOptions() & QRegularExpression::CaseInsensitiveOption)
+            rulePattern = QLatin1String("(?i)") + rulePattern;
+
+        if (!pattern.isEmpty())
+            pattern += QLatin1Char('|');
+        pattern += QLatin1Char('(') + rulePattern + QLatin1Char(')');
+
+        _rules << rule;
+        _groups << group;
+        group += 1 + rule.pattern.captureCount();
+
+        _rulePatterns << QRegularExpression(limit + rulePattern,
+                                            QRegularExpression::UseUnicodePropertiesOption);
+
+        RuleStatistics statistics;
+        statistics.name = rule.name;
+        statistics.hits = 0;
+        statistics.profiledTime = 0;
+        _statistics << statistics;
+    }
+    _groups << group;
+
+    _pattern = QRegularExpression(limit + pattern, QRegularExpression::UseUnicodePropertiesOption);
+    _pattern.optimize();
+}
+
+QList<HighlightFilter::Rule> HighlightFilter::rules() const
+{
+    return _rules;
+}
+
+void HighlightFilter::setTimeBudget(int msecs)
+{
+    _timeBudget = qMax(1, msecs);
+}
+
+int HighlightFilter::timeBudget() const
+{
+    return _timeBudget;
+}
+
+void HighlightFilter::setProfiling(bool profiling)
+{
+    _profiling = profiling;
+}
+
+bool HighlightFilter::profiling() const
+{
+    return _profiling;
+}
+
+QList<HighlightFilter::RuleStatistics> HighlightFilter::statistics() const
+{
+    return _statistics;
+}
+
+quint64 HighlightFilter::exceededBudgets() const
+{
+    return _exceededBudgets;
+}
+
+void HighlightFilter::resetStatistics()
+{
+    for (RuleStatistics& statistics : _statistics)
+    {
+        statistics.hits = 0;
+        statistics.profiledTime = 0;
+    }
+    _exceededBudgets = 0;
+}
+
+void HighlightFilter::process()
+{
+    const QString* text = buffer();
+
+    Q_ASSERT( text );
+
+    if (_rules.isEmpty())
+        return;
+
+    QElapsedTimer timer;
+    timer.start();
+    const qint64 budget = qint64(_timeBudget) * 1000000;
+
+    int start = 0;
+    while (start < text->length())
+    {
+        int end = text->indexOf(QLatin1Char('\n'), start);
+        if (end == -1)
+            end = text->length();
+
+        const QStringRef line = text->midRef(start, end - start);
+        QRegularExpressionMatchIterator matches = _pattern.globalMatch(line);
+        while (matches.hasNext())
+        {
+            const QRegularExpressionMatch match = matches.next();
+            if (match.capturedLength() == 0)
+                continue;
+
+            // the first rule whose group took part in the match is the one which matched
+            for (int i = 0; i < _rules.count(); i++)
+            {
+                if (match.capturedStart(_groups[i]) == -1)
+                    continue;
+
+                int startLine = 0;
+                int endLine = 0;
+                int startColumn = 0;
+                int endColumn = 0;
+
+                getLineColumn(start + match.capturedStart(),startLine,startColumn);
+                getLineColumn(start + match.capturedEnd(),endLine,endColumn);
+
+                addHotSpot(new HotSpot(startLine,startColumn,endLine,endColumn,_rules[i]));
+                _statistics[i].hits++;
+                break;
+            }
+        }
+
+        if (_profiling)
+        {
+            for (int i = 0; i < _rulePatterns.count(); i++)
+            {
+                QElapsedTimer ruleTimer;
+                ruleTimer.start();
+
+                QRegularExpressionMatchIterator ruleMatches = _rulePatterns[i].globalMatch(line);
+                while (ruleMatches.hasNext())
+                    ruleMatches.next();
+
+                _statistics[i].profiledTime += ruleTimer.nsecsElapsed();
+            }
+        }
+
+        start = end + 1;
+
+        if (start < text->length() && timer.nsecsElapsed() > budget)
+        {
+            _exceededBudgets++;
+            break;
+        }
+    }
+}
+
 //#include "Filter.moc"
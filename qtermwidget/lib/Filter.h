@@ -22,11 +22,14 @@
 
 // Qt
 #include <QAction>
+#include <QColor>
 #include <QList>
 #include <QObject>
 #include <QStringList>
 #include <QHash>
 #include <QRegExp>
+#include <QRegularExpression>
+#include <QVector>
 
 // Local
 #include "qtermwidget_export.h"
@@ -87,7 +90,9 @@ public:
             // this hotspot represents a clickable link
             Link,
             // this hotspot represents a marker
-            Marker
+            Marker,
+            // this hotspot gives its text a different style
+            Highlight
        };
 
        /** Returns the line when the hotspot area starts */
@@ -129,6 +134,7 @@ public:
        int    _endColumn;
        Type _type;
 
+       friend class Filter;
     };
 
     /** Constructs a new filter. */
@@ -161,6 +167,13 @@ public:
      */
     void setBuffer(const QString* buffer , const QList<int>* linePositions);
 
+    /**
+     * Moves the hotspots which start on line i of the buffer to line @p lineMap[i], and
+     * deletes the hotspots which start on lines mapped to -1 or beyond the end of @p lineMap.
+     * This keeps the hotspots of text which has only moved to other lines of the buffer.
+     */
+    void moveHotSpots(const QVector<int>& lineMap);
+
 protected:
     /** Adds a new hotspot to the list */
     void addHotSpot(HotSpot*);
@@ -183,6 +196,9 @@ private:
  *
  * Subclasses can reimplement newHotSpot() to return custom hotspot types when matches for the regular expression
  * are found.
+ *
+ * When the filter is part of a FilterChain, the chain usually matches the regular expressions of all of its
+ * RegExpFilters in a single pass over the text instead of calling process(), see FilterChain::process().
  */
 class QTERMWIDGET_EXPORT RegExpFilter : public Filter
 {
@@ -218,6 +234,14 @@ public:
     /** Returns the regular expression which the filter searches for in blocks of text */
     QRegExp regExp() const;
 
+    /**
+     * Converts @p regExp to a QRegularExpression with the same meaning.
+     *
+     * Only regular expressions and fixed strings with greedy quantifiers can be
+     * converted, @p ok is set to false for anything else.
+     */
+    static QRegularExpression toRegularExpression(const QRegExp& regExp, bool* ok = nullptr);
+
     /**
      * Reimplemented to search the filter's text buffer for text matching regExp()
      *
@@ -235,7 +259,12 @@ protected:
                                     int endLine,int endColumn);
 
 private:
+    // adds a hotspot for the match of @p length characters at @p position in buffer()
+    void addMatch(int position, int length, const QStringList& capturedTexts);
+
     QRegExp _searchText;
+
+    friend class FilterChain;
 };
 
 class FilterObject;
@@ -308,6 +337,135 @@ signals:
     void activated(const QUrl& url, bool fromContextMenu);
 };
 
+/**
+ * A filter which gives the text matching user defined rules a different style, for
+ * instance to colorize the severities, addresses and timings in logs.  The hotspots
+ * of the filter have the Highlight type, and the display draws their text with the
+ * colors and the font variant of their rule.
+ *
+ * The regular expressions of all rules are compiled into one, which is matched once
+ * against each line of text.  Since a pathological pattern must not stall the display,
+ * the work of matching one line is bounded by a match limit, and once the time budget
+ * of an update is used up, the rest of the text is left unhighlighted.
+ *
+ * Rules can be loaded from files in the same INI format as color schemes, with one
+ * group per rule.  The rules are tried in the order of their group names, the first
+ * one which matches at a position wins:
+ *
+ * @code
+ * [General]
+ * TimeBudget=5
+ *
+ * [1 Errors]
+ * Pattern="^.*\\b(ERROR|FATAL)\\b.*$"
+ * Foreground=#ff5555
+ * Bold=true
+ *
+ * [2 Latency]
+ * Pattern="\\b\\d+(\\.\\d+)?ms\\b"
+ * Foreground=255,200,0
+ * @endcode
+ *
+ * As in any QSettings INI file, backslashes have to be doubled and patterns containing
+ * commas have to be quoted.  Foreground and Background take colors as in color schemes
+ * or color names.  Bold, Italic, Underline and CaseSensitive default to false, false,
+ * false and true.  Back references are not supported, since they would refer to the
+ * wrong groups once the patterns are combined.
+ */
+class QTERMWIDGET_EXPORT HighlightFilter : public Filter
+{
+public:
+    /** A rule which gives the text matching a regular expression a different style */
+    struct Rule
+    {
+        Rule();
+
+        QString name;
+        QRegularExpression pattern;
+        QColor foreground;  // invalid to keep the color of the text
+        QColor background;  // invalid to keep the color of the text
+        bool bold;
+        bool italic;
+        bool underline;
+    };
+
+    /** Counters of the work done for a rule, to find out which rules are costly */
+    struct RuleStatistics
+    {
+        QString name;
+        /** The number of matches of the rule */
+        quint64 hits;
+        /** The time in nanoseconds spent matching the rule on its own, see setProfiling() */
+        qint64 profiledTime;
+    };
+
+    /** Type of hotspot created by HighlightFilter, which covers text matching a rule */
+    class HotSpot : public Filter::HotSpot
+    {
+    public:
+        HotSpot(int startLine, int startColumn, int endLine, int endColumn, const Rule& rule);
+        void activate(const QString& action = QString()) override;
+
+        /** Returns the rule which the text of the hotspot matched */
+        const Rule& rule() const;
+    private:
+        Rule _rule;
+    };
+
+    HighlightFilter();
+
+    /**
+     * Loads the rules and the time budget from @p fileName, replacing the current rules.
+     * Rules with invalid patterns are skipped.  Returns false if the file cannot be read.
+     */
+    bool load(const QString& fileName);
+
+    /** Sets the rules of the filter.  Rules with invalid patterns are skipped. */
+    void setRules(const QList<Rule>& rules);
+    /** Returns the rules of the filter */
+    QList<Rule> rules() const;
+
+    /** Sets the time in milliseconds after which matching stops for the rest of an update */
+    void setTimeBudget(int msecs);
+    /** Returns the time budget of an update, see setTimeBudget() */
+    int timeBudget() const;
+
+    /**
+     * Enables or disables profiling.  While profiling, each rule is also matched on its
+     * own against each line, to measure its cost for RuleStatistics::profiledTime.  This
+     * slows down the filter considerably and is only meant for tuning rules.
+     */
+    void setProfiling(bool profiling);
+    /** Returns true if profiling is enabled, see setProfiling() */
+    bool profiling() const;
+
+    /** Returns the counters of each rule, in the order of rules() */
+    QList<RuleStatistics> statistics() const;
+    /** Returns the number of updates which ran out of their time budget */
+    quint64 exceededBudgets() const;
+    /** Resets all counters */
+    void resetStatistics();
+
+    /** Reimplemented to match the rules against the filter's text buffer */
+    void process() override;
+
+private:
+    // the most backtracking steps PCRE takes to match one line, which the time
+    // budget cannot interrupt
+    static const int MATCH_LIMIT = 200000;
+    static const int DEFAULT_TIME_BUDGET = 5;
+
+    QList<Rule> _rules;
+    QRegularExpression _pattern;
+    QVector<int> _groups;   // first capture group of each rule, followed by the number of groups
+    QList<QRegularExpression> _rulePatterns;    // for profiling
+
+    int _timeBudget;
+    bool _profiling;
+    QList<RuleStatistics> _statistics;
+    quint64 _exceededBudgets;
+};
+
 /**
  * A chain which allows a group of filters to be processed as one.
  * The chain owns the filters added to it and deletes them when the chain itself is destroyed.
@@ -328,6 +486,7 @@ signals:
 class QTERMWIDGET_EXPORT FilterChain : protected QList<Filter*>
 {
 public:
+    FilterChain();
     virtual ~FilterChain();
 
     /** Adds a new filter to the chain.  The chain will delete this filter when it is destroyed */
@@ -343,8 +502,17 @@ public:
     void reset();
     /**
      * Processes each filter in the chain
+     *
+     * The regular expressions of the chain's RegExpFilters are compiled together into
+     * one alternation, which is matched once over the text, rather than once per filter.
+     * Each match is handed to the filter whose regular expression matched.  Where the
+     * matches of several filters would overlap, the earlier match wins, and the filter
+     * which was added first if they start at the same position.
+     *
+     * Other filters, and regular expressions which cannot be converted by
+     * RegExpFilter::toRegularExpression(), are processed on their own.
      */
-    void process();
+    virtual void process();
 
     /** Sets the buffer for each filter in the chain to process. */
     void setBuffer(const QString* buffer , const QList<int>* linePositions);
@@ -356,15 +524,54 @@ public:
     /** Returns a list of all hotspots at the given line in all the chain's filters */
     QList<Filter::HotSpot> hotSpotsAtLine(int line) const;
 
+protected:
+    /**
+     * Processes the buffer after only parts of it have changed, instead of processing all of it.
+     *
+     * The hotspots of the RegExpFilters are moved by Filter::moveHotSpots() with @p lineMap,
+     * and only the ranges of the buffer given by @p changedRanges (start and end positions)
+     * are matched again.  Other filters are reset and process the whole buffer.  If the
+     * filters have changed since the last call, all of them process the whole buffer.
+     */
+    void processChanges(const QVector<int>& lineMap, const QVector<QPair<int,int> >& changedRanges);
+
+private:
+    // rebuilds _combinedRegExp if the filters or their regular expressions have changed,
+    // returns true if it did
+    bool updateCombinedRegExp();
+    // matches _combinedRegExp at the positions from start to end of the buffer
+    void matchCombined(int start, int end);
+
+    const QString* _buffer;
+
+    // the regular expressions the combined one was built from, one per RegExpFilter in the chain
+    QList<RegExpFilter*> _regExpFilters;
+    QList<QRegExp> _regExps;
+
+    // the filters matched by _combinedRegExp, and the number of the capture group
+    // around the regular expression of each, followed by the number of groups
+    QList<RegExpFilter*> _combinedFilters;
+    QVector<int> _combinedGroups;
+    QRegularExpression _combinedRegExp;
 };
 
-/** A filter chain which processes character images from terminal displays */
+/**
+ * A filter chain which processes character images from terminal displays
+ *
+ * The image is divided into paragraphs, runs of lines joined by the LINE_WRAPPED
+ * property.  Paragraphs whose text is unchanged since the previous image, even if
+ * they have moved to other lines, keep their decoded text and their hotspots, so
+ * that only the text of new and changed paragraphs is decoded and matched again.
+ */
 class QTERMWIDGET_NO_EXPORT TerminalImageFilterChain : public FilterChain
 {
 public:
     TerminalImageFilterChain();
     ~TerminalImageFilterChain() override;
 
+    /** Reimplemented to process only the paragraphs which have changed since the previous image */
+    void process() override;
+
     /**
      * Set the current terminal image to @p image.
      *
@@ -377,8 +584,29 @@ public:
                   const QVector<LineProperty>& lineProperties);
 
 private:
+    struct Paragraph
+    {
+        int firstLine;
+        int lineCount;
+        bool newline;   // whether the text ends with a line break
+        uint hash;      // of the characters
+    };
+
     QString* _buffer;
     QList<int>* _linePositions;
+
+    // the previous image, its text and its paragraphs
+    QString _previousBuffer;
+    QList<int> _previousLinePositions;
+    QVector<wchar_t> _characters;
+    QVector<Paragraph> _paragraphs;
+    int _columns;
+
+    // changes since the previous image, see FilterChain::processChanges()
+    QVector<int> _lineMap;
+    QVector<QPair<int,int> > _changedRanges;
+    bool _processAll;
+    bool _imagePending;     // setImage() was called but not process()
 };
 
 }
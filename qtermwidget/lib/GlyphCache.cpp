@@ -0,0 +1,216 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "GlyphCache.h"
+
+// Qt
+#include <QFontMetrics>
+#include <QPaintEngine>
+#include <QPainter>
+#include <QVarLengthArray>
+
+using namespace Konsole;
+
+const int GlyphCache::ATLAS_COLUMNS;
+const int GlyphCache::MAX_ATLAS_ROWS;
+const int GlyphCache::MAX_COLOR_PAIRS;
+
+// glyphs which cannot be drawn into a cell of their own
+static bool isCellGlyph(wchar_t c)
+{
+    if (c < 0x20 || (c >= 0xd800 && c <= 0xdfff) || uint(c) > 0x10ffff)
+        return false;
+
+    switch (QChar::category(uint(c)))
+    {
+        case QChar::Mark_NonSpacing:
+        case QChar::Mark_SpacingCombining:
+        case QChar::Mark_Enclosing:
+        case QChar::Other_Format:
+            return false;
+        default:
+            return true;
+    }
+}
+
+GlyphCache::GlyphCache()
+    : _atlasRows(0)
+    , _usedCells(0)
+    , _baselineOffset(0)
+    , _devicePixelRatio(1.0)
+{
+}
+
+void GlyphCache::clear()
+{
+    _cells.clear();
+    _colorPairs.clear();
+    _atlas = QImage();
+    _atlasRows = 0;
+    _usedCells = 0;
+}
+
+QRect GlyphCache::cellRect(int cell) const
+{
+    return QRect((cell % ATLAS_COLUMNS) * _cellSize.width(),
+                 (cell / ATLAS_COLUMNS) * _cellSize.height(),
+                 _cellSize.width(), _cellSize.height());
+}
+
+bool GlyphCache::growAtlas()
+{
+    if (_atlasRows >= MAX_ATLAS_ROWS)
+        return false;
+
+    const int newRows = qMin(qMax(4, _atlasRows * 2), MAX_ATLAS_ROWS);
+    QImage atlas(QSize(ATLAS_COLUMNS * _cellSize.width(), newRows * _cellSize.height()) * _devicePixelRatio,
+                 QImage::Format_RGB32);
+    if (atlas.isNull())
+        return false;
+
+    if (!_atlas.isNull())
+    {
+        QPainter painter(&atlas);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.drawImage(0, 0, _atlas);
+    }
+
+    atlas.setDevicePixelRatio(_devicePixelRatio);
+    _atlas = atlas;
+    _atlasRows = newRows;
+    return true;
+}
+
+int GlyphCache::glyph(wchar_t c, const QFont& font, quint64 colors,
+                      const QColor& foreground, const QColor& background)
+{
+    const quint32 variant = (font.bold()      ? 1 : 0)
+                          | (font.italic()    ? 2 : 0)
+                          | (font.underline() ? 4 : 0)
+                          | (font.strikeOut() ? 8 : 0)
+                          | (font.overline()  ? 16 : 0);
+    const QPair<quint64, quint64> key(quint64(uint(c)) | (quint64(variant) << 32), colors);
+
+    QHash<QPair<quint64, quint64>, int>::const_iterator it = _cells.constFind(key);
+    if (it != _cells.constEnd())
+        return it.value();
+
+    const uint ucs4 = uint(c);
+    const QString string = QString::fromUcs4(&ucs4, 1);
+
+    // glyphs which would be clipped by their cell are left to QPainter::drawText(),
+    // which may draw beyond the cell
+    const QRect bounds = QFontMetrics(font).boundingRect(string);
+    if (bounds.left() < 0 || bounds.right() >= _cellSize.width())
+    {
+        _cells.insert(key, -1);
+        return -1;
+    }
+
+    if (_usedCells == _atlasRows * ATLAS_COLUMNS && !growAtlas())
+        return -1;
+
+    const int cell = _usedCells++;
+    const QRect target = cellRect(cell);
+
+    QPainter(&_atlas).fillRect(target, background);
+    rasterize(_atlas, target, font, foreground, _baselineOffset, string);
+
+    _cells.insert(key, cell);
+    return cell;
+}
+
+void GlyphCache::rasterize(QImage& image, const QRect& cell, const QFont& font,
+                           const QColor& color, int baselineOffset, const QString& text)
+{
+    QPainter painter(&image);
+    painter.setClipRect(cell);
+    painter.setFont(font);
+    painter.setPen(color);
+    painter.setLayoutDirection(Qt::LeftToRight);
+
+    QRect drawRect(cell);
+    drawRect.setHeight(cell.height() + baselineOffset);
+    painter.drawText(drawRect, Qt::AlignBottom, text);
+}
+
+bool GlyphCache::drawText(QPainter& painter, const QRect& rect, int cellWidth,
+                          int baselineOffset, const std::wstring& text, const QColor& background)
+{
+    // scaled text (double width or height lines) and printing are left to
+    // QPainter, bitmaps would not scale well
+    if (!painter.paintEngine() || painter.paintEngine()->type() != QPaintEngine::Raster
+        || painter.worldTransform().type() > QTransform::TxTranslate)
+        return false;
+
+    const int count = static_cast<int>(text.size());
+    if (count == 0 || count * cellWidth != rect.width()
+        || count > ATLAS_COLUMNS * MAX_ATLAS_ROWS)
+        return false;
+
+    const QSize cellSize(cellWidth, rect.height());
+    const qreal devicePixelRatio = painter.device()->devicePixelRatioF();
+    if (cellSize != _cellSize || baselineOffset != _baselineOffset
+        || devicePixelRatio != _devicePixelRatio)
+    {
+        clear();
+        _cellSize = cellSize;
+        _baselineOffset = baselineOffset;
+        _devicePixelRatio = devicePixelRatio;
+    }
+
+    // start over rather than evicting single glyphs once the atlas is full, the
+    // glyphs in use are rendered again on the next few paints
+    if (_usedCells + count > ATLAS_COLUMNS * MAX_ATLAS_ROWS)
+        clear();
+
+    const QColor foreground = painter.pen().color();
+    const quint64 colors = (quint64(foreground.rgb() & 0xffffff) << 24) | (background.rgb() & 0xffffff);
+    if (!_colorPairs.contains(colors))
+    {
+        if (_colorPairs.size() >= MAX_COLOR_PAIRS)
+            return false;
+        _colorPairs.insert(colors);
+    }
+
+    // look up all glyphs before drawing, so that nothing is drawn twice if
+    // the run has to be drawn by QPainter after all
+    QVarLengthArray<int, 256> cells(count);
+    const QFont& font = painter.font();
+    for (int i = 0; i < count; i++)
+    {
+        if (!isCellGlyph(text[i]))
+            return false;
+        cells[i] = glyph(text[i], font, colors, foreground, background);
+        if (cells[i] < 0)
+            return false;
+    }
+
+    QRectF source(QPointF(0, 0), QSizeF(cellSize) * _devicePixelRatio);
+    QRectF target(rect.topLeft(), QSizeF(cellSize));
+    for (int i = 0; i < count; i++)
+    {
+        source.moveTopLeft(QPointF(cellRect(cells[i]).topLeft()) * _devicePixelRatio);
+        painter.drawImage(target, _atlas, source);
+        target.translate(cellWidth, 0);
+    }
+
+    return true;
+}
@@ -0,0 +1,119 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef GLYPHCACHE_H
+#define GLYPHCACHE_H
+
+// Standard Library
+#include <string>
+
+// Qt
+#include <QColor>
+#include <QHash>
+#include <QImage>
+#include <QPair>
+#include <QSet>
+#include <QSize>
+
+class QFont;
+class QPainter;
+class QRect;
+class QString;
+
+namespace Konsole
+{
+
+/**
+ * Caches the rendered glyphs of a fixed pitch terminal font.
+ *
+ * Each glyph is rasterized once, for a given character, font variant
+ * (bold, italic, underline, strike-out and overline), foreground and
+ * background color, into an opaque cell of an atlas image.  Drawing onto the
+ * background keeps the subpixel antialiasing which QPainter::drawText() uses
+ * for opaque targets.  Runs of text are then drawn by copying one cell of the
+ * atlas per character, instead of having QPainter::drawText() shape the whole
+ * run on every paint.
+ *
+ * Only text which maps one character to one cell can be drawn this way.
+ * Double width characters, surrogates, combining marks and glyphs which
+ * extend beyond their cell are rejected, so that the caller falls back to
+ * QPainter::drawText() for them.  So are colors beyond the first
+ * MAX_COLOR_PAIRS pairs, which keeps output in many different colors from
+ * filling the atlas over and over.
+ */
+class GlyphCache
+{
+public:
+    GlyphCache();
+
+    /**
+     * Draws @p text into @p rect, one character per cell of @p cellWidth pixels,
+     * using the font and the pen color of @p painter.  The cells are opaque, the
+     * area of @p rect must already be filled with @p background.
+     *
+     * @p baselineOffset is the extra height added below the cell when the text is
+     * aligned to the bottom of it, see TerminalDisplay::calDrawTextAdditionHeight().
+     *
+     * Returns false, without drawing anything, if the text cannot be drawn from
+     * the cache.
+     */
+    bool drawText(QPainter& painter, const QRect& rect, int cellWidth,
+                  int baselineOffset, const std::wstring& text, const QColor& background);
+
+    /**
+     * Discards all cached glyphs.  This must be called when the base font
+     * of the display changes.
+     */
+    void clear();
+
+    /**
+     * Draws the glyphs of @p text into @p cell of @p image, in the place where
+     * TerminalDisplay::drawCharacters() puts runs of text: aligned to the bottom of
+     * the cell extended by @p baselineOffset.  Shared by all the glyph caches.
+     */
+    static void rasterize(QImage& image, const QRect& cell, const QFont& font,
+                          const QColor& color, int baselineOffset, const QString& text);
+
+private:
+    // returns the cell of the glyph in the atlas, rendering it if it is not
+    // cached yet, or -1 if the glyph does not fit into a cell
+    int glyph(wchar_t c, const QFont& font, quint64 colors,
+              const QColor& foreground, const QColor& background);
+    QRect cellRect(int cell) const;
+    bool growAtlas();
+
+    static const int ATLAS_COLUMNS = 64;
+    static const int MAX_ATLAS_ROWS = 64;
+    static const int MAX_COLOR_PAIRS = 64;
+
+    // keyed by the character and font variant, and by the colors
+    QHash<QPair<quint64, quint64>, int> _cells;
+    QSet<quint64> _colorPairs;
+    QImage _atlas;
+    int _atlasRows;
+    int _usedCells;
+
+    QSize _cellSize;
+    int _baselineOffset;
+    qreal _devicePixelRatio;
+};
+
+}
+
+#endif // GLYPHCACHE_H
@@ -151,7 +151,7 @@ void HistoryFile::add(const unsigned char* bytes, int len)
   length += rc;
 }
 
-void HistoryFile::get(unsigned char* bytes, int len, int loc)
+void HistoryFile::get(unsigned char* bytes, int len, qint64 loc)
 {
   //count number of get() calls vs. number of add() calls.
   //If there are many more get() calls compared with add()
@@ -163,21 +163,20 @@ void HistoryFile::get(unsigned char* bytes, int len, int loc)
 
   if ( fileMap )
   {
-    for (int i=0;i<len;i++)
-            bytes[i]=fileMap[loc+i];
+    memcpy(bytes, fileMap+loc, len);
   }
   else
   {
       int rc = 0;
 
       if (loc < 0 || len < 0 || loc + len > length)
-        fprintf(stderr,"getHist(...,%d,%d): invalid args.\n",len,loc);
+        fprintf(stderr,"getHist(...,%d,%lld): invalid args.\n",len,(long long)loc);
       rc = KDE_lseek(ion,loc,SEEK_SET); if (rc < 0) { perror("HistoryFile::get.seek"); return; }
       rc = read(ion,bytes,len);     if (rc < 0) { perror("HistoryFile::get.read"); return; }
   }
 }
 
-int HistoryFile::len()
+qint64 HistoryFile::len()
 {
   return length;
 }
@@ -196,6 +195,21 @@ HistoryScroll::~HistoryScroll()
   delete m_histType;
 }
 
+void HistoryScroll::addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count)
+{
+  QVector<Character> cells;
+  for (int i = 0; i < count; i++)
+  {
+    const int length = lines[i].size();
+    cells.resize(length);
+    for (int j = 0; j < length; j++)
+      cells[j] = lines[i][j].unpack();
+
+    addCells(cells.constData(), length);
+    addLine(wrapped[i]);
+  }
+}
+
 bool HistoryScroll::hasScroll()
 {
   return true;
@@ -204,20 +218,39 @@ bool HistoryScroll::hasScroll()
 // History Scroll File //////////////////////////////////////
 
 /*
-   The history scroll makes a Row(Row(Cell)) from
-   two history buffers. The index buffer contains
-   start of line positions which refere to the cells
-   buffer.
-
-   Note that index[0] addresses the second line
-   (line #1), while the first line (line #0) starts
-   at 0 in cells.
+   The history scroll is a Row(Segment), of which only the last
+   segment is kept in memory as it is filled.
+
+   A closed segment is written to the history file as the qCompress()ed
+   form of
+
+     lineCount                  (int)
+     lineEnds[lineCount]        (int)
+     wrapped[lineCount]         (bool)
+     cells[lineEnds[lineCount-1]] (PackedCharacter)
+
+   The style ids in the cells refer to CharacterStyleTable::instance.
+   The styles of the closed segments are remembered when they are written,
+   so that they are kept without reading the file back.
 */
 
+const int HistoryScrollFile::SEGMENT_LINES;
+const int HistoryScrollFile::CACHED_SEGMENTS;
+
+void HistoryScrollFile::Segment::clear()
+{
+  cells.clear();
+  lineEnds.clear();
+  wrapped.clear();
+}
+
 HistoryScrollFile::HistoryScrollFile(const QString &logFileName)
   : HistoryScroll(new HistoryTypeFile(logFileName)),
-  m_logFileName(logFileName)
+  m_logFileName(logFileName),
+  m_cache(CACHED_SEGMENTS)
 {
+  m_openSegment.lineEnds.reserve(SEGMENT_LINES);
+  m_openSegment.wrapped.reserve(SEGMENT_LINES);
 }
 
 HistoryScrollFile::~HistoryScrollFile()
@@ -226,59 +259,161 @@ HistoryScrollFile::~HistoryScrollFile()
 
 int HistoryScrollFile::getLines()
 {
-  return index.len() / sizeof(int);
+  return m_segments.count() * SEGMENT_LINES + m_openSegment.lineEnds.count();
+}
+
+const HistoryScrollFile::Segment* HistoryScrollFile::segment(int lineno, int& line)
+{
+  Q_ASSERT( lineno >= 0 && lineno < getLines() );
+
+  const int index = lineno / SEGMENT_LINES;
+  line = lineno % SEGMENT_LINES;
+
+  if (index == m_segments.count())
+    return &m_openSegment;
+
+  Segment* cached = m_cache.object(index);
+  if (cached)
+    return cached;
+
+  const SegmentLocation& location = m_segments[index];
+  QByteArray compressed(location.compressedLength, Qt::Uninitialized);
+  m_file.get((unsigned char*)compressed.data(), location.compressedLength, location.offset);
+  const QByteArray data = qUncompress(compressed);
+
+  Segment* decoded = new Segment;
+  const char* p = data.constData();
+  int lineCount = 0;
+  if (data.size() >= (int)sizeof(int))
+    memcpy(&lineCount, p, sizeof(int));
+
+  if (lineCount == SEGMENT_LINES)
+  {
+    p += sizeof(int);
+    decoded->lineEnds.resize(lineCount);
+    memcpy(decoded->lineEnds.data(), p, lineCount * sizeof(int));
+    p += lineCount * sizeof(int);
+    decoded->wrapped.resize(lineCount);
+    memcpy(decoded->wrapped.data(), p, lineCount * sizeof(bool));
+    p += lineCount * sizeof(bool);
+    decoded->cells.resize(decoded->lineEnds.last());
+    memcpy(decoded->cells.data(), p, decoded->cells.size() * sizeof(PackedCharacter));
+  }
+  else
+  {
+    // the file could not be read back, show empty lines instead
+    qWarning() << "HistoryScrollFile: could not read history segment" << index;
+    decoded->lineEnds.fill(0, SEGMENT_LINES);
+    decoded->wrapped.fill(false, SEGMENT_LINES);
+  }
+
+  m_cache.insert(index, decoded);
+  return decoded;
+}
+
+void HistoryScrollFile::closeSegment()
+{
+  const Segment& segment = m_openSegment;
+  const int lineCount = segment.lineEnds.count();
+
+  QByteArray data;
+  data.reserve(sizeof(int) + lineCount * (sizeof(int) + sizeof(bool)) +
+               segment.cells.count() * sizeof(PackedCharacter));
+  data.append((const char*)&lineCount, sizeof(int));
+  data.append((const char*)segment.lineEnds.constData(), lineCount * sizeof(int));
+  data.append((const char*)segment.wrapped.constData(), lineCount * sizeof(bool));
+  data.append((const char*)segment.cells.constData(), segment.cells.count() * sizeof(PackedCharacter));
+
+  const PackedCharacter* cells = segment.cells.constData();
+  for (int i = 0; i < segment.cells.count(); i++)
+  {
+    if (i == 0 || cells[i].style() != cells[i-1].style())
+      m_segmentStyles.insert(cells[i].style());
+  }
+
+  const QByteArray compressed = qCompress(data);
+
+  SegmentLocation location;
+  location.offset = m_file.len();
+  location.compressedLength = compressed.size();
+  m_file.add((const unsigned char*)compressed.constData(), compressed.size());
+
+  // the segment is the one most likely to be looked at next, so rather than
+  // reading it back, it moves into the cache as it is
+  Segment* cached = new Segment(m_openSegment);
+  m_cache.insert(m_segments.count(), cached);
+  m_segments.append(location);
+
+  m_openSegment.clear();
+  m_openSegment.lineEnds.reserve(SEGMENT_LINES);
+  m_openSegment.wrapped.reserve(SEGMENT_LINES);
 }
 
 int HistoryScrollFile::getLineLen(int lineno)
 {
-  return (startOfLine(lineno+1) - startOfLine(lineno)) / sizeof(Character);
+  int line;
+  const Segment* s = segment(lineno, line);
+  return s->lineEnds[line] - s->lineStart(line);
 }
 
 bool HistoryScrollFile::isWrappedLine(int lineno)
 {
-  if (lineno>=0 && lineno <= getLines()) {
-    unsigned char flag;
-    lineflags.get((unsigned char*)&flag,sizeof(unsigned char),(lineno)*sizeof(unsigned char));
-    return flag;
+  if (lineno>=0 && lineno < getLines()) {
+    int line;
+    return segment(lineno, line)->wrapped[line];
   }
   return false;
 }
 
-int HistoryScrollFile::startOfLine(int lineno)
+void HistoryScrollFile::getCells(int lineno, int colno, int count, Character res[])
 {
-  if (lineno <= 0) return 0;
-  if (lineno <= getLines())
-    {
+  if (count == 0) return;
 
-    if (!index.isMapped())
-            index.map();
+  int line;
+  const Segment* s = segment(lineno, line);
+  const int start = s->lineStart(line) + colno;
+  Q_ASSERT( start + count <= s->lineEnds[line] );
 
-    int res;
-    index.get((unsigned char*)&res,sizeof(int),(lineno-1)*sizeof(int));
-    return res;
-    }
-  return cells.len();
+  const PackedCharacter* cells = s->cells.constData() + start;
+  for (int i = 0; i < count; i++)
+    res[i] = cells[i].unpack();
 }
 
-void HistoryScrollFile::getCells(int lineno, int colno, int count, Character res[])
+void HistoryScrollFile::addCells(const Character text[], int count)
 {
-  cells.get((unsigned char*)res,count*sizeof(Character),startOfLine(lineno)+colno*sizeof(Character));
+  QVector<PackedCharacter>& cells = m_openSegment.cells;
+  const int start = cells.count();
+  cells.resize(start + count);
+  for (int i = 0; i < count; i++)
+    cells[start + i] = PackedCharacter(text[i]);
 }
 
-void HistoryScrollFile::addCells(const Character text[], int count)
+void HistoryScrollFile::addLine(bool previousWrapped)
 {
-  cells.add((unsigned char*)text,count*sizeof(Character));
+  m_openSegment.lineEnds.append(m_openSegment.cells.count());
+  m_openSegment.wrapped.append(previousWrapped);
+
+  if (m_openSegment.lineEnds.count() == SEGMENT_LINES)
+    closeSegment();
 }
 
-void HistoryScrollFile::addLine(bool previousWrapped)
+void HistoryScrollFile::addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    m_openSegment.cells += lines[i];
+    addLine(wrapped[i]);
+  }
+}
+
+void HistoryScrollFile::markUsedStyles(QBitArray& styles)
 {
-  if (index.isMapped())
-          index.unmap();
+  for (quint32 style : qAsConst(m_segmentStyles))
+    styles.setBit(style);
 
-  int locn = cells.len();
-  index.add((unsigned char*)&locn,sizeof(int));
-  unsigned char flags = previousWrapped ? 0x01 : 0x00;
-  lineflags.add((unsigned char*)&flags,sizeof(unsigned char));
+  const PackedCharacter* cells = m_openSegment.cells.constData();
+  for (int i = 0; i < m_openSegment.cells.count(); i++)
+    styles.setBit(cells[i].style());
 }
 
 
@@ -298,7 +433,7 @@ HistoryScrollBuffer::~HistoryScrollBuffer()
     delete[] _historyBuffer;
 }
 
-void HistoryScrollBuffer::addCellsVector(const QVector<Character>& cells)
+void HistoryScrollBuffer::appendLine(const HistoryLine& line)
 {
     _head++;
     if ( _usedLines < _maxLineCount )
@@ -309,15 +444,16 @@ void HistoryScrollBuffer::addCellsVector(const QVector<Character>& cells)
         _head = 0;
     }
 
-    _historyBuffer[bufferIndex(_usedLines-1)] = cells;
+    _historyBuffer[bufferIndex(_usedLines-1)] = line;
     _wrappedLine[bufferIndex(_usedLines-1)] = false;
 }
 void HistoryScrollBuffer::addCells(const Character a[], int count)
 {
   HistoryLine newLine(count);
-  std::copy(a,a+count,newLine.begin());
+  for (int i = 0; i < count; i++)
+    newLine[i] = PackedCharacter(a[i]);
 
-  addCellsVector(newLine);
+  appendLine(newLine);
 }
 
 void HistoryScrollBuffer::addLine(bool previousWrapped)
@@ -325,6 +461,26 @@ void HistoryScrollBuffer::addLine(bool previousWrapped)
     _wrappedLine[bufferIndex(_usedLines-1)] = previousWrapped;
 }
 
+void HistoryScrollBuffer::addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count)
+{
+    for (int i = qMax(0, count - _maxLineCount); i < count; i++)
+    {
+        appendLine(lines[i]);
+        _wrappedLine[bufferIndex(_usedLines-1)] = wrapped[i];
+    }
+}
+
+void HistoryScrollBuffer::markUsedStyles(QBitArray& styles)
+{
+    for (int i = 0; i < _usedLines; i++)
+    {
+        const HistoryLine& line = _historyBuffer[bufferIndex(i)];
+        const PackedCharacter* cells = line.constData();
+        for (int x = 0; x < line.count(); x++)
+            styles.setBit(cells[x].style());
+    }
+}
+
 int HistoryScrollBuffer::getLines()
 {
     return _usedLines;
@@ -377,7 +533,9 @@ void HistoryScrollBuffer::getCells(int lineNumber, int startColumn, int count, C
 
   Q_ASSERT( startColumn <= line.size() - count );
 
-  memcpy(buffer, line.constData() + startColumn , count * sizeof(Character));
+  const PackedCharacter* data = line.constData() + startColumn;
+  for (int i = 0; i < count; i++)
+    buffer[i] = data[i].unpack();
 }
 
 void HistoryScrollBuffer::setMaxNbLines(unsigned int lineCount)
@@ -461,8 +619,14 @@ void HistoryScrollNone::addLine(bool)
 {
 }
 
+void HistoryScrollNone::markUsedStyles(QBitArray&)
+{
+}
+
 // History Scroll BlockArray //////////////////////////////////////
 
+const int HistoryScrollBlockArray::MAX_LINE_LENGTH;
+
 HistoryScrollBlockArray::HistoryScrollBlockArray(size_t size)
   : HistoryScroll(new HistoryTypeBlockArray(size))
 {
@@ -475,20 +639,19 @@ HistoryScrollBlockArray::~HistoryScrollBlockArray()
 
 int  HistoryScrollBlockArray::getLines()
 {
-  return m_lineLengths.count();
+  return m_blockArray.len();
 }
 
 int  HistoryScrollBlockArray::getLineLen(int lineno)
 {
-    if ( m_lineLengths.contains(lineno) )
-        return m_lineLengths[lineno];
-    else
-        return 0;
+  const Block *b = m_blockArray.at(m_blockArray.firstIndex() + lineno);
+  return b ? b->size : 0;
 }
 
-bool HistoryScrollBlockArray::isWrappedLine(int /*lineno*/)
+bool HistoryScrollBlockArray::isWrappedLine(int lineno)
 {
-  return false;
+  const Block *b = m_blockArray.at(m_blockArray.firstIndex() + lineno);
+  return b && b->flags;
 }
 
 void HistoryScrollBlockArray::getCells(int lineno, int colno,
@@ -496,15 +659,23 @@ void HistoryScrollBlockArray::getCells(int lineno, int colno,
 {
   if (!count) return;
 
-  const Block *b = m_blockArray.at(lineno);
+  const Block *b = m_blockArray.at(m_blockArray.firstIndex() + lineno);
 
   if (!b) {
     memset(static_cast<void*>(res), 0, count * sizeof(Character)); // still better than random data
     return;
   }
 
-  Q_ASSERT(((colno + count) * sizeof(Character)) < ENTRIES);
-  memcpy(res, b->data + (colno * sizeof(Character)), count * sizeof(Character));
+  Q_ASSERT(colno + count <= (int)b->size);
+  const PackedCharacter* cells = reinterpret_cast<const PackedCharacter*>(b->data) + colno;
+  for (int i = 0; i < count; i++)
+    res[i] = cells[i].unpack();
+}
+
+void HistoryScrollBlockArray::setMaxNbLines(size_t lineCount)
+{
+  m_blockArray.setHistorySize(lineCount);
+  dynamic_cast<HistoryTypeBlockArray*>(m_histType)->m_size = lineCount;
 }
 
 void HistoryScrollBlockArray::addCells(const Character a[], int count)
@@ -513,23 +684,54 @@ void HistoryScrollBlockArray::addCells(const Character a[], int count)
 
   if (!b) return;
 
-  // put cells in block's data
-  Q_ASSERT((count * sizeof(Character)) < ENTRIES);
+  // put cells in block's data, the line is added by addLine()
+  count = qMin(count, MAX_LINE_LENGTH);
+
+  PackedCharacter* cells = reinterpret_cast<PackedCharacter*>(b->data);
+  for (int i = 0; i < count; i++)
+    cells[i] = PackedCharacter(a[i]);
+  b->size = count;
+}
+
+void HistoryScrollBlockArray::addLine(bool previousWrapped)
+{
+  Block *b = m_blockArray.lastBlock();
+
+  if (!b) return;
 
-  memset(b->data, 0, sizeof(b->data));
+  b->flags = previousWrapped;
+  m_blockArray.newBlock();
+}
 
-  memcpy(b->data, a, count * sizeof(Character));
-  b->size = count * sizeof(Character);
+void HistoryScrollBlockArray::addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count)
+{
+  // the lines are copied straight into the blocks, cut to a block like addCells() does
+  for (int i = qMax(0, count - getType().maximumLineCount()); i < count; i++)
+  {
+    Block *b = m_blockArray.lastBlock();
 
-  size_t res = m_blockArray.newBlock();
-  Q_ASSERT(res > 0);
-  Q_UNUSED( res );
+    if (!b) return;
 
-  m_lineLengths.insert(m_blockArray.getCurrent(), count);
+    const int length = qMin(lines[i].size(), MAX_LINE_LENGTH);
+    memcpy(b->data, lines[i].constData(), length * sizeof(PackedCharacter));
+    b->size = length;
+    b->flags = wrapped[i];
+    m_blockArray.newBlock();
+  }
 }
 
-void HistoryScrollBlockArray::addLine(bool)
+void HistoryScrollBlockArray::markUsedStyles(QBitArray& styles)
 {
+  for (int i = 0; i < getLines(); i++)
+  {
+    const Block *b = m_blockArray.at(m_blockArray.firstIndex() + i);
+
+    if (!b) continue;
+
+    const PackedCharacter* cells = reinterpret_cast<const PackedCharacter*>(b->data);
+    for (size_t x = 0; x < b->size; x++)
+      styles.setBit(cells[x].style());
+  }
 }
 
 ////////////////////////////////////////////////////////////////
@@ -538,6 +740,8 @@ void HistoryScrollBlockArray::addLine(bool)
 void* CompactHistoryBlock::allocate ( size_t length )
 {
  Q_ASSERT ( length > 0 );
+  // keep every allocation aligned for the line objects and the 32 bit arrays
+  length = ( length + 7 ) & ~size_t ( 7 );
   if ( tail-blockStart+length > blockLength )
     return nullptr;
 
@@ -557,7 +761,7 @@ void CompactHistoryBlock::deallocate ( )
 void* CompactHistoryBlockList::allocate(size_t size)
 {
   CompactHistoryBlock* block;
-  if ( list.isEmpty() || list.last()->remaining() < size)
+  if ( list.isEmpty() || list.last()->remaining() < size + 8 )
   {
     block = new CompactHistoryBlock();
     list.append ( block );
@@ -575,16 +779,16 @@ void CompactHistoryBlockList::deallocate(void* ptr)
 {
   Q_ASSERT( !list.isEmpty());
 
+  // lines are dropped oldest first, so the block is nearly always the first one
   int i=0;
-  CompactHistoryBlock *block = list.at(i);
-  while ( i<list.size() && !block->contains(ptr) )
-  {
+  while ( i<list.size() && !list.at(i)->contains(ptr) )
     i++;
-    block=list.at(i);
-  }
 
   Q_ASSERT( i<list.size() );
+  if ( i == list.size() )
+    return;
 
+  CompactHistoryBlock *block = list.at(i);
   block->deallocate();
 
   if (!block->isInUse())
@@ -606,63 +810,49 @@ void* CompactHistoryLine::operator new (size_t size, CompactHistoryBlockList& bl
   return blockList.allocate(size);
 }
 
-CompactHistoryLine::CompactHistoryLine ( const TextLine& line, CompactHistoryBlockList& bList )
+CompactHistoryLine::CompactHistoryLine ( const QVector<PackedCharacter>& line, CompactHistoryBlockList& bList )
   : blockList(bList),
-    formatLength(0)
+    formatArray(nullptr),
+    length(line.size()),
+    text(nullptr),
+    formatLength(0),
+    wrapped(false)
 {
-  length=line.size();
-
-  if (line.size() > 0) {
-    formatLength=1;
-    int k=1;
+  if (length > 0) {
+    const PackedCharacter* cells = line.constData();
 
     // count number of different formats in this text line
-    Character c = line[0];
-    while ( k<length )
+    formatLength=1;
+    for ( quint32 k=1; k<length; k++ )
     {
-      if ( !(line[k].equalsFormat(c)))
-      {
+      if ( cells[k].rendition() != cells[k-1].rendition() || cells[k].style() != cells[k-1].style() )
         formatLength++; // format change detected
-        c=line[k];
-      }
-      k++;
     }
 
     //kDebug() << "number of different formats in string: " << formatLength;
     formatArray = (CharacterFormat*) blockList.allocate(sizeof(CharacterFormat)*formatLength);
     Q_ASSERT (formatArray!=nullptr);
-    text = (quint16*) blockList.allocate(sizeof(quint16)*line.size());
+    text = (quint32*) blockList.allocate(sizeof(quint32)*length);
     Q_ASSERT (text!=nullptr);
 
-    length=line.size();
-    wrapped=false;
-
     // record formats and their positions in the format array
-    c=line[0];
-    formatArray[0].setFormat ( c );
+    formatArray[0].setFormat ( cells[0] );
     formatArray[0].startPos=0;                        // there's always at least 1 format (for the entire line, unless a change happens)
 
-    k=1;                                              // look for possible format changes
-    int j=1;
-    while ( k<length && j<formatLength )
+    quint32 j=1;
+    for ( quint32 k=1; k<length; k++ )
     {
-      if (!(line[k].equalsFormat(c)))
+      if ( !formatArray[j-1].equalsFormat(cells[k]) )
       {
-        c=line[k];
-        formatArray[j].setFormat(c);
+        formatArray[j].setFormat(cells[k]);
         formatArray[j].startPos=k;
-        //kDebug() << "format entry " << j << " at pos " << formatArray[j].startPos << " " << &(formatArray[j].startPos) ;
         j++;
       }
-      k++;
     }
 
     // copy character values
-    for ( int i=0; i<line.size(); i++ )
-    {
-      text[i]=line[i].character;
-      //kDebug() << "char " << i << " at mem " << &(text[i]);
-    }
+    for ( quint32 i=0; i<length; i++ )
+      text[i]=cells[i].character();
   }
   //kDebug() << "line created, length " << length << " at " << &(length);
 }
@@ -677,17 +867,34 @@ CompactHistoryLine::~CompactHistoryLine()
   blockList.deallocate(this);
 }
 
+void CompactHistoryLine::markUsedStyles ( QBitArray& styles ) const
+{
+  for ( quint32 i = 0; i < formatLength; i++ )
+    styles.setBit ( formatArray[i].style );
+}
+
+int CompactHistoryLine::formatIndex ( int index ) const
+{
+  // binary search for the last run starting at or before 'index'
+  int first = 0;
+  int last = formatLength - 1;
+  while ( first < last )
+  {
+    const int middle = ( first + last + 1 ) / 2;
+    if ( formatArray[middle].startPos <= ( quint32 ) index )
+      first = middle;
+    else
+      last = middle - 1;
+  }
+  return first;
+}
+
 void CompactHistoryLine::getCharacter ( int index, Character &r )
 {
-  Q_ASSERT ( index < length );
-  int formatPos=0;
-  while ( ( formatPos+1 ) < formatLength && index >= formatArray[formatPos+1].startPos )
-    formatPos++;
+  Q_ASSERT ( index < ( int ) length );
+  const CharacterFormat& format = formatArray[formatIndex ( index )];
 
-  r.character=text[index];
-  r.rendition = formatArray[formatPos].rendition;
-  r.foregroundColor = formatArray[formatPos].fgColor;
-  r.backgroundColor = formatArray[formatPos].bgColor;
+  r = PackedCharacter ( text[index], format.rendition, format.style ).unpack();
 }
 
 void CompactHistoryLine::getCharacters ( Character* array, int length, int startColumn )
@@ -695,9 +902,26 @@ void CompactHistoryLine::getCharacters ( Character* array, int length, int start
   Q_ASSERT ( startColumn >= 0 && length >= 0 );
   Q_ASSERT ( startColumn+length <= ( int ) getLength() );
 
-  for ( int i=startColumn; i<length+startColumn; i++ )
+  if ( length == 0 )
+    return;
+
+  // unpack run by run, looking up the colors of each run only once
+  quint32 formatPos = formatIndex ( startColumn );
+  int i = startColumn;
+  const int end = startColumn + length;
+  while ( i < end )
   {
-    getCharacter ( i, array[i-startColumn] );
+    const CharacterFormat& format = formatArray[formatPos];
+    const int runEnd = ( formatPos+1 < formatLength ) ?
+                       qMin ( end, ( int ) formatArray[formatPos+1].startPos ) : end;
+
+    Character c = PackedCharacter ( ' ', format.rendition, format.style ).unpack();
+    for ( ; i < runEnd; i++ )
+    {
+      c.character = text[i];
+      array[i-startColumn] = c;
+    }
+    formatPos++;
   }
 }
 
@@ -705,6 +929,9 @@ CompactHistoryScroll::CompactHistoryScroll ( unsigned int maxLineCount )
     : HistoryScroll ( new CompactHistoryType ( maxLineCount ) )
     ,lines()
     ,blockList()
+    ,_maxLineCount ( 0 )
+    ,_usedLines ( 0 )
+    ,_firstLine ( 0 )
 {
   //kDebug() << "scroll of length " << maxLineCount << " created";
   setMaxNbLines ( maxLineCount );
@@ -712,45 +939,78 @@ CompactHistoryScroll::CompactHistoryScroll ( unsigned int maxLineCount )
 
 CompactHistoryScroll::~CompactHistoryScroll()
 {
-  qDeleteAll ( lines.begin(), lines.end() );
+  for ( int i = 0; i < _usedLines; i++ )
+    delete lines[lineIndex ( i )];
   lines.clear();
 }
 
-void CompactHistoryScroll::addCellsVector ( const TextLine& cells )
+int CompactHistoryScroll::lineIndex ( int lineNumber ) const
+{
+  Q_ASSERT ( lineNumber >= 0 && lineNumber < _usedLines );
+  return ( _firstLine + lineNumber ) % _maxLineCount;
+}
+
+void CompactHistoryScroll::appendLine ( const QVector<PackedCharacter>& cells, bool wrapped )
 {
-  CompactHistoryLine *line;
-  line = new(blockList) CompactHistoryLine ( cells, blockList );
+  if ( _maxLineCount == 0 )
+    return;
 
-  if ( lines.size() > ( int ) _maxLineCount )
+  CompactHistoryLine *line = new(blockList) CompactHistoryLine ( cells, blockList );
+  line->setWrapped ( wrapped );
+
+  if ( _usedLines == ( int ) _maxLineCount )
+  {
+    // overwrite the oldest line
+    delete lines[_firstLine];
+    lines[_firstLine] = line;
+    _firstLine = ( _firstLine + 1 ) % _maxLineCount;
+  }
+  else
   {
-    delete lines.takeAt ( 0 );
+    lines[( _firstLine + _usedLines ) % _maxLineCount] = line;
+    _usedLines++;
   }
-  lines.append ( line );
 }
 
 void CompactHistoryScroll::addCells ( const Character a[], int count )
 {
-  TextLine newLine ( count );
-  std::copy ( a,a+count,newLine.begin() );
-  addCellsVector ( newLine );
+  QVector<PackedCharacter> newLine ( count );
+  for ( int i = 0; i < count; i++ )
+    newLine[i] = PackedCharacter ( a[i] );
+  appendLine ( newLine, false );
 }
 
 void CompactHistoryScroll::addLine ( bool previousWrapped )
 {
-  CompactHistoryLine *line = lines.last();
+  if ( _usedLines == 0 )
+    return;
+
+  CompactHistoryLine *line = lines[lineIndex ( _usedLines-1 )];
   //kDebug() << "last line at address " << line;
   line->setWrapped(previousWrapped);
 }
 
+void CompactHistoryScroll::addLines ( const QVector<PackedCharacter> newLines[], const bool wrapped[], int count )
+{
+  for ( int i = qMax ( 0, count - ( int ) _maxLineCount ); i < count; i++ )
+    appendLine ( newLines[i], wrapped[i] );
+}
+
+void CompactHistoryScroll::markUsedStyles ( QBitArray& styles )
+{
+  for ( int i = 0; i < _usedLines; i++ )
+    lines[lineIndex ( i )]->markUsedStyles ( styles );
+}
+
 int CompactHistoryScroll::getLines()
 {
-  return lines.size();
+  return _usedLines;
 }
 
 int CompactHistoryScroll::getLineLen ( int lineNumber )
 {
-  Q_ASSERT ( lineNumber >= 0 && lineNumber < lines.size() );
-  CompactHistoryLine* line = lines[lineNumber];
+  Q_ASSERT ( lineNumber >= 0 && lineNumber < _usedLines );
+  CompactHistoryLine* line = lines[lineIndex ( lineNumber )];
   //kDebug() << "request for line at address " << line;
   return line->getLength();
 }
@@ -759,8 +1019,8 @@ int CompactHistoryScroll::getLineLen ( int lineNumber )
 void CompactHistoryScroll::getCells ( int lineNumber, int startColumn, int count, Character buffer[] )
 {
   if ( count == 0 ) return;
-  Q_ASSERT ( lineNumber < lines.size() );
-  CompactHistoryLine* line = lines[lineNumber];
+  Q_ASSERT ( lineNumber < _usedLines );
+  CompactHistoryLine* line = lines[lineIndex ( lineNumber )];
   Q_ASSERT ( startColumn >= 0 );
   Q_ASSERT ( (unsigned int)startColumn <= line->getLength() - count );
   line->getCharacters ( buffer, count, startColumn );
@@ -768,18 +1028,29 @@ void CompactHistoryScroll::getCells ( int lineNumber, int startColumn, int count
 
 void CompactHistoryScroll::setMaxNbLines ( unsigned int lineCount )
 {
+  // keep the newest lines, in order from the start of the new ring
+  HistoryArray newLines ( lineCount );
+  const int keptLines = qMin ( _usedLines, ( int ) lineCount );
+  const int droppedLines = _usedLines - keptLines;
+
+  for ( int i = 0; i < droppedLines; i++ )
+    delete lines[lineIndex ( i )];
+  for ( int i = 0; i < keptLines; i++ )
+    newLines[i] = lines[lineIndex ( droppedLines + i )];
+
+  lines.swap ( newLines );
   _maxLineCount = lineCount;
+  _usedLines = keptLines;
+  _firstLine = 0;
 
-  while (lines.size() > (int) lineCount) {
-    delete lines.takeAt(0);
-  }
+  dynamic_cast<CompactHistoryType*>(m_histType)->m_nbLines = lineCount;
   //kDebug() << "set max lines to: " << _maxLineCount;
 }
 
 bool CompactHistoryScroll::isWrappedLine ( int lineNumber )
 {
-  Q_ASSERT ( lineNumber < lines.size() );
-  return lines[lineNumber]->isWrapped();
+  Q_ASSERT ( lineNumber < _usedLines );
+  return lines[lineIndex ( lineNumber )]->isWrapped();
 }
 
 
@@ -836,7 +1107,33 @@ int HistoryTypeBlockArray::maximumLineCount() const
 
 HistoryScroll* HistoryTypeBlockArray::scroll(HistoryScroll *old) const
 {
-  delete old;
+  if (old)
+  {
+    HistoryScrollBlockArray *oldArray = dynamic_cast<HistoryScrollBlockArray*>(old);
+    if (oldArray)
+    {
+      oldArray->setMaxNbLines(m_size);
+      return oldArray;
+    }
+
+    HistoryScroll *newScroll = new HistoryScrollBlockArray(m_size);
+    int lines = old->getLines();
+    int startLine = 0;
+    if (lines > (int) m_size)
+      startLine = lines - m_size;
+
+    QVector<Character> line;
+    for (int i = startLine; i < lines; i++)
+    {
+      int size = old->getLineLen(i);
+      line.resize(size);
+      old->getCells(i, 0, size, line.data());
+      newScroll->addCells(line.constData(), size);
+      newScroll->addLine(old->isWrappedLine(i));
+    }
+    delete old;
+    return newScroll;
+  }
   return new HistoryScrollBlockArray(m_size);
 }
 
@@ -919,7 +1216,7 @@ const QString& HistoryTypeFile::getFileName() const
 
 HistoryScroll* HistoryTypeFile::scroll(HistoryScroll *old) const
 {
-  if (dynamic_cast<HistoryFile *>(old))
+  if (dynamic_cast<HistoryScrollFile *>(old))
      return old; // Unchanged.
 
   HistoryScroll *newScroll = new HistoryScrollFile(m_fileName);
@@ -981,7 +1278,24 @@ HistoryScroll* CompactHistoryType::scroll ( HistoryScroll *old ) const
       oldBuffer->setMaxNbLines ( m_nbLines );
       return oldBuffer;
     }
+
+    HistoryScroll *newScroll = new CompactHistoryScroll ( m_nbLines );
+    int lines = old->getLines();
+    int startLine = 0;
+    if ( lines > ( int ) m_nbLines )
+      startLine = lines - m_nbLines;
+
+    QVector<Character> line;
+    for ( int i = startLine; i < lines; i++ )
+    {
+      int size = old->getLineLen ( i );
+      line.resize ( size );
+      old->getCells ( i, 0, size, line.data() );
+      newScroll->addCells ( line.constData(), size );
+      newScroll->addLine ( old->isWrappedLine ( i ) );
+    }
     delete old;
+    return newScroll;
   }
   return new CompactHistoryScroll ( m_nbLines );
 }
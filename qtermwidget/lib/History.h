@@ -23,7 +23,9 @@
 
 // Qt
 #include <QBitRef>
+#include <QCache>
 #include <QHash>
+#include <QSet>
 #include <QVector>
 #include <QTemporaryFile>
 
@@ -52,8 +54,8 @@ public:
   virtual ~HistoryFile();
 
   virtual void add(const unsigned char* bytes, int len);
-  virtual void get(unsigned char* bytes, int len, int loc);
-  virtual int  len();
+  virtual void get(unsigned char* bytes, int len, qint64 loc);
+  virtual qint64 len();
 
   //mmaps the file in read-only mode
   void map();
@@ -65,7 +67,7 @@ public:
 
 private:
   int  ion;
-  int  length;
+  qint64 length;
   QTemporaryFile tmpFile;
 
   //pointer to start of mmap'ed file data, or 0 if the file is not mmap'ed
@@ -117,6 +119,16 @@ public:
 
   virtual void addLine(bool previousWrapped=false) = 0;
 
+  // adds 'count' lines of the screen at once, wrapped[i] telling whether
+  // lines[i] is continued on the next line.  Bounded histories skip the lines
+  // which the rest of the batch would push out again.  The default implementation
+  // unpacks them and adds them one at a time through addCells() and addLine()
+  virtual void addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count);
+
+  // sets the bits of 'styles' for the ids in CharacterStyleTable which are
+  // used by the lines in the history, see CharacterStyleTable::reclaimUnusedStyles()
+  virtual void markUsedStyles(QBitArray& styles) = 0;
+
   //
   // FIXME:  Passing around constant references to HistoryType instances
   // is very unsafe, because those references will no longer
@@ -133,6 +145,13 @@ protected:
 
 //////////////////////////////////////////////////////////////////////
 // File-based history (e.g. file log, no limitation in length)
+//
+// Lines are collected in segments of SEGMENT_LINES lines.  Once full, a
+// segment is compressed and appended to the history file, and only its
+// position in the file is kept in memory.  Since every segment holds the
+// same number of lines, the segment of a line is found by a division.
+// Decompressed segments are kept in a small LRU cache, so scrolling back
+// through a stretch of history decompresses each segment once.
 //////////////////////////////////////////////////////////////////////
 
 class HistoryScrollFile : public HistoryScroll
@@ -148,14 +167,41 @@ public:
 
   void addCells(const Character a[], int count) override;
   void addLine(bool previousWrapped=false) override;
+  void addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count) override;
+  void markUsedStyles(QBitArray& styles) override;
+
+  /** The number of lines stored in each segment. */
+  static const int SEGMENT_LINES = 4096;
+  /** The number of decompressed segments which are cached. */
+  static const int CACHED_SEGMENTS = 16;
 
 private:
-  int startOfLine(int lineno);
+  struct Segment
+  {
+    QVector<PackedCharacter> cells;
+    QVector<int> lineEnds;   // offset in 'cells' behind the end of each line
+    QVector<bool> wrapped;
+
+    int lineStart(int line) const { return line > 0 ? lineEnds[line-1] : 0; }
+    void clear();
+  };
+
+  struct SegmentLocation
+  {
+    qint64 offset;          // in the history file
+    int compressedLength;
+  };
+
+  // returns the segment which holds 'lineno', and the line within it
+  const Segment* segment(int lineno, int& line);
+  void closeSegment();
 
   QString m_logFileName;
-  HistoryFile index; // lines Row(int)
-  HistoryFile cells; // text  Row(Character)
-  HistoryFile lineflags; // flags Row(unsigned char)
+  HistoryFile m_file;                  // compressed segments
+  QVector<SegmentLocation> m_segments; // closed segments, in order
+  Segment m_openSegment;               // the segment being filled
+  QCache<int,Segment> m_cache;         // decompressed closed segments
+  QSet<quint32> m_segmentStyles;       // styles used by the closed segments
 };
 
 
@@ -165,7 +211,9 @@ private:
 class HistoryScrollBuffer : public HistoryScroll
 {
 public:
-  typedef QVector<Character> HistoryLine;
+  // lines are kept in the packed form of the screen, so that they can be
+  // shared with it rather than copied
+  typedef QVector<PackedCharacter> HistoryLine;
 
   HistoryScrollBuffer(unsigned int maxNbLines = 1000);
   ~HistoryScrollBuffer() override;
@@ -176,8 +224,9 @@ public:
   bool isWrappedLine(int lineno) override;
 
   void addCells(const Character a[], int count) override;
-  void addCellsVector(const QVector<Character>& cells) override;
   void addLine(bool previousWrapped=false) override;
+  void addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count) override;
+  void markUsedStyles(QBitArray& styles) override;
 
   void setMaxNbLines(unsigned int nbLines);
   unsigned int maxNbLines() const { return _maxLineCount; }
@@ -185,6 +234,7 @@ public:
 
 private:
   int bufferIndex(int lineNumber);
+  void appendLine(const HistoryLine& line);
 
   HistoryLine* _historyBuffer;
   QBitArray _wrappedLine;
@@ -234,6 +284,7 @@ public:
 
   void addCells(const Character a[], int count) override;
   void addLine(bool previousWrapped=false) override;
+  void markUsedStyles(QBitArray& styles) override;
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -252,39 +303,49 @@ public:
 
   void addCells(const Character a[], int count) override;
   void addLine(bool previousWrapped=false) override;
+  void addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count) override;
+  void markUsedStyles(QBitArray& styles) override;
+
+  void setMaxNbLines(size_t nbLines);
+
+  // the longest line a block can hold, longer lines are cut
+  static const int MAX_LINE_LENGTH = ENTRIES / sizeof(PackedCharacter);
 
 protected:
+  // each line takes one block, holding its packed cells, the size of
+  // which is the cell count and the flags of which are the wrap flag
   BlockArray m_blockArray;
-  QHash<int,size_t> m_lineLengths;
 };
 
 //////////////////////////////////////////////////////////////////////
 // History using compact storage
 // This implementation uses a list of fixed-sized blocks
 // where history lines are allocated in (avoids heap fragmentation)
+//
+// Each line keeps its text as UTF-32 values and its formatting as runs
+// of (start, rendition, style), style being an id in CharacterStyleTable.
+// Most lines have only a handful of runs, which makes a line take little
+// more than 4 bytes per character.
 //////////////////////////////////////////////////////////////////////
-typedef QVector<Character> TextLine;
-
 class CharacterFormat
 {
 public:
   bool equalsFormat(const CharacterFormat &other) const {
-    return other.rendition==rendition && other.fgColor==fgColor && other.bgColor==bgColor;
+    return other.rendition==rendition && other.style==style;
   }
 
-  bool equalsFormat(const Character &c) const {
-    return c.rendition==rendition && c.foregroundColor==fgColor && c.backgroundColor==bgColor;
+  bool equalsFormat(const PackedCharacter &c) const {
+    return c.rendition()==rendition && c.style()==style;
   }
 
-  void setFormat(const Character& c) {
-    rendition=c.rendition;
-    fgColor=c.foregroundColor;
-    bgColor=c.backgroundColor;
+  void setFormat(const PackedCharacter& c) {
+    rendition=c.rendition();
+    style=c.style();
   }
 
-  CharacterColor fgColor, bgColor;
-  quint16 startPos;
-  quint8 rendition;
+  quint32 startPos;
+  quint32 style;
+  quint16 rendition;
 };
 
 class CompactHistoryBlock
@@ -335,7 +396,7 @@ private:
 class CompactHistoryLine
 {
 public:
-  CompactHistoryLine(const TextLine&, CompactHistoryBlockList& blockList);
+  CompactHistoryLine(const QVector<PackedCharacter>&, CompactHistoryBlockList& blockList);
   virtual ~CompactHistoryLine();
 
   // custom new operator to allocate memory from custom pool instead of heap
@@ -348,18 +409,26 @@ public:
   virtual void setWrapped(bool isWrapped) { wrapped=isWrapped;};
   virtual unsigned int getLength() const {return length;};
 
+  // sets the bits of 'styles' for the styles of the line
+  void markUsedStyles(QBitArray& styles) const;
+
 protected:
+  // returns the index of the format run which covers column 'index'
+  int formatIndex(int index) const;
+
   CompactHistoryBlockList& blockList;
   CharacterFormat* formatArray;
-  quint16 length;
-  quint16* text;
-  quint16 formatLength;
+  quint32 length;
+  quint32* text;
+  quint32 formatLength;
   bool wrapped;
 };
 
 class CompactHistoryScroll : public HistoryScroll
 {
-  typedef QList<CompactHistoryLine*> HistoryArray;
+  // the lines are kept in a ring, so that both looking up a line
+  // and dropping the oldest one take constant time
+  typedef QVector<CompactHistoryLine*> HistoryArray;
 
 public:
   CompactHistoryScroll(unsigned int maxNbLines = 1000);
@@ -371,18 +440,23 @@ public:
   bool isWrappedLine(int lineno) override;
 
   void addCells(const Character a[], int count) override;
-  void addCellsVector(const TextLine& cells) override;
   void addLine(bool previousWrapped=false) override;
+  void addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count) override;
+  void markUsedStyles(QBitArray& styles) override;
 
   void setMaxNbLines(unsigned int nbLines);
   unsigned int maxNbLines() const { return _maxLineCount; }
 
 private:
-  bool hasDifferentColors(const TextLine& line) const;
+  int lineIndex(int lineNumber) const;
+  void appendLine(const QVector<PackedCharacter>& cells, bool wrapped);
+
   HistoryArray lines;
   CompactHistoryBlockList blockList;
 
   unsigned int _maxLineCount;
+  int _usedLines;
+  int _firstLine; // index in 'lines' of the oldest line
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -426,6 +500,8 @@ public:
 
 class HistoryTypeBlockArray : public HistoryType
 {
+    friend class HistoryScrollBlockArray;
+
 public:
   HistoryTypeBlockArray(size_t size);
 
@@ -473,6 +549,8 @@ protected:
 
 class CompactHistoryType : public HistoryType
 {
+    friend class CompactHistoryScroll;
+
 public:
   CompactHistoryType(unsigned int size);
 
@@ -0,0 +1,702 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "HistoryExport.h"
+
+// Qt
+#include <QElapsedTimer>
+#include <QIODevice>
+#include <QTimer>
+#include <QtDebug>
+
+// Konsole
+#include "HistoryIndex.h"
+
+using namespace Konsole;
+
+const int HistoryExport::BLOCK_LINES;
+const int HistoryExport::MAX_PENDING_BLOCKS;
+const int HistoryExport::COPY_SLICE_MSEC;
+const int HistoryExport::PAUSE_MSEC;
+const int HistoryExportWorker::CHUNK_SIZE;
+
+// the rendition flags which change the appearance of the text in the export
+static const quint16 STYLE_RENDITION = RE_BOLD | RE_BLINK | RE_UNDERLINE | RE_ITALIC
+                                     | RE_FAINT | RE_STRIKEOUT | RE_CONCEAL | RE_OVERLINE;
+
+HistoryExport::HistoryExport(Emulation* emulation, QIODevice* device, Format format,
+                             const ColorEntry* colorTable, QObject* parent)
+    : QObject(parent)
+    , _emulation(emulation)
+    , _index(nullptr)
+    , _device(device)
+    , _format(format)
+    , _firstLine(0)
+    , _endLine(0)
+    , _nextLine(0)
+    , _droppedLines(0)
+    , _pendingBlocks(0)
+    , _exportedLines(0)
+    , _skippedLines(0)
+    , _gapLines(0)
+    , _copyScheduled(false)
+    , _endRequested(false)
+    , _finished(false)
+    , _worker(nullptr)
+{
+    qRegisterMetaType<Konsole::HistoryExportBlock>("Konsole::HistoryExportBlock");
+
+    if (!colorTable)
+        colorTable = base_color_table;
+    _colorTable.reserve(TABLE_COLORS);
+    for (int i = 0; i < TABLE_COLORS; i++)
+        _colorTable.append(colorTable[i]);
+}
+
+HistoryExport::~HistoryExport()
+{
+    if (_worker)
+    {
+        _worker->cancel();
+        _thread.quit();
+        _thread.wait();
+        delete _worker;
+    }
+}
+
+void HistoryExport::start()
+{
+    if (!_emulation || !_device || !_device->isWritable())
+    {
+        finish(false);
+        return;
+    }
+
+    _index = _emulation->historyIndex();
+    _firstLine = _index->droppedLineCount();
+    _droppedLines = _firstLine;
+    _nextLine = _firstLine;
+    _endLine = _firstLine + _emulation->lineCount();
+
+    _worker = new HistoryExportWorker(_device, _format, _colorTable);
+    _worker->moveToThread(&_thread);
+    connect(this, SIGNAL(beginExport()), _worker, SLOT(begin()));
+    connect(this, SIGNAL(writeBlock(Konsole::HistoryExportBlock)),
+            _worker, SLOT(writeBlock(Konsole::HistoryExportBlock)));
+    connect(this, SIGNAL(endExport()), _worker, SLOT(end()));
+    connect(_worker, SIGNAL(blockWritten(int,bool)), this, SLOT(blockWritten(int,bool)));
+    connect(_worker, SIGNAL(ended(bool)), this, SLOT(exportEnded(bool)));
+    _thread.start(QThread::LowPriority);
+
+    emit beginExport();
+    copyBlocks();
+}
+
+void HistoryExport::cancel()
+{
+    finish(false);
+}
+
+int HistoryExport::skippedLines() const
+{
+    return _skippedLines;
+}
+
+void HistoryExport::copyBlocks()
+{
+    _copyScheduled = false;
+    if (_finished || _endRequested)
+        return;
+
+    if (!_emulation)
+    {
+        finish(false);
+        return;
+    }
+
+    // the alternate screen has a history of its own (usually none), so the
+    // export waits until the primary screen is back
+    if (_emulation->historyIndex() != _index)
+    {
+        _copyScheduled = true;
+        QTimer::singleShot(PAUSE_MSEC, this, SLOT(copyBlocks()));
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+
+    bool done = _nextLine >= _endLine;
+    while (!done && _pendingBlocks < MAX_PENDING_BLOCKS)
+    {
+        // the numbers of the lines only go back if the history was cleared,
+        // in which case the rest of the lines are gone and the file is incomplete
+        const qint64 dropped = _index->droppedLineCount();
+        if (dropped < _droppedLines)
+        {
+            finish(false);
+            return;
+        }
+        _droppedLines = dropped;
+
+        // lines dropped from the history before they could be copied are skipped,
+        // the next block marks the gap
+        if (_nextLine < dropped)
+        {
+            const int skipped = int(qMin(dropped, _endLine) - _nextLine);
+            _skippedLines += skipped;
+            _gapLines += skipped;
+            _nextLine += skipped;
+        }
+
+        const int firstLine = int(_nextLine - dropped);
+        const int lastLine = int(qMin(_endLine - dropped, qint64(_emulation->lineCount())));
+        if (firstLine >= lastLine)
+        {
+            done = true;
+            break;
+        }
+
+        const int endLine = qMin(firstLine + BLOCK_LINES, lastLine);
+        const int historyLines = _index->lineCount();
+
+        HistoryExportBlock block;
+        block.firstLine = _nextLine - _firstLine;
+        block.skippedLines = _gapLines;
+        _gapLines = 0;
+        block.lineEnds.reserve(endLine - firstLine);
+        block.wrapped.reserve(endLine - firstLine);
+        block.times.reserve(endLine - firstLine);
+        for (int line = firstLine; line < endLine; line++)
+        {
+            block.wrapped.append(_emulation->appendLineCells(line, block.cells));
+            block.lineEnds.append(block.cells.count());
+            block.times.append(line < historyLines ? _index->lineTime(line) : -1);
+        }
+
+        for (int i = 0; i < block.cells.count(); i++)
+        {
+            const Character& c = block.cells.at(i);
+            if (!(c.rendition & RE_EXTENDED_CHAR))
+                continue;
+
+            ushort length = 0;
+            const ushort* chars = ExtendedCharTable::instance.lookupExtendedChar(c.charSequence, length);
+            if (chars)
+                block.extendedChars.insert(i, QString::fromUtf16(chars, length));
+        }
+
+        _nextLine += endLine - firstLine;
+        _pendingBlocks++;
+        emit writeBlock(block);
+
+        done = _nextLine >= _endLine;
+        if (!done && timer.elapsed() >= COPY_SLICE_MSEC)
+        {
+            _copyScheduled = true;
+            QTimer::singleShot(0, this, SLOT(copyBlocks()));
+            return;
+        }
+    }
+
+    if (done)
+    {
+        // the lines at the end were skipped, a block without lines marks them
+        if (_gapLines > 0)
+        {
+            HistoryExportBlock block;
+            block.firstLine = _nextLine - _firstLine;
+            block.skippedLines = _gapLines;
+            _gapLines = 0;
+            _pendingBlocks++;
+            emit writeBlock(block);
+        }
+
+        _endRequested = true;
+        emit endExport();
+    }
+}
+
+void HistoryExport::blockWritten(int lineCount, bool ok)
+{
+    if (_finished)
+        return;
+
+    _pendingBlocks--;
+    _exportedLines += lineCount;
+    emit progress(_exportedLines, int(_endLine - _firstLine) - _skippedLines);
+
+    if (!ok)
+        finish(false);
+    else if (!_copyScheduled)
+        copyBlocks();
+}
+
+void HistoryExport::exportEnded(bool ok)
+{
+    finish(ok);
+}
+
+void HistoryExport::finish(bool ok)
+{
+    if (_finished)
+        return;
+
+    // the device is handed back only once the export thread is done with it,
+    // which takes at most the time to write one chunk
+    _finished = true;
+    if (_worker)
+    {
+        _worker->cancel();
+        _thread.quit();
+        _thread.wait();
+    }
+
+    emit finished(ok);
+    deleteLater();
+}
+
+HistoryExportWorker::HistoryExportWorker(QIODevice* device, HistoryExport::Format format,
+                                         const QVector<ColorEntry>& colorTable)
+    : _device(device)
+    , _format(format)
+    , _colorTable(colorTable)
+    , _styleOpen(false)
+    , _lineOpen(false)
+    , _failed(false)
+    , _cancelled(0)
+{
+    // the capacity is kept when the chunk is emptied
+    _chunk.reserve(2 * CHUNK_SIZE);
+}
+
+void HistoryExportWorker::cancel()
+{
+    _cancelled.storeRelease(1);
+}
+
+void HistoryExportWorker::begin()
+{
+    if (_format == HistoryExport::Html)
+    {
+        _chunk.append("<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n</head>\n"
+                      "<body style=\"background-color:");
+        appendHexColor(_colorTable.at(DEFAULT_BACK_COLOR).color);
+        _chunk.append("\">\n<pre style=\"font-family:monospace;color:");
+        appendHexColor(_colorTable.at(DEFAULT_FORE_COLOR).color);
+        _chunk.append("\">\n");
+    }
+}
+
+void HistoryExportWorker::writeBlock(const HistoryExportBlock& block)
+{
+    if (block.skippedLines > 0 && !_cancelled.loadAcquire())
+    {
+        writeGap(block.skippedLines);
+        flush(false);
+    }
+
+    const int lineCount = block.lineEnds.count();
+    for (int line = 0; line < lineCount && !_failed; line++)
+    {
+        if (_cancelled.loadAcquire())
+            return;
+
+        writeLine(block, line);
+        flush(false);
+    }
+
+    if (!_cancelled.loadAcquire())
+        emit blockWritten(lineCount, !_failed);
+}
+
+void HistoryExportWorker::end()
+{
+    if (_cancelled.loadAcquire())
+        return;
+
+    closeStyle();
+    if (_format == HistoryExport::Html)
+        _chunk.append("</pre>\n</body>\n</html>\n");
+    flush(true);
+
+    emit ended(!_failed);
+}
+
+void HistoryExportWorker::writeGap(int skippedLines)
+{
+    if (_format == HistoryExport::JsonLines)
+    {
+        _chunk.append("{\"skipped\":");
+        appendNumber(skippedLines);
+        _chunk.append("}\n");
+        return;
+    }
+
+    closeStyle();
+    if (_lineOpen)
+        _chunk.append('\n');
+    _lineOpen = false;
+
+    _chunk.append("[");
+    appendNumber(skippedLines);
+    _chunk.append(" lines dropped from the history before they were exported]\n");
+}
+
+void HistoryExportWorker::writeLine(const HistoryExportBlock& block, int line)
+{
+    const int start = line == 0 ? 0 : block.lineEnds.at(line - 1);
+    int end = block.lineEnds.at(line);
+    const bool wrapped = block.wrapped.at(line);
+    const bool styled = _format == HistoryExport::Html || _format == HistoryExport::Ansi;
+    _lineOpen = wrapped;
+
+    // the screen lines are padded with blanks, which the history does not keep
+    // either.  The blanks at the end of wrapped lines separate words.
+    while (!wrapped && end > start)
+    {
+        const Character& c = block.cells.at(end - 1);
+        if ((c.character != L' ' && c.character != 0) || (c.rendition & RE_EXTENDED_CHAR))
+            break;
+        if (styled && (c.backgroundColor != CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_BACK_COLOR)
+                       || (c.rendition & (RE_UNDERLINE | RE_STRIKEOUT | RE_OVERLINE))))
+            break;
+        end--;
+    }
+
+    switch (_format)
+    {
+        case HistoryExport::PlainText:
+            appendText(block, start, end, false);
+            if (!wrapped)
+                _chunk.append('\n');
+            break;
+
+        case HistoryExport::Html:
+            appendText(block, start, end, true);
+            closeStyle();
+            if (!wrapped)
+                _chunk.append('\n');
+            break;
+
+        case HistoryExport::Ansi:
+            // the style carries on into the next line if the line wraps
+            appendText(block, start, end, true);
+            if (!wrapped)
+            {
+                closeStyle();
+                _chunk.append('\n');
+            }
+            break;
+
+        case HistoryExport::JsonLines:
+        {
+            const qint64 time = block.times.at(line);
+            _chunk.append("{\"line\":");
+            appendNumber(block.firstLine + line);
+            _chunk.append(",\"time\":");
+            if (time < 0)
+                _chunk.append("null");
+            else
+                appendNumber(time);
+            _chunk.append(",\"text\":\"");
+            appendText(block, start, end, false);
+            _chunk.append("\",\"wrapped\":");
+            _chunk.append(wrapped ? "true" : "false");
+            _chunk.append("}\n");
+            break;
+        }
+    }
+}
+
+void HistoryExportWorker::appendText(const HistoryExportBlock& block, int start, int end, bool styled)
+{
+    const Character* cells = block.cells.constData();
+    for (int i = start; i < end; i++)
+    {
+        const Character& c = cells[i];
+
+        if (c.rendition & RE_EXTENDED_CHAR)
+        {
+            if (styled)
+                appendStyle(c);
+            const QVector<uint> text = block.extendedChars.value(i).toUcs4();
+            for (const uint u : text)
+                appendEscaped(u);
+            continue;
+        }
+
+        // the second half of a double width character
+        if (c.character == 0)
+            continue;
+
+        if (styled)
+            appendStyle(c);
+
+        uint u = uint(c.character);
+        if (QChar::isHighSurrogate(u) && i + 1 < end && QChar::isLowSurrogate(uint(cells[i + 1].character)))
+            u = QChar::surrogateToUcs4(ushort(u), ushort(cells[++i].character));
+        appendEscaped(u);
+    }
+}
+
+void HistoryExportWorker::appendCharacter(uint c)
+{
+    if (c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+        c = QChar::ReplacementCharacter;
+
+    if (c < 0x80)
+    {
+        _chunk.append(char(c));
+    }
+    else if (c < 0x800)
+    {
+        _chunk.append(char(0xc0 | (c >> 6)));
+        _chunk.append(char(0x80 | (c & 0x3f)));
+    }
+    else if (c < 0x10000)
+    {
+        _chunk.append(char(0xe0 | (c >> 12)));
+        _chunk.append(char(0x80 | ((c >> 6) & 0x3f)));
+        _chunk.append(char(0x80 | (c & 0x3f)));
+    }
+    else
+    {
+        _chunk.append(char(0xf0 | (c >> 18)));
+        _chunk.append(char(0x80 | ((c >> 12) & 0x3f)));
+        _chunk.append(char(0x80 | ((c >> 6) & 0x3f)));
+        _chunk.append(char(0x80 | (c & 0x3f)));
+    }
+}
+
+void HistoryExportWorker::appendEscaped(uint c)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+
+    switch (_format)
+    {
+        case HistoryExport::Html:
+            if (c == '<')
+                _chunk.append("&lt;");
+            else if (c == '>')
+                _chunk.append("&gt;");
+            else if (c == '&')
+                _chunk.append("&amp;");
+            else
+                appendCharacter(c);
+            break;
+
+        case HistoryExport::JsonLines:
+            if (c == '"' || c == '\\')
+            {
+                _chunk.append('\\');
+                _chunk.append(char(c));
+            }
+            else if (c < 0x20)
+            {
+                _chunk.append("\\u00");
+                _chunk.append(hexDigits[c >> 4]);
+                _chunk.append(hexDigits[c & 0xf]);
+            }
+            else
+            {
+                appendCharacter(c);
+            }
+            break;
+
+        default:
+            appendCharacter(c);
+            break;
+    }
+}
+
+bool HistoryExportWorker::isDefaultStyle(const Character& c) const
+{
+    return !(c.rendition & STYLE_RENDITION)
+           && c.foregroundColor == CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_FORE_COLOR)
+           && c.backgroundColor == CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_BACK_COLOR)
+           && c.fontWeight(_colorTable.constData()) != ColorEntry::Bold;
+}
+
+void HistoryExportWorker::appendStyle(const Character& c)
+{
+    if (_styleOpen
+        && (c.rendition & STYLE_RENDITION) == (_style.rendition & STYLE_RENDITION)
+        && c.foregroundColor == _style.foregroundColor
+        && c.backgroundColor == _style.backgroundColor)
+        return;
+
+    if (isDefaultStyle(c))
+    {
+        closeStyle();
+        return;
+    }
+
+    // a SGR sequence resets the previous style itself, a span has to be closed
+    if (_format == HistoryExport::Html)
+        closeStyle();
+    _style = c;
+    _styleOpen = true;
+
+    const ColorEntry* colorTable = _colorTable.constData();
+    const ColorEntry::FontWeight weight = c.fontWeight(colorTable);
+    const bool bold = weight == ColorEntry::UseCurrentFormat ? (c.rendition & RE_BOLD)
+                                                             : weight == ColorEntry::Bold;
+    const bool defaultForeground = c.foregroundColor == CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_FORE_COLOR);
+    const bool defaultBackground = c.backgroundColor == CharacterColor(COLOR_SPACE_DEFAULT, DEFAULT_BACK_COLOR);
+
+    if (_format == HistoryExport::Html)
+    {
+        _chunk.append("<span style=\"");
+        if (!defaultForeground)
+        {
+            _chunk.append("color:");
+            appendHexColor(c.foregroundColor.color(colorTable));
+            _chunk.append(';');
+        }
+        if (!defaultBackground)
+        {
+            _chunk.append("background-color:");
+            appendHexColor(c.backgroundColor.color(colorTable));
+            _chunk.append(';');
+        }
+        if (bold)
+            _chunk.append("font-weight:bold;");
+        if (c.rendition & RE_ITALIC)
+            _chunk.append("font-style:italic;");
+        if (c.rendition & RE_FAINT)
+            _chunk.append("opacity:0.5;");
+        if (c.rendition & RE_CONCEAL)
+            _chunk.append("visibility:hidden;");
+        if (c.rendition & (RE_UNDERLINE | RE_STRIKEOUT | RE_OVERLINE))
+        {
+            _chunk.append("text-decoration:");
+            if (c.rendition & RE_UNDERLINE)
+                _chunk.append(" underline");
+            if (c.rendition & RE_STRIKEOUT)
+                _chunk.append(" line-through");
+            if (c.rendition & RE_OVERLINE)
+                _chunk.append(" overline");
+            _chunk.append(';');
+        }
+        _chunk.append("\">");
+        return;
+    }
+
+    // the colors are resolved with the color table, so that the output looks
+    // the same regardless of the palette of the terminal it is shown in
+    _chunk.append("\033[0");
+    if (bold)
+        _chunk.append(";1");
+    if (c.rendition & RE_FAINT)
+        _chunk.append(";2");
+    if (c.rendition & RE_ITALIC)
+        _chunk.append(";3");
+    if (c.rendition & RE_UNDERLINE)
+        _chunk.append(";4");
+    if (c.rendition & RE_BLINK)
+        _chunk.append(";5");
+    if (c.rendition & RE_CONCEAL)
+        _chunk.append(";8");
+    if (c.rendition & RE_STRIKEOUT)
+        _chunk.append(";9");
+    if (c.rendition & RE_OVERLINE)
+        _chunk.append(";53");
+    if (!defaultForeground)
+        appendRgbColor(";38;2;", c.foregroundColor.color(colorTable));
+    if (!defaultBackground)
+        appendRgbColor(";48;2;", c.backgroundColor.color(colorTable));
+    _chunk.append('m');
+}
+
+void HistoryExportWorker::closeStyle()
+{
+    if (!_styleOpen)
+        return;
+
+    _styleOpen = false;
+    if (_format == HistoryExport::Html)
+        _chunk.append("</span>");
+    else
+        _chunk.append("\033[0m");
+}
+
+void HistoryExportWorker::appendHexColor(const QColor& color)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+
+    const QRgb rgb = color.rgb();
+    _chunk.append('#');
+    for (int shift = 20; shift >= 0; shift -= 4)
+        _chunk.append(hexDigits[(rgb >> shift) & 0xf]);
+}
+
+void HistoryExportWorker::appendRgbColor(const char* prefix, const QColor& color)
+{
+    _chunk.append(prefix);
+    appendNumber(color.red());
+    _chunk.append(';');
+    appendNumber(color.green());
+    _chunk.append(';');
+    appendNumber(color.blue());
+}
+
+void HistoryExportWorker::appendNumber(qint64 number)
+{
+    char digits[20];
+    int count = 0;
+    quint64 value = number < 0 ? quint64(-(number + 1)) + 1 : quint64(number);
+    do
+    {
+        digits[count++] = char('0' + value % 10);
+        value /= 10;
+    } while (value);
+
+    if (number < 0)
+        _chunk.append('-');
+    while (count > 0)
+        _chunk.append(digits[--count]);
+}
+
+bool HistoryExportWorker::flush(bool force)
+{
+    if (_failed)
+        return false;
+
+    // whole chunks are written as the buffer fills up, the rest at the end
+    int written = 0;
+    while (_chunk.size() - written >= CHUNK_SIZE || (force && written < _chunk.size()))
+    {
+        const int size = qMin(CHUNK_SIZE, _chunk.size() - written);
+        if (_device->write(_chunk.constData() + written, size) != size)
+        {
+            qWarning() << "Cannot export the history:" << _device->errorString();
+            _failed = true;
+            break;
+        }
+        written += size;
+    }
+
+    if (_failed)
+        _chunk.resize(0);
+    else if (written > 0)
+        _chunk.remove(0, written);
+    return !_failed;
+}
@@ -0,0 +1,254 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef HISTORYEXPORT_H
+#define HISTORYEXPORT_H
+
+// Qt
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QHash>
+#include <QObject>
+#include <QPointer>
+#include <QString>
+#include <QThread>
+#include <QVector>
+
+// Konsole
+#include "Character.h"
+#include "Emulation.h"
+
+class QIODevice;
+
+namespace Konsole
+{
+
+class HistoryExportWorker;
+class HistoryIndex;
+
+/**
+ * A block of lines copied from the history, to be written by the export
+ * thread.  The characters are copied as they are stored, so that the block
+ * does not refer to the history any more.
+ */
+struct HistoryExportBlock
+{
+    HistoryExportBlock() : firstLine(0), skippedLines(0) {}
+
+    QVector<Character> cells;
+    // the end of each line in cells
+    QVector<int> lineEnds;
+    QVector<bool> wrapped;
+    // the time at which each line entered the history, see HistoryIndex::lineTime()
+    QVector<qint64> times;
+    // the text of the cells which hold extended characters, by their index in
+    // cells, since ExtendedCharTable can only be used from the GUI thread
+    QHash<int, QString> extendedChars;
+    // the number of the first line of the block, counted from the start of the export
+    qint64 firstLine;
+    // the number of lines right before the block which were dropped from the
+    // history before they could be copied
+    int skippedLines;
+};
+
+/**
+ * Writes the whole output of an emulation, its history followed by the screen,
+ * to a device in one of several formats.
+ *
+ * The lines are copied from the history in blocks of BLOCK_LINES lines on the
+ * GUI thread, in time slices short enough not to hold up painting, and are
+ * formatted and written on a separate thread.  At most MAX_PENDING_BLOCKS
+ * blocks are in flight, and the output is written in chunks of CHUNK_SIZE
+ * bytes, so the memory used does not depend on the size of the history.
+ *
+ * The lines to export are fixed when the export starts.  Lines which are
+ * dropped from the history before they are copied are skipped.  They are
+ * counted by skippedLines(), left out of progress(), and a line in the output
+ * marks where they are missing.  The export pauses while the alternate screen
+ * is shown.  If the history is cleared, the export fails, since the lines
+ * which were not copied yet are gone.
+ *
+ * start() returns immediately.  progress() is emitted as the blocks are
+ * written, and finished() exactly once, when the export is done, fails or is
+ * cancelled.  The device must not be used until then, and must be usable
+ * from another thread, a QFile for instance.  It is not closed.
+ *
+ * The export deletes itself once it is finished.
+ */
+class HistoryExport : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Format
+    {
+        /** The text of the lines, as saved by QTermWidget::saveHistory() */
+        PlainText,
+        /** A HTML document with the colors and the rendition of the text */
+        Html,
+        /** The text with the colors and the rendition as SGR escape sequences */
+        Ansi,
+        /**
+         * One JSON object per line, with the number, time, text and wrapping of
+         * the line.  Skipped lines are replaced by an object with their count.
+         */
+        JsonLines
+    };
+
+    /**
+     * Constructs an export of the output of @p emulation to @p device.
+     * The colors are resolved with @p colorTable, which is copied.
+     */
+    HistoryExport(Emulation* emulation, QIODevice* device, Format format,
+                  const ColorEntry* colorTable, QObject* parent);
+    ~HistoryExport() override;
+
+    void start();
+
+    /**
+     * Stops the export, emitting finished() with false once the export thread
+     * no longer uses the device.
+     */
+    void cancel();
+
+    /**
+     * Returns the number of lines which were dropped from the history before
+     * they could be copied, and are missing from the output.
+     */
+    int skippedLines() const;
+
+signals:
+    /**
+     * Emitted when a block is written, with the number of lines written so far
+     * and the number of lines to write, not counting the skipped lines.
+     */
+    void progress(int exportedLines, int totalLines);
+    /** Emitted when the export ends, @p ok is false if it failed or was cancelled */
+    void finished(bool ok);
+
+    void beginExport();
+    void writeBlock(const Konsole::HistoryExportBlock& block);
+    void endExport();
+
+private slots:
+    void copyBlocks();
+    void blockWritten(int lineCount, bool ok);
+    void exportEnded(bool ok);
+
+private:
+    void finish(bool ok);
+
+    static const int BLOCK_LINES = 1000;
+    // blocks handed to the export thread and not written yet
+    static const int MAX_PENDING_BLOCKS = 4;
+    // the time spent copying before returning to the event loop
+    static const int COPY_SLICE_MSEC = 4;
+    // the time to wait for the primary screen to be shown again
+    static const int PAUSE_MSEC = 200;
+
+    QPointer<Emulation> _emulation;
+    const HistoryIndex* _index;
+    QIODevice* _device;
+    Format _format;
+    QVector<ColorEntry> _colorTable;
+
+    // lines are numbered like HistoryIndex::droppedLineCount() counts them
+    qint64 _firstLine;
+    qint64 _endLine;
+    qint64 _nextLine;
+    qint64 _droppedLines;
+
+    int _pendingBlocks;
+    int _exportedLines;
+    int _skippedLines;
+    // skipped lines which are not marked in the output yet
+    int _gapLines;
+    bool _copyScheduled;
+    bool _endRequested;
+    bool _finished;
+
+    QThread _thread;
+    HistoryExportWorker* _worker;
+};
+
+/**
+ * Formats the blocks of a HistoryExport and writes them to the device, on
+ * the export thread.
+ *
+ * The output is encoded as UTF-8 straight from the characters into a buffer,
+ * which is written to the device whenever it holds CHUNK_SIZE bytes.
+ */
+class HistoryExportWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    HistoryExportWorker(QIODevice* device, HistoryExport::Format format,
+                        const QVector<ColorEntry>& colorTable);
+
+    /** Abandons the block being written and ignores further blocks.  Thread-safe. */
+    void cancel();
+
+public slots:
+    void begin();
+    void writeBlock(const Konsole::HistoryExportBlock& block);
+    void end();
+
+signals:
+    void blockWritten(int lineCount, bool ok);
+    void ended(bool ok);
+
+private:
+    void writeLine(const HistoryExportBlock& block, int line);
+    // marks the lines skipped before the block
+    void writeGap(int skippedLines);
+    // appends the text of the line, escaped for the format, with the style
+    // of the characters for Html and Ansi
+    void appendText(const HistoryExportBlock& block, int start, int end, bool styled);
+    void appendCharacter(uint c);
+    void appendEscaped(uint c);
+    void appendStyle(const Character& c);
+    void closeStyle();
+    void appendHexColor(const QColor& color);
+    void appendRgbColor(const char* prefix, const QColor& color);
+    void appendNumber(qint64 number);
+    bool isDefaultStyle(const Character& c) const;
+    bool flush(bool force);
+
+    static const int CHUNK_SIZE = 64 * 1024;
+
+    QIODevice* _device;
+    HistoryExport::Format _format;
+    QVector<ColorEntry> _colorTable;
+
+    QByteArray _chunk;
+    // the style of the open span or SGR sequence
+    Character _style;
+    bool _styleOpen;
+    // whether the last line written wraps, and was not ended
+    bool _lineOpen;
+    bool _failed;
+    QAtomicInt _cancelled;
+};
+
+}
+
+Q_DECLARE_METATYPE(Konsole::HistoryExportBlock)
+
+#endif // HISTORYEXPORT_H
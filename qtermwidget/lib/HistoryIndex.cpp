@@ -0,0 +1,215 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "HistoryIndex.h"
+
+// Standard Library
+#include <algorithm>
+
+// Qt
+#include <QDateTime>
+
+// Konsole
+#include "konsole_wcwidth.h"
+
+using namespace Konsole;
+
+const int HistoryIndex::SEGMENT_LINES;
+const int HistoryIndex::SEGMENT_BITS;
+
+HistoryIndex::HistoryIndex()
+{
+    reset();
+}
+
+void HistoryIndex::reset(int unindexedLines)
+{
+    _segments.clear();
+    _firstSegment = 0;
+    _firstLine = 0;
+    _indexedFrom = unindexedLines;
+    _lineCount = unindexedLines;
+    _previous[0] = _previous[1] = 0;
+    _previousCount = 0;
+    _times.clear();
+}
+
+quint32 HistoryIndex::trigram(uint a, uint b, uint c)
+{
+    quint32 hash = (a * 0x9e3779b1u) ^ (b * 0x85ebca77u) ^ (c * 0xc2b2ae3du);
+    hash ^= hash >> 15;
+    return hash & (SEGMENT_BITS - 1);
+}
+
+void HistoryIndex::addCharacter(quint64* bits, uint c)
+{
+    c = QChar::toCaseFolded(c);
+
+    if (_previousCount == 2)
+    {
+        const quint32 bit = trigram(_previous[0], _previous[1], c);
+        bits[bit / 64] |= quint64(1) << (bit % 64);
+    }
+    else
+    {
+        _previousCount++;
+    }
+
+    _previous[0] = _previous[1];
+    _previous[1] = c;
+}
+
+void HistoryIndex::addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count,
+                            int droppedLines)
+{
+    if (count > 0)
+    {
+        const qint64 second = QDateTime::currentMSecsSinceEpoch() / 1000 * 1000;
+        if (_times.isEmpty() || _times.last().second != second)
+            _times.append(qMakePair(_firstLine + _lineCount, second));
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        const int segment = int((_firstLine + _lineCount - _indexedFrom) / SEGMENT_LINES);
+        if (_segments.isEmpty())
+            _firstSegment = segment;
+        while (_firstSegment + _segments.count() <= segment)
+            _segments.append(QVector<quint64>(SEGMENT_BITS / 64, 0));
+
+        quint64* bits = _segments[segment - _firstSegment].data();
+
+        // the same characters as PlainTextDecoder::decodeLine() produces
+        const PackedCharacter* cells = lines[i].constData();
+        const int length = lines[i].count();
+        for (int j = 0; j < length;)
+        {
+            const wchar_t c = cells[j].character();
+            addCharacter(bits, c);
+            j += qMax(1, konsole_wcwidth(c));
+        }
+        if (!wrapped[i])
+            addCharacter(bits, '\n');
+
+        _lineCount++;
+    }
+
+    dropLines(droppedLines);
+}
+
+void HistoryIndex::dropLines(int count)
+{
+    if (count <= 0)
+        return;
+
+    count = qMin(count, _lineCount);
+    _firstLine += count;
+    _lineCount -= count;
+
+    while (!_segments.isEmpty()
+           && _indexedFrom + qint64(_firstSegment + 1) * SEGMENT_LINES <= _firstLine)
+    {
+        _segments.removeFirst();
+        _firstSegment++;
+    }
+
+    // keep the entry which covers the first line
+    int obsoleteTimes = 0;
+    while (obsoleteTimes + 1 < _times.count() && _times.at(obsoleteTimes + 1).first <= _firstLine)
+        obsoleteTimes++;
+    _times.remove(0, obsoleteTimes);
+}
+
+qint64 HistoryIndex::lineTime(int line) const
+{
+    if (line < 0 || line >= _lineCount)
+        return -1;
+
+    const qint64 number = _firstLine + line;
+    auto it = std::upper_bound(_times.constBegin(), _times.constEnd(), number,
+                               [](qint64 value, const QPair<qint64, qint64>& entry) {
+                                   return value < entry.first;
+                               });
+    if (it == _times.constBegin())
+        return -1;
+    return (it - 1)->second;
+}
+
+QVector<quint32> HistoryIndex::trigrams(const QString& text)
+{
+    QVector<quint32> result;
+
+    // text spanning more than two segments would have its trigrams spread
+    // over more segments than mayContain() looks at together
+    if (text.length() >= SEGMENT_LINES)
+        return result;
+
+    const QVector<uint> characters = text.toUcs4();
+    for (int i = 2; i < characters.count(); i++)
+    {
+        result.append(trigram(QChar::toCaseFolded(characters[i-2]),
+                              QChar::toCaseFolded(characters[i-1]),
+                              QChar::toCaseFolded(characters[i])));
+    }
+
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+bool HistoryIndex::mayContain(const QVector<quint32>& trigrams, int firstLine, int lastLine) const
+{
+    if (trigrams.isEmpty() || lastLine >= _lineCount)
+        return true;
+
+    const qint64 first = _firstLine + qMax(firstLine, 0);
+    const qint64 last = _firstLine + lastLine;
+    if (first < _indexedFrom)
+        return true;
+
+    const int firstSegment = int((first - _indexedFrom) / SEGMENT_LINES);
+    const int lastSegment = int((last - _indexedFrom) / SEGMENT_LINES);
+    // text which crosses the boundary of two segments has its trigrams
+    // split between them, so pairs of adjacent segments are tested together
+    for (int segment = firstSegment; segment <= lastSegment; segment++)
+    {
+        const int index = segment - _firstSegment;
+        if (index < 0 || index >= _segments.count())
+            return true;
+
+        const quint64* bits = _segments.at(index).constData();
+        const quint64* nextBits = (segment < lastSegment && index + 1 < _segments.count())
+                                  ? _segments.at(index + 1).constData() : nullptr;
+        bool containsAll = true;
+        for (const quint32 bit : trigrams)
+        {
+            const quint64 mask = quint64(1) << (bit % 64);
+            if (!(bits[bit / 64] & mask) && !(nextBits && (nextBits[bit / 64] & mask)))
+            {
+                containsAll = false;
+                break;
+            }
+        }
+        if (containsAll)
+            return true;
+    }
+
+    return false;
+}
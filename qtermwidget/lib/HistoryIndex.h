@@ -0,0 +1,132 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef HISTORYINDEX_H
+#define HISTORYINDEX_H
+
+// Qt
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QVector>
+
+// Konsole
+#include "Character.h"
+
+namespace Konsole
+{
+
+/**
+ * A trigram index over the text of the history, used to rule out parts of
+ * the history when searching for literal text.
+ *
+ * The history is divided into segments of SEGMENT_LINES lines.  For each
+ * segment, a bitmap records the hashes of the case folded trigrams of its
+ * text, as PlainTextDecoder would produce it (including the line breaks of
+ * unwrapped lines).  A range of lines can only contain a piece of text if the
+ * bitmaps of its segments have the bits of all trigrams of the text set.
+ * False positives are possible, false negatives are not, so the lines which
+ * pass still have to be searched.
+ *
+ * The index is fed with the lines as they enter the history, and segments
+ * are discarded once all of their lines have been dropped from it.
+ * Each segment takes SEGMENT_BITS / 8 bytes, which is 4 bytes per line.
+ *
+ * The index also records when the lines entered the history, to the second,
+ * and numbers the lines independently of the lines dropped from the history.
+ */
+class HistoryIndex
+{
+public:
+    static const int SEGMENT_LINES = 1024;
+
+    HistoryIndex();
+
+    /**
+     * Adds @p count lines, which have just been appended to the history.
+     * @p droppedLines is the number of lines which the history dropped from its
+     * start to make room for them.
+     */
+    void addLines(const QVector<PackedCharacter> lines[], const bool wrapped[], int count,
+                  int droppedLines);
+
+    /**
+     * Discards the index, for a history which already holds @p unindexedLines
+     * lines.  Those lines are never ruled out by mayContain().
+     */
+    void reset(int unindexedLines = 0);
+
+    /** Returns the number of history lines the index knows of. */
+    int lineCount() const { return _lineCount; }
+
+    /**
+     * Returns the number of lines dropped from the start of the history since
+     * the last reset().  Adding it to the number of a line in the history gives
+     * a number which stays the same while older lines are dropped.
+     */
+    qint64 droppedLineCount() const { return _firstLine; }
+
+    /**
+     * Returns the time in milliseconds since the epoch at which @p line entered
+     * the history, to the second, or -1 if it is not known.
+     */
+    qint64 lineTime(int line) const;
+
+    /**
+     * Returns the trigrams of @p text, to be passed to mayContain().  Text
+     * shorter than three characters, or too long to fit into two segments,
+     * has none.
+     */
+    static QVector<quint32> trigrams(const QString& text);
+
+    /**
+     * Returns false if the lines from @p firstLine to @p lastLine (inclusive)
+     * of the history cannot contain text with the given @p trigrams, ignoring
+     * case.  Lines beyond the history, and lines which are not indexed, may
+     * contain anything, as may any lines if there are no trigrams.
+     */
+    bool mayContain(const QVector<quint32>& trigrams, int firstLine, int lastLine) const;
+
+private:
+    static const int SEGMENT_BITS = 32768;
+
+    static quint32 trigram(uint a, uint b, uint c);
+    void addCharacter(quint64* bits, uint c);
+    void dropLines(int count);
+
+    QList<QVector<quint64> > _segments;
+    int _firstSegment;      // number of the first segment in _segments
+
+    // lines are numbered from the last reset(), including the dropped ones
+    qint64 _firstLine;      // number of the first line of the history
+    qint64 _indexedFrom;    // number of the first indexed line
+    int _lineCount;
+
+    // the last two characters, since trigrams span line boundaries
+    uint _previous[2];
+    int _previousCount;
+
+    // the number of the first line added in each second, and the time of that
+    // second in milliseconds since the epoch
+    QVector<QPair<qint64, qint64> > _times;
+};
+
+}
+
+#endif // HISTORYINDEX_H
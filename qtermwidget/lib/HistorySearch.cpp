@@ -16,14 +16,80 @@
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
     02110-1301  USA.
 */
-#include <QApplication>
+#include <QElapsedTimer>
 #include <QTextStream>
-#include <QDebug>
+#include <QTimer>
+
+#include <algorithm>
 
 #include "TerminalCharacterDecoder.h"
 #include "Emulation.h"
+#include "Filter.h"
 #include "HistorySearch.h"
 
+const int HistorySearch::BLOCK_LINES;
+const int HistorySearch::MAX_PENDING_BLOCKS;
+const int HistorySearch::DECODE_SLICE_MSEC;
+
+HistorySearchWorker::HistorySearchWorker(const QRegExp& regExp) :
+m_regExp(regExp),
+m_useRegularExpression(false),
+m_cancelled(0) {
+    m_regularExpression = RegExpFilter::toRegularExpression(regExp, &m_useRegularExpression);
+    if (m_useRegularExpression)
+        m_regularExpression.optimize();
+}
+
+void HistorySearchWorker::cancel() {
+    m_cancelled.storeRelease(1);
+}
+
+void HistorySearchWorker::searchBlock(int block, const QString& text, const QList<int>& linePositions, int firstLine) {
+    QList<HistorySearchMatch> matches;
+
+    // Translates a position in text to a line and column in history
+    auto locate = [&](int position, int& column, int& line) {
+        int lineInText = std::upper_bound(linePositions.constBegin(), linePositions.constEnd(), position)
+                         - linePositions.constBegin() - 1;
+        lineInText = qMax(lineInText, 0);
+        column = position - (linePositions.isEmpty() ? 0 : linePositions.at(lineInText));
+        line = firstLine + lineInText;
+    };
+
+    // Finds the next match at or after position, returns its position or -1
+    int length = 0;
+    auto next = [&](int position) {
+        if (!m_useRegularExpression) {
+            position = m_regExp.indexIn(text, position);
+            length = m_regExp.matchedLength();
+            return position;
+        }
+
+        const QRegularExpressionMatch match = m_regularExpression.match(text, position);
+        length = match.capturedLength();
+        return match.hasMatch() ? match.capturedStart() : -1;
+    };
+
+    int position = 0;
+    while (!m_cancelled.loadAcquire() && (position = next(position)) != -1) {
+        // An empty match cannot be selected, skip to the next character
+        if (length == 0) {
+            position++;
+            continue;
+        }
+
+        HistorySearchMatch match;
+        locate(position, match.startColumn, match.startLine);
+        locate(position + length - 1, match.endColumn, match.endLine);
+        matches.append(match);
+
+        position += length;
+    }
+
+    if (!m_cancelled.loadAcquire())
+        emit blockSearched(block, matches);
+}
+
 HistorySearch::HistorySearch(EmulationPtr emulation, const QRegExp& regExp,
         bool forwards, int startColumn, int startLine,
         QObject* parent) :
@@ -32,126 +98,255 @@ m_emulation(emulation),
 m_regExp(regExp),
 m_forwards(forwards),
 m_startColumn(startColumn),
-m_startLine(startLine) {
+m_startLine(startLine),
+m_decodedBlocks(0),
+m_searchedBlocks(0),
+m_finished(false),
+m_findAll(false),
+m_matchCount(0),
+m_droppedLines(0),
+m_index(nullptr),
+m_worker(nullptr) {
+    qRegisterMetaType<QList<int> >("QList<int>");
+    qRegisterMetaType<QList<HistorySearchMatch> >("QList<HistorySearchMatch>");
 }
 
 HistorySearch::~HistorySearch() {
+    if (m_worker) {
+        m_worker->cancel();
+        m_thread.quit();
+        m_thread.wait();
+        delete m_worker;
+    }
 }
 
 void HistorySearch::search() {
-    bool found = false;
+    if (m_regExp.isEmpty() || !m_emulation) {
+        finish();
+        return;
+    }
 
-    if (! m_regExp.isEmpty())
-    {
-        if (m_forwards) {
-            found = search(m_startColumn, m_startLine, -1, m_emulation->lineCount()) || search(0, 0, m_startColumn, m_startLine);
-        } else {
-            found = search(0, 0, m_startColumn, m_startLine) || search(m_startColumn, m_startLine, -1, m_emulation->lineCount());
-        }
+    // The forward search runs from the start position to the end of history
+    // and then from the top to the start position, the backward search the
+    // other way round.  The line of the start position is part of both halves,
+    // the blocks are filtered by isBeforeStart() to the columns on either side.
+    const int lastLine = m_emulation->lineCount() - 1;
+    m_startLine = qBound(0, m_startLine, qMax(lastLine, 0));
+    if (m_forwards) {
+        addBlocks(m_startLine, lastLine, false);
+        addBlocks(0, m_startLine, true);
+    } else {
+        addBlocks(0, m_startLine, false);
+        addBlocks(m_startLine, lastLine, true);
+    }
 
-        if (found) {
-            emit matchFound(m_foundStartColumn, m_foundStartLine, m_foundEndColumn, m_foundEndLine);
-        }
-        else {
+    start();
+}
+
+void HistorySearch::findAllMatches() {
+    m_findAll = true;
+    m_forwards = true;
+
+    if (m_regExp.isEmpty() || !m_emulation) {
+        finish();
+        emit allMatchesFound(0);
+        return;
+    }
+
+    addBlocks(0, m_emulation->lineCount() - 1, false);
+    start();
+}
+
+void HistorySearch::start() {
+    if (m_blocks.isEmpty()) {
+        finish();
+        if (m_findAll)
+            emit allMatchesFound(0);
+        else
             emit noMatchFound();
-        }
+        return;
     }
 
-    deleteLater();
+    m_worker = new HistorySearchWorker(m_regExp);
+    m_worker->moveToThread(&m_thread);
+    connect(this, SIGNAL(searchBlock(int, QString, QList<int>, int)),
+            m_worker, SLOT(searchBlock(int, QString, QList<int>, int)));
+    connect(m_worker, SIGNAL(blockSearched(int, QList<HistorySearchMatch>)),
+            this, SLOT(blockSearched(int, QList<HistorySearchMatch>)));
+    m_thread.start(QThread::LowPriority);
+
+    decodeBlocks();
 }
 
-bool HistorySearch::search(int startColumn, int startLine, int endColumn, int endLine) {
-    qDebug() << "search from" << startColumn << "," << startLine
-            <<  "to" << endColumn << "," << endLine;
+void HistorySearch::cancel() {
+    finish();
+}
 
-    int linesRead = 0;
-    int linesToRead = endLine - startLine + 1;
+void HistorySearch::dropLines(int lines) {
+    if (m_finished || lines <= 0)
+        return;
 
-    qDebug() << "linesToRead:" << linesToRead;
+    // The blocks which are not decoded yet move up with their lines, the
+    // matches of those on the search thread are moved when they come back
+    m_droppedLines += lines;
+    for (int i = m_decodedBlocks; i < m_blocks.size(); i++) {
+        Block& block = m_blocks[i];
+        block.firstLine = qMax(block.firstLine - lines, 0);
+        block.lastLine -= lines;
+    }
+}
 
-    // We read process history from (and including) startLine to (and including) endLine in
-    // blocks of at most 10K lines so that we do not use unhealthy amounts of memory
-    int blockSize;
-    while ((blockSize = qMin(10000, linesToRead - linesRead)) > 0) {
+void HistorySearch::addBlocks(int firstLine, int lastLine, bool wrapped) {
+    // Literal text can be looked up in the history index, which rules out
+    // most blocks without decoding them
+    if (!m_index && m_regExp.patternSyntax() == QRegExp::FixedString) {
+        m_index = m_emulation->historyIndex();
+        m_trigrams = HistoryIndex::trigrams(m_regExp.pattern());
+    }
 
-        QString string;
-        QTextStream searchStream(&string);
-        PlainTextDecoder decoder;
-        decoder.begin(&searchStream);
-        decoder.setRecordLinePositions(true);
-
-        // Calculate lines to read and read them
-        int blockStartLine = m_forwards ? startLine + linesRead : endLine - linesRead - blockSize + 1;
-        int chunkEndLine = blockStartLine + blockSize - 1;
-        m_emulation->writeToStream(&decoder, blockStartLine, chunkEndLine);
-
-        // We search between startColumn in the first line of the string and endColumn in the last
-        // line of the string. First we calculate the position (in the string) of endColumn in the
-        // last line of the string
-        int endPosition;
-
-        // The String that Emulator.writeToStream produces has a newline at the end, and so ends with an
-        // empty line - we ignore that.
-        int numberOfLinesInString = decoder.linePositions().size() - 1;
-        if (numberOfLinesInString > 0 && endColumn > -1 )
-        {
-            endPosition = decoder.linePositions().at(numberOfLinesInString - 1) + endColumn;
+    if (m_forwards) {
+        for (int line = firstLine; line <= lastLine; line += BLOCK_LINES) {
+            Block block = {line, qMin(line + BLOCK_LINES - 1, lastLine), wrapped, 0};
+            addBlock(block);
         }
-        else
-        {
-            endPosition = string.size();
+    } else {
+        for (int line = lastLine; line >= firstLine; line -= BLOCK_LINES) {
+            Block block = {qMax(line - BLOCK_LINES + 1, firstLine), line, wrapped, 0};
+            addBlock(block);
         }
+    }
+}
 
-        // So now we can log for m_regExp in the string between startColumn and endPosition
-        int matchStart;
-        if (m_forwards)
-        {
-            matchStart = string.indexOf(m_regExp, startColumn);
-            if (matchStart >= endPosition)
-                matchStart = -1;
-        }
-        else
-        {
-            matchStart = string.lastIndexOf(m_regExp, endPosition - 1);
-            if (matchStart < startColumn)
-                matchStart = -1;
-        }
+void HistorySearch::addBlock(const Block& block) {
+    if (m_index && !m_index->mayContain(m_trigrams, block.firstLine, block.lastLine))
+        return;
 
-        if (matchStart > -1)
-        {
-            int matchEnd = matchStart + m_regExp.matchedLength() - 1;
-            qDebug() << "Found in string from" << matchStart << "to" << matchEnd;
+    m_blocks.append(block);
+}
 
-            // Translate startPos and endPos to startColum, startLine, endColumn and endLine in history.
-            int startLineNumberInString = findLineNumberInString(decoder.linePositions(), matchStart);
-            m_foundStartColumn = matchStart - decoder.linePositions().at(startLineNumberInString);
-            m_foundStartLine = startLineNumberInString + startLine + linesRead;
+void HistorySearch::decodeBlocks() {
+    if (m_finished)
+        return;
+
+    if (!m_emulation) {
+        finish();
+        return;
+    }
 
-            int endLineNumberInString = findLineNumberInString(decoder.linePositions(), matchEnd);
-            m_foundEndColumn = matchEnd - decoder.linePositions().at(endLineNumberInString);
-            m_foundEndLine = endLineNumberInString + startLine + linesRead;
+    QElapsedTimer timer;
+    timer.start();
 
-            qDebug() << "m_foundStartColumn" << m_foundStartColumn
-                    << "m_foundStartLine" << m_foundEndLine
-                    << "m_foundEndColumn" << m_foundEndColumn
-                    << "m_foundEndLine" << m_foundEndLine;
+    while (m_decodedBlocks < m_blocks.size()
+           && m_decodedBlocks - m_searchedBlocks < MAX_PENDING_BLOCKS) {
+        Block& block = m_blocks[m_decodedBlocks];
+        block.droppedLines = m_droppedLines;
 
-            return true;
+        // The history may have shrunk since the search started
+        const int lastLine = qMin(block.lastLine, m_emulation->lineCount() - 1);
+
+        QString string;
+        QList<int> linePositions;
+        if (block.firstLine <= lastLine) {
+            QTextStream searchStream(&string);
+            PlainTextDecoder decoder;
+            decoder.begin(&searchStream);
+            decoder.setRecordLinePositions(true);
+            m_emulation->writeToStream(&decoder, block.firstLine, lastLine);
+            decoder.end();
+            searchStream.flush();
+            linePositions = decoder.linePositions();
         }
 
+        emit searchBlock(m_decodedBlocks, string, linePositions, block.firstLine);
+        m_decodedBlocks++;
 
-        linesRead += blockSize;
+        if (timer.elapsed() >= DECODE_SLICE_MSEC) {
+            QTimer::singleShot(0, this, SLOT(decodeBlocks()));
+            return;
+        }
     }
+}
 
-    qDebug() << "Not found";
-    return false;
+bool HistorySearch::isBeforeStart(const HistorySearchMatch& match) const {
+    return match.startLine < m_startLine
+           || (match.startLine == m_startLine && match.startColumn < m_startColumn);
 }
 
+void HistorySearch::blockSearched(int block, const QList<HistorySearchMatch>& blockMatches) {
+    if (m_finished)
+        return;
 
-int HistorySearch::findLineNumberInString(QList<int> linePositions, int position) {
-    int lineNum = 0;
-    while (lineNum + 1 < linePositions.size() && linePositions[lineNum + 1] <= position)
-        lineNum++;
+    m_searchedBlocks = block + 1;
 
-    return lineNum;
+    // Lines dropped while the block was on the search thread move its matches up
+    QList<HistorySearchMatch> matches = blockMatches;
+    const int dropped = m_droppedLines - m_blocks.at(block).droppedLines;
+    if (dropped > 0) {
+        matches.clear();
+        for (HistorySearchMatch match : blockMatches) {
+            match.startLine -= dropped;
+            match.endLine -= dropped;
+            if (match.startLine >= 0)
+                matches.append(match);
+        }
+    }
+
+    if (m_findAll) {
+        m_matchCount += matches.size();
+        if (!matches.isEmpty())
+            emit matchesFound(matches);
+
+        if (m_searchedBlocks == m_blocks.size()) {
+            finish();
+            emit allMatchesFound(m_matchCount);
+        } else {
+            decodeBlocks();
+        }
+        return;
+    }
+
+    // Before wrapping around, only matches beyond the start position count
+    // (from it onwards when searching forwards, before it when searching
+    // backwards).  Afterwards, the part beyond the start position has
+    // been searched already, so any match does.
+    const Block& searched = m_blocks.at(block);
+    const HistorySearchMatch* found = nullptr;
+    if (m_forwards) {
+        for (const HistorySearchMatch& match : matches) {
+            if (searched.wrapped || !isBeforeStart(match)) {
+                found = &match;
+                break;
+            }
+        }
+    } else {
+        for (int i = matches.size() - 1; i >= 0; i--) {
+            if (searched.wrapped || isBeforeStart(matches.at(i))) {
+                found = &matches.at(i);
+                break;
+            }
+        }
+    }
+
+    if (found) {
+        const HistorySearchMatch match = *found;
+        finish();
+        emit matchFound(match.startColumn, match.startLine, match.endColumn, match.endLine);
+    } else if (m_searchedBlocks == m_blocks.size()) {
+        finish();
+        emit noMatchFound();
+    } else {
+        decodeBlocks();
+    }
+}
+
+void HistorySearch::finish() {
+    if (m_finished)
+        return;
+
+    // Any block still on the search thread is dropped, the thread itself is
+    // stopped when the search is deleted
+    m_finished = true;
+    if (m_worker)
+        m_worker->cancel();
+    deleteLater();
 }
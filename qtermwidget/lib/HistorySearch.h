@@ -19,20 +19,91 @@
 #ifndef TASK_H
 #define	TASK_H
 
+#include <QAtomicInt>
+#include <QList>
 #include <QObject>
 #include <QPointer>
+#include <QRegularExpression>
 #include <QMap>
+#include <QThread>
+#include <QVector>
 
 #include <Session.h>
 #include <ScreenWindow.h>
 
 #include "Emulation.h"
+#include "HistoryIndex.h"
 #include "TerminalCharacterDecoder.h"
 
 using namespace Konsole;
 
 typedef QPointer<Emulation> EmulationPtr;
 
+/**
+ * The position of a match, in lines of the history (including the screen)
+ * and columns of those lines.  The end position is inclusive.
+ */
+struct HistorySearchMatch
+{
+    int startColumn;
+    int startLine;
+    int endColumn;
+    int endLine;
+};
+
+Q_DECLARE_METATYPE(HistorySearchMatch)
+
+/**
+ * Runs the regular expression of a HistorySearch over blocks of decoded
+ * history text, on the search thread.
+ *
+ * The regular expression is converted to a precompiled QRegularExpression
+ * where possible, QRegExp is only used for the syntaxes which cannot be.
+ */
+class HistorySearchWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit HistorySearchWorker(const QRegExp& regExp);
+
+    /** Abandons the block being searched and ignores further blocks.  Thread-safe. */
+    void cancel();
+
+public slots:
+    void searchBlock(int block, const QString& text, const QList<int>& linePositions, int firstLine);
+
+signals:
+    void blockSearched(int block, const QList<HistorySearchMatch>& matches);
+
+private:
+    QRegExp m_regExp;
+    QRegularExpression m_regularExpression;
+    bool m_useRegularExpression;
+    QAtomicInt m_cancelled;
+};
+
+/**
+ * Searches the history of an emulation for the next (or previous) match of
+ * a regular expression, starting at a given position and wrapping around.
+ *
+ * The history is decoded into text in blocks of BLOCK_LINES lines on the GUI
+ * thread, in time slices short enough not to hold up painting.  Each decoded
+ * block is a read-only copy of its part of the history, which is matched
+ * against the regular expression on a separate thread.  The blocks are
+ * searched in the order in which matches are wanted, so the search finishes
+ * as soon as the first matching block comes back.  Literal searches skip
+ * the blocks which the HistoryIndex rules out.
+ *
+ * search() returns immediately.  Exactly one of matchFound() and noMatchFound()
+ * is emitted later, unless the search is cancelled first.
+ *
+ * Alternatively, findAllMatches() looks for every match in the history, from
+ * the top down.  The matches are reported by matchesFound() as the blocks come
+ * back, followed by allMatchesFound() once the whole history is searched.
+ *
+ * The search deletes itself once it is done.
+ */
 class HistorySearch : public QObject
 {
     Q_OBJECT
@@ -45,14 +116,56 @@ public:
 
     void search();
 
+    /** Finds every match instead of the next one, the start position is ignored. */
+    void findAllMatches();
+
+    /**
+     * Stops the search without emitting any further signals, for instance
+     * because a newer search replaces it.
+     */
+    void cancel();
+
+    /**
+     * Tells a running search that the first @p lines lines were dropped from
+     * the history.  The lines which are still to be searched, and the matches
+     * reported from then on, move up with their text, and matches in the
+     * dropped lines are left out.
+     */
+    void dropLines(int lines);
+
 signals:
     void matchFound(int startColumn, int startLine, int endColumn, int endLine);
     void noMatchFound();
+    /** Reports the matches within a part of the history, in the order of their positions */
+    void matchesFound(const QList<HistorySearchMatch>& matches);
+    /** Emitted after the last matchesFound() with the number of matches reported */
+    void allMatchesFound(int count);
+    void searchBlock(int block, const QString& text, const QList<int>& linePositions, int firstLine);
 
-private:
-    bool search(int startColumn, int startLine, int endColumn, int endLine);
-    int findLineNumberInString(QList<int> linePositions, int position);
+private slots:
+    void decodeBlocks();
+    void blockSearched(int block, const QList<HistorySearchMatch>& matches);
 
+private:
+    struct Block
+    {
+        int firstLine;
+        int lastLine;
+        bool wrapped; // part of the search after wrapping around
+        int droppedLines; // m_droppedLines when the block was decoded
+    };
+
+    void addBlocks(int firstLine, int lastLine, bool wrapped);
+    void addBlock(const Block& block);
+    void start();
+    bool isBeforeStart(const HistorySearchMatch& match) const;
+    void finish();
+
+    static const int BLOCK_LINES = 1000;
+    // blocks handed to the search thread and not searched yet
+    static const int MAX_PENDING_BLOCKS = 4;
+    // the time spent decoding before returning to the event loop
+    static const int DECODE_SLICE_MSEC = 4;
 
     EmulationPtr m_emulation;
     QRegExp m_regExp;
@@ -60,10 +173,21 @@ private:
     int m_startColumn;
     int m_startLine;
 
-    int m_foundStartColumn;
-    int m_foundStartLine;
-    int m_foundEndColumn;
-    int m_foundEndLine;
+    QList<Block> m_blocks;
+    int m_decodedBlocks;
+    int m_searchedBlocks;
+    bool m_finished;
+    bool m_findAll;
+    int m_matchCount;
+    // lines dropped from the history since the search started
+    int m_droppedLines;
+
+    // the history index of the emulation, for literal searches only
+    const HistoryIndex* m_index;
+    QVector<quint32> m_trigrams;
+
+    QThread m_thread;
+    HistorySearchWorker* m_worker;
 };
 
 #endif	/* TASK_H */
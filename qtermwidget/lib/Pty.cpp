@@ -291,8 +291,14 @@ void Pty::sendData(const char* data, int length)
 
 void Pty::dataReceived()
 {
-     QByteArray data = pty()->readAll();
-    emit receivedData(data.constData(),data.count());
+    // hand out the read buffer's chunks in place rather than copying
+    // them into a temporary QByteArray with readAll()
+    int length = 0;
+    while (const char* chunk = pty()->peekBuffered(&length))
+    {
+        emit receivedData(chunk, length);
+        pty()->skipBuffered(length);
+    }
 }
 
 void Pty::lockPty(bool lock)
@@ -183,7 +183,8 @@ Q_OBJECT
      * Emitted when a new block of data is received from
      * the teletype.
      *
-     * @param buffer Pointer to the data received.
+     * @param buffer Pointer to the data received.  This points straight
+     * into the pty's read buffer and is only valid during the emission.
      * @param length Length of @p buffer
      */
     void receivedData(const char* buffer, int length);
@@ -29,8 +29,10 @@
 #include <unistd.h>
 #include <cstring>
 #include <cctype>
+#include <algorithm>
 
 // Qt
+#include <QBitArray>
 #include <QTextStream>
 #include <QDate>
 
@@ -68,12 +70,21 @@ Character Screen::defaultChar = Character(' ',
 
 //#define REVERSE_WRAPPED_LINES  // for wrapped line debug
 
+// konsole_wcwidth() shortcut for printable ASCII, by far the most common case
+static inline int characterWidth(wchar_t c)
+{
+    return (c >= 0x20 && c < 0x7f) ? 1 : konsole_wcwidth(c);
+}
+
     Screen::Screen(int l, int c)
 : lines(l),
     columns(c),
     screenLines(new ImageLine[lines+1] ),
     _scrolledLines(0),
     _droppedLines(0),
+    _generation(1),
+    _imageGeneration(1),
+    _pendingHistoryCount(0),
     history(new HistoryScrollNone()),
     cuX(0), cuY(0),
     currentRendition(0),
@@ -81,15 +92,24 @@ Character Screen::defaultChar = Character(' ',
     selBegin(0), selTopLeft(0), selBottomRight(0),
     blockSelectionMode(false),
     effectiveForeground(CharacterColor()), effectiveBackground(CharacterColor()), effectiveRendition(0),
+    effectiveStyle(CharacterStyleTable::DEFAULT_STYLE),
     lastPos(-1)
 {
     lineProperties.resize(lines+1);
+    _lineSlots.resize(lines+1);
+    _lineGenerations.resize(lines+1);
     for (int i=0;i<lines+1;i++)
+    {
         lineProperties[i]=LINE_DEFAULT;
+        _lineSlots[i]=i;
+        _lineGenerations[i]=_generation;
+    }
 
     initTabStops();
     clearSelection();
     reset();
+
+    CharacterStyleTable::instance.addScreen(this);
 }
 
 /*! Destructor
@@ -97,6 +117,7 @@ Character Screen::defaultChar = Character(' ',
 
 Screen::~Screen()
 {
+    CharacterStyleTable::instance.removeScreen(this);
     delete[] screenLines;
     delete history;
 }
@@ -201,29 +222,29 @@ void Screen::deleteChars(int n)
         n = 1;
 
     // if cursor is beyond the end of the line there is nothing to do
-    if ( cuX >= screenLines[cuY].count() )
+    if ( cuX >= screenLine(cuY).count() )
         return;
 
-    if ( cuX+n > screenLines[cuY].count() )
-        n = screenLines[cuY].count() - cuX;
+    if ( cuX+n > screenLine(cuY).count() )
+        n = screenLine(cuY).count() - cuX;
 
     Q_ASSERT( n >= 0 );
-    Q_ASSERT( cuX+n <= screenLines[cuY].count() );
+    Q_ASSERT( cuX+n <= screenLine(cuY).count() );
 
-    screenLines[cuY].remove(cuX,n);
+    screenLine(cuY).remove(cuX,n);
 }
 
 void Screen::insertChars(int n)
 {
     if (n == 0) n = 1; // Default
 
-    if ( screenLines[cuY].size() < cuX )
-        screenLines[cuY].resize(cuX);
+    if ( screenLine(cuY).size() < cuX )
+        screenLine(cuY).resize(cuX);
 
-    screenLines[cuY].insert(cuX,n,' ');
+    screenLine(cuY).insert(cuX,n,PackedCharacter());
 
-    if ( screenLines[cuY].count() > columns )
-        screenLines[cuY].resize(columns);
+    if ( screenLine(cuY).count() > columns )
+        screenLine(cuY).resize(columns);
 }
 
 void Screen::repeatChars(int count)
@@ -266,6 +287,8 @@ void Screen::setMode(int m)
     switch(m)
     {
         case MODE_Origin : cuX = 0; cuY = _topMargin; break; //FIXME: home
+        case MODE_Screen :
+        case MODE_Cursor : setAllLinesChanged(); break;
     }
 }
 
@@ -275,6 +298,8 @@ void Screen::resetMode(int m)
     switch(m)
     {
         case MODE_Origin : cuX = 0; cuY = 0; break; //FIXME: home
+        case MODE_Screen :
+        case MODE_Cursor : setAllLinesChanged(); break;
     }
 }
 
@@ -325,17 +350,31 @@ void Screen::resizeImage(int new_lines, int new_columns)
         }
     }
 
-    // create new screen lines and copy from old to new
+    // create new screen lines and copy from old to new,
+    // which puts the slots back into screen order
 
     ImageLine* newScreenLines = new ImageLine[new_lines+1];
+    QVarLengthArray<LineProperty,64> newLineProperties(new_lines+1);
     for (int i=0; i < qMin(lines,new_lines+1) ;i++)
-        newScreenLines[i]=screenLines[i];
+    {
+        newScreenLines[i]=screenLine(i);
+        newLineProperties[i]=lineProperty(i);
+    }
     for (int i=lines;(i > 0) && (i<new_lines+1);i++)
+    {
         newScreenLines[i].resize( new_columns );
+        newLineProperties[i] = LINE_DEFAULT;
+    }
 
-    lineProperties.resize(new_lines+1);
-    for (int i=lines;(i > 0) && (i<new_lines+1);i++)
-        lineProperties[i] = LINE_DEFAULT;
+    lineProperties = newLineProperties;
+    _lineSlots.resize(new_lines+1);
+    _lineGenerations.resize(new_lines+1);
+    for (int i=0;i<new_lines+1;i++)
+    {
+        _lineSlots[i] = i;
+        _lineGenerations[i] = _generation;
+    }
+    setAllLinesChanged();
 
     clearSelection();
 
@@ -352,6 +391,8 @@ void Screen::resizeImage(int new_lines, int new_columns)
     _bottomMargin=lines-1;
     initTabStops();
     clearSelection();
+
+    flushHistory();
 }
 
 void Screen::setDefaultMargins()
@@ -420,6 +461,8 @@ void Screen::updateEffectiveRendition()
 
     if (currentRendition & RE_BOLD)
         effectiveForeground.setIntensive();
+
+    effectiveStyle = CharacterStyleTable::instance.styleId(effectiveForeground, effectiveBackground);
 }
 
 void Screen::copyFromHistory(Character* dest, int startLine, int count) const
@@ -464,7 +507,9 @@ void Screen::copyFromScreen(Character* dest , int startLine , int count) const
             int srcIndex = srcLineStartIndex + column;
             int destIndex = destLineStartIndex + column;
 
-            dest[destIndex] = screenLines[srcIndex/columns].value(srcIndex%columns,defaultChar);
+            const ImageLine& srcLine = screenLine(srcIndex/columns);
+            const int srcColumn = srcIndex%columns;
+            dest[destIndex] = srcColumn < srcLine.size() ? srcLine[srcColumn].unpack() : defaultChar;
 
             // invert selected text
             if (selBegin != -1 && isSelected(column,line + history->getLines()))
@@ -504,10 +549,12 @@ void Screen::getImage( Character* dest, int size, int startLine, int endLine ) c
             reverseRendition(dest[i]); // for reverse display
     }
 
-    // mark the character at the current cursor position
-    int cursorIndex = loc(cuX, cuY + linesInHistoryBuffer);
-    if(getMode(MODE_Cursor) && cursorIndex < columns*mergedLines)
-        dest[cursorIndex].rendition |= RE_CURSOR;
+    // mark the character at the current cursor position.  After the last
+    // column was written the cursor waits beyond it, keep it on that line
+    // so that it stays on the line which getImage() is asked for.
+    const int cursorLine = history->getLines() + cuY - startLine;
+    if (getMode(MODE_Cursor) && cursorLine >= 0 && cursorLine < mergedLines)
+        dest[loc(qMin(cuX,columns-1), cursorLine)].rendition |= RE_CURSOR;
 }
 
 QVector<LineProperty> Screen::getLineProperties( int startLine , int endLine ) const
@@ -537,7 +584,7 @@ QVector<LineProperty> Screen::getLineProperties( int startLine , int endLine ) c
     const int firstScreenLine = startLine + linesInHistory - history->getLines();
     for (int line = firstScreenLine; line < firstScreenLine+linesInScreen; line++)
     {
-        result[index]=lineProperties[line];
+        result[index]=lineProperty(line);
         index++;
     }
 
@@ -574,11 +621,11 @@ void Screen::backspace()
     cuX = qMin(columns-1,cuX); // nowrap!
     cuX = qMax(0,cuX-1);
 
-    if (screenLines[cuY].size() < cuX+1)
-        screenLines[cuY].resize(cuX+1);
+    if (screenLine(cuY).size() < cuX+1)
+        screenLine(cuY).resize(cuX+1);
 
     if (BS_CLEARS)
-        screenLines[cuY][cuX].character = ' ';
+        screenLine(cuY)[cuX].setCharacter(' ');
 }
 
 void Screen::tab(int n)
@@ -657,7 +704,7 @@ void Screen::displayCharacter(wchar_t c)
 
     if (cuX+w > columns) {
         if (getMode(MODE_Wrap)) {
-            lineProperties[cuY] = (LineProperty)(lineProperties[cuY] | LINE_WRAPPED);
+            lineProperty(cuY) = (LineProperty)(lineProperty(cuY) | LINE_WRAPPED);
             nextLine();
         }
         else
@@ -665,10 +712,10 @@ void Screen::displayCharacter(wchar_t c)
     }
 
     // ensure current line vector has enough elements
-    int size = screenLines[cuY].size();
+    int size = screenLine(cuY).size();
     if (size < cuX+w)
     {
-        screenLines[cuY].resize(cuX+w);
+        screenLine(cuY).resize(cuX+w);
     }
 
     if (getMode(MODE_Insert)) insertChars(w);
@@ -678,12 +725,7 @@ void Screen::displayCharacter(wchar_t c)
     // check if selection is still valid.
     checkSelection(lastPos, lastPos);
 
-    Character& currentChar = screenLines[cuY][cuX];
-
-    currentChar.character = c;
-    currentChar.foregroundColor = effectiveForeground;
-    currentChar.backgroundColor = effectiveBackground;
-    currentChar.rendition = effectiveRendition;
+    screenLine(cuY)[cuX] = PackedCharacter(c, effectiveRendition, effectiveStyle);
 
     lastDrawnChar = c;
 
@@ -693,20 +735,87 @@ void Screen::displayCharacter(wchar_t c)
     {
         i++;
 
-        if ( screenLines[cuY].size() < cuX + i + 1 )
-            screenLines[cuY].resize(cuX+i+1);
+        if ( screenLine(cuY).size() < cuX + i + 1 )
+            screenLine(cuY).resize(cuX+i+1);
 
-        Character& ch = screenLines[cuY][cuX + i];
-        ch.character = 0;
-        ch.foregroundColor = effectiveForeground;
-        ch.backgroundColor = effectiveBackground;
-        ch.rendition = effectiveRendition;
+        screenLine(cuY)[cuX + i] = PackedCharacter(0, effectiveRendition, effectiveStyle);
 
         w--;
     }
     cuX = newCursorX;
 }
 
+void Screen::displayCharacters(const wchar_t* text, int length)
+{
+    // insert mode shifts the rest of the line for every character
+    if (getMode(MODE_Insert))
+    {
+        for (int i = 0; i < length; i++)
+            displayCharacter(text[i]);
+        return;
+    }
+
+    const PackedCharacter trailingCell(0, effectiveRendition, effectiveStyle);
+
+    int i = 0;
+    while (i < length)
+    {
+        // find the characters which still fit on the current line
+        int end = i;
+        int endX = cuX;
+        while (end < length)
+        {
+            const int w = characterWidth(text[end]);
+            if (w > 0)
+            {
+                if (endX + w > columns)
+                    break;
+                endX += w;
+            }
+            end++;
+        }
+
+        // let displayCharacter() wrap or clamp the one which doesn't
+        if (end == i)
+        {
+            displayCharacter(text[i++]);
+            continue;
+        }
+
+        if (endX == cuX)
+        {
+            // nothing but zero width characters, which are dropped
+            i = end;
+            continue;
+        }
+
+        ImageLine& line = screenLine(cuY);
+        if (line.size() < endX)
+            line.resize(endX);
+
+        checkSelection(loc(cuX,cuY), loc(endX-1,cuY));
+
+        PackedCharacter* data = line.data();
+        int x = cuX;
+        for (; i < end; i++)
+        {
+            const wchar_t c = text[i];
+            int w = characterWidth(c);
+            if (w <= 0)
+                continue;
+
+            data[x] = PackedCharacter(c, effectiveRendition, effectiveStyle);
+            lastPos = loc(x,cuY);
+            lastDrawnChar = c;
+
+            while (--w)
+                data[++x] = trailingCell;
+            x++;
+        }
+        cuX = endX;
+    }
+}
+
 void Screen::compose(const QString& /*compose*/)
 {
     Q_ASSERT( 0 /*Not implemented yet*/ );
@@ -735,6 +844,7 @@ void Screen::resetDroppedLines()
 void Screen::resetScrolledLines()
 {
     _scrolledLines = 0;
+    _lastScrolledRegion = QRect();
 }
 
 void Screen::scrollUp(int n)
@@ -759,10 +869,11 @@ void Screen::scrollUp(int from, int n)
         n = _bottomMargin + 1 - from;
 
     _scrolledLines -= n;
-    _lastScrolledRegion = QRect(0,_topMargin,columns-1,(_bottomMargin-_topMargin));
+    addScrolledRegion(from);
 
     //FIXME: make sure `topMargin', `bottomMargin', `from', `n' is in bounds.
-    moveImage(loc(0,from),loc(0,from+n),loc(columns,_bottomMargin));
+    if (from + n <= _bottomMargin)
+        moveImage(loc(0,from),loc(0,from+n),loc(columns-1,_bottomMargin));
     clearImage(loc(0,_bottomMargin-n+1),loc(columns-1,_bottomMargin),' ');
 }
 
@@ -783,10 +894,18 @@ void Screen::scrollDown(int from, int n)
         return;
     if (from + n > _bottomMargin)
         n = _bottomMargin - from;
+    addScrolledRegion(from);
     moveImage(loc(0,from+n),loc(0,from),loc(columns-1,_bottomMargin-n));
     clearImage(loc(0,from),loc(columns-1,from+n-1),' ');
 }
 
+void Screen::addScrolledRegion(int from)
+{
+    const QRect region(0, from, columns, _bottomMargin - from + 1);
+    _lastScrolledRegion = _lastScrolledRegion.isValid() ? _lastScrolledRegion.united(region)
+                                                        : region;
+}
+
 void Screen::setCursorYX(int y, int x)
 {
     setCursorY(y); setCursorX(x);
@@ -841,20 +960,21 @@ void Screen::clearImage(int loca, int loce, char c)
     int topLine = loca/columns;
     int bottomLine = loce/columns;
 
-    Character clearCh(c,currentForeground,currentBackground,DEFAULT_RENDITION);
+    const PackedCharacter clearCh(c, DEFAULT_RENDITION,
+            CharacterStyleTable::instance.styleId(currentForeground,currentBackground));
 
     //if the character being used to clear the area is the same as the
     //default character, the affected lines can simply be shrunk.
-    bool isDefaultCh = (clearCh == Character());
+    bool isDefaultCh = (clearCh == PackedCharacter());
 
     for (int y=topLine;y<=bottomLine;y++)
     {
-        lineProperties[y] = 0;
+        lineProperty(y) = 0;
 
         int endCol = ( y == bottomLine) ? loce%columns : columns-1;
         int startCol = ( y == topLine ) ? loca%columns : 0;
 
-        QVector<Character>& line = screenLines[y];
+        ImageLine& line = screenLine(y);
 
         if ( isDefaultCh && endCol == columns-1 )
         {
@@ -865,7 +985,7 @@ void Screen::clearImage(int loca, int loce, char c)
             if (line.size() < endCol + 1)
                 line.resize(endCol+1);
 
-            Character* data = line.data();
+            PackedCharacter* data = line.data();
             for (int i=startCol;i<=endCol;i++)
                 data[i]=clearCh;
         }
@@ -878,28 +998,28 @@ void Screen::moveImage(int dest, int sourceBegin, int sourceEnd)
 
     int lines=(sourceEnd-sourceBegin)/columns;
 
-    //move screen image and line properties:
-    //the source and destination areas of the image may overlap,
-    //so it matters that we do the copy in the right order -
-    //forwards if dest < sourceBegin or backwards otherwise.
-    //(search the web for 'memmove implementation' for details)
-    if (dest < sourceBegin)
+    //move screen image and line properties by rotating the slots of the
+    //affected lines: the lines overwritten by the move end up in the area
+    //which the source lines vacate, and are cleared by the caller.
+    const int destLine = dest/columns;
+    const int sourceLine = sourceBegin/columns;
+    if (destLine < sourceLine)
     {
-        for (int i=0;i<=lines;i++)
-        {
-            screenLines[ (dest/columns)+i ] = screenLines[ (sourceBegin/columns)+i ];
-            lineProperties[(dest/columns)+i]=lineProperties[(sourceBegin/columns)+i];
-        }
+        std::rotate(_lineSlots.begin() + destLine,
+                    _lineSlots.begin() + sourceLine,
+                    _lineSlots.begin() + sourceLine + lines + 1);
     }
-    else
+    else if (destLine > sourceLine)
     {
-        for (int i=lines;i>=0;i--)
-        {
-            screenLines[ (dest/columns)+i ] = screenLines[ (sourceBegin/columns)+i ];
-            lineProperties[(dest/columns)+i]=lineProperties[(sourceBegin/columns)+i];
-        }
+        std::rotate(_lineSlots.begin() + sourceLine,
+                    _lineSlots.begin() + sourceLine + lines + 1,
+                    _lineSlots.begin() + destLine + lines + 1);
     }
 
+    const int lastChangedLine = qMax(destLine,sourceLine) + lines;
+    for (int y = qMin(destLine,sourceLine); y <= lastChangedLine; y++)
+        _lineGenerations[y] = _generation;
+
     if (lastPos != -1)
     {
         int diff = dest - sourceBegin; // Scroll by this amount
@@ -911,6 +1031,8 @@ void Screen::moveImage(int dest, int sourceBegin, int sourceEnd)
     // Adjust selection to follow scroll.
     if (selBegin != -1)
     {
+        setAllLinesChanged();
+
         bool beginIsTL = (selBegin == selTopLeft);
         int diff = dest - sourceBegin; // Scroll by this amount
         int scr_TL=loc(0,history->getLines());
@@ -963,6 +1085,7 @@ void Screen::clearEntireScreen()
     {
         addHistLine(); scrollUp(0,1);
     }
+    flushHistory();
 
     clearImage(loc(0,0),loc(columns-1,lines-1),' ');
 }
@@ -1033,6 +1156,9 @@ void Screen::setBackColor(int space, int color)
 
 void Screen::clearSelection()
 {
+    if (selBegin != -1)
+        setAllLinesChanged();
+
     selBottomRight = -1;
     selTopLeft = -1;
     selBegin = -1;
@@ -1073,6 +1199,7 @@ void Screen::setSelectionStart(const int x, const int y, const bool mode)
     selBottomRight = selBegin;
     selTopLeft = selBegin;
     blockSelectionMode = mode;
+    setAllLinesChanged();
 }
 
 void Screen::setSelectionEnd( const int x, const int y)
@@ -1080,6 +1207,8 @@ void Screen::setSelectionEnd( const int x, const int y)
     if (selBegin == -1)
         return;
 
+    setAllLinesChanged();
+
     int endPos =  loc(x,y);
 
     if (endPos < selBegin)
@@ -1246,22 +1375,22 @@ int Screen::copyLineToStream(int line ,
 
         Q_ASSERT( count >= 0 );
 
-        const int screenLine = line-history->getLines();
+        const int screenRow = line-history->getLines();
 
-        Character* data = screenLines[screenLine].data();
-        int length = screenLines[screenLine].count();
+        const PackedCharacter* data = screenLine(screenRow).data();
+        int length = screenLine(screenRow).count();
 
         //retrieve line from screen image
         for (int i=start;i < qMin(start+count,length);i++)
         {
-            characterBuffer[i-start] = data[i];
+            characterBuffer[i-start] = data[i].unpack();
         }
 
         // count cannot be any greater than length
         count = qBound(0,count,length-start);
 
-        Q_ASSERT( screenLine < lineProperties.count() );
-        currentLineProperties |= lineProperties[screenLine];
+        Q_ASSERT( screenRow < _lineSlots.count() );
+        currentLineProperties |= lineProperty(screenRow);
     }
 
     // add new line character at end
@@ -1286,19 +1415,65 @@ void Screen::writeLinesToStream(TerminalCharacterDecoder* decoder, int fromLine,
     writeToStream(decoder,loc(0,fromLine),loc(columns-1,toLine));
 }
 
+LineProperty Screen::appendLineCells(int line, QVector<Character>& cells) const
+{
+    const int start = cells.count();
+
+    if (line < history->getLines())
+    {
+        const int length = history->getLineLen(line);
+        cells.resize(start + length);
+        history->getCells(line, 0, length, cells.data() + start);
+        return history->isWrappedLine(line) ? LINE_WRAPPED : LINE_DEFAULT;
+    }
+
+    const int screenRow = line - history->getLines();
+    Q_ASSERT( screenRow < _lineSlots.count() );
+
+    const ImageLine& data = screenLine(screenRow);
+    cells.reserve(start + data.count());
+    for (const PackedCharacter& c : data)
+        cells.append(c.unpack());
+    return lineProperty(screenRow);
+}
+
 void Screen::addHistLine()
 {
     // add line to history buffer
     // we have to take care about scrolling, too...
 
-    if (hasScroll())
+    if (hasScroll() && selBegin == -1)
+    {
+        // with nothing selected, no positions need to follow the history, so
+        // the line is only queued here and handed over by flushHistory().
+        // Its storage is swapped with a spare line instead of being copied,
+        // the callers scroll the top line away and clear it anyway.
+        if (_pendingHistoryCount == _pendingHistory.count())
+        {
+            _pendingHistory.append(ImageLine());
+            _pendingHistoryWrapped.append(false);
+        }
+
+        screenLine(0).swap(_pendingHistory[_pendingHistoryCount]);
+        _pendingHistoryWrapped[_pendingHistoryCount] = lineProperty(0) & LINE_WRAPPED;
+
+        if (++_pendingHistoryCount == MAX_PENDING_HISTORY)
+            flushHistory();
+    }
+    else if (hasScroll())
     {
+        flushHistory();
+
+        // the selection is adjusted below
+        setAllLinesChanged();
+
         int oldHistLines = history->getLines();
 
-        history->addCellsVector(screenLines[0]);
-        history->addLine( lineProperties[0] & LINE_WRAPPED );
+        const bool wrapped = lineProperty(0) & LINE_WRAPPED;
+        history->addLines(&screenLine(0), &wrapped, 1);
 
         int newHistLines = history->getLines();
+        _historyIndex.addLines(&screenLine(0), &wrapped, 1, 1 - (newHistLines - oldHistLines));
 
         bool beginIsTL = (selBegin == selTopLeft);
 
@@ -1345,6 +1520,46 @@ void Screen::addHistLine()
 
 }
 
+void Screen::flushHistory()
+{
+    if (_pendingHistoryCount == 0)
+        return;
+
+    const int oldHistLines = history->getLines();
+
+    history->addLines(_pendingHistory.constData(), _pendingHistoryWrapped.constData(),
+                      _pendingHistoryCount);
+
+    // If the history is full, every line which did not
+    // make it grow pushed out an older one
+    const int dropped = _pendingHistoryCount - (history->getLines() - oldHistLines);
+    _historyIndex.addLines(_pendingHistory.constData(), _pendingHistoryWrapped.constData(),
+                           _pendingHistoryCount, dropped);
+    _droppedLines += dropped;
+    _pendingHistoryCount = 0;
+}
+
+void Screen::markUsedStyles(QBitArray& styles)
+{
+    // the spare lines in _pendingHistory are cleared before they are shown
+    for (int i = 0; i < _pendingHistoryCount; i++)
+    {
+        const PackedCharacter* data = _pendingHistory[i].constData();
+        for (int x = 0; x < _pendingHistory[i].count(); x++)
+            styles.setBit(data[x].style());
+    }
+
+    for (int i = 0; i <= lines; i++)
+    {
+        const PackedCharacter* data = screenLines[i].constData();
+        for (int x = 0; x < screenLines[i].count(); x++)
+            styles.setBit(data[x].style());
+    }
+
+    styles.setBit(effectiveStyle);
+    history->markUsedStyles(styles);
+}
+
 int Screen::getHistLines() const
 {
     return history->getLines();
@@ -1352,6 +1567,7 @@ int Screen::getHistLines() const
 
 void Screen::setScroll(const HistoryType& t , bool copyPreviousScroll)
 {
+    flushHistory();
     clearSelection();
 
     if ( copyPreviousScroll )
@@ -1362,6 +1578,10 @@ void Screen::setScroll(const HistoryType& t , bool copyPreviousScroll)
         history = t.scroll(nullptr);
         delete oldScroll;
     }
+
+    // lines carried over from the previous scroll were indexed against
+    // its line numbers, they are left unindexed
+    _historyIndex.reset(history->getLines());
 }
 
 bool Screen::hasScroll() const
@@ -1377,9 +1597,9 @@ const HistoryType& Screen::getScroll() const
 void Screen::setLineProperty(LineProperty property , bool enable)
 {
     if ( enable )
-        lineProperties[cuY] = (LineProperty)(lineProperties[cuY] | property);
+        lineProperty(cuY) = (LineProperty)(lineProperty(cuY) | property);
     else
-        lineProperties[cuY] = (LineProperty)(lineProperties[cuY] & ~property);
+        lineProperty(cuY) = (LineProperty)(lineProperty(cuY) & ~property);
 }
 void Screen::fillWithDefaultChar(Character* dest, int count)
 {
@@ -31,6 +31,7 @@
 // Konsole
 #include "Character.h"
 #include "History.h"
+#include "HistoryIndex.h"
 
 #define MODE_Origin    0
 #define MODE_Wrap      1
@@ -348,6 +349,14 @@ public:
      */
     void displayCharacter(wchar_t c);
 
+    /**
+     * Displays @p length characters from @p text starting at the current
+     * cursor position.  This is equivalent to calling displayCharacter()
+     * for each character, but the characters which fit on the current line
+     * are written to it in one pass.
+     */
+    void displayCharacters(const wchar_t* text, int length);
+
     // Do composition with last shown character FIXME: Not implemented yet for KDE 4
     void compose(const QString& compose);
 
@@ -405,6 +414,9 @@ public:
      * in a history buffer.
      */
     bool hasScroll() const;
+    /** Returns the search index of the lines in the history buffer. */
+    const HistoryIndex& historyIndex() const
+    { return _historyIndex; }
 
     /**
      * Sets the start of the selection.
@@ -460,6 +472,14 @@ public:
      */
     void writeLinesToStream(TerminalCharacterDecoder* decoder, int fromLine, int toLine) const;
 
+    /**
+     * Appends the characters of @p line, where 0 is the first line in the
+     * history, to @p cells and returns the properties of the line.  Unlike
+     * writeLinesToStream(), the characters are copied as they are stored,
+     * without a trailing new line and regardless of the selection mode.
+     */
+    LineProperty appendLineCells(int line, QVector<Character>& cells) const;
+
     /**
      * Copies the selected characters, set using @see setSelBeginXY and @see setSelExtentXY
      * into a stream.
@@ -514,10 +534,11 @@ public:
     int scrolledLines() const;
 
     /**
-     * Returns the region of the image which was last scrolled.
+     * Returns the region of the image which was scrolled since the last
+     * call to resetScrolledLines(), or an invalid rect if none was.
      *
-     * This is the area of the image from the top margin to the
-     * bottom margin when the last scroll occurred.
+     * This is the area of the image from the first line which was scrolled
+     * to the bottom margin, united over all the scrolls.
      */
     QRect lastScrolledRegion() const;
 
@@ -544,6 +565,36 @@ public:
      */
     void resetDroppedLines();
 
+    /**
+     * Hands the lines which scrolled off the screen since the last call
+     * over to the history.  Lines are collected while a batch of output
+     * is processed and added in one go.  This must be called before the
+     * history is accessed, Emulation does so after each batch.
+     */
+    void flushHistory();
+
+    /**
+     * Sets the bits of @p styles for the ids in CharacterStyleTable which are
+     * used by the screen image, the lines waiting for the history and the
+     * history itself.  See CharacterStyleTable::reclaimUnusedStyles()
+     */
+    void markUsedStyles(QBitArray& styles);
+
+    /**
+     * Starts a new generation of changes to the screen image and returns
+     * the generation which ended.  Together with isLineChanged(), this lets
+     * each view of the screen find out which lines it has to fetch again.
+     */
+    quint32 nextGeneration() { return _generation++; }
+
+    /**
+     * Returns true if screen line @p line (or anything else which affects
+     * how it appears in getImage()) may have changed after the generation
+     * @p generation, as returned by nextGeneration().
+     */
+    bool isLineChanged(int line, quint32 generation) const
+    { return _imageGeneration > generation || _lineGenerations[line] > generation; }
+
     /**
       * Fills the buffer @p dest with @p count instances of the default (ie. blank)
       * Character style.
@@ -581,12 +632,16 @@ private:
     //the parameters are specified as offsets from the start of the screen image.
     //the loc(x,y) macro can be used to generate these values from a column,line pair.
     //
-    //NOTE: moveImage() can only move whole lines
+    //NOTE: moveImage() can only move whole lines.  The lines which were
+    //overwritten end up in the area vacated by the source and must be
+    //cleared by the caller.
     void moveImage(int dest, int sourceBegin, int sourceEnd);
     // scroll up 'i' lines in current region, clearing the bottom 'i' lines
     void scrollUp(int from, int i);
     // scroll down 'i' lines in current region, clearing the top 'i' lines
     void scrollDown(int from, int i);
+    // adds the lines from 'from' to the bottom margin to _lastScrolledRegion
+    void addScrolledRegion(int from);
 
     void addHistLine();
 
@@ -612,18 +667,46 @@ private:
     int lines;
     int columns;
 
-    typedef QVector<Character> ImageLine;      // [0..columns]
-    ImageLine*          screenLines;    // [lines]
+    typedef QVector<PackedCharacter> ImageLine;      // [0..columns]
+    ImageLine*          screenLines;    // [lines], indexed by slot
 
     int _scrolledLines;
     QRect _lastScrolledRegion;
 
     int _droppedLines;
 
-    QVarLengthArray<LineProperty,64> lineProperties;
+    QVarLengthArray<LineProperty,64> lineProperties; // [lines], indexed by slot
+
+    // maps each line of the screen to the slot of screenLines and lineProperties
+    // holding it.  Scrolling rotates the slots of a region instead of moving
+    // the lines themselves, see moveImage()
+    QVarLengthArray<int,64> _lineSlots;
+
+    // the non-const accessors are used to modify lines, and mark them as changed
+    ImageLine& screenLine(int y) { _lineGenerations[y] = _generation; return screenLines[_lineSlots[y]]; }
+    const ImageLine& screenLine(int y) const { return screenLines[_lineSlots[y]]; }
+    LineProperty& lineProperty(int y) { _lineGenerations[y] = _generation; return lineProperties[_lineSlots[y]]; }
+    LineProperty lineProperty(int y) const { return lineProperties[_lineSlots[y]]; }
+
+    // the generation in which each line last changed, see isLineChanged()
+    QVarLengthArray<quint32,64> _lineGenerations; // [lines], indexed by line
+    quint32 _generation;
+    // the generation of the last change which affected all lines,
+    // such as the selection or the screen mode
+    quint32 _imageGeneration;
+    void setAllLinesChanged() { _imageGeneration = _generation; }
+
+    // lines which scrolled off the screen during the current batch of output,
+    // waiting for flushHistory().  Entries from _pendingHistoryCount onwards
+    // are spare lines kept for reuse.
+    QVector<ImageLine> _pendingHistory;
+    QVector<bool> _pendingHistoryWrapped;
+    int _pendingHistoryCount;
+    static const int MAX_PENDING_HISTORY = 256;
 
     // history buffer ---------------
     HistoryScroll* history;
+    HistoryIndex _historyIndex;
 
     // cursor location
     int cuX;
@@ -632,7 +715,7 @@ private:
     // cursor color and rendition info
     CharacterColor currentForeground;
     CharacterColor currentBackground;
-    quint8 currentRendition;
+    quint16 currentRendition;
 
     // margins ----------------
     int _topMargin;
@@ -655,7 +738,8 @@ private:
     // effective colors and rendition ------------
     CharacterColor effectiveForeground; // These are derived from
     CharacterColor effectiveBackground; // the cu_* variables above
-    quint8 effectiveRendition;          // to speed up operation
+    quint16 effectiveRendition;         // to speed up operation
+    quint32 effectiveStyle;             // id of the effective colors in CharacterStyleTable
 
     class SavedState
     {
@@ -665,7 +749,7 @@ private:
 
         int cursorColumn;
         int cursorLine;
-        quint8 rendition;
+        quint16 rendition;
         CharacterColor foreground;
         CharacterColor background;
     };
@@ -34,10 +34,16 @@ ScreenWindow::ScreenWindow(QObject* parent)
     , _windowBuffer(nullptr)
     , _windowBufferSize(0)
     , _bufferNeedsUpdate(true)
+    , _screenGeneration(0)
+    , _bufferScreenOffset(0)
+    , _bufferCursorLine(-1)
+    , _allLinesDirty(true)
     , _windowLines(1)
     , _currentLine(0)
     , _trackOutput(true)
     , _scrollCount(0)
+    , _visible(true)
+    , _refreshRate(60)
 {
 }
 ScreenWindow::~ScreenWindow()
@@ -49,6 +55,7 @@ void ScreenWindow::setScreen(Screen* screen)
     Q_ASSERT( screen );
 
     _screen = screen;
+    _bufferNeedsUpdate = true;
 }
 
 Screen* ScreenWindow::screen() const
@@ -68,21 +75,68 @@ Character* ScreenWindow::getImage()
         _bufferNeedsUpdate = true;
     }
 
-     if (!_bufferNeedsUpdate)
-        return _windowBuffer;
+    const int screenOffset = _screen->getHistLines() - currentLine();
+    const int cursorLine = screenOffset + _screen->getCursorY();
+
+    // the lines of the buffer only stay in place if the window shows the
+    // same part of the screen, and no history
+    if (screenOffset != _bufferScreenOffset || screenOffset > 0)
+        _bufferNeedsUpdate = true;
+
+    if (_bufferNeedsUpdate)
+    {
+        _screen->getImage(_windowBuffer,size,
+                          currentLine(),endWindowLine());
 
-    _screen->getImage(_windowBuffer,size,
-                      currentLine(),endWindowLine());
+        // this window may look beyond the end of the screen, in which
+        // case there will be an unused area which needs to be filled
+        // with blank characters
+        fillUnusedArea();
 
-    // this window may look beyond the end of the screen, in which
-    // case there will be an unused area which needs to be filled
-    // with blank characters
-    fillUnusedArea();
+        _allLinesDirty = true;
+    }
+    else
+    {
+        // fetch the lines which changed, and the lines which the cursor
+        // left and entered
+        const int lastLine = endWindowLine() - currentLine();
+        for (int line = 0; line <= lastLine; line++)
+        {
+            if (_screen->isLineChanged(line - screenOffset, _screenGeneration) ||
+                line == cursorLine || line == _bufferCursorLine)
+                updateLine(line);
+        }
+    }
 
+    _screenGeneration = _screen->nextGeneration();
+    _bufferScreenOffset = screenOffset;
+    _bufferCursorLine = cursorLine;
     _bufferNeedsUpdate = false;
     return _windowBuffer;
 }
 
+void ScreenWindow::updateLine(int line)
+{
+    const int columns = windowColumns();
+    _screen->getImage(_windowBuffer + line*columns, columns,
+                      currentLine() + line, currentLine() + line);
+
+    if (_dirtyLines.count() != windowLines())
+        _dirtyLines.resize(windowLines());
+    _dirtyLines[line] = true;
+}
+
+bool ScreenWindow::isLineDirty(int line) const
+{
+    return _allLinesDirty || _dirtyLines.value(line);
+}
+
+void ScreenWindow::resetDirtyLines()
+{
+    _allLinesDirty = false;
+    _dirtyLines.fill(false);
+}
+
 void ScreenWindow::fillUnusedArea()
 {
     int screenEndLine = _screen->getHistLines() + _screen->getLines() - 1;
@@ -162,6 +216,8 @@ void ScreenWindow::clearSelection()
 void ScreenWindow::setWindowLines(int lines)
 {
     Q_ASSERT(lines > 0);
+    if (lines != _windowLines)
+        _bufferNeedsUpdate = true;
     _windowLines = lines;
 }
 int ScreenWindow::windowLines() const
@@ -243,6 +299,34 @@ bool ScreenWindow::trackOutput() const
     return _trackOutput;
 }
 
+void ScreenWindow::setVisible(bool visible)
+{
+    if (_visible == visible)
+        return;
+
+    _visible = visible;
+    emit presentationChanged();
+}
+
+bool ScreenWindow::isVisible() const
+{
+    return _visible;
+}
+
+void ScreenWindow::setRefreshRate(qreal refreshRate)
+{
+    if (refreshRate <= 0 || qFuzzyCompare(_refreshRate, refreshRate))
+        return;
+
+    _refreshRate = refreshRate;
+    emit presentationChanged();
+}
+
+qreal ScreenWindow::refreshRate() const
+{
+    return _refreshRate;
+}
+
 int ScreenWindow::scrollCount() const
 {
     return _scrollCount;
@@ -265,6 +349,8 @@ QRect ScreenWindow::scrollRegion() const
 
 void ScreenWindow::notifyOutputChanged()
 {
+    const int previousLine = _currentLine;
+
     // move window to the bottom of the screen and update scroll count
     // if this window is currently tracking the bottom of the screen
     if ( _trackOutput )
@@ -287,7 +373,11 @@ void ScreenWindow::notifyOutputChanged()
         _currentLine = qMin( _currentLine , _screen->getHistLines() );
     }
 
-    _bufferNeedsUpdate = true;
+    // the lines of the buffer only move if the window or the screen image
+    // did, otherwise getImage() fetches just the lines which changed
+    if ( _currentLine != previousLine || _screen->droppedLines() != 0 ||
+         _screen->scrolledLines() != 0 )
+        _bufferNeedsUpdate = true;
 
     emit outputChanged();
 }
@@ -79,9 +79,25 @@ public:
      *
      * The returned buffer is managed by the ScreenWindow instance and does not need to be
      * deleted by the caller.
+     *
+     * Only the lines which changed on the screen since the previous call are
+     * copied again, see isLineDirty().
      */
     Character* getImage();
 
+    /**
+     * Returns true if @p line of the window may have changed in the images
+     * returned by getImage() since the last call to resetDirtyLines().  Lines
+     * for which this returns false are the same as they were then, which
+     * allows views to skip comparing them.
+     */
+    bool isLineDirty(int line) const;
+
+    /**
+     * Marks all lines as unchanged, see isLineDirty()
+     */
+    void resetDirtyLines();
+
     /**
      * Returns the line attributes associated with the lines of characters which
      * are currently visible through this window
@@ -209,6 +225,24 @@ public:
      */
     bool trackOutput() const;
 
+    /**
+     * Sets whether the view of this window is shown.  The emulation skips the
+     * updates of its windows while none of them is visible.  Windows are
+     * visible by default.
+     */
+    void setVisible(bool visible);
+    /** Returns whether the view of this window is shown.  See setVisible() */
+    bool isVisible() const;
+
+    /**
+     * Sets the refresh rate in Hz of the screen which the view of this window
+     * is shown on.  The emulation updates its windows at most once per frame
+     * of the fastest visible one.  The default is 60 Hz.
+     */
+    void setRefreshRate(qreal refreshRate);
+    /** Returns the refresh rate of the view of this window.  See setRefreshRate() */
+    qreal refreshRate() const;
+
     /**
      * Returns the text which is currently selected.
      *
@@ -244,20 +278,34 @@ signals:
 
     void scrollToEnd();
 
+    /** Emitted when the visibility or the refresh rate of the window changes. */
+    void presentationChanged();
+
 private:
     int endWindowLine() const;
     void fillUnusedArea();
+    void updateLine(int line);
 
     Screen* _screen; // see setScreen() , screen()
     Character* _windowBuffer;
     int _windowBufferSize;
-    bool _bufferNeedsUpdate;
+    bool _bufferNeedsUpdate; // true if all lines of the buffer need updating
+
+    // what the buffer shows, to find out which lines getImage() needs to update
+    quint32 _screenGeneration;   // see Screen::nextGeneration()
+    int _bufferScreenOffset;     // window line of the first screen line
+    int _bufferCursorLine;       // window line of the cursor
+
+    QVector<bool> _dirtyLines; // see isLineDirty(), resetDirtyLines()
+    bool _allLinesDirty;
 
     int  _windowLines;
     int  _currentLine; // see scrollTo() , currentLine()
     bool _trackOutput; // see setTrackOutput() , trackOutput()
     int  _scrollCount; // count of lines which the window has been scrolled by since
                        // the last call to resetScrollCount()
+    bool _visible;     // see setVisible()
+    qreal _refreshRate; // see setRefreshRate()
 };
 
 }
@@ -20,6 +20,8 @@
 #include <QAction>
 #include <QRegExp>
 #include <QDebug>
+#include <QHideEvent>
+#include <QShowEvent>
 
 #include "SearchBar.h"
 
@@ -84,6 +86,21 @@ void SearchBar::show()
     widget.searchTextEdit->selectAll();
 }
 
+void SearchBar::setMatchCount(int current, int total)
+{
+    if (current > 0)
+        widget.matchCountLabel->setText(tr("%1 of %2").arg(current).arg(total));
+    else
+        widget.matchCountLabel->setText(tr("%n match(es)", "", total));
+    widget.matchCountLabel->show();
+}
+
+void SearchBar::clearMatchCount()
+{
+    widget.matchCountLabel->hide();
+    widget.matchCountLabel->clear();
+}
+
 void SearchBar::noMatchFound()
 {
     QPalette palette;
@@ -111,6 +128,21 @@ void SearchBar::keyReleaseEvent(QKeyEvent* keyEvent)
     }
 }
 
+void SearchBar::showEvent(QShowEvent* event)
+{
+    QWidget::showEvent(event);
+    // matches are only highlighted while the search bar is visible
+    if (!event->spontaneous())
+        Q_EMIT highlightMatchesChanged(highlightAllMatches());
+}
+
+void SearchBar::hideEvent(QHideEvent* event)
+{
+    QWidget::hideEvent(event);
+    if (!event->spontaneous())
+        Q_EMIT highlightMatchesChanged(false);
+}
+
 void SearchBar::clearBackgroundColor()
 {
     widget.searchTextEdit->setPalette(QWidget::window()->palette());
@@ -35,6 +35,14 @@ public:
     bool matchCase();
     bool highlightAllMatches();
 
+    /**
+     * Shows that there are @p total matches, and that the current one is
+     * number @p current of them, or none of them if @p current is 0.
+     */
+    void setMatchCount(int current, int total);
+    /** Hides the number of matches */
+    void clearMatchCount();
+
 public slots:
     void noMatchFound();
 
@@ -46,6 +54,8 @@ signals:
 
 protected:
     void keyReleaseEvent(QKeyEvent* keyEvent) override;
+    void showEvent(QShowEvent* event) override;
+    void hideEvent(QHideEvent* event) override;
 
 private slots:
     void clearBackgroundColor();
@@ -33,6 +33,7 @@
 #include <QByteRef>
 #include <QDir>
 #include <QFile>
+#include <QMetaMethod>
 #include <QRegExp>
 #include <QStringList>
 #include <QFile>
@@ -43,6 +44,7 @@
 #include "TerminalDisplay.h"
 #include "ShellCommand.h"
 #include "Vt102Emulation.h"
+#include "SessionRecorder.h"
 
 using namespace Konsole;
 
@@ -71,6 +73,7 @@ Session::Session(QObject* parent) :
 //   , _zmodemProc(0)
 //   , _zmodemProgress(0)
         , _hasDarkBackground(false)
+        , _recorder(nullptr)
 {
     //prepare DBus communication
 //    new SessionAdaptor(this);
@@ -572,6 +575,7 @@ void Session::sendKeyEvent(QKeyEvent* e) const
 
 Session::~Session()
 {
+    stopRecording();
     delete _emulation;
     delete _shellProcess;
 //  delete _zmodemProc;
@@ -903,10 +907,58 @@ void Session::zmodemFinished()
   }
 }
 */
+bool Session::startRecording(const QString& fileName)
+{
+    stopRecording();
+
+    SessionRecorder* recorder = new SessionRecorder(this);
+    if (!recorder->start(fileName, _emulation->imageSize(), _emulation->codec()))
+    {
+        delete recorder;
+        return false;
+    }
+
+    _recorder = recorder;
+    connect( _emulation, SIGNAL(sendData(const char *,int)),
+             _recorder, SLOT(recordInput(const char *,int)) );
+    connect( _emulation, SIGNAL(imageSizeChanged(int, int)),
+             _recorder, SLOT(recordResize(int, int)) );
+    return true;
+}
+
+void Session::stopRecording()
+{
+    // waits for the rest of the recording to be written
+    delete _recorder;
+    _recorder = nullptr;
+}
+
+bool Session::isRecording() const
+{
+    return _recorder != nullptr;
+}
+
 void Session::onReceiveBlock( const char * buf, int len )
 {
+    if (_recorder)
+        _recorder->recordOutput( buf, len );
+    emit receivedBytes( buf, len );
     _emulation->receiveData( buf, len );
-    emit receivedData( QString::fromLatin1( buf, len ) );
+}
+
+void Session::connectNotify(const QMetaMethod & signal)
+{
+    // the emulation only collects the decoded text while it is wanted
+    if (signal == QMetaMethod::fromSignal(&Session::receivedData))
+        connect(_emulation, &Emulation::receivedText, this, &Session::receivedData, Qt::UniqueConnection);
+}
+
+void Session::disconnectNotify(const QMetaMethod & signal)
+{
+    // an invalid signal stands for disconnecting all of them
+    const QMetaMethod receivedDataSignal = QMetaMethod::fromSignal(&Session::receivedData);
+    if ((!signal.isValid() || signal == receivedDataSignal) && !isSignalConnected(receivedDataSignal))
+        disconnect(_emulation, &Emulation::receivedText, this, &Session::receivedData);
 }
 
 QSize Session::size()
@@ -37,6 +37,7 @@ namespace Konsole {
 
 class Emulation;
 class Pty;
+class SessionRecorder;
 class TerminalDisplay;
 //class ZModemDialog;
 
@@ -375,6 +376,18 @@ public:
      */
     int getPtySlaveFd() const;
 
+    /**
+     * Starts recording the output and the input of the session to @p fileName,
+     * stopping the current recording.  See SessionRecorder.
+     *
+     * @return false if the file cannot be created.
+     */
+    bool startRecording(const QString& fileName);
+    /** Stops recording the session, see startRecording(). */
+    void stopRecording();
+    /** Returns true if the session is being recorded. */
+    bool isRecording() const;
+
 public slots:
 
     /**
@@ -416,10 +429,22 @@ signals:
     void finished();
 
     /**
-     * Emitted when output is received from the terminal process.
+     * Emitted with the output received from the terminal process, decoded
+     * with the codec of the emulation.  The text is emitted once per update
+     * of the views rather than once per read, and only decoded into text while
+     * this signal is connected.  See Emulation::receivedText()
      */
     void receivedData( const QString & text );
 
+    /**
+     * Emitted for each block of output read from the terminal process, before
+     * the emulation processes it.  @p data is only valid during the emission,
+     * so the connections have to be direct and receivers which keep the
+     * bytes have to copy them.  Emitting the signal costs next to nothing
+     * while nothing is connected to it.
+     */
+    void receivedBytes( const char * data, int length );
+
     /** Emitted when the session's title has changed. */
     void titleChanged();
 
@@ -488,6 +513,10 @@ signals:
     void silence();
     void activity();
 
+protected:
+    void connectNotify(const QMetaMethod & signal) override;
+    void disconnectNotify(const QMetaMethod & signal) override;
+
 private slots:
     void done(int);
 
@@ -570,6 +599,8 @@ private:
 
     int ptySlaveFd;
 
+    SessionRecorder* _recorder;
+
 };
 
 /**
@@ -0,0 +1,184 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "SessionPlayer.h"
+
+// Standard Library
+#include <climits>
+
+// Qt
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTextCodec>
+#include <QtDebug>
+
+using namespace Konsole;
+
+const int SessionPlayer::PLAY_SLICE_MSEC;
+
+SessionPlayer::SessionPlayer(Emulation* emulation, QObject* parent)
+    : QObject(parent)
+    , _emulation(emulation)
+    , _speed(1)
+    , _playing(false)
+    , _baseTime(0)
+    , _playedBytes(0)
+    , _hasEvent(false)
+    , _eventTime(0)
+    , _lastEventTime(0)
+{
+    _timer.setSingleShot(true);
+    connect(&_timer, SIGNAL(timeout()), this, SLOT(play()));
+}
+
+bool SessionPlayer::start(const QString& fileName)
+{
+    stop();
+
+    _file.setFileName(fileName);
+    if (!_file.open(QIODevice::ReadOnly))
+    {
+        qWarning() << "Cannot play the recording" << fileName << ":" << _file.errorString();
+        return false;
+    }
+
+    const QJsonObject header = QJsonDocument::fromJson(_file.readLine()).object();
+    if (header.value(QLatin1String("version")).toInt() != 2)
+    {
+        qWarning() << "Cannot play the recording" << fileName << ": not an asciicast v2 file";
+        _file.close();
+        return false;
+    }
+
+    _playing = true;
+    _hasEvent = false;
+    _baseTime = 0;
+    _lastEventTime = 0;
+    _playedBytes = 0;
+    _clock.start();
+    _playTime.start();
+
+    _timer.start(0);
+    return true;
+}
+
+void SessionPlayer::stop()
+{
+    if (_playing)
+        finish();
+}
+
+bool SessionPlayer::isPlaying() const
+{
+    return _playing;
+}
+
+void SessionPlayer::setSpeed(qreal speed)
+{
+    speed = speed <= 0 ? 0 : qBound<qreal>(1, speed, 100);
+    if (speed == _speed)
+        return;
+
+    // the new speed applies from the output played last
+    _speed = speed;
+    _baseTime = _lastEventTime;
+    _clock.restart();
+
+    if (_playing)
+        _timer.start(0);
+}
+
+qreal SessionPlayer::speed() const
+{
+    return _speed;
+}
+
+bool SessionPlayer::readEvent()
+{
+    while (!_file.atEnd())
+    {
+        const QJsonArray event = QJsonDocument::fromJson(_file.readLine()).array();
+        if (event.size() < 3 || event.at(1).toString() != QLatin1String("o"))
+            continue;
+
+        _eventTime = qint64(event.at(0).toDouble() * 1000000);
+        _eventData = _emulation->codec()->fromUnicode(event.at(2).toString());
+        return true;
+    }
+
+    return false;
+}
+
+void SessionPlayer::play()
+{
+    if (!_playing)
+        return;
+
+    if (!_emulation)
+    {
+        finish();
+        return;
+    }
+
+    QElapsedTimer slice;
+    slice.start();
+
+    while (true)
+    {
+        if (!_hasEvent && !(_hasEvent = readEvent()))
+        {
+            finish();
+            return;
+        }
+
+        if (_speed > 0)
+        {
+            const qint64 due = qint64((_eventTime - _baseTime) / _speed);
+            const qint64 wait = (due - _clock.nsecsElapsed() / 1000) / 1000;
+            if (wait > 0)
+            {
+                _timer.start(int(qMin<qint64>(wait, INT_MAX)));
+                return;
+            }
+        }
+
+        _emulation->receiveData(_eventData.constData(), _eventData.size());
+        _playedBytes += _eventData.size();
+        _lastEventTime = _eventTime;
+        _hasEvent = false;
+
+        if (slice.elapsed() >= PLAY_SLICE_MSEC)
+        {
+            _timer.start(0);
+            return;
+        }
+    }
+}
+
+void SessionPlayer::finish()
+{
+    _playing = false;
+    _timer.stop();
+    _file.close();
+    _eventData.clear();
+
+    emit finished(_playedBytes, _playTime.elapsed());
+}
@@ -0,0 +1,116 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef SESSIONPLAYER_H
+#define SESSIONPLAYER_H
+
+// Qt
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QObject>
+#include <QPointer>
+#include <QTimer>
+
+// Konsole
+#include "Emulation.h"
+
+namespace Konsole
+{
+
+/**
+ * Plays a recording made by SessionRecorder, or any other asciicast v2 file,
+ * by passing the recorded output to Emulation::receiveData().
+ *
+ * The output is played at 1 to 100 times the recorded speed, or as fast as
+ * the emulation can take it, which makes recordings useful for measuring the
+ * speed of the emulation.  The events are read from the file as they are
+ * played, and the emulation is fed in time slices of PLAY_SLICE_MSEC, so that
+ * the terminal is painted while the recording plays.
+ *
+ * The input and the resize events are not played, the size of the terminal
+ * is left to its views.
+ */
+class SessionPlayer : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SessionPlayer(Emulation* emulation, QObject* parent = nullptr);
+
+    /**
+     * Starts playing the recording in @p fileName, stopping the one which is
+     * playing.  Returns false if the file cannot be read or is not an asciicast
+     * v2 recording.
+     */
+    bool start(const QString& fileName);
+
+    /** Stops playing, finished() is emitted if a recording was playing. */
+    void stop();
+
+    /** Returns true from start() until finished() is emitted. */
+    bool isPlaying() const;
+
+    /**
+     * Sets the speed as a multiple of the recorded speed, between 1 and 100,
+     * or 0 to play the output as fast as possible.  The default is 1.
+     */
+    void setSpeed(qreal speed);
+    qreal speed() const;
+
+signals:
+    /**
+     * Emitted when the recording has been played or stop() is called, with
+     * the number of bytes of output played and the time it took.
+     */
+    void finished(qint64 bytes, qint64 msecs);
+
+private slots:
+    void play();
+
+private:
+    bool readEvent();
+    void finish();
+
+    // the time spent playing before returning to the event loop
+    static const int PLAY_SLICE_MSEC = 16;
+
+    QPointer<Emulation> _emulation;
+    QFile _file;
+    QTimer _timer;
+    qreal _speed;
+    bool _playing;
+
+    // the time since the playback reached _baseTime, the time of the
+    // recording in microseconds
+    QElapsedTimer _clock;
+    qint64 _baseTime;
+    QElapsedTimer _playTime;
+    qint64 _playedBytes;
+
+    // the next output to play, in the codec of the emulation
+    bool _hasEvent;
+    qint64 _eventTime;
+    QByteArray _eventData;
+    qint64 _lastEventTime;
+};
+
+}
+
+#endif // SESSIONPLAYER_H
@@ -0,0 +1,287 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "SessionRecorder.h"
+
+// Qt
+#include <QDateTime>
+#include <QTextCodec>
+#include <QTextDecoder>
+#include <QTimer>
+#include <QtDebug>
+
+using namespace Konsole;
+
+const int SessionRecordQueue::CAPACITY;
+const int SessionRecorder::OVERFLOW_RETRY_MSEC;
+
+// the size of the writes to the file
+static const int WRITE_CHUNK_SIZE = 64 * 1024;
+
+SessionRecordQueue::SessionRecordQueue()
+    : _slots(CAPACITY)
+    , _head(0)
+    , _tail(0)
+{
+    // the slots are accessed through a pointer, so that neither thread makes
+    // QVector check whether it has to detach
+    _ring = _slots.data();
+}
+
+bool SessionRecordQueue::push(const SessionRecord& record)
+{
+    const uint head = _head.load();
+    if (head - _tail.loadAcquire() == uint(CAPACITY))
+        return false;
+
+    _ring[head & (CAPACITY - 1)] = record;
+    _head.storeRelease(head + 1);
+    return true;
+}
+
+bool SessionRecordQueue::pop(SessionRecord& record)
+{
+    const uint tail = _tail.load();
+    if (tail == _head.loadAcquire())
+        return false;
+
+    // the data is released by the consumer, which is the thread that is
+    // allowed to wait
+    SessionRecord& slot = _ring[tail & (CAPACITY - 1)];
+    record.time = slot.time;
+    record.type = slot.type;
+    record.data.swap(slot.data);
+    slot.data.clear();
+
+    _tail.storeRelease(tail + 1);
+    return true;
+}
+
+SessionRecorder::SessionRecorder(QObject* parent)
+    : QObject(parent)
+    , _retryScheduled(false)
+    , _wakeUpPending(0)
+    , _worker(nullptr)
+{
+}
+
+SessionRecorder::~SessionRecorder()
+{
+    if (!_worker)
+        return;
+
+    _thread.quit();
+    _thread.wait();
+
+    // the writer has stopped, so the rest is written by this thread
+    do
+    {
+        while (!_overflow.isEmpty() && _queue.push(_overflow.head()))
+            _overflow.dequeue();
+        _worker->writeRecords();
+    } while (!_overflow.isEmpty());
+
+    delete _worker;
+}
+
+bool SessionRecorder::start(const QString& fileName, const QSize& size, const QTextCodec* codec)
+{
+    if (_worker)
+        return false;
+
+    QFile* file = new QFile(fileName);
+    if (!file->open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qWarning() << "Cannot record the session to" << fileName << ":" << file->errorString();
+        delete file;
+        return false;
+    }
+
+    const QByteArray header = "{\"version\": 2, \"width\": " + QByteArray::number(size.width())
+                            + ", \"height\": " + QByteArray::number(size.height())
+                            + ", \"timestamp\": " + QByteArray::number(QDateTime::currentMSecsSinceEpoch() / 1000)
+                            + "}\n";
+    if (file->write(header) != header.size())
+    {
+        qWarning() << "Cannot record the session to" << fileName << ":" << file->errorString();
+        delete file;
+        return false;
+    }
+
+    _clock.start();
+
+    _worker = new SessionRecorderWorker(this, file, codec);
+    _worker->moveToThread(&_thread);
+    connect(this, SIGNAL(recordsAvailable()), _worker, SLOT(writeRecords()));
+    _thread.start(QThread::LowPriority);
+    return true;
+}
+
+bool SessionRecorder::isRecording() const
+{
+    return _worker != nullptr;
+}
+
+void SessionRecorder::recordOutput(const char* data, int length)
+{
+    record(SessionRecord::Output, QByteArray(data, length));
+}
+
+void SessionRecorder::recordInput(const char* data, int length)
+{
+    record(SessionRecord::Input, QByteArray(data, length));
+}
+
+void SessionRecorder::recordResize(int lines, int columns)
+{
+    record(SessionRecord::Resize, QByteArray::number(columns) + 'x' + QByteArray::number(lines));
+}
+
+void SessionRecorder::record(char type, const QByteArray& data)
+{
+    if (!_worker)
+        return;
+
+    SessionRecord record;
+    record.time = _clock.nsecsElapsed() / 1000;
+    record.type = type;
+    record.data = data;
+
+    // the records have to stay in order, so once one overflows the later
+    // ones queue up behind it
+    if (!_overflow.isEmpty() || !_queue.push(record))
+    {
+        _overflow.enqueue(record);
+        if (!_retryScheduled)
+        {
+            _retryScheduled = true;
+            QTimer::singleShot(OVERFLOW_RETRY_MSEC, this, SLOT(pushOverflow()));
+        }
+    }
+
+    wakeWriter();
+}
+
+void SessionRecorder::pushOverflow()
+{
+    _retryScheduled = false;
+
+    while (!_overflow.isEmpty() && _queue.push(_overflow.head()))
+        _overflow.dequeue();
+
+    if (!_overflow.isEmpty())
+    {
+        _retryScheduled = true;
+        QTimer::singleShot(OVERFLOW_RETRY_MSEC, this, SLOT(pushOverflow()));
+    }
+
+    wakeWriter();
+}
+
+void SessionRecorder::wakeWriter()
+{
+    if (_wakeUpPending.testAndSetOrdered(0, 1))
+        emit recordsAvailable();
+}
+
+SessionRecorderWorker::SessionRecorderWorker(SessionRecorder* recorder, QFile* file,
+                                             const QTextCodec* codec)
+    : _recorder(recorder)
+    , _file(file)
+{
+    // the file moves to the writer thread along with the worker
+    _file->setParent(this);
+
+    if (!codec)
+        codec = QTextCodec::codecForName("UTF-8");
+    _outputDecoder = codec->makeDecoder();
+    _inputDecoder = codec->makeDecoder();
+
+    _buffer.reserve(2 * WRITE_CHUNK_SIZE);
+}
+
+SessionRecorderWorker::~SessionRecorderWorker()
+{
+    delete _outputDecoder;
+    delete _inputDecoder;
+}
+
+void SessionRecorderWorker::writeRecords()
+{
+    _recorder->_wakeUpPending.storeRelease(0);
+
+    SessionRecord record;
+    while (_recorder->_queue.pop(record))
+    {
+        _buffer.append('[');
+        _buffer.append(QByteArray::number(double(record.time) / 1000000, 'f', 6));
+        _buffer.append(", \"");
+        _buffer.append(record.type);
+        _buffer.append("\", \"");
+        if (record.type == SessionRecord::Output)
+            appendString(_outputDecoder->toUnicode(record.data));
+        else if (record.type == SessionRecord::Input)
+            appendString(_inputDecoder->toUnicode(record.data));
+        else
+            _buffer.append(record.data);
+        _buffer.append("\"]\n");
+
+        if (_buffer.size() >= WRITE_CHUNK_SIZE)
+        {
+            _file->write(_buffer);
+            _buffer.resize(0);
+        }
+    }
+
+    if (!_buffer.isEmpty())
+    {
+        _file->write(_buffer);
+        _buffer.resize(0);
+    }
+    _file->flush();
+}
+
+void SessionRecorderWorker::appendString(const QString& text)
+{
+    static const char hexDigits[] = "0123456789abcdef";
+
+    QString escaped;
+    escaped.reserve(text.size());
+    for (const QChar c : text)
+    {
+        const ushort u = c.unicode();
+        if (u == '"' || u == '\\')
+        {
+            escaped.append(QLatin1Char('\\'));
+            escaped.append(c);
+        }
+        else if (u < 0x20 || u == 0x7f)
+        {
+            escaped.append(QLatin1String("\\u00"));
+            escaped.append(QLatin1Char(hexDigits[u >> 4]));
+            escaped.append(QLatin1Char(hexDigits[u & 0xf]));
+        }
+        else
+        {
+            escaped.append(c);
+        }
+    }
+    _buffer.append(escaped.toUtf8());
+}
@@ -0,0 +1,185 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef SESSIONRECORDER_H
+#define SESSIONRECORDER_H
+
+// Qt
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QObject>
+#include <QQueue>
+#include <QSize>
+#include <QThread>
+#include <QVector>
+
+class QTextCodec;
+class QTextDecoder;
+
+namespace Konsole
+{
+
+/** An event of a recorded session, see SessionRecorder */
+struct SessionRecord
+{
+    /** The types of the events, as asciicast names them */
+    enum Type
+    {
+        Output = 'o',
+        Input = 'i',
+        Resize = 'r'
+    };
+
+    // microseconds since the recording started
+    qint64 time;
+    char type;
+    // the bytes for Output and Input, "<columns>x<lines>" for Resize
+    QByteArray data;
+};
+
+/**
+ * A bounded queue of records which one thread appends to and another thread
+ * takes from, without locking.
+ *
+ * The records are kept in a ring of CAPACITY slots.  The producer only
+ * advances the head and the consumer only advances the tail, each publishing
+ * its slots to the other with release and acquire ordering.
+ */
+class SessionRecordQueue
+{
+public:
+    SessionRecordQueue();
+
+    /** Appends @p record, returns false if the queue is full.  Producer only. */
+    bool push(const SessionRecord& record);
+    /** Takes the oldest record into @p record, returns false if the queue is empty.  Consumer only. */
+    bool pop(SessionRecord& record);
+
+private:
+    static const int CAPACITY = 4096;
+
+    QVector<SessionRecord> _slots;
+    SessionRecord* _ring;
+    QAtomicInteger<uint> _head;   // the number of records pushed
+    QAtomicInteger<uint> _tail;   // the number of records popped
+};
+
+class SessionRecorderWorker;
+
+/**
+ * Records the output and the input of a session, with the time of each
+ * block, in the asciicast v2 format used by asciinema.
+ *
+ * The file starts with a header line which holds the size of the terminal,
+ * followed by one line per event: the time in seconds since the recording
+ * started, the type of the event ("o" for output, "i" for input and "r" for
+ * a resize) and the data of the event.  The bytes are converted from the
+ * codec of the terminal to UTF-8, as the format requires.
+ *
+ * The record*() functions only copy the bytes into a SessionRecordQueue,
+ * the records are formatted and written to the file on a separate thread, so
+ * the session never waits for the disk.  Should the writer fall behind until
+ * the queue is full, the records are kept in a list by the recording thread
+ * and handed over once there is room again, so none are lost.
+ */
+class SessionRecorder : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit SessionRecorder(QObject* parent = nullptr);
+    /** Stops the recording, waiting for all records to be written. */
+    ~SessionRecorder() override;
+
+    /**
+     * Creates @p fileName and writes the header of the recording of a terminal
+     * of size @p size (in columns and lines), whose bytes are encoded with
+     * @p codec.  Returns false if the file cannot be created.
+     */
+    bool start(const QString& fileName, const QSize& size, const QTextCodec* codec);
+
+    /** Returns true from a successful start() until the recorder is deleted. */
+    bool isRecording() const;
+
+public slots:
+    void recordOutput(const char* data, int length);
+    void recordInput(const char* data, int length);
+    void recordResize(int lines, int columns);
+
+signals:
+    void recordsAvailable();
+
+private slots:
+    void pushOverflow();
+
+private:
+    void record(char type, const QByteArray& data);
+    void wakeWriter();
+
+    // the time to wait before trying to hand over the overflowing records again
+    static const int OVERFLOW_RETRY_MSEC = 10;
+
+    QElapsedTimer _clock;
+    SessionRecordQueue _queue;
+    QQueue<SessionRecord> _overflow;
+    bool _retryScheduled;
+
+    // set by the recorder when it wakes the writer up, cleared by the writer
+    // before it takes the records, so that no wake up is lost
+    QAtomicInt _wakeUpPending;
+
+    QThread _thread;
+    SessionRecorderWorker* _worker;
+
+    friend class SessionRecorderWorker;
+};
+
+/**
+ * Formats the records of a SessionRecorder and writes them to the file,
+ * on the writer thread.
+ */
+class SessionRecorderWorker : public QObject
+{
+    Q_OBJECT
+
+public:
+    SessionRecorderWorker(SessionRecorder* recorder, QFile* file, const QTextCodec* codec);
+    ~SessionRecorderWorker() override;
+
+public slots:
+    /** Writes the records in the queue. */
+    void writeRecords();
+
+private:
+    void appendString(const QString& text);
+
+    SessionRecorder* _recorder;
+    QFile* _file;
+    // the bytes may end in the middle of a character, so each direction
+    // has a decoder of its own which keeps the rest for the next record
+    QTextDecoder* _outputDecoder;
+    QTextDecoder* _inputDecoder;
+    QByteArray _buffer;
+};
+
+}
+
+#endif // SESSIONRECORDER_H
@@ -23,6 +23,9 @@
 // Own
 #include "TerminalDisplay.h"
 
+// Standard Library
+#include <algorithm>
+
 // Qt
 #include <QAbstractButton>
 #include <QApplication>
@@ -33,18 +36,23 @@
 #include <QTime>
 #include <QFile>
 #include <QGridLayout>
+#include <QGuiApplication>
 #include <QLabel>
 #include <QLayout>
 #include <QMessageBox>
 #include <QPainter>
 #include <QPixmap>
 #include <QRegularExpression>
+#include <QScreen>
 #include <QScrollBar>
 #include <QStyle>
+#include <QStyleOptionSlider>
 #include <QTimer>
 #include <QtDebug>
 #include <QUrl>
 #include <QMimeData>
+#include <QOpenGLContext>
+#include <QWindow>
 #include <QDrag>
 
 // KDE
@@ -65,6 +73,7 @@
 #include "konsole_wcwidth.h"
 #include "ScreenWindow.h"
 #include "TerminalCharacterDecoder.h"
+#include "TerminalGLView.h"
 
 using namespace Konsole;
 
@@ -104,10 +113,81 @@ const ColorEntry Konsole::base_color_table[TABLE_COLORS] =
 bool TerminalDisplay::_antialiasText = true;
 bool TerminalDisplay::HAVE_TRANSPARENCY = true;
 
+const int TerminalDisplay::FILTER_IDLE_DELAY;
+const int TerminalDisplay::FILTER_MAX_DELAY;
+
 // we use this to force QPainter to display text in LTR mode
 // more information can be found in: http://unicode.org/reports/tr9/
 const QChar LTR_OVERRIDE_CHAR( 0x202D );
 
+// the translucent color laid over search matches, and the color of their
+// marks on the scroll bar
+static const QRgb SEARCH_MATCH_COLOR = qRgba(255, 200, 0, 100);
+static const QRgb SEARCH_MATCH_MARK_COLOR = qRgb(255, 170, 0);
+
+namespace Konsole
+{
+
+/**
+ * Marks the lines of search matches on the scroll bar of a display.  It is
+ * laid over the scroll bar, and lets mouse events through to it.
+ */
+class SearchMatchMarks : public QWidget
+{
+public:
+    SearchMatchMarks(TerminalDisplay* display, QScrollBar* scrollBar)
+        : QWidget(scrollBar)
+        , _display(display)
+        , _scrollBar(scrollBar)
+    {
+        setAttribute(Qt::WA_TransparentForMouseEvents);
+        setAttribute(Qt::WA_NoSystemBackground);
+    }
+
+protected:
+    void paintEvent(QPaintEvent*) override
+    {
+        const QVector<TerminalDisplay::SearchMatch>& matches = _display->searchMatches();
+        ScreenWindow* window = _display->screenWindow();
+        if (matches.isEmpty() || !window || window->lineCount() <= 0)
+            return;
+
+        QStyleOptionSlider option;
+        option.initFrom(_scrollBar);
+        option.orientation = Qt::Vertical;
+        option.minimum = _scrollBar->minimum();
+        option.maximum = _scrollBar->maximum();
+        option.sliderPosition = _scrollBar->sliderPosition();
+        option.sliderValue = _scrollBar->value();
+        option.singleStep = _scrollBar->singleStep();
+        option.pageStep = _scrollBar->pageStep();
+        option.subControls = QStyle::SC_All;
+        const QRect groove = _scrollBar->style()->subControlRect(QStyle::CC_ScrollBar, &option,
+                                                                 QStyle::SC_ScrollBarGroove, _scrollBar);
+
+        QPainter painter(this);
+        const QColor color = QColor::fromRgba(SEARCH_MATCH_MARK_COLOR);
+        const qint64 lineCount = window->lineCount();
+
+        // many matches share a pixel row, each row is only painted once
+        int lastY = -1;
+        for (const TerminalDisplay::SearchMatch& match : matches)
+        {
+            const int y = groove.top() + int(match.start.y() * groove.height() / lineCount);
+            if (y == lastY)
+                continue;
+            painter.fillRect(groove.left(), y, groove.width(), 2, color);
+            lastY = y;
+        }
+    }
+
+private:
+    TerminalDisplay* _display;
+    QScrollBar* _scrollBar;
+};
+
+}
+
 /* ------------------------------------------------------------------------- */
 /*                                                                           */
 /*                                Colors                                     */
@@ -135,6 +215,7 @@ void TerminalDisplay::setScreenWindow(ScreenWindow* window)
     }
 
     _screenWindow = window;
+    _imageNeedsFullUpdate = true;
 
     if ( window )
     {
@@ -147,7 +228,11 @@ void TerminalDisplay::setScreenWindow(ScreenWindow* window)
         connect( _screenWindow , SIGNAL(scrolled(int)) , this , SLOT(updateFilters()) );
         connect( _screenWindow , &ScreenWindow::scrollToEnd , this , &TerminalDisplay::scrollToEnd );
         window->setWindowLines(_lines);
+        updateScreenWindowPresentation(isVisible());
     }
+
+    if (_glView)
+        _glView->setScreenWindow(window);
 }
 
 const ColorEntry* TerminalDisplay::colorTable() const
@@ -164,13 +249,13 @@ void TerminalDisplay::setBackgroundColor(const QColor& color)
       // Avoid propagating the palette change to the scroll bar
       _scrollBar->setPalette( QApplication::palette() );
 
-    update();
+    invalidate(rect());
 }
 void TerminalDisplay::setForegroundColor(const QColor& color)
 {
     _colorTable[DEFAULT_FORE_COLOR].color = color;
 
-    update();
+    invalidate(rect());
 }
 void TerminalDisplay::setColorTable(const ColorEntry table[])
 {
@@ -178,6 +263,9 @@ void TerminalDisplay::setColorTable(const ColorEntry table[])
       _colorTable[i] = table[i];
 
   setBackgroundColor(_colorTable[DEFAULT_BACK_COLOR].color);
+
+  if (_glView)
+      _glView->setColorTable(_colorTable);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -245,6 +333,8 @@ void TerminalDisplay::fontChange(const QFont&)
 
   _fontAscent = fm.ascent();
 
+  _glyphCache.clear();
+
   emit changedFontMetricSignal( _fontHeight, _fontWidth );
   propagateSize();
 
@@ -252,7 +342,7 @@ void TerminalDisplay::fontChange(const QFont&)
   // Although this operation will destory the orignal content,
   // the content will be drawn again after the test.
   _drawTextTestFlag = true;
-  update();
+  invalidate(rect());
 }
 
 void TerminalDisplay::calDrawTextAdditionHeight(QPainter& painter)
@@ -332,6 +422,10 @@ TerminalDisplay::TerminalDisplay(QWidget *parent)
 ,_image(nullptr)
 ,_randomSeed(0)
 ,_resizing(false)
+,_imageNeedsFullUpdate(true)
+,_glView(nullptr)
+,_fillRectCount(0)
+,_hiddenUpdatePending(true)
 ,_terminalSizeHint(false)
 ,_terminalSizeStartup(true)
 ,_bidiEnabled(false)
@@ -363,6 +457,11 @@ TerminalDisplay::TerminalDisplay(QWidget *parent)
 ,_opacity(static_cast<qreal>(1))
 ,_backgroundMode(None)
 ,_filterChain(new TerminalImageFilterChain())
+,_filterUpdateMode(QTermWidget::DeferredFilterUpdates)
+,_filterTimer(nullptr)
+,_filtersPending(false)
+,_highlightScrollCount(0)
+,_searchMatchMarks(nullptr)
 ,_cursorShape(Emulation::KeyboardCursorShape::BlockCursor)
 ,mMotionAfterPasting(NoMoveScreenWindow)
 ,_leftBaseMargin(1)
@@ -398,12 +497,18 @@ TerminalDisplay::TerminalDisplay(QWidget *parent)
   // check in TerminalDisplay::setScrollBarPosition(ScrollBarPosition position)
   _scrollBar->hide();
 
+  _searchMatchMarks = new SearchMatchMarks(this, _scrollBar);
+
   // setup timers for blinking cursor and text
   _blinkTimer   = new QTimer(this);
   connect(_blinkTimer, SIGNAL(timeout()), this, SLOT(blinkEvent()));
   _blinkCursorTimer   = new QTimer(this);
   connect(_blinkCursorTimer, SIGNAL(timeout()), this, SLOT(blinkCursorEvent()));
 
+  _filterTimer = new QTimer(this);
+  _filterTimer->setSingleShot(true);
+  connect(_filterTimer, &QTimer::timeout, this, &TerminalDisplay::processPendingFilters);
+
 //  KCursor::setAutoHideCursor( this, true );
 
   setUsesMouse(true);
@@ -737,10 +842,14 @@ void TerminalDisplay::drawBackground(QPainter& painter, const QRect& rect, const
                 painter.setCompositionMode(QPainter::CompositionMode_Source);
                 painter.fillRect(rect, color);
                 painter.restore();
+                _fillRectCount++;
             }
         }
         else
+        {
             painter.fillRect(rect, backgroundColor);
+            _fillRectCount++;
+        }
 }
 
 void TerminalDisplay::drawCursor(QPainter& painter,
@@ -799,7 +908,8 @@ void TerminalDisplay::drawCharacters(QPainter& painter,
                                      const QRect& rect,
                                      const std::wstring& text,
                                      const Character* style,
-                                     bool invertCharacterColor)
+                                     bool invertCharacterColor,
+                                     const QColor& background)
 {
     // don't draw text which is currently blinking
     if ( _blinking && (style->rendition & RE_BLINK) )
@@ -854,6 +964,10 @@ void TerminalDisplay::drawCharacters(QPainter& painter,
         if (_bidiEnabled) {
             painter.drawText(rect.x(), rect.y() + _fontAscent + _lineSpacing, QString::fromStdWString(text));
         } else {
+         // fixed pitch text which maps each character to one cell is copied
+         // glyph by glyph from the cache, instead of being laid out again
+         if (!_fixedFont || !background.isValid()
+             || !_glyphCache.drawText(painter, rect, _fontWidth, _drawTextAdditionHeight, text, background))
          {
             QRect drawRect(rect.topLeft(), rect.size());
             drawRect.setHeight(rect.height() + _drawTextAdditionHeight);
@@ -866,7 +980,8 @@ void TerminalDisplay::drawCharacters(QPainter& painter,
 void TerminalDisplay::drawTextFragment(QPainter& painter ,
                                        const QRect& rect,
                                        const std::wstring& text,
-                                       const Character* style)
+                                       const Character* style,
+                                       bool fillBackground)
 {
     painter.save();
 
@@ -875,7 +990,7 @@ void TerminalDisplay::drawTextFragment(QPainter& painter ,
     const QColor backgroundColor = style->backgroundColor.color(_colorTable);
 
     // draw background if different from the display's background color
-    if ( backgroundColor != palette().background().color() )
+    if ( fillBackground && backgroundColor != palette().background().color() )
         drawBackground(painter,rect,backgroundColor,
                        false /* do not use transparency */);
 
@@ -885,8 +1000,15 @@ void TerminalDisplay::drawTextFragment(QPainter& painter ,
     if ( style->rendition & RE_CURSOR )
         drawCursor(painter,rect,foregroundColor,backgroundColor,invertCharacterColor);
 
+    // the glyph cache draws opaque cells, which needs a solid background
+    // under the text.  the cursor may only cover part of the cell
+    const bool opaqueBackground = backgroundColor != palette().background().color()
+                                  || (_backgroundImage.isNull() && _opacity >= static_cast<qreal>(1));
+    const QColor textBackground = opaqueBackground && !(style->rendition & RE_CURSOR)
+                                  ? backgroundColor : QColor();
+
     // draw text
-    drawCharacters(painter,rect,text,style,invertCharacterColor);
+    drawCharacters(painter,rect,text,style,invertCharacterColor,textBackground);
 
     painter.restore();
 }
@@ -922,61 +1044,35 @@ void TerminalDisplay::setCursorPos(const int curx, const int cury)
 // display is much cheaper than re-rendering all the text for the
 // part of the image which has moved up or down.
 // Instead only new lines have to be drawn
+//
+// the lines are moved within _backingStore, which only holds the contents,
+// so any region of lines can be scrolled, such as the one between the margins
+// set with DECSTBM, wherever the scroll bar is and whatever is shown over the
+// display.  without a backing store the lines are drawn again by updateImage()
 void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
 {
-    // if the flow control warning is enabled this will interfere with the
-    // scrolling optimizations and cause artifacts.  the simple solution here
-    // is to just disable the optimization whilst it is visible
-    if ( _outputSuspendedLabel && _outputSuspendedLabel->isVisible() )
+    if ( lines == 0 || _image == nullptr || !useBackingStore() || _backingStore.isNull() )
+        return;
+
+    // QPixmap::scroll() works in device pixels, which only hold whole lines
+    // for integer scale factors
+    const qreal dpr = _backingStore.devicePixelRatio();
+    const int scale = qRound(dpr);
+    if ( dpr != scale )
         return;
 
     // constrain the region to the display
-    // the bottom of the region is capped to the number of lines in the display's
-    // internal image - 2, so that the height of 'region' is strictly less
-    // than the height of the internal image.
     QRect region = screenWindowRegion;
-    region.setBottom( qMin(region.bottom(),this->_lines-2) );
+    region.setTop( qMax(region.top(),0) );
+    region.setBottom( qMin(region.bottom(),this->_lines-1) );
 
     // return if there is nothing to do
-    if (    lines == 0
-         || _image == nullptr
-         || !region.isValid()
-         || (region.top() + abs(lines)) >= region.bottom()
-         || this->_lines <= region.height() ) return;
-
-    // hide terminal size label to prevent it being scrolled
-    if (_resizeWidget && _resizeWidget->isVisible())
-        _resizeWidget->hide();
-
-    // Note:  With Qt 4.4 the left edge of the scrolled area must be at 0
-    // to get the correct (newly exposed) part of the widget repainted.
-    //
-    // The right edge must be before the left edge of the scroll bar to
-    // avoid triggering a repaint of the entire widget, the distance is
-    // given by SCROLLBAR_CONTENT_GAP
-    //
-    // Set the QT_FLUSH_PAINT environment variable to '1' before starting the
-    // application to monitor repainting.
-    //
-    int scrollBarWidth = _scrollBar->isHidden() ? 0 :
-                         _scrollBar->style()->styleHint(QStyle::SH_ScrollBar_Transient, nullptr, _scrollBar) ?
-                         0 : _scrollBar->width();
-    const int SCROLLBAR_CONTENT_GAP = scrollBarWidth == 0 ? 0 : 1;
-    QRect scrollRect;
-    if ( _scrollbarLocation == QTermWidget::ScrollBarLeft )
-    {
-        scrollRect.setLeft(scrollBarWidth+SCROLLBAR_CONTENT_GAP);
-        scrollRect.setRight(width());
-    }
-    else
-    {
-        scrollRect.setLeft(0);
-        scrollRect.setRight(width() - scrollBarWidth - SCROLLBAR_CONTENT_GAP);
-    }
+    if ( !region.isValid() || abs(lines) >= region.height() )
+        return;
+
     void* firstCharPos = &_image[ region.top() * this->_columns ];
     void* lastCharPos = &_image[ (region.top() + abs(lines)) * this->_columns ];
 
-    int top = _topMargin + (region.top() * _fontHeight);
     int linesToMove = region.height() - abs(lines);
     int bytesToMove = linesToMove *
                       this->_columns *
@@ -989,35 +1085,51 @@ void TerminalDisplay::scrollImage(int lines , const QRect& screenWindowRegion)
     if ( lines > 0 )
     {
         // check that the memory areas that we are going to move are valid
-        Q_ASSERT( (char*)lastCharPos + bytesToMove <
+        Q_ASSERT( (char*)lastCharPos + bytesToMove <=
                   (char*)(_image + (this->_lines * this->_columns)) );
 
-        Q_ASSERT( (lines*this->_columns) < _imageSize );
-
         //scroll internal image down
         memmove( firstCharPos , lastCharPos , bytesToMove );
-
-        //set region of display to scroll
-        scrollRect.setTop(top);
     }
     else
     {
         // check that the memory areas that we are going to move are valid
-        Q_ASSERT( (char*)firstCharPos + bytesToMove <
+        Q_ASSERT( (char*)firstCharPos + bytesToMove <=
                   (char*)(_image + (this->_lines * this->_columns)) );
 
         //scroll internal image up
         memmove( lastCharPos , firstCharPos , bytesToMove );
+    }
 
-        //set region of the display to scroll
-        scrollRect.setTop(top + abs(lines) * _fontHeight);
+    // the copy with the highlights moves with it
+    if ( !_highlightedImage.isEmpty() )
+    {
+        Character* first = _highlightedImage.data() + region.top() * this->_columns;
+        Character* last = _highlightedImage.data() + (region.top() + abs(lines)) * this->_columns;
+        if ( lines > 0 )
+            memmove( (void*)first , (const void*)last , bytesToMove );
+        else
+            memmove( (void*)last , (const void*)first , bytesToMove );
     }
-    scrollRect.setHeight(linesToMove * _fontHeight );
 
-    Q_ASSERT(scrollRect.isValid() && !scrollRect.isEmpty());
+    // the lines are moved across the whole width, so that the contents under
+    // a transient scroll bar move with them
+    const QRect strip( 0, _topMargin + region.top() * _fontHeight,
+                       width(), region.height() * _fontHeight );
+    const int dy = -lines * _fontHeight;
+    const int exposedHeight = abs(lines) * _fontHeight;
+    const QRect exposed( 0, lines > 0 ? strip.bottom() + 1 - exposedHeight : strip.top(),
+                         width(), exposedHeight );
+
+    _backingStore.scroll( 0, dy * scale,
+                          QRect(strip.topLeft() * scale, strip.size() * scale) );
+
+    // the parts of the strip which were still to be drawn have moved as well
+    const QRegion dirtyStrip = _backingStoreDirty & strip;
+    _backingStoreDirty -= strip;
+    _backingStoreDirty |= (dirtyStrip.translated(0, dy) & strip) | exposed;
 
-    //scroll the display vertically to match internal _image
-    scroll( 0 , _fontHeight * (-lines) , scrollRect );
+    update( strip & contentsRect() );
 }
 
 QRegion TerminalDisplay::hotSpotRegion() const
@@ -1061,6 +1173,9 @@ void TerminalDisplay::processFilters()
     if (!_screenWindow)
         return;
 
+    _filtersPending = false;
+    _filterTimer->stop();
+
     QRegion preUpdateHotSpots = hotSpotRegion();
 
     // use _screenWindow->getImage() here rather than _image because
@@ -1068,15 +1183,17 @@ void TerminalDisplay::processFilters()
     // ScreenWindow emits a scrolled() signal - which will happen before
     // updateImage() is called on the display and therefore _image is
     // out of date at this point
-    _filterChain->setImage( _screenWindow->getImage(),
+    const Character* image = _screenWindow->getImage();
+    _filterChain->setImage( image,
                             _screenWindow->windowLines(),
                             _screenWindow->windowColumns(),
                             _screenWindow->getLineProperties() );
     _filterChain->process();
+    updateHighlightedImage( image, _screenWindow->windowColumns() );
 
     QRegion postUpdateHotSpots = hotSpotRegion();
 
-    update( preUpdateHotSpots | postUpdateHotSpots );
+    invalidate( preUpdateHotSpots | postUpdateHotSpots );
 }
 
 void TerminalDisplay::updateImage()
@@ -1084,13 +1201,44 @@ void TerminalDisplay::updateImage()
   if ( !_screenWindow )
       return;
 
+  // while the display is hidden only the screen window follows the output,
+  // the image is brought up to date once when it is shown again
+  if ( !isVisible() )
+  {
+      _hiddenUpdatePending = true;
+      return;
+  }
+
+  // the output which the emulation held back is delivered as the display is
+  // shown, together with the line properties and filters, so there is
+  // nothing left for catchUpHiddenUpdates() to do
+  _hiddenUpdatePending = false;
+
   // optimization - scroll the existing image where possible and
   // avoid expensive text drawing for parts of the image that
   // can simply be moved up or down
-  scrollImage( _screenWindow->scrollCount() ,
-               _screenWindow->scrollRegion() );
+  //
+  // the OpenGL view draws the whole image anyway, _image is only kept up to
+  // date for the selection and the input method
+  const int scrollCount = _screenWindow->scrollCount();
+  if (!_glView)
+      scrollImage( scrollCount ,
+                   _screenWindow->scrollRegion() );
+
+  // the highlights move with their text until the filters run again.  If the
+  // filters ran on the scrolled window already, the copy of _image with the
+  // highlights has to be laid out again
+  scrollHighlightSpans( scrollCount - _highlightScrollCount ,
+                        _screenWindow->scrollRegion() );
+  const bool updateAllHighlightedLines = _highlightScrollCount != 0;
+  _highlightScrollCount = 0;
   _screenWindow->resetScrollCount();
 
+  // lines which the screen window reports as unchanged are still the same
+  // in _image, unless _image was rebuilt or scrolled since
+  const bool updateAllLines = _imageNeedsFullUpdate || scrollCount != 0;
+  _imageNeedsFullUpdate = false;
+
   if (!_image) {
      // Create _image.
      // The emitted changedContentSizeSignal also leads to getImage being recreated, so do this first.
@@ -1111,7 +1259,11 @@ void TerminalDisplay::updateImage()
   QPoint tL  = contentsRect().topLeft();
   int    tLx = tL.x();
   int    tLy = tL.y();
-  _hasBlinker = false;
+
+  // blinking characters on lines which are skipped are not seen, so the
+  // blink timer may keep running until the next full update
+  if (updateAllLines)
+    _hasBlinker = false;
 
   CharacterColor cf;       // undefined
   CharacterColor _clipboard;       // undefined
@@ -1131,6 +1283,11 @@ void TerminalDisplay::updateImage()
 
   for (y = 0; y < linesToUpdate; ++y)
   {
+    // double height lines are repainted regardless, see below
+    if (!updateAllLines && !_screenWindow->isLineDirty(y) &&
+        !(_lineProperties.value(y) & LINE_DOUBLEHEIGHT))
+        continue;
+
     const Character*       currentLine = &_image[y*this->_columns];
     const Character* const newLine = &newimg[y*columns];
 
@@ -1141,11 +1298,13 @@ void TerminalDisplay::updateImage()
     // its cell boundaries
     memset(dirtyMask, 0, columnsToUpdate+2);
 
+    bool lineChanged = false;
     for( x = 0 ; x < columnsToUpdate ; ++x)
     {
         if ( newLine[x] != currentLine[x] )
         {
             dirtyMask[x] = true;
+            lineChanged = true;
         }
     }
 
@@ -1232,6 +1391,15 @@ void TerminalDisplay::updateImage()
     // replace the line of characters in the old _image with the
     // current line of the new _image
     memcpy((void*)currentLine,(const void*)newLine,columnsToUpdate*sizeof(Character));
+
+    if (lineChanged && !updateAllHighlightedLines)
+        updateHighlightedLine(y);
+  }
+
+  if (updateAllHighlightedLines)
+  {
+    for (y = 0; y < this->_lines; ++y)
+        updateHighlightedLine(y);
   }
 
   // if the new _image is smaller than the previous _image, then ensure that the area
@@ -1257,7 +1425,10 @@ void TerminalDisplay::updateImage()
   dirtyRegion |= _inputMethodData.previousPreeditRect;
 
   // update the parts of the display which have changed
-  update(dirtyRegion);
+  if (!_glView)
+      invalidate(dirtyRegion);
+
+  _screenWindow->resetDirtyLines();
 
   if ( _hasBlinker && !_blinkTimer->isActive()) _blinkTimer->start( TEXT_BLINK_DELAY );
   if (!_hasBlinker && _blinkTimer->isActive()) { _blinkTimer->stop(); _blinking = false; }
@@ -1357,6 +1528,14 @@ void TerminalDisplay::focusInEvent(QFocusEvent*)
 
 void TerminalDisplay::paintEvent( QPaintEvent* pe )
 {
+  // once shown with a size, the view has tried to create its context, and
+  // without one it draws nothing
+  if (_glView && _glView->isVisible() && !_glView->size().isEmpty() && !_glView->isValid())
+  {
+      qWarning() << "The OpenGL view has no context, the terminal is drawn without OpenGL";
+      fallBackToRasterBackend();
+  }
+
   QPainter paint(this);
   QRect cr = contentsRect();
 
@@ -1444,17 +1623,86 @@ void TerminalDisplay::paintEvent( QPaintEvent* pe )
   if(_drawTextTestFlag)
   {
     calDrawTextAdditionHeight(paint);
+    updateGLViewGeometry();
   }
 
   const auto rects = (pe->region() & cr).rects();
+  if (useBackingStore())
+  {
+    paintBackingStore();
+
+    const qreal dpr = _backingStore.devicePixelRatio();
+    for (const QRect &rect : rects)
+    {
+      paint.drawPixmap(rect.topLeft(), _backingStore,
+                       QRectF(QPointF(rect.topLeft()) * dpr, QSizeF(rect.size()) * dpr));
+    }
+  }
+  else
+  {
+    // the backing store is drawn from scratch once it is used again
+    _backingStore = QPixmap();
+    _backingStoreDirty = QRegion();
+
+    for (const QRect &rect : rects)
+    {
+      drawBackground(paint,rect,palette().background().color(),
+                     true /* use opacity setting */);
+      if (!_glView)
+      {
+          drawCellBackgrounds(paint, rect);
+          drawContents(paint, rect);
+      }
+    }
+  }
+  drawInputMethodPreeditString(paint,preeditRect());
+  paintFilters(paint);
+  paintSearchMatches(paint);
+}
+
+bool TerminalDisplay::useBackingStore() const
+{
+  // a background image or a translucent background has to be blended with
+  // the contents on every paint
+  return !_glView && _backgroundImage.isNull() && _opacity >= static_cast<qreal>(1);
+}
+
+void TerminalDisplay::paintBackingStore()
+{
+  const qreal dpr = devicePixelRatioF();
+  const QSize pixelSize = size() * dpr;
+  if (_backingStore.size() != pixelSize || _backingStore.devicePixelRatio() != dpr)
+  {
+    _backingStore = QPixmap(pixelSize);
+    _backingStore.setDevicePixelRatio(dpr);
+    _backingStoreDirty = rect();
+  }
+
+  const QRegion dirty = _backingStoreDirty & contentsRect();
+  _backingStoreDirty = QRegion();
+  if (dirty.isEmpty())
+    return;
+
+  QPainter paint(&_backingStore);
+  paint.setClipRegion(dirty);
+  paint.setFont(font());
+  paint.setPen(palette().color(foregroundRole()));
+  paint.setLayoutDirection(layoutDirection());
+
+  const auto rects = dirty.rects();
   for (const QRect &rect : rects)
   {
     drawBackground(paint,rect,palette().background().color(),
                    true /* use opacity setting */);
+    drawCellBackgrounds(paint, rect);
     drawContents(paint, rect);
   }
-  drawInputMethodPreeditString(paint,preeditRect());
-  paintFilters(paint);
+}
+
+void TerminalDisplay::invalidate(const QRegion& region)
+{
+  _backingStoreDirty |= region;
+  update(region);
 }
 
 QPoint TerminalDisplay::cursorPosition() const
@@ -1502,8 +1750,109 @@ FilterChain* TerminalDisplay::filterChain() const
     return _filterChain;
 }
 
+void TerminalDisplay::setFilterUpdateMode(QTermWidget::FilterUpdateMode mode)
+{
+    _filterUpdateMode = mode;
+
+    if (mode == QTermWidget::ImmediateFilterUpdates)
+        processPendingFilters();
+}
+
+void TerminalDisplay::processPendingFilters()
+{
+    if (_filtersPending)
+        processFilters();
+}
+
+void TerminalDisplay::addSearchMatches(const QVector<SearchMatch>& matches)
+{
+    if (matches.isEmpty())
+        return;
+
+    _searchMatches += matches;
+    update();
+    _searchMatchMarks->update();
+}
+
+void TerminalDisplay::clearSearchMatches()
+{
+    if (_searchMatches.isEmpty())
+        return;
+
+    _searchMatches.clear();
+    update();
+    _searchMatchMarks->update();
+}
+
+void TerminalDisplay::dropSearchMatchLines(int lines)
+{
+    if (_searchMatches.isEmpty() || lines <= 0)
+        return;
+
+    // the matches are in the order of their positions, so the dropped ones
+    // are at the front
+    int dropped = 0;
+    while (dropped < _searchMatches.size() && _searchMatches.at(dropped).start.y() < lines)
+        dropped++;
+    _searchMatches.remove(0, dropped);
+
+    for (SearchMatch& match : _searchMatches)
+    {
+        match.start.ry() -= lines;
+        match.end.ry() -= lines;
+    }
+
+    update();
+    _searchMatchMarks->update();
+}
+
+const QVector<TerminalDisplay::SearchMatch>& TerminalDisplay::searchMatches() const
+{
+    return _searchMatches;
+}
+
+void TerminalDisplay::paintSearchMatches(QPainter& painter)
+{
+    if (_searchMatches.isEmpty() || !_screenWindow)
+        return;
+
+    const int firstLine = _screenWindow->currentLine();
+    const int lastLine = firstLine + _lines - 1;
+    const int leftMargin = _leftBaseMargin
+                           + ((_scrollbarLocation == QTermWidget::ScrollBarLeft
+                               && !_scrollBar->style()->styleHint(QStyle::SH_ScrollBar_Transient, nullptr, _scrollBar))
+                              ? _scrollBar->width() : 0);
+    const QColor color = QColor::fromRgba(SEARCH_MATCH_COLOR);
+
+    // the matches neither overlap nor go out of order, so their ends are
+    // sorted as well, and the first visible match can be looked up directly
+    QVector<SearchMatch>::const_iterator match =
+        std::lower_bound(_searchMatches.constBegin(), _searchMatches.constEnd(), firstLine,
+                         [](const SearchMatch& m, int line) { return m.end.y() < line; });
+
+    for (; match != _searchMatches.constEnd() && match->start.y() <= lastLine; ++match)
+    {
+        const int matchLastLine = qMin(match->end.y(), lastLine);
+        for (int line = qMax(match->start.y(), firstLine); line <= matchLastLine; line++)
+        {
+            const int startColumn = line == match->start.y() ? match->start.x() : 0;
+            const int endColumn = line == match->end.y() ? match->end.x() + 1 : _columns;
+            const int y = line - firstLine;
+
+            QRect r;
+            r.setCoords( startColumn*_fontWidth + leftMargin,
+                         y*_fontHeight + _topBaseMargin,
+                         endColumn*_fontWidth - 1 + leftMargin,
+                         (y+1)*_fontHeight - 1 + _topBaseMargin );
+            painter.fillRect(r, color);
+        }
+    }
+}
+
 void TerminalDisplay::paintFilters(QPainter& painter)
 {
+    // until the deferred update runs, the hotspots of the last one are
+    // painted, processFilters() repaints them once it has
     // get color of character under mouse and use it to draw
     // lines for filters
     QPoint cursorPos = mapFromGlobal(QCursor::pos());
@@ -1618,6 +1967,115 @@ void TerminalDisplay::paintFilters(QPainter& painter)
     }
 }
 
+void TerminalDisplay::updateHighlightedImage(const Character* image, int columns)
+{
+    _highlightSpans.clear();
+    _highlightedImage.clear();
+    _highlightScrollCount = _screenWindow ? _screenWindow->scrollCount() : 0;
+
+    if (!_image)
+        return;
+
+    const auto spots = _filterChain->hotSpots();
+    for (Filter::HotSpot* const spot : spots)
+    {
+        if (spot->type() != Filter::HotSpot::Highlight)
+            continue;
+
+        const HighlightFilter::Rule& rule = static_cast<HighlightFilter::HotSpot*>(spot)->rule();
+
+        HighlightSpan span;
+        span.foreground = CharacterColor(COLOR_SPACE_RGB, rule.foreground.rgb() & 0xffffff);
+        span.background = CharacterColor(COLOR_SPACE_RGB, rule.background.rgb() & 0xffffff);
+        span.hasForeground = rule.foreground.isValid();
+        span.hasBackground = rule.background.isValid();
+        span.rendition = (rule.bold ? RE_BOLD : 0)
+                       | (rule.italic ? RE_ITALIC : 0)
+                       | (rule.underline ? RE_UNDERLINE : 0);
+
+        const int lastColumn = qMin(columns, _columns);
+        for (int line = spot->startLine(); line <= spot->endLine() && line < _lines; line++)
+        {
+            span.line = line;
+            span.startColumn = line == spot->startLine() ? spot->startColumn() : 0;
+            span.endColumn = line == spot->endLine() ? qMin(spot->endColumn(), lastColumn) : lastColumn;
+            if (span.startColumn >= span.endColumn)
+                continue;
+
+            span.text.resize(span.endColumn - span.startColumn);
+            for (int column = span.startColumn; column < span.endColumn; column++)
+                span.text[column - span.startColumn] = image[line * columns + column].character;
+            _highlightSpans.append(span);
+        }
+    }
+
+    if (_highlightSpans.isEmpty())
+        return;
+
+    _highlightedImage.resize(_imageSize + 1);
+    _highlightedImage[_imageSize] = _image[_imageSize];
+    for (int line = 0; line < _lines; line++)
+        updateHighlightedLine(line);
+}
+
+void TerminalDisplay::updateHighlightedLine(int line)
+{
+    if (_highlightSpans.isEmpty())
+        return;
+
+    Character* const highlighted = _highlightedImage.data() + loc(0,line);
+    const Character* const plain = _image + loc(0,line);
+    std::copy(plain, plain + _columns, highlighted);
+
+    for (const HighlightSpan& span : qAsConst(_highlightSpans))
+    {
+        if (span.line != line)
+            continue;
+
+        // the span is left out while other text is at its place, until the
+        // filters run again
+        bool textMatches = true;
+        for (int column = span.startColumn; column < span.endColumn && textMatches; column++)
+            textMatches = plain[column].character == span.text.at(column - span.startColumn);
+        if (!textMatches)
+            continue;
+
+        for (int column = span.startColumn; column < span.endColumn; column++)
+        {
+            Character& character = highlighted[column];
+            if (span.hasForeground)
+                character.foregroundColor = span.foreground;
+            if (span.hasBackground)
+                character.backgroundColor = span.background;
+            character.rendition |= span.rendition;
+        }
+    }
+}
+
+void TerminalDisplay::scrollHighlightSpans(int lines, const QRect& region)
+{
+    if (lines == 0 || _highlightSpans.isEmpty())
+        return;
+
+    // the same part of the image as in scrollImage()
+    const int top = qMax(region.top(), 0);
+    const int bottom = qMin(region.bottom(), _lines - 1);
+
+    for (int i = _highlightSpans.size() - 1; i >= 0; i--)
+    {
+        HighlightSpan& span = _highlightSpans[i];
+        if (span.line < top || span.line > bottom)
+            continue;
+
+        span.line -= lines;
+        if (span.line < top || span.line > bottom)
+            _highlightSpans.remove(i);
+    }
+
+    if (_highlightSpans.isEmpty())
+        _highlightedImage.clear();
+}
+
 int TerminalDisplay::textWidth(const int startColumn, const int length, const int line) const
 {
   QFontMetrics fm(font());
@@ -1638,6 +2096,89 @@ QRect TerminalDisplay::calculateTextArea(int topLeftX, int topLeftY, int startCo
                _fontHeight};
 }
 
+namespace
+{
+// a rectangle of cells with the same background, see drawCellBackgrounds()
+struct BackgroundSpan
+{
+    int left;
+    int right;
+    int top;
+    QColor color;
+};
+}
+
+void TerminalDisplay::drawCellBackgrounds(QPainter &paint, const QRect &rect)
+{
+  QPoint tL  = contentsRect().topLeft();
+  int    tLx = tL.x();
+  int    tLy = tL.y();
+
+  int lux = qMin(_usedColumns-1, qMax(0,(rect.left()   - tLx - _leftMargin ) / _fontWidth));
+  int luy = qMin(_usedLines-1,   qMax(0,(rect.top()    - tLy - _topMargin  ) / _fontHeight));
+  int rlx = qMin(_usedColumns-1, qMax(0,(rect.right()  - tLx - _leftMargin ) / _fontWidth));
+  int rly = qMin(_usedLines-1,   qMax(0,(rect.bottom() - tLy - _topMargin  ) / _fontHeight));
+
+  const Character* const image = _highlightedImage.isEmpty() ? _image : _highlightedImage.constData();
+  const QColor displayBackground = palette().background().color();
+
+  // the spans of the previous lines which may go on, and those of the
+  // current line, both ordered by column
+  QVector<BackgroundSpan> open;
+  QVector<BackgroundSpan> current;
+
+  auto fill = [&](const BackgroundSpan& span, int bottom) {
+      QRect area = calculateTextArea(tLx, tLy, span.left, span.top, span.right - span.left + 1);
+      area.setHeight(_fontHeight * (bottom - span.top + 1));
+      drawBackground(paint, area, span.color, false /* do not use transparency */);
+  };
+
+  for (int y = luy; y <= rly; y++)
+  {
+    current.clear();
+
+    // scaled lines fill their backgrounds along with the text
+    const bool scaled = y < _lineProperties.size()
+                        && (_lineProperties[y] & (LINE_DOUBLEWIDTH | LINE_DOUBLEHEIGHT));
+    if (!scaled)
+    {
+      int x = lux;
+      while (x <= rlx)
+      {
+        const CharacterColor& background = image[loc(x,y)].backgroundColor;
+        int end = x;
+        while (end < rlx && image[loc(end+1,y)].backgroundColor == background)
+          end++;
+
+        const QColor color = background.color(_colorTable);
+        if (color != displayBackground)
+          current.append({x, end, y, color});
+
+        x = end + 1;
+      }
+    }
+
+    // carry on the spans of the previous line which match one of this line.
+    // with a variable pitch font the columns of two lines do not line up
+    int i = 0;
+    for (BackgroundSpan& span : current)
+    {
+      while (i < open.size() && open[i].left < span.left)
+        fill(open[i++], y - 1);
+      if (_fixedFont && i < open.size() && open[i].left == span.left
+          && open[i].right == span.right && open[i].color == span.color)
+        span.top = open[i++].top;
+    }
+    while (i < open.size())
+      fill(open[i++], y - 1);
+
+    open.swap(current);
+  }
+
+  for (const BackgroundSpan& span : qAsConst(open))
+    fill(span, rly);
+}
+
 void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
 {
   QPoint tL  = contentsRect().topLeft();
@@ -1649,12 +2190,14 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
   int rlx = qMin(_usedColumns-1, qMax(0,(rect.right()  - tLx - _leftMargin ) / _fontWidth));
   int rly = qMin(_usedLines-1,   qMax(0,(rect.bottom() - tLy - _topMargin  ) / _fontHeight));
 
+  const Character* const image = _highlightedImage.isEmpty() ? _image : _highlightedImage.constData();
+
   const int bufferSize = _usedColumns;
   std::wstring unistr;
   unistr.reserve(bufferSize);
   for (int y = luy; y <= rly; y++)
   {
-    quint32 c = _image[loc(lux,y)].character;
+    quint32 c = image[loc(lux,y)].character;
     int x = lux;
     if(!c && x)
       x--; // Search for start of multi-column character
@@ -1667,12 +2210,12 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
       unistr.resize(bufferSize);
 
       // is this a single character or a sequence of characters ?
-      if ( _image[loc(x,y)].rendition & RE_EXTENDED_CHAR )
+      if ( image[loc(x,y)].rendition & RE_EXTENDED_CHAR )
       {
         // sequence of characters
         ushort extendedCharLength = 0;
         ushort* chars = ExtendedCharTable::instance
-                            .lookupExtendedChar(_image[loc(x,y)].charSequence,extendedCharLength);
+                            .lookupExtendedChar(image[loc(x,y)].charSequence,extendedCharLength);
         for ( int index = 0 ; index < extendedCharLength ; index++ )
         {
             Q_ASSERT( p < bufferSize );
@@ -1682,7 +2225,7 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
       else
       {
         // single character
-        c = _image[loc(x,y)].character;
+        c = image[loc(x,y)].character;
         if (c)
         {
              Q_ASSERT( p < bufferSize );
@@ -1691,25 +2234,25 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
       }
 
       bool lineDraw = isLineChar(c);
-      bool doubleWidth = (_image[ qMin(loc(x,y)+1,_imageSize) ].character == 0);
-      CharacterColor currentForeground = _image[loc(x,y)].foregroundColor;
-      CharacterColor currentBackground = _image[loc(x,y)].backgroundColor;
-      quint8 currentRendition = _image[loc(x,y)].rendition;
+      bool doubleWidth = (image[ qMin(loc(x,y)+1,_imageSize) ].character == 0);
+      CharacterColor currentForeground = image[loc(x,y)].foregroundColor;
+      CharacterColor currentBackground = image[loc(x,y)].backgroundColor;
+      quint16 currentRendition = image[loc(x,y)].rendition;
 
       while (x+len <= rlx &&
-             _image[loc(x+len,y)].foregroundColor == currentForeground &&
-             _image[loc(x+len,y)].backgroundColor == currentBackground &&
-             _image[loc(x+len,y)].rendition == currentRendition &&
-             (_image[ qMin(loc(x+len,y)+1,_imageSize) ].character == 0) == doubleWidth &&
-             isLineChar( c = _image[loc(x+len,y)].character) == lineDraw) // Assignment!
+             image[loc(x+len,y)].foregroundColor == currentForeground &&
+             image[loc(x+len,y)].backgroundColor == currentBackground &&
+             image[loc(x+len,y)].rendition == currentRendition &&
+             (image[ qMin(loc(x+len,y)+1,_imageSize) ].character == 0) == doubleWidth &&
+             isLineChar( c = image[loc(x+len,y)].character) == lineDraw) // Assignment!
       {
         if (c)
           unistr[p++] = c; //fontMap(c);
-        if (doubleWidth) // assert((_image[loc(x+len,y)+1].character == 0)), see above if condition
+        if (doubleWidth) // assert((image[loc(x+len,y)+1].character == 0)), see above if condition
           len++; // Skip trailing part of multi-column character
         len++;
       }
-      if ((x+len < _usedColumns) && (!_image[loc(x+len,y)].character))
+      if ((x+len < _usedColumns) && (!image[loc(x+len,y)].character))
         len++; // Adjust for trailing part of multi-column character
 
             bool save__fixedFont = _fixedFont;
@@ -1743,11 +2286,13 @@ void TerminalDisplay::drawContents(QPainter &paint, const QRect &rect)
          //(instead of textArea.topLeft() * painter-scale)
          textArea.moveTopLeft( textScale.inverted().map(textArea.topLeft()) );
 
-         //paint text fragment
+         //paint text fragment, the backgrounds of scaled lines are not
+         //drawn by drawCellBackgrounds()
          drawTextFragment(    paint,
                             textArea,
                             unistr,
-                            &_image[loc(x,y)] ); //,
+                            &image[loc(x,y)],
+                            !textScale.isIdentity() ); //,
                             //0,
                             //!_isPrinting );
 
@@ -1781,7 +2326,7 @@ void TerminalDisplay::blinkEvent()
   //TODO:  Optimize to only repaint the areas of the widget
   // where there is blinking text
   // rather than repainting the whole widget.
-  update();
+  invalidate(rect());
 }
 
 QRect TerminalDisplay::imageToWidget(const QRect& imageArea) const
@@ -1797,8 +2342,14 @@ QRect TerminalDisplay::imageToWidget(const QRect& imageArea) const
 
 void TerminalDisplay::updateCursor()
 {
+  if (_glView)
+  {
+      _glView->setCursorShown(!_cursorBlinking);
+      return;
+  }
+
   QRect cursorRect = imageToWidget( QRect(cursorPosition(),QSize(1,1)) );
-  update(cursorRect);
+  invalidate(cursorRect);
 }
 
 void TerminalDisplay::blinkCursorEvent()
@@ -1876,13 +2427,61 @@ void TerminalDisplay::updateImageSize()
 //the same signal as the one for a content size change
 void TerminalDisplay::showEvent(QShowEvent*)
 {
+    // the emulation shows the output it held back while the display was
+    // hidden straight away, in which case updateImage() has caught up already
+    updateScreenWindowPresentation(true);
+    catchUpHiddenUpdates();
     emit changedContentSizeSignal(_contentHeight,_contentWidth);
 }
 void TerminalDisplay::hideEvent(QHideEvent*)
 {
+    updateScreenWindowPresentation(false);
+
+    // the filters are processed when the display is shown again
+    if (_filtersPending)
+    {
+        _filterTimer->stop();
+        _hiddenUpdatePending = true;
+    }
+
     emit changedContentSizeSignal(_contentHeight,_contentWidth);
 }
 
+void TerminalDisplay::catchUpHiddenUpdates()
+{
+    if (!_hiddenUpdatePending || !_screenWindow)
+        return;
+
+    _hiddenUpdatePending = false;
+
+    // the widget is repainted as a whole when it is shown, so there is no
+    // point in scrolling the old image
+    _screenWindow->resetScrollCount();
+    _imageNeedsFullUpdate = true;
+
+    updateLineProperties();
+    updateImage();
+    processFilters();
+}
+
+// the emulation paces the updates of the window by the refresh rate of the
+// screen the display is shown on, and stops them while the display is hidden
+void TerminalDisplay::updateScreenWindowPresentation(bool visible)
+{
+    if (!_screenWindow)
+        return;
+
+    QScreen* screen = nullptr;
+    if (window()->windowHandle())
+        screen = window()->windowHandle()->screen();
+    if (!screen)
+        screen = QGuiApplication::primaryScreen();
+    if (screen)
+        _screenWindow->setRefreshRate(screen->refreshRate());
+
+    _screenWindow->setVisible(visible);
+}
+
 /* ------------------------------------------------------------------------- */
 /*                                                                           */
 /*                                Scrollbar                                  */
@@ -1952,11 +2551,13 @@ void TerminalDisplay::setScrollBarPosition(QTermWidget::ScrollBarPosition positi
   _scrollbarLocation = position;
 
   propagateSize();
-  update();
+  invalidate(rect());
 }
 
 void TerminalDisplay::mousePressEvent(QMouseEvent* ev)
 {
+  processPendingFilters();
+
   if ( _possibleTripleClick && (ev->button()==Qt::LeftButton) ) {
     mouseTripleClickEvent(ev);
     return;
@@ -2039,6 +2640,7 @@ QList<QAction*> TerminalDisplay::filterActions(const QPoint& position)
   int charLine, charColumn;
   getCharacterPosition(position,charLine,charColumn);
 
+  processPendingFilters();
   Filter::HotSpot* spot = _filterChain->hotSpotAt(charLine,charColumn);
 
   return spot ? spot->actions() : QList<QAction*>();
@@ -2057,6 +2659,7 @@ void TerminalDisplay::mouseMoveEvent(QMouseEvent* ev)
 
   // handle filters
   // change link hot-spot appearance on mouse-over
+  processPendingFilters();
   Filter::HotSpot* spot = _filterChain->hotSpotAt(charLine,charColumn);
   if ( spot && spot->type() == Filter::HotSpot::Link)
   {
@@ -2450,7 +3053,29 @@ void TerminalDisplay::updateFilters()
     if ( !_screenWindow )
         return;
 
-    processFilters();
+    if ( !isVisible() )
+    {
+        _hiddenUpdatePending = true;
+        return;
+    }
+
+    if ( _filterUpdateMode == QTermWidget::ImmediateFilterUpdates )
+    {
+        processFilters();
+        return;
+    }
+
+    // wait until the output has been idle for FILTER_IDLE_DELAY, but not for
+    // longer than FILTER_MAX_DELAY since the first change, so that bursts of
+    // output are filtered a few times per second rather than on every update
+    if ( !_filtersPending )
+    {
+        _filtersPending = true;
+        _filterDelay.start();
+    }
+
+    const int remaining = FILTER_MAX_DELAY - static_cast<int>(_filterDelay.elapsed());
+    _filterTimer->start(qBound(0, remaining, FILTER_IDLE_DELAY));
 }
 
 void TerminalDisplay::updateLineProperties()
@@ -2458,6 +3083,12 @@ void TerminalDisplay::updateLineProperties()
     if ( !_screenWindow )
         return;
 
+    if ( !isVisible() )
+    {
+        _hiddenUpdatePending = true;
+        return;
+    }
+
     _lineProperties = _screenWindow->getLineProperties();
 }
 
@@ -3046,7 +3677,9 @@ void TerminalDisplay::swapColorTable()
   _colorTable[1]=_colorTable[0];
   _colorTable[0]= color;
   _colorsInverted = !_colorsInverted;
-  update();
+  if (_glView)
+      _glView->setColorTable(_colorTable);
+  invalidate(rect());
 }
 
 void TerminalDisplay::clearImage()
@@ -3066,6 +3699,7 @@ void TerminalDisplay::clearImage()
 void TerminalDisplay::calcGeometry()
 {
   _scrollBar->resize(_scrollBar->sizeHint().width(), contentsRect().height());
+  _searchMatchMarks->resize(_scrollBar->size());
   int scrollBarWidth = _scrollBar->style()->styleHint(QStyle::SH_ScrollBar_Transient, nullptr, _scrollBar)
                        ? 0 : _scrollBar->width();
   switch(_scrollbarLocation)
@@ -3099,6 +3733,75 @@ void TerminalDisplay::calcGeometry()
      _lines = qMax(1,_contentHeight / _fontHeight);
      _usedLines = qMin(_usedLines,_lines);
   }
+
+  updateGLViewGeometry();
+}
+
+void TerminalDisplay::updateGLViewGeometry()
+{
+  if (!_glView)
+      return;
+
+  // the view covers the content area and its margins, but not the scroll bar
+  const QRect cr = contentsRect();
+  _glView->setGeometry(cr.left() + _leftMargin - _leftBaseMargin, cr.top(),
+                       _contentWidth + 2 * _leftBaseMargin, cr.height());
+  _glView->setCellGeometry(font(), _fontWidth, _fontHeight, _drawTextAdditionHeight,
+                           QPoint(_leftBaseMargin, _topMargin));
+}
+
+void TerminalDisplay::setRenderBackend(QTermWidget::RenderBackend backend)
+{
+  if (backend == renderBackend())
+      return;
+
+  if (backend == QTermWidget::OpenGLBackend)
+  {
+      // QOpenGLWidget does not call initializeGL() at all if it cannot
+      // create a context, so that is tried out first
+      QOpenGLContext testContext;
+      if (!testContext.create())
+      {
+          qWarning() << "Cannot create an OpenGL context, the terminal is drawn without OpenGL";
+          return;
+      }
+
+      _glView = new TerminalGLView(this);
+      connect(_glView, SIGNAL(initializationFailed()), this, SLOT(fallBackToRasterBackend()));
+      _glView->setColorTable(_colorTable);
+      _glView->setScreenWindow(_screenWindow);
+      updateGLViewGeometry();
+      // keep the labels and the scroll bar above the view
+      _glView->lower();
+      _glView->show();
+  }
+  else
+  {
+      delete _glView;
+      _glView = nullptr;
+  }
+
+  // the raster backend starts over from a blank widget
+  _imageNeedsFullUpdate = true;
+  invalidate(rect());
+}
+
+QTermWidget::RenderBackend TerminalDisplay::renderBackend() const
+{
+  return _glView ? QTermWidget::OpenGLBackend : QTermWidget::RasterBackend;
+}
+
+void TerminalDisplay::fallBackToRasterBackend()
+{
+  if (!_glView)
+      return;
+
+  // the view is in the middle of initializing
+  _glView->deleteLater();
+  _glView = nullptr;
+
+  _imageNeedsFullUpdate = true;
+  invalidate(rect());
 }
 
 void TerminalDisplay::makeImage()
@@ -3115,8 +3818,11 @@ void TerminalDisplay::makeImage()
   // We over-commit one character so that we can be more relaxed in dealing with
   // certain boundary conditions: _image[_imageSize] is a valid but unused position
   _image = new Character[_imageSize+1];
+  _highlightSpans.clear();
+  _highlightedImage.clear();
 
   clearImage();
+  _imageNeedsFullUpdate = true;
 }
 
 // calculate the needed size, this must be synced with calcGeometry()
@@ -23,12 +23,15 @@
 
 // Qt
 #include <QColor>
+#include <QElapsedTimer>
 #include <QPointer>
+#include <QVector>
 #include <QWidget>
 
 // Konsole
 #include "Filter.h"
 #include "Character.h"
+#include "GlyphCache.h"
 #include "qtermwidget.h"
 //#include "konsole_export.h"
 #define KONSOLEPRIVATE_EXPORT
@@ -73,6 +76,8 @@ namespace Konsole
 extern unsigned short vt100_graphics[32];
 
 class ScreenWindow;
+class TerminalGLView;
+class SearchMatchMarks;
 
 /**
  * A widget which displays output from a terminal emulation and sends input keypresses and mouse activity
@@ -122,6 +127,20 @@ public:
      */
     void setScrollBarPosition(QTermWidget::ScrollBarPosition position);
 
+    /**
+     * Sets how the display is drawn.  With QTermWidget::OpenGLBackend the text
+     * is drawn by a TerminalGLView which covers the content area of the display.
+     */
+    void setRenderBackend(QTermWidget::RenderBackend backend);
+    /** Returns how the display is drawn.  See setRenderBackend() */
+    QTermWidget::RenderBackend renderBackend() const;
+
+    /**
+     * Returns the number of rectangles filled with a background color since
+     * the display was created, to measure the cost of painting.
+     */
+    quint64 fillRectCount() const { return _fillRectCount; }
+
     /**
      * Sets the current position and range of the display's scroll bar.
      *
@@ -148,6 +167,20 @@ public:
      */
     FilterChain* filterChain() const;
 
+    /**
+     * Sets when the filters run after the output has changed.  The default is
+     * QTermWidget::DeferredFilterUpdates.
+     */
+    void setFilterUpdateMode(QTermWidget::FilterUpdateMode mode);
+    /** Returns when the filters run after the output has changed.  See setFilterUpdateMode() */
+    QTermWidget::FilterUpdateMode filterUpdateMode() const { return _filterUpdateMode; }
+
+    /**
+     * Runs the filters now if an update of them has been deferred, so that
+     * the hotspots of filterChain() match the current image.
+     */
+    void processPendingFilters();
+
     /**
      * Updates the filters in the display's filter chain.  This will cause
      * the hotspots to be updated to match the current image.
@@ -164,6 +197,36 @@ public:
      */
     void processFilters();
 
+    /**
+     * A piece of text highlighted as a search match.  The columns and lines
+     * count from the start of the output, history included, as
+     * ScreenWindow::currentLine() does.
+     */
+    struct SearchMatch
+    {
+        QPoint start; // column and line of the first character
+        QPoint end;   // column and line of the last character
+    };
+
+    /**
+     * Adds @p matches to the highlighted search matches.  The matches must
+     * follow the ones added before, in the order of their positions, and must
+     * not overlap.
+     *
+     * Only the matches within the visible part of the output are painted,
+     * all of them are marked on the scroll bar.
+     */
+    void addSearchMatches(const QVector<SearchMatch>& matches);
+    /** Removes the highlighting of all search matches. */
+    void clearSearchMatches();
+    /**
+     * Moves the highlighted search matches up by @p lines, the number of lines
+     * which the history dropped, and removes the matches dropped with them.
+     */
+    void dropSearchMatchLines(int lines);
+    /** Returns the highlighted search matches, see addSearchMatches() */
+    const QVector<SearchMatch>& searchMatches() const;
+
     /**
      * Returns a list of menu actions created by the filters for the content
      * at the given @p position.
@@ -441,7 +504,9 @@ public slots:
      */
     void updateImage();
 
-    /** Essentially calles processFilters().
+    /**
+     * Calls processFilters(), or schedules it if the filters are in the
+     * QTermWidget::DeferredFilterUpdates mode.
      */
     void updateFilters();
 
@@ -641,8 +706,29 @@ private slots:
     void swapColorTable();
     void tripleClickTimeout();  // resets possibleTripleClick
 
+    // drops the OpenGL view when it cannot draw
+    void fallBackToRasterBackend();
+
 private:
 
+    // tells the screen window whether the display is visible and the refresh
+    // rate of the screen it is shown on
+    void updateScreenWindowPresentation(bool visible);
+    // brings the image, the line properties and the filters up to date with
+    // the output received while the display was hidden
+    void catchUpHiddenUpdates();
+    // places the OpenGL view over the content area and passes on the font
+    void updateGLViewGeometry();
+
+    // returns true if the contents are drawn into _backingStore, which needs
+    // an opaque background
+    bool useBackingStore() const;
+    // draws the dirty parts of _backingStore
+    void paintBackingStore();
+    // marks 'region' of the contents to be drawn again and schedules a repaint.
+    // use update() for what is drawn over the contents, such as hotspots
+    void invalidate(const QRegion& region);
+
     // -- Drawing helpers --
 
     // determine the width of this text
@@ -650,14 +736,21 @@ private:
     // determine the area that encloses this series of characters
     QRect calculateTextArea(int topLeftX, int topLeftY, int startColumn, int line, int length);
 
+    // fills the backgrounds of the cells in the part of the display specified
+    // by 'rect' which differ from the background of the display.  the cells of
+    // a line with the same background are merged into spans, and equal spans
+    // of consecutive lines into rectangles, which are filled once each
+    void drawCellBackgrounds(QPainter &paint, const QRect &rect);
     // divides the part of the display specified by 'rect' into
     // fragments according to their colors and styles and calls
-    // drawTextFragment() to draw the fragments
+    // drawTextFragment() to draw the fragments.  the backgrounds are left to
+    // drawCellBackgrounds(), except on double width and double height lines
     void drawContents(QPainter &paint, const QRect &rect);
     // draws a section of text, all the text in this section
     // has a common color and style
     void drawTextFragment(QPainter& painter, const QRect& rect,
-                          const std::wstring& text, const Character* style);
+                          const std::wstring& text, const Character* style,
+                          bool fillBackground);
     // draws the background for a text fragment
     // if useOpacitySetting is true then the color's alpha value will be set to
     // the display's transparency (set with setOpacity()), otherwise the background
@@ -667,9 +760,11 @@ private:
     // draws the cursor character
     void drawCursor(QPainter& painter, const QRect& rect , const QColor& foregroundColor,
                                        const QColor& backgroundColor , bool& invertColors);
-    // draws the characters or line graphics in a text fragment
+    // draws the characters or line graphics in a text fragment.  'background' is the
+    // opaque color under the text, if it is known, which lets the glyph cache draw it
     void drawCharacters(QPainter& painter, const QRect& rect,  const std::wstring& text,
-                                           const Character* style, bool invertCharacterColor);
+                                           const Character* style, bool invertCharacterColor,
+                                           const QColor& background = QColor());
     // draws a string of line graphics
     void drawLineCharString(QPainter& painter, int x, int y,
                             const std::wstring& str, const Character* attributes);
@@ -703,6 +798,16 @@ private:
     void makeImage();
 
     void paintFilters(QPainter& painter);
+    // finds the spans of the highlight hotspots in 'image', the image of the screen
+    // window which the filters ran on, and lays them over a copy of _image, see
+    // _highlightedImage.  called whenever the hotspots change, not for every paint
+    void updateHighlightedImage(const Character* image, int columns);
+    // lays the spans of 'line' which still cover their text over the copy of the
+    // line, called for the lines of _image which change
+    void updateHighlightedLine(int line);
+    // moves the spans with their lines, see scrollImage()
+    void scrollHighlightSpans(int lines, const QRect& region);
+    void paintSearchMatches(QPainter& painter);
 
     void calDrawTextAdditionHeight(QPainter& painter);
 
@@ -730,6 +835,15 @@ private:
     QGridLayout* _gridLayout;
 
     bool _fixedFont; // has fixed pitch
+    GlyphCache _glyphCache; // rendered glyphs of fixed pitch fonts
+    TerminalGLView* _glView; // draws the text with QTermWidget::OpenGLBackend
+
+    // the rendered contents of the display, which paintEvent() copies to the
+    // widget and scrollImage() scrolls, see useBackingStore()
+    QPixmap _backingStore;
+    QRegion _backingStoreDirty; // the parts of _backingStore to draw again
+
+    quint64 _fillRectCount;  // see fillRectCount()
     int  _fontHeight;     // height
     int  _fontWidth;     // width
     int  _fontAscent;     // ascend
@@ -763,6 +877,8 @@ private:
     uint _randomSeed;
 
     bool _resizing;
+    bool _imageNeedsFullUpdate; // compare all lines in the next updateImage()
+    bool _hiddenUpdatePending;  // the output changed while the display was hidden, see showEvent()
     bool _terminalSizeHint;
     bool _terminalSizeStartup;
     bool _bidiEnabled;
@@ -829,6 +945,40 @@ private:
     TerminalImageFilterChain* _filterChain;
     QRegion _mouseOverHotspotArea;
 
+    // deferred updates of the filters, see setFilterUpdateMode()
+    QTermWidget::FilterUpdateMode _filterUpdateMode;
+    QTimer* _filterTimer;
+    QElapsedTimer _filterDelay;   // since the first change the filters have not seen
+    bool _filtersPending;
+
+    // a line of a HighlightFilter hotspot, with the text it covered.  While the
+    // filters are out of date, the spans move with their lines, and a span is
+    // only drawn where its text still is
+    struct HighlightSpan
+    {
+        int line;
+        int startColumn;
+        int endColumn; // exclusive
+        CharacterColor foreground;
+        CharacterColor background;
+        bool hasForeground;
+        bool hasBackground;
+        quint16 rendition;
+        QVector<wchar_t> text;
+    };
+    QVector<HighlightSpan> _highlightSpans;
+    // the scroll count of the screen window when the spans were found, which
+    // updateImage() has not applied to _image yet
+    int _highlightScrollCount;
+
+    // the image with the styles of the HighlightFilter hotspots, which drawContents()
+    // draws instead of _image.  empty if there are none
+    QVector<Character> _highlightedImage;
+
+    // search matches, sorted by position, and their marks on the scroll bar
+    QVector<SearchMatch> _searchMatches;
+    SearchMatchMarks* _searchMatchMarks;
+
     QTermWidget::KeyboardCursorShape _cursorShape;
 
     // custom cursor color.  if this is invalid then the foreground
@@ -852,6 +1002,11 @@ private:
     //the delay in milliseconds between redrawing blinking text
     static const int TEXT_BLINK_DELAY = 500;
 
+    //the time in milliseconds for which the output has to be idle before deferred
+    //filter updates run, and the longest they are deferred while it keeps changing
+    static const int FILTER_IDLE_DELAY = 40;
+    static const int FILTER_MAX_DELAY = 300;
+
     int _leftBaseMargin;
     int _topBaseMargin;
 
@@ -0,0 +1,492 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "TerminalGLView.h"
+
+// Qt
+#include <QImage>
+#include <QOpenGLContext>
+#include <QOpenGLShaderProgram>
+#include <QSurfaceFormat>
+#include <QVector2D>
+#include <QtDebug>
+
+// Konsole
+#include "Character.h"
+#include "GlyphCache.h"
+#include "ScreenWindow.h"
+
+using namespace Konsole;
+
+const int TerminalGLView::ATLAS_COLUMNS;
+const int TerminalGLView::MAX_ATLAS_ROWS;
+
+// the texels of a cell in the cell texture
+static const int CELL_TEXELS = 3;
+
+// the renditions which select the variant of the font a glyph is drawn with
+static const quint16 GLYPH_RENDITIONS = RE_BOLD | RE_ITALIC | RE_UNDERLINE | RE_STRIKEOUT | RE_OVERLINE;
+
+// one instance per cell, numbered line by line.  the cell texture holds the
+// atlas cell of the glyph in the red and green bytes of the first texel, and
+// the foreground and background colors in the other two
+static const char vertexShaderSource[] =
+    "uniform sampler2D cells;\n"
+    "uniform vec2 viewSize;\n"
+    "uniform vec2 origin;\n"
+    "uniform vec2 cellSize;\n"
+    "uniform vec2 atlasSize;\n"
+    "uniform int columns;\n"
+    "in vec2 corner;\n"
+    "out vec2 atlasPosition;\n"
+    "out vec3 foreground;\n"
+    "out vec3 background;\n"
+    "void main()\n"
+    "{\n"
+    "    int column = gl_InstanceID % columns;\n"
+    "    int line = gl_InstanceID / columns;\n"
+    "    vec4 glyph = texelFetch(cells, ivec2(column * 3, line), 0);\n"
+    "    foreground = texelFetch(cells, ivec2(column * 3 + 1, line), 0).rgb;\n"
+    "    background = texelFetch(cells, ivec2(column * 3 + 2, line), 0).rgb;\n"
+    "    int cell = int(glyph.r * 255.0 + 0.5) + 256 * int(glyph.g * 255.0 + 0.5);\n"
+    "    int atlasColumns = int(atlasSize.x);\n"
+    "    vec2 atlasCell = vec2(float(cell % atlasColumns), float(cell / atlasColumns));\n"
+    "    atlasPosition = (atlasCell + corner) / atlasSize;\n"
+    "    vec2 position = origin + (vec2(float(column), float(line)) + corner) * cellSize;\n"
+    "    gl_Position = vec4(position.x / viewSize.x * 2.0 - 1.0,\n"
+    "                       1.0 - position.y / viewSize.y * 2.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char fragmentShaderSource[] =
+    "uniform sampler2D atlas;\n"
+    "in vec2 atlasPosition;\n"
+    "in vec3 foreground;\n"
+    "in vec3 background;\n"
+    "out vec4 fragColor;\n"
+    "void main()\n"
+    "{\n"
+    "    float coverage = texture(atlas, atlasPosition).a;\n"
+    "    fragColor = vec4(mix(background, foreground, coverage), 1.0);\n"
+    "}\n";
+
+TerminalGLView::TerminalGLView(QWidget* parent)
+    : QOpenGLWidget(parent)
+    , _cellWidth(1)
+    , _cellHeight(1)
+    , _baselineOffset(0)
+    , _cursorShown(true)
+    , _initialized(false)
+    , _program(nullptr)
+    , _quad(QOpenGLBuffer::VertexBuffer)
+    , _cellTexture(0)
+    , _lines(0)
+    , _columns(0)
+    , _cellsDirty(true)
+    , _atlasTexture(0)
+    , _atlasColumns(0)
+    , _atlasRows(0)
+    , _usedCells(0)
+    , _atlasDirty(true)
+    , _devicePixelRatio(1.0)
+{
+    for (int i = 0; i < TABLE_COLORS; i++)
+        _colorTable[i] = base_color_table[i];
+
+    // the display underneath handles the mouse and the keyboard
+    setAttribute(Qt::WA_TransparentForMouseEvents);
+    setFocusPolicy(Qt::NoFocus);
+
+    // instanced drawing and texelFetch() need OpenGL 3.3 or OpenGL ES 3.0
+    QSurfaceFormat surfaceFormat = format();
+    if (QOpenGLContext::openGLModuleType() == QOpenGLContext::LibGL)
+    {
+        surfaceFormat.setVersion(3, 3);
+        surfaceFormat.setProfile(QSurfaceFormat::CoreProfile);
+    }
+    else
+    {
+        surfaceFormat.setVersion(3, 0);
+    }
+    setFormat(surfaceFormat);
+}
+
+TerminalGLView::~TerminalGLView()
+{
+    releaseResources();
+}
+
+void TerminalGLView::setScreenWindow(ScreenWindow* window)
+{
+    if (_screenWindow)
+        disconnect(_screenWindow, nullptr, this, nullptr);
+
+    _screenWindow = window;
+
+    if (window)
+    {
+        connect(window, SIGNAL(outputChanged()), this, SLOT(updateImage()));
+        connect(window, SIGNAL(scrolled(int)), this, SLOT(updateImage()));
+    }
+
+    updateImage();
+}
+
+void TerminalGLView::setColorTable(const ColorEntry table[])
+{
+    for (int i = 0; i < TABLE_COLORS; i++)
+        _colorTable[i] = table[i];
+
+    updateImage();
+}
+
+void TerminalGLView::setCellGeometry(const QFont& font, int cellWidth, int cellHeight,
+                                     int baselineOffset, const QPoint& origin)
+{
+    if (font != _font || cellWidth != _cellWidth || cellHeight != _cellHeight
+        || baselineOffset != _baselineOffset)
+    {
+        _font = font;
+        _cellWidth = qMax(1, cellWidth);
+        _cellHeight = qMax(1, cellHeight);
+        _baselineOffset = baselineOffset;
+        _atlasDirty = true;
+    }
+
+    _origin = origin;
+    updateImage();
+}
+
+void TerminalGLView::setCursorShown(bool shown)
+{
+    if (shown == _cursorShown)
+        return;
+
+    _cursorShown = shown;
+    updateImage();
+}
+
+void TerminalGLView::updateImage()
+{
+    // the image is taken from the window when the view is painted, which
+    // does not happen while it is hidden
+    _cellsDirty = true;
+    update();
+}
+
+void TerminalGLView::initializeGL()
+{
+    // the context is replaced when the view moves to another top level window
+    connect(context(), SIGNAL(aboutToBeDestroyed()), this, SLOT(releaseResources()),
+            Qt::UniqueConnection);
+
+    initializeOpenGLFunctions();
+
+    const QSurfaceFormat surfaceFormat = context()->format();
+    const bool supported = context()->isOpenGLES()
+                         ? surfaceFormat.majorVersion() >= 3
+                         : surfaceFormat.version() >= qMakePair(3, 3);
+    if (!supported || !buildProgram())
+    {
+        qWarning() << "Cannot draw the terminal with OpenGL" << surfaceFormat.majorVersion()
+                   << "." << surfaceFormat.minorVersion();
+        emit initializationFailed();
+        return;
+    }
+
+    static const GLfloat corners[] = { 0, 0, 1, 0, 0, 1, 1, 1 };
+
+    _vao.create();
+    QOpenGLVertexArrayObject::Binder vaoBinder(&_vao);
+    _quad.create();
+    _quad.bind();
+    _quad.allocate(corners, sizeof(corners));
+    _program->bind();
+    _program->enableAttributeArray(0);
+    _program->setAttributeBuffer(0, GL_FLOAT, 0, 2);
+    _program->release();
+    _quad.release();
+
+    GLuint textures[2];
+    glGenTextures(2, textures);
+    _cellTexture = textures[0];
+    _atlasTexture = textures[1];
+    for (GLuint texture : textures)
+    {
+        // the cells are drawn at the size they are rasterized at, so no
+        // filtering is needed
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    _initialized = true;
+    _atlasDirty = true;
+    _cellsDirty = true;
+    _lines = 0;
+    _columns = 0;
+}
+
+bool TerminalGLView::buildProgram()
+{
+    const QByteArray header = context()->isOpenGLES()
+                            ? "#version 300 es\n"
+                              "precision highp float;\n"
+                              "precision highp int;\n"
+                              "precision highp sampler2D;\n"
+                            : "#version 330 core\n";
+
+    _program = new QOpenGLShaderProgram;
+    _program->bindAttributeLocation("corner", 0);
+    if (!_program->addShaderFromSourceCode(QOpenGLShader::Vertex, header + vertexShaderSource)
+        || !_program->addShaderFromSourceCode(QOpenGLShader::Fragment, header + fragmentShaderSource)
+        || !_program->link())
+    {
+        qWarning() << "Cannot build the shaders of the terminal:" << _program->log();
+        delete _program;
+        _program = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+void TerminalGLView::releaseResources()
+{
+    if (!_initialized)
+        return;
+
+    makeCurrent();
+    delete _program;
+    _program = nullptr;
+    _quad.destroy();
+    _vao.destroy();
+    const GLuint textures[2] = { _cellTexture, _atlasTexture };
+    glDeleteTextures(2, textures);
+    _cellTexture = 0;
+    _atlasTexture = 0;
+    doneCurrent();
+
+    _initialized = false;
+    _glyphs.clear();
+}
+
+void TerminalGLView::resetAtlas()
+{
+    _atlasDirty = false;
+    _devicePixelRatio = devicePixelRatioF();
+    _cellPixels = QSize(qRound(_cellWidth * _devicePixelRatio), qRound(_cellHeight * _devicePixelRatio));
+
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    _atlasColumns = qBound(2, maxTextureSize / _cellPixels.width(), ATLAS_COLUMNS);
+    _atlasRows = qBound(1, maxTextureSize / _cellPixels.height(), MAX_ATLAS_ROWS);
+
+    // the first cell is left empty for blank cells
+    _glyphs.clear();
+    _usedCells = 1;
+
+    QImage blank(_atlasColumns * _cellPixels.width(), _atlasRows * _cellPixels.height(),
+                 QImage::Format_RGBA8888_Premultiplied);
+    blank.fill(Qt::transparent);
+
+    glBindTexture(GL_TEXTURE_2D, _atlasTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, blank.width(), blank.height(), 0,
+                 GL_RGBA, GL_UNSIGNED_BYTE, blank.constBits());
+
+    _cellsDirty = true;
+}
+
+QString TerminalGLView::text(const Character& c) const
+{
+    if (c.rendition & RE_EXTENDED_CHAR)
+    {
+        ushort length = 0;
+        const ushort* chars = ExtendedCharTable::instance.lookupExtendedChar(c.charSequence, length);
+        if (chars)
+            return QString::fromUtf16(chars, length);
+        return QString();
+    }
+
+    const uint ucs4 = uint(c.character);
+    return QString::fromUcs4(&ucs4, 1);
+}
+
+int TerminalGLView::glyph(const QString& text, quint16 rendition, bool doubleWidth)
+{
+    const quint16 variant = (rendition & GLYPH_RENDITIONS) | (doubleWidth ? 0x8000 : 0);
+
+    QString key;
+    key.reserve(text.size() + 1);
+    key += QChar(variant);
+    key += text;
+
+    QHash<QString, int>::const_iterator it = _glyphs.constFind(key);
+    if (it != _glyphs.constEnd())
+        return it.value();
+
+    // both halves of a double width glyph are kept on the same row
+    const int width = doubleWidth ? 2 : 1;
+    int cell = _usedCells;
+    if (doubleWidth && cell % _atlasColumns == _atlasColumns - 1)
+        cell++;
+    if (cell + width > _atlasColumns * _atlasRows)
+        return -1;
+    _usedCells = cell + width;
+
+    QImage image(_cellPixels.width() * width, _cellPixels.height(), QImage::Format_RGBA8888_Premultiplied);
+    image.setDevicePixelRatio(_devicePixelRatio);
+    image.fill(Qt::transparent);
+
+    QFont font = _font;
+    font.setBold(font.bold() || (rendition & RE_BOLD));
+    font.setItalic(font.italic() || (rendition & RE_ITALIC));
+    font.setUnderline(font.underline() || (rendition & RE_UNDERLINE));
+    font.setStrikeOut(font.strikeOut() || (rendition & RE_STRIKEOUT));
+    font.setOverline(font.overline() || (rendition & RE_OVERLINE));
+
+    GlyphCache::rasterize(image, QRect(0, 0, _cellWidth * width, _cellHeight), font,
+                          Qt::white, _baselineOffset, text);
+
+    glBindTexture(GL_TEXTURE_2D, _atlasTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0,
+                    (cell % _atlasColumns) * _cellPixels.width(),
+                    (cell / _atlasColumns) * _cellPixels.height(),
+                    image.width(), image.height(), GL_RGBA, GL_UNSIGNED_BYTE, image.constBits());
+
+    _glyphs.insert(key, cell);
+    return cell;
+}
+
+void TerminalGLView::uploadCells()
+{
+    const Character* image = _screenWindow->getImage();
+    const int lines = _screenWindow->windowLines();
+    const int columns = _screenWindow->windowColumns();
+
+    _cellData.resize(lines * columns * CELL_TEXELS * 4);
+
+    // when the atlas fills up it is started over once, the glyphs which do
+    // not fit after that are left blank
+    bool atlasReset = false;
+    for (int line = 0; line < lines; line++)
+    {
+        int rightHalf = -1;
+        for (int column = 0; column < columns; column++)
+        {
+            const Character& c = image[line * columns + column];
+
+            QColor foreground = c.foregroundColor.color(_colorTable);
+            QColor background = c.backgroundColor.color(_colorTable);
+            if ((c.rendition & RE_CURSOR) && _cursorShown)
+                qSwap(foreground, background);
+
+            int cell = 0;
+            if (c.character == 0 && rightHalf > 0)
+            {
+                cell = rightHalf;
+                rightHalf = -1;
+            }
+            else if (c.character != 0 && c.character != ' ' && !(c.rendition & RE_CONCEAL))
+            {
+                const bool doubleWidth = column + 1 < columns && image[line * columns + column + 1].character == 0;
+                cell = glyph(text(c), c.rendition, doubleWidth);
+                if (cell < 0 && !atlasReset)
+                {
+                    atlasReset = true;
+                    resetAtlas();
+                    line = -1;
+                    break;
+                }
+                cell = qMax(0, cell);
+                rightHalf = doubleWidth && cell > 0 ? cell + 1 : -1;
+            }
+
+            uchar* texel = _cellData.data() + (line * columns + column) * CELL_TEXELS * 4;
+            texel[0] = uchar(cell & 0xff);
+            texel[1] = uchar(cell >> 8);
+            texel[2] = 0;
+            texel[3] = 0;
+            texel[4] = uchar(foreground.red());
+            texel[5] = uchar(foreground.green());
+            texel[6] = uchar(foreground.blue());
+            texel[7] = 255;
+            texel[8] = uchar(background.red());
+            texel[9] = uchar(background.green());
+            texel[10] = uchar(background.blue());
+            texel[11] = 255;
+        }
+    }
+
+    glBindTexture(GL_TEXTURE_2D, _cellTexture);
+    if (lines != _lines || columns != _columns)
+    {
+        _lines = lines;
+        _columns = columns;
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, columns * CELL_TEXELS, lines, 0,
+                     GL_RGBA, GL_UNSIGNED_BYTE, _cellData.constData());
+    }
+    else
+    {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, columns * CELL_TEXELS, lines,
+                        GL_RGBA, GL_UNSIGNED_BYTE, _cellData.constData());
+    }
+
+    _cellsDirty = false;
+}
+
+void TerminalGLView::paintGL()
+{
+    const QColor background = _colorTable[DEFAULT_BACK_COLOR].color;
+    glClearColor(background.redF(), background.greenF(), background.blueF(), 1);
+    glClear(GL_COLOR_BUFFER_BIT);
+
+    if (!_initialized || !_screenWindow)
+        return;
+
+    if (_atlasDirty || devicePixelRatioF() != _devicePixelRatio)
+        resetAtlas();
+    if (_cellsDirty)
+        uploadCells();
+    if (_lines == 0 || _columns == 0)
+        return;
+
+    _program->bind();
+    _program->setUniformValue("cells", 0);
+    _program->setUniformValue("atlas", 1);
+    _program->setUniformValue("viewSize", QVector2D(width(), height()));
+    _program->setUniformValue("origin", QVector2D(_origin));
+    _program->setUniformValue("cellSize", QVector2D(_cellWidth, _cellHeight));
+    _program->setUniformValue("atlasSize", QVector2D(_atlasColumns, _atlasRows));
+    _program->setUniformValue("columns", _columns);
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, _cellTexture);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, _atlasTexture);
+
+    QOpenGLVertexArrayObject::Binder vaoBinder(&_vao);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, _lines * _columns);
+
+    glActiveTexture(GL_TEXTURE0);
+    _program->release();
+}
@@ -0,0 +1,154 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef TERMINALGLVIEW_H
+#define TERMINALGLVIEW_H
+
+// Qt
+#include <QFont>
+#include <QHash>
+#include <QOpenGLBuffer>
+#include <QOpenGLExtraFunctions>
+#include <QOpenGLVertexArrayObject>
+#include <QOpenGLWidget>
+#include <QPointer>
+#include <QSize>
+#include <QVector>
+
+// Konsole
+#include "CharacterColor.h"
+
+class QOpenGLShaderProgram;
+
+namespace Konsole
+{
+
+class Character;
+class ScreenWindow;
+
+/**
+ * Draws the image of a ScreenWindow with OpenGL, for TerminalDisplay's
+ * OpenGL backend.
+ *
+ * The glyphs are rasterized once, in white, into the cells of an atlas
+ * texture.  The image of the window is converted into a texture with three
+ * texels per cell, holding the atlas cell of the glyph and the foreground
+ * and background colors, which is uploaded whenever the output changes.
+ * The whole grid is then drawn by a single instanced draw call of one quad
+ * per cell, whose fragments mix the two colors by the coverage of the glyph,
+ * so the cost of drawing does not depend on the amount of text shown.
+ *
+ * The view only draws the text, its colors and the cursor.  The view does
+ * not take mouse events, which go to the display underneath, and neither
+ * does it draw hotspots, search matches, background images or opacity,
+ * which are left to the raster backend.  The colors of HighlightFilter
+ * rules, the intense colors of bold text, and faint and blinking text are
+ * not drawn either, such text is shown in its plain colors.
+ */
+class TerminalGLView : public QOpenGLWidget, protected QOpenGLExtraFunctions
+{
+    Q_OBJECT
+
+public:
+    explicit TerminalGLView(QWidget* parent = nullptr);
+    ~TerminalGLView() override;
+
+    /** Sets the window whose image is drawn, following its output. */
+    void setScreenWindow(ScreenWindow* window);
+
+    /** Sets the colors used to draw the characters, @p table is copied. */
+    void setColorTable(const ColorEntry table[]);
+
+    /**
+     * Sets the font and the size of the cells, which are placed from @p origin
+     * in the view.  @p baselineOffset is the extra height below a cell which
+     * the text is aligned to, see TerminalDisplay::calDrawTextAdditionHeight().
+     */
+    void setCellGeometry(const QFont& font, int cellWidth, int cellHeight,
+                         int baselineOffset, const QPoint& origin);
+
+    /** Sets whether the cursor is drawn, so that it can blink. */
+    void setCursorShown(bool shown);
+
+signals:
+    /**
+     * Emitted when the view cannot draw, because the OpenGL context does not
+     * provide OpenGL 3.3 or OpenGL ES 3.0.
+     */
+    void initializationFailed();
+
+public slots:
+    /** Marks the image of the window as changed and schedules a repaint. */
+    void updateImage();
+
+protected:
+    void initializeGL() override;
+    void paintGL() override;
+
+private slots:
+    void releaseResources();
+
+private:
+    bool buildProgram();
+    void resetAtlas();
+    // uploads the image of the window to the cell texture
+    void uploadCells();
+    // returns the atlas cell of the glyph, rasterizing it if it is not cached
+    // yet.  double width glyphs take two cells, the cell returned and the next
+    int glyph(const QString& text, quint16 rendition, bool doubleWidth);
+    QString text(const Character& c) const;
+
+    static const int ATLAS_COLUMNS = 64;
+    static const int MAX_ATLAS_ROWS = 64;
+
+    QPointer<ScreenWindow> _screenWindow;
+    ColorEntry _colorTable[TABLE_COLORS];
+    QFont _font;
+    int _cellWidth;
+    int _cellHeight;
+    int _baselineOffset;
+    QPoint _origin;
+    bool _cursorShown;
+
+    bool _initialized;
+    QOpenGLShaderProgram* _program;
+    QOpenGLVertexArrayObject _vao;
+    QOpenGLBuffer _quad;
+
+    // the cell texture, three texels per cell
+    GLuint _cellTexture;
+    QVector<uchar> _cellData;
+    int _lines;
+    int _columns;
+    bool _cellsDirty;
+
+    // the glyph atlas, white glyphs whose alpha is their coverage
+    GLuint _atlasTexture;
+    QHash<QString, int> _glyphs;
+    int _atlasColumns;
+    int _atlasRows;
+    int _usedCells;
+    bool _atlasDirty;
+    qreal _devicePixelRatio;
+    QSize _cellPixels;  // the size of a cell in the atlas, in device pixels
+};
+
+}
+
+#endif // TERMINALGLVIEW_H
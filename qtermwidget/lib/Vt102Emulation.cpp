@@ -40,13 +40,20 @@
 
 // Standard
 #include <cstdio>
+#include <cwchar>
 #include <unistd.h>
 
+#if defined(__SSE2__) && WCHAR_MAX > 0xffff
+#include <emmintrin.h>
+#define VT102_SSE2_SCAN
+#endif
+
 // Qt
 #include <QEvent>
 #include <QKeyEvent>
 #include <QByteRef>
 #include <QDebug>
+#include <QtAlgorithms>
 
 // KDE
 //#include <kdebug.h>
@@ -61,14 +68,14 @@ using namespace Konsole;
 
 Vt102Emulation::Vt102Emulation()
     : Emulation(),
-     prevCC(0),
+     _parser(this),
      _titleUpdateTimer(new QTimer(this)),
      _reportFocusEvents(false)
 {
   _titleUpdateTimer->setSingleShot(true);
   QObject::connect(_titleUpdateTimer , SIGNAL(timeout()) , this , SLOT(updateTitle()));
 
-  initTokenizer();
+  initCharacterClasses();
   reset();
 }
 
@@ -83,7 +90,7 @@ void Vt102Emulation::clearEntireScreen()
 
 void Vt102Emulation::reset()
 {
-  resetTokenizer();
+  _parser.reset();
   resetModes();
   resetCharset(0);
   _screen[0]->reset();
@@ -109,7 +116,7 @@ void Vt102Emulation::reset()
 
    The pipeline proceeds as follows:
 
-   - Tokenizing the ESC codes (onReceiveChar)
+   - Parsing the ESC codes (Vt102Parser) and mapping them to tokens
    - VT100 code page translation of plain characters (applyCharset)
    - Interpretation of ESC codes (processToken)
 
@@ -170,255 +177,269 @@ void Vt102Emulation::reset()
 #define TY_CSI_PG(A)  TY_CONSTRUCT(9,A,0)
 #define TY_CSI_PE(A)  TY_CONSTRUCT(10,A,0)
 
-#define MAX_ARGUMENT 4096
-
-// Tokenizer --------------------------------------------------------------- --
-
-/* The tokenizer's state
-
-   The state is represented by the buffer (tokenBuffer, tokenBufferPos),
-   and accompanied by decoded arguments kept in (argv,argc).
-   Note that they are kept internal in the tokenizer.
-*/
-
-void Vt102Emulation::resetTokenizer()
-{
-  tokenBufferPos = 0;
-  argc = 0;
-  argv[0] = 0;
-  argv[1] = 0;
-  prevCC = 0;
-}
-
-void Vt102Emulation::addDigit(int digit)
-{
-  if (argv[argc] < MAX_ARGUMENT)
-      argv[argc] = 10*argv[argc] + digit;
-}
-
-void Vt102Emulation::addArgument()
-{
-  argc = qMin(argc+1,MAXARGS-1);
-  argv[argc] = 0;
-}
-
-void Vt102Emulation::addToCurrentToken(wchar_t cc)
-{
-  tokenBuffer[tokenBufferPos] = cc;
-  tokenBufferPos = qMin(tokenBufferPos+1,MAX_TOKEN_LENGTH-1);
-}
-
 // Character Class flags used while decoding
-#define CTL  1  // Control character
-#define CHR  2  // Printable character
-#define CPN  4  // TODO: Document me
-#define DIG  8  // Digit
-#define SCS 16  // TODO: Document me
-#define GRP 32  // TODO: Document me
+#define CPN  4  // Final character of a CSI sequence taking up to two numeric arguments
+#define SCS 16  // Intermediate character of a character set designation ESC ( etc.
 #define CPS 64  // Character which indicates end of window resize
                 // escape sequence '\e[8;<row>;<col>t'
+#define TXT 128 // Printable character which needs no parsing, see receiveChars()
 
-void Vt102Emulation::initTokenizer()
+void Vt102Emulation::initCharacterClasses()
 {
   int i;
   quint8* s;
   for(i = 0;i < 256; ++i)
     charClass[i] = 0;
-  for(i = 0;i < 32; ++i)
-    charClass[i] |= CTL;
-  for(i = 32;i < 256; ++i)
-    charClass[i] |= CHR;
   for(s = (quint8*)"@ABCDGHILMPSTXZbcdfry"; *s; ++s)
     charClass[*s] |= CPN;
   // resize = \e[8;<row>;<col>t
   for(s = (quint8*)"t"; *s; ++s)
     charClass[*s] |= CPS;
-  for(s = (quint8*)"0123456789"; *s; ++s)
-    charClass[*s] |= DIG;
   for(s = (quint8*)"()+*%"; *s; ++s)
     charClass[*s] |= SCS;
-  for(s = (quint8*)"()+*#[]%"; *s; ++s)
-    charClass[*s] |= GRP;
-
-  resetTokenizer();
+  // DEL and the C1 range (which includes the 8-bit CSI) are left out
+  for(i = 32;i < 127; ++i)
+    charClass[i] |= TXT;
+  for(i = 160;i < 256; ++i)
+    charClass[i] |= TXT;
 }
 
-/* Ok, here comes the nasty part of the decoder.
+#define DEL 127
+
+// process an incoming unicode character
+void Vt102Emulation::receiveChar(wchar_t cc)
+{
+  _parser.receiveChar(cc);
+}
 
-   Instead of keeping an explicit state, we deduce it from the
-   token scanned so far. It is then immediately combined with
-   the current character to form a scanning decision.
+/* The parser reports what it has recognized through the methods below,
+   which turn each sequence into one or more tokens.
 
-   This is done by the following defines.
+   Control characters are also allowed *within* escape sequences (a VT100
+   behaviour), so execute() may be called while a sequence is in progress.
+*/
 
-   - P is the length of the token scanned so far.
-   - L (often P-1) is the position on which contents we base a decision.
-   - C is a character or a group of characters (taken from 'charClass').
+void Vt102Emulation::print(wchar_t cc)
+{
+  // VT52 has no character sets to apply
+  processToken( TY_CHR(), getMode(MODE_Ansi) ? applyCharset(cc) : cc, 0);
+}
 
-   - 'cc' is the current character
-   - 's' is a pointer to the start of the token buffer
-   - 'p' is the current position within the token buffer
+void Vt102Emulation::execute(wchar_t cc)
+{
+  processToken( TY_CTL(cc+'@'), 0, 0);
+}
 
-   Note that they need to applied in proper order.
-*/
+void Vt102Emulation::escDispatch(wchar_t final)
+{
+  if (_parser.intermediateCount() == 0)
+  {
+    processToken( TY_ESC(final), 0, 0);
+    return;
+  }
 
-#define lec(P,L,C) (p == (P) && s[(L)] == (C))
-#define lun(     ) (p ==  1  && cc >= 32 )
-#define les(P,L,C) (p == (P) && s[L] < 256 && (charClass[s[(L)]] & (C)) == (C))
-#define eec(C)     (p >=  3  && cc == (C))
-#define ees(C)     (p >=  3  && cc < 256 && (charClass[cc] & (C)) == (C))
-#define eps(C)     (p >=  3  && s[2] != '?' && s[2] != '!' && s[2] != '>' && cc < 256 && (charClass[cc] & (C)) == (C))
-#define epp( )     (p >=  3  && s[2] == '?')
-#define epe( )     (p >=  3  && s[2] == '!')
-#define egt( )     (p >=  3  && s[2] == '>')
-#define esp( )     (p ==  4  && s[3] == ' ')
-#define Xpe        (tokenBufferPos >= 2 && tokenBuffer[1] == ']')
-#define Xte        (Xpe      && (cc ==  7 || (prevCC == 27 && cc == 92) )) // 27, 92 => "\e\\" (ST, String Terminator)
-#define ces(C)     (cc < 256 && (charClass[cc] & (C)) == (C) && !Xte)
-
-#define CNTL(c) ((c)-'@')
-#define ESC 27
-#define DEL 127
+  const wchar_t intermediate = _parser.intermediate(0);
+  if (_parser.intermediateCount() == 1 && intermediate == '#')
+    processToken( TY_ESC_DE(final), 0, 0);
+  else if (_parser.intermediateCount() == 1 && (charClass[intermediate] & SCS))
+    processToken( TY_ESC_CS(intermediate, final), 0, 0);
+  else
+    reportDecodingError();
+}
 
-// process an incoming unicode character
-void Vt102Emulation::receiveChar(wchar_t cc)
+void Vt102Emulation::csiDispatch(wchar_t final)
 {
-  if (cc == DEL)
-    return; //VT100: ignore.
+  const int argc = _parser.parameterCount();
+  const wchar_t marker = _parser.privateMarker();
 
-  if (ces(CTL))
+  if (_parser.intermediateCount() > 0)
   {
-    // ignore control characters in the text part of Xpe (aka OSC) "ESC]"
-    // escape sequences; this matches what XTERM docs say
-    if (Xpe) {
-        prevCC = cc;
-        return;
-    }
+    const wchar_t intermediate = _parser.intermediate(0);
+    if (_parser.intermediateCount() == 1 && marker == 0 && intermediate == ' ' && final == 'q')
+      processToken( TY_CSI_PS_SP(final, _parser.parameter(0)), _parser.parameter(0), 0);
+    else if (_parser.intermediateCount() == 1 && marker == 0 && intermediate == '!')
+      processToken( TY_CSI_PE(final), 0, 0);
+    else
+      reportDecodingError();
+    return;
+  }
 
-    // DEC HACK ALERT! Control Characters are allowed *within* esc sequences in VT100
-    // This means, they do neither a resetTokenizer() nor a pushToToken(). Some of them, do
-    // of course. Guess this originates from a weakly layered handling of the X-on
-    // X-off protocol, which comes really below this level.
-    if (cc == CNTL('X') || cc == CNTL('Z') || cc == ESC)
-        resetTokenizer(); //VT100: CAN or SUB
-    if (cc != ESC)
-    {
-        processToken(TY_CTL(cc+'@' ),0,0);
-        return;
-    }
+  if (marker == '?')
+  {
+    for (int i = 0; i < argc; i++)
+      processToken( TY_CSI_PR(final, _parser.parameter(i)), 0, 0);
+    return;
+  }
+  if (marker == '>')
+  {
+    for (int i = 0; i < argc; i++)
+      processToken( TY_CSI_PG(final), 0, 0); // spec. case for ESC]>0c or ESC]>c
+    return;
+  }
+  if (marker != 0)
+  {
+    reportDecodingError();
+    return;
   }
-  // advance the state
-  addToCurrentToken(cc);
 
-  wchar_t* s = tokenBuffer;
-  int  p = tokenBufferPos;
+  if (charClass[final] & CPN)
+  {
+    processToken( TY_CSI_PN(final), _parser.parameter(0), _parser.parameter(1));
+    return;
+  }
+  // resize = \e[8;<row>;<col>t
+  if (charClass[final] & CPS)
+  {
+    processToken( TY_CSI_PS(final, _parser.parameter(0)), _parser.parameter(1), _parser.parameter(2));
+    return;
+  }
 
-  if (getMode(MODE_Ansi))
+  for (int i = 0; i < argc; i++)
   {
-    if (lec(1,0,ESC)) { return; }
-    if (lec(1,0,ESC+128)) { s[0] = ESC; receiveChar('['); return; }
-    if (les(2,1,GRP)) { return; }
-    if (Xte         ) { processWindowAttributeChange(); resetTokenizer(); return; }
-    if (Xpe         ) { prevCC = cc; return; }
-    if (lec(3,2,'?')) { return; }
-    if (lec(3,2,'>')) { return; }
-    if (lec(3,2,'!')) { return; }
-    if (lun(       )) { processToken( TY_CHR(), applyCharset(cc), 0);   resetTokenizer(); return; }
-    if (lec(2,0,ESC)) { processToken( TY_ESC(s[1]), 0, 0);              resetTokenizer(); return; }
-    if (les(3,1,SCS)) { processToken( TY_ESC_CS(s[1],s[2]), 0, 0);      resetTokenizer(); return; }
-    if (lec(3,1,'#')) { processToken( TY_ESC_DE(s[2]), 0, 0);           resetTokenizer(); return; }
-    if (eps(    CPN)) { processToken( TY_CSI_PN(cc), argv[0],argv[1]);  resetTokenizer(); return; }
-    if (esp(       )) { return; }
-    if (lec(5, 4, 'q') && s[3] == ' ') {
-      processToken( TY_CSI_PS_SP(cc, argv[0]), argv[0], 0);
-      resetTokenizer();
-      return;
-    }
+    const int arg = _parser.parameter(i);
 
-    // resize = \e[8;<row>;<col>t
-    if (eps(CPS))
+    // number of colon separated sub-parameters following this one
+    int subArgs = 0;
+    while (_parser.isSubParameter(i + subArgs + 1))
+      subArgs++;
+
+    if (final == 'm' && (arg == 38 || arg == 48) && subArgs > 0)
     {
-        processToken( TY_CSI_PS(cc, argv[0]), argv[1], argv[2]);
-        resetTokenizer();
-        return;
+      // ESC[ ... 38:2:<colorspace>:<red>:<green>:<blue> ... m (the colorspace may be left out)
+      // ESC[ ... 38:5:<index> ... m
+      if (_parser.parameter(i+1) == 2 && subArgs >= 4)
+      {
+        const int red = i + (subArgs >= 5 ? 3 : 2);
+        processToken( TY_CSI_PS(final, arg), COLOR_SPACE_RGB,
+                      (_parser.parameter(red) << 16) | (_parser.parameter(red+1) << 8) | _parser.parameter(red+2));
+      }
+      else if (_parser.parameter(i+1) == 5 && subArgs >= 2)
+      {
+        processToken( TY_CSI_PS(final, arg), COLOR_SPACE_256, _parser.parameter(i+2));
+      }
+      else
+      {
+        processToken( TY_CSI_PS(final, arg), 0, 0);
+      }
     }
-
-    if (epe(   )) { processToken( TY_CSI_PE(cc), 0, 0); resetTokenizer(); return; }
-    if (ees(DIG)) { addDigit(cc-'0'); return; }
-    if (eec(';') || eec(':')) { addArgument(); return; }
-    for (int i=0;i<=argc;i++)
+    else if (final == 'm' && argc - i > 4 && (arg == 38 || arg == 48) && _parser.parameter(i+1) == 2)
     {
-        if (epp())
-            processToken( TY_CSI_PR(cc,argv[i]), 0, 0);
-        else if (egt())
-            processToken( TY_CSI_PG(cc), 0, 0); // spec. case for ESC]>0c or ESC]>c
-        else if (cc == 'm' && argc - i >= 4 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 2)
-        {
-            // ESC[ ... 48;2;<red>;<green>;<blue> ... m -or- ESC[ ... 38;2;<red>;<green>;<blue> ... m
-            i += 2;
-            processToken( TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_RGB, (argv[i] << 16) | (argv[i+1] << 8) | argv[i+2]);
-            i += 2;
-        }
-        else if (cc == 'm' && argc - i >= 2 && (argv[i] == 38 || argv[i] == 48) && argv[i+1] == 5)
-        {
-            // ESC[ ... 48;5;<index> ... m -or- ESC[ ... 38;5;<index> ... m
-            i += 2;
-            processToken( TY_CSI_PS(cc, argv[i-2]), COLOR_SPACE_256, argv[i]);
-        }
-        else
-            processToken( TY_CSI_PS(cc,argv[i]), 0, 0);
+      // ESC[ ... 48;2;<red>;<green>;<blue> ... m -or- ESC[ ... 38;2;<red>;<green>;<blue> ... m
+      processToken( TY_CSI_PS(final, arg), COLOR_SPACE_RGB,
+                    (_parser.parameter(i+2) << 16) | (_parser.parameter(i+3) << 8) | _parser.parameter(i+4));
+      i += 4;
     }
-    resetTokenizer();
-  }
-  else
-  {
-    // VT52 Mode
-    if (lec(1,0,ESC))
-        return;
-    if (les(1,0,CHR))
+    else if (final == 'm' && argc - i > 2 && (arg == 38 || arg == 48) && _parser.parameter(i+1) == 5)
     {
-        processToken( TY_CHR(), s[0], 0);
-        resetTokenizer();
-        return;
+      // ESC[ ... 48;5;<index> ... m -or- ESC[ ... 38;5;<index> ... m
+      processToken( TY_CSI_PS(final, arg), COLOR_SPACE_256, _parser.parameter(i+2));
+      i += 2;
     }
-    if (lec(2,1,'Y'))
-        return;
-    if (lec(3,1,'Y'))
-        return;
-    if (p < 4)
+    else
     {
-        processToken( TY_VT52(s[1] ), 0, 0);
-        resetTokenizer();
-        return;
+      // sub-parameters other than the colors above are not supported
+      processToken( TY_CSI_PS(final, arg), 0, 0);
     }
-    processToken( TY_VT52(s[1]), s[2], s[3]);
-    resetTokenizer();
-    return;
+    i += subArgs;
   }
 }
+
+void Vt102Emulation::oscDispatch()
+{
+  processWindowAttributeChange();
+}
+
+void Vt102Emulation::dcsDispatch(wchar_t final)
+{
+  // no device control strings are supported, the whole
+  // string including its payload is dropped
+  Q_UNUSED(final);
+  reportDecodingError();
+}
+
+void Vt102Emulation::vt52Dispatch(wchar_t c, wchar_t row, wchar_t column)
+{
+  processToken( TY_VT52(c), row, column);
+}
+
+int Vt102Emulation::printableRunLength(const wchar_t* text, int length) const
+{
+  int i = 0;
+
+#ifdef VT102_SSE2_SCAN
+  // same test as the TXT class below, four characters at a time:
+  // (c > 0x1f && c < 0x7f) || c > 0x9f
+  const __m128i controlMax = _mm_set1_epi32(0x1f);
+  const __m128i del = _mm_set1_epi32(DEL);
+  const __m128i c1Max = _mm_set1_epi32(0x9f);
+  for (; i + 4 <= length; i += 4)
+  {
+    const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+    const __m128i ascii = _mm_and_si128(_mm_cmpgt_epi32(c, controlMax), _mm_cmplt_epi32(c, del));
+    const __m128i printable = _mm_or_si128(ascii, _mm_cmpgt_epi32(c, c1Max));
+    const int mask = _mm_movemask_ps(_mm_castsi128_ps(printable));
+    if (mask != 0xf)
+      return i + qCountTrailingZeroBits(uint(~mask));
+  }
+#endif
+
+  for (; i < length; i++)
+  {
+    const wchar_t cc = text[i];
+    if (cc < 256 && !(charClass[cc] & TXT))
+      break;
+  }
+  return i;
+}
+
+void Vt102Emulation::receiveChars(const wchar_t* text, int length)
+{
+  int i = 0;
+  while (i < length)
+  {
+    const CharCodes& charset = _charset[_currentScreen == _screen[1]];
+
+    // while no escape sequence is in progress, runs of plain text are
+    // handed to the screen as a whole rather than token by token.
+    // The VT100 graphics and pound charsets remap some of them, so
+    // those keep going through applyCharset()
+    if (_parser.isIdle() && getMode(MODE_Ansi) && !charset.graphic && !charset.pound)
+    {
+      const int run = printableRunLength(text + i, length - i);
+      if (run > 0)
+      {
+        _currentScreen->displayCharacters(text + i, run);
+        i += run;
+        continue;
+      }
+    }
+    receiveChar(text[i++]);
+  }
+}
+
 void Vt102Emulation::processWindowAttributeChange()
 {
   // Describes the window or terminal session attribute to change
   // See Session::UserTitleChange for possible values
+  const wchar_t* payload = _parser.payload();
+  const int length = _parser.payloadLength();
   int attributeToChange = 0;
   int i;
-  for (i = 2; i < tokenBufferPos     &&
-              tokenBuffer[i] >= '0'  &&
-              tokenBuffer[i] <= '9'; i++)
+  for (i = 0; i < length     &&
+              payload[i] >= '0'  &&
+              payload[i] <= '9'; i++)
   {
-    attributeToChange = 10 * attributeToChange + (tokenBuffer[i]-'0');
+    attributeToChange = 10 * attributeToChange + (payload[i]-'0');
   }
 
-  if (tokenBuffer[i] != ';')
+  if (i == length || payload[i] != ';')
   {
     reportDecodingError();
     return;
   }
 
-  // copy from the first char after ';', and skipping the ending delimiter
-  // 0x07 or 0x92. Note that as control characters in OSC text parts are
-  // ignored, only the second char in ST ("\e\\") is appended to tokenBuffer.
-  QString newValue = QString::fromWCharArray(tokenBuffer + i + 1, tokenBufferPos-i-2);
+  // the payload holds neither the "ESC]" introducer nor the terminator
+  QString newValue = QString::fromWCharArray(payload + i + 1, length - i - 1);
 
   _pendingTitleUpdates[attributeToChange] = newValue;
   _titleUpdateTimer->start(20);
@@ -1295,6 +1316,10 @@ void Vt102Emulation::setMode(int m)
     case MODE_AppScreen : _screen[1]->clearSelection();
                           setScreen(1);
     break;
+
+    case MODE_Ansi:
+        _parser.setAnsiMode(true);
+    break;
   }
   if (m < MODES_SCREEN || m == MODE_NewLine)
   {
@@ -1327,6 +1352,10 @@ void Vt102Emulation::resetMode(int m)
         _screen[0]->clearSelection();
         setScreen(0);
     break;
+
+    case MODE_Ansi:
+        _parser.setAnsiMode(false);
+    break;
   }
   if (m < MODES_SCREEN || m == MODE_NewLine)
   {
@@ -1367,9 +1396,7 @@ char Vt102Emulation::eraseChar() const
 
 void Vt102Emulation::reportDecodingError()
 {
-  if (tokenBufferPos == 0 || ( tokenBufferPos == 1 && (tokenBuffer[0] & 0xff) >= 32) )
-    return;
-  qCDebug(qtermwidgetLogger) << "Undecodable sequence:" << QString::fromWCharArray(tokenBuffer, tokenBufferPos);
+  qCDebug(qtermwidgetLogger) << "Undecodable sequence:" << _parser.describeSequence();
 }
 
 //#include "Vt102Emulation.moc"
@@ -34,6 +34,7 @@
 // Konsole
 #include "Emulation.h"
 #include "Screen.h"
+#include "Vt102Parser.h"
 
 #define MODE_AppScreen       (MODES_SCREEN+0)   // Mode #1
 #define MODE_AppCuKeys       (MODES_SCREEN+1)   // Application cursor keys (DECCKM)
@@ -75,7 +76,7 @@ struct CharCodes
  * sequences.
  *
  */
-class Vt102Emulation : public Emulation
+class Vt102Emulation : public Emulation, private Vt102ParserHandler
 {
 Q_OBJECT
 
@@ -103,6 +104,7 @@ protected:
   void setMode(int mode) override;
   void resetMode(int mode) override;
   void receiveChar(wchar_t cc) override;
+  void receiveChars(const wchar_t* text, int length) override;
 
 private slots:
   //causes changeTitle() to be emitted for each (int,QString) pair in pendingTitleUpdates
@@ -132,24 +134,30 @@ private:
   // (except MODE_Allow132Columns)
   void resetModes();
 
-  void resetTokenizer();
-  #define MAX_TOKEN_LENGTH 256 // Max length of tokens (e.g. window title)
-  void addToCurrentToken(wchar_t cc);
-  wchar_t tokenBuffer[MAX_TOKEN_LENGTH]; //FIXME: overflow?
-  int tokenBufferPos;
-#define MAXARGS 15
-  void addDigit(int dig);
-  void addArgument();
-  int argv[MAXARGS];
-  int argc;
-  void initTokenizer();
-  int prevCC;
+  // separates the incoming characters into control sequences,
+  // which are passed back to the Vt102ParserHandler methods below
+  Vt102Parser _parser;
+  void initCharacterClasses();
+
+  // reimplemented from Vt102ParserHandler, these map the
+  // recognized sequences to tokens for processToken()
+  void print(wchar_t c) override;
+  void execute(wchar_t c) override;
+  void escDispatch(wchar_t final) override;
+  void csiDispatch(wchar_t final) override;
+  void oscDispatch() override;
+  void dcsDispatch(wchar_t final) override;
+  void vt52Dispatch(wchar_t c, wchar_t row, wchar_t column) override;
 
   // Set of flags for each of the ASCII characters which indicates
   // what category they fall into (printable character, control, digit etc.)
   // for the purposes of decoding terminal output
   int charClass[256];
 
+  // returns the number of characters at the start of 'text' which
+  // can be displayed as they are, without involving the parser
+  int printableRunLength(const wchar_t* text, int length) const;
+
   void reportDecodingError();
 
   void processToken(int code, wchar_t p, int q);
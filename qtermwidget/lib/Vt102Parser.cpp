@@ -0,0 +1,418 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+// Own
+#include "Vt102Parser.h"
+
+using namespace Konsole;
+
+const int Vt102Parser::MAX_PARAMETERS;
+const int Vt102Parser::MAX_PARAMETER_VALUE;
+const int Vt102Parser::MAX_PAYLOAD_LENGTH;
+const int Vt102Parser::MAX_INTERMEDIATES;
+
+#define BEL 7
+#define CAN 24
+#define SUB 26
+#define ESC 27
+#define DEL 127
+#define CSI_8BIT 0x9b
+
+// character ranges of the ECMA-48 syntax
+static inline bool isIntermediate(wchar_t cc) { return cc >= 0x20 && cc <= 0x2f; }
+static inline bool isParameter(wchar_t cc)    { return cc >= 0x30 && cc <= 0x3f; }
+static inline bool isPrivateMarker(wchar_t cc){ return cc >= 0x3c && cc <= 0x3f; }
+static inline bool isFinal(wchar_t cc)        { return cc >= 0x40 && cc <= 0x7e; }
+
+Vt102Parser::Vt102Parser(Vt102ParserHandler* handler)
+    : _handler(handler)
+    , _state(Ground)
+    , _stringState(Ground)
+    , _ansi(true)
+    , _vt52Row(0)
+{
+    clearSequence(0);
+}
+
+void Vt102Parser::reset()
+{
+    _state = Ground;
+    clearSequence(0);
+}
+
+void Vt102Parser::setAnsiMode(bool ansi)
+{
+    _ansi = ansi;
+}
+
+void Vt102Parser::clearSequence(wchar_t introducer)
+{
+    _introducer = introducer;
+    _final = 0;
+    _parameters[0] = 0;
+    _parameterCount = 1;
+    _subParameters = 0;
+    _parameterOverflow = false;
+    _privateMarker = 0;
+    _intermediateCount = 0;
+    // keeps the capacity, so that the next string is collected without allocating
+    _payload.clear();
+}
+
+void Vt102Parser::enterEscape()
+{
+    clearSequence(0);
+    _state = _ansi ? Escape : Vt52Escape;
+}
+
+void Vt102Parser::collectIntermediate(wchar_t cc)
+{
+    if (_intermediateCount < MAX_INTERMEDIATES)
+        _intermediates[_intermediateCount] = cc;
+    _intermediateCount++;
+}
+
+void Vt102Parser::collectParameter(wchar_t cc)
+{
+    if (cc >= '0' && cc <= '9')
+    {
+        if (_parameterOverflow)
+            return;
+        int& parameter = _parameters[_parameterCount-1];
+        if (parameter < MAX_PARAMETER_VALUE)
+            parameter = 10*parameter + (cc - '0');
+    }
+    else if (cc == ';' || cc == ':')
+    {
+        if (_parameterCount == MAX_PARAMETERS)
+        {
+            _parameterOverflow = true;
+            return;
+        }
+        if (cc == ':')
+            _subParameters |= 1u << _parameterCount;
+        _parameters[_parameterCount++] = 0;
+    }
+    else
+    {
+        // private markers are only valid in front of the parameters
+        _state = (_state == DcsParam || _state == DcsEntry) ? DcsIgnore : CsiIgnore;
+    }
+}
+
+void Vt102Parser::collectPayload(wchar_t cc)
+{
+    if (payloadLength() < MAX_PAYLOAD_LENGTH)
+        _payload.push_back(cc);
+}
+
+bool Vt102Parser::inString() const
+{
+    switch (_state)
+    {
+        case OscString:
+        case DcsEntry:
+        case DcsParam:
+        case DcsIntermediate:
+        case DcsPassthrough:
+        case DcsIgnore:
+        case SosPmApcString:
+        case StringEscape:
+            return true;
+        default:
+            return false;
+    }
+}
+
+void Vt102Parser::terminateString()
+{
+    const State state = _state == StringEscape ? _stringState : _state;
+    _state = Ground;
+
+    if (state == OscString)
+        _handler->oscDispatch();
+    else if (state == DcsPassthrough)
+        _handler->dcsDispatch(_final);
+}
+
+void Vt102Parser::receiveControl(wchar_t cc)
+{
+    if (cc == ESC)
+    {
+        // inside a string, ESC may be the start of the string terminator ESC '\'
+        if (inString())
+        {
+            if (_state != StringEscape)
+            {
+                _stringState = _state;
+                _state = StringEscape;
+            }
+        }
+        else
+        {
+            enterEscape();
+        }
+        return;
+    }
+
+    // control characters in the text part of strings are ignored, except for
+    // BEL which xterm accepts as the terminator of OSC
+    if (inString())
+    {
+        if (cc == BEL && _state == OscString)
+            terminateString();
+        return;
+    }
+
+    // DEC HACK ALERT! Control Characters are allowed *within* esc sequences in VT100
+    // This means, they neither abort nor become part of the sequence.  Except for
+    // CAN and SUB, which cancel it.
+    if (cc == CAN || cc == SUB)
+        reset();
+
+    _handler->execute(cc);
+}
+
+void Vt102Parser::receiveChar(wchar_t cc)
+{
+    if (cc == DEL)
+        return; //VT100: ignore.
+
+    if (cc < 0x20)
+    {
+        receiveControl(cc);
+        return;
+    }
+
+    switch (_state)
+    {
+        case Ground:
+            if (cc == CSI_8BIT && _ansi)
+            {
+                clearSequence('[');
+                _state = CsiEntry;
+            }
+            else
+            {
+                _handler->print(cc);
+            }
+            break;
+
+        case Escape:
+            if (isIntermediate(cc))
+            {
+                collectIntermediate(cc);
+                _state = EscapeIntermediate;
+            }
+            else if (cc == '[')
+            {
+                clearSequence('[');
+                _state = CsiEntry;
+            }
+            else if (cc == ']')
+            {
+                clearSequence(']');
+                _state = OscString;
+            }
+            else if (cc == 'P')
+            {
+                clearSequence('P');
+                _state = DcsEntry;
+            }
+            else if (cc == 'X' || cc == '^' || cc == '_')
+            {
+                clearSequence(cc);
+                _state = SosPmApcString;
+            }
+            else
+            {
+                _state = Ground;
+                if (cc < DEL)
+                {
+                    _final = cc;
+                    _handler->escDispatch(cc);
+                }
+            }
+            break;
+
+        case EscapeIntermediate:
+            if (isIntermediate(cc))
+                collectIntermediate(cc);
+            else
+            {
+                _state = Ground;
+                if (cc < DEL)
+                {
+                    _final = cc;
+                    _handler->escDispatch(cc);
+                }
+            }
+            break;
+
+        case CsiEntry:
+        case CsiParam:
+        case DcsEntry:
+        case DcsParam:
+        {
+            const bool dcs = _state == DcsEntry || _state == DcsParam;
+            if (isParameter(cc))
+            {
+                if (isPrivateMarker(cc) && (_state == CsiEntry || _state == DcsEntry))
+                    _privateMarker = cc;
+                else
+                    collectParameter(cc);
+
+                if (_state == CsiEntry)
+                    _state = CsiParam;
+                else if (_state == DcsEntry)
+                    _state = DcsParam;
+            }
+            else if (isIntermediate(cc))
+            {
+                collectIntermediate(cc);
+                _state = dcs ? DcsIntermediate : CsiIntermediate;
+            }
+            else if (isFinal(cc))
+            {
+                _final = cc;
+                if (dcs)
+                {
+                    _state = DcsPassthrough;
+                }
+                else
+                {
+                    _state = Ground;
+                    _handler->csiDispatch(cc);
+                }
+            }
+            else
+            {
+                // characters beyond ASCII abandon the sequence
+                _state = dcs ? DcsIgnore : Ground;
+            }
+            break;
+        }
+
+        case CsiIntermediate:
+        case DcsIntermediate:
+        {
+            const bool dcs = _state == DcsIntermediate;
+            if (isIntermediate(cc))
+            {
+                collectIntermediate(cc);
+            }
+            else if (isFinal(cc))
+            {
+                _final = cc;
+                if (dcs)
+                {
+                    _state = DcsPassthrough;
+                }
+                else
+                {
+                    _state = Ground;
+                    _handler->csiDispatch(cc);
+                }
+            }
+            else
+            {
+                _state = dcs ? DcsIgnore : (isParameter(cc) ? CsiIgnore : Ground);
+            }
+            break;
+        }
+
+        case CsiIgnore:
+            if (isFinal(cc) || cc > DEL)
+                _state = Ground;
+            break;
+
+        case OscString:
+        case DcsPassthrough:
+            collectPayload(cc);
+            break;
+
+        case DcsIgnore:
+        case SosPmApcString:
+            break;
+
+        case StringEscape:
+            if (cc == '\\')
+            {
+                terminateString();
+            }
+            else
+            {
+                // anything but ST abandons the string and starts a new escape sequence
+                enterEscape();
+                receiveChar(cc);
+            }
+            break;
+
+        case Vt52Escape:
+            if (cc == 'Y')
+            {
+                _state = Vt52Row;
+            }
+            else
+            {
+                _state = Ground;
+                _handler->vt52Dispatch(cc, 0, 0);
+            }
+            break;
+
+        case Vt52Row:
+            _vt52Row = cc;
+            _state = Vt52Column;
+            break;
+
+        case Vt52Column:
+            _state = Ground;
+            _handler->vt52Dispatch('Y', _vt52Row, cc);
+            break;
+    }
+}
+
+QString Vt102Parser::describeSequence() const
+{
+    QString text = QLatin1String("ESC");
+    if (_introducer)
+        text += QChar(uint(_introducer));
+
+    if (_introducer == '[' || _introducer == 'P')
+    {
+        if (_privateMarker)
+            text += QChar(uint(_privateMarker));
+        for (int i = 0; i < _parameterCount; i++)
+        {
+            if (i > 0)
+                text += QLatin1Char(isSubParameter(i) ? ':' : ';');
+            text += QString::number(_parameters[i]);
+        }
+    }
+
+    for (int i = 0; i < _intermediateCount && i < MAX_INTERMEDIATES; i++)
+        text += QChar(uint(_intermediates[i]));
+    if (_final)
+        text += QChar(uint(_final));
+
+    if (!_payload.empty())
+        text += QString::fromWCharArray(_payload.data(), payloadLength());
+
+    return text;
+}
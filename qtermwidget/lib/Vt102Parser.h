@@ -0,0 +1,194 @@
+/*
+    This file is part of Konsole, an X terminal.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+    02110-1301  USA.
+*/
+
+#ifndef VT102PARSER_H
+#define VT102PARSER_H
+
+// Standard Library
+#include <vector>
+
+// Qt
+#include <QString>
+
+namespace Konsole
+{
+
+/**
+ * Receives the actions which a Vt102Parser recognizes in the incoming
+ * character stream.  While a dispatch method runs, the parameters,
+ * intermediates and payload of the sequence can be read from the parser.
+ */
+class Vt102ParserHandler
+{
+public:
+    virtual ~Vt102ParserHandler() {}
+
+    /** A printable character was received outside of any control sequence. */
+    virtual void print(wchar_t c) = 0;
+    /**
+     * A C0 control character was received.  Apart from CAN, SUB and ESC,
+     * control characters do not interrupt a control sequence in progress.
+     */
+    virtual void execute(wchar_t c) = 0;
+    /** The escape sequence ESC {intermediates} @p final was received. */
+    virtual void escDispatch(wchar_t final) = 0;
+    /** The control sequence CSI {marker} {parameters} {intermediates} @p final was received. */
+    virtual void csiDispatch(wchar_t final) = 0;
+    /** The operating system command ESC ] {payload} ST was received. */
+    virtual void oscDispatch() = 0;
+    /** The device control string ESC P {parameters} {intermediates} @p final {payload} ST was received. */
+    virtual void dcsDispatch(wchar_t final) = 0;
+    /**
+     * The VT52 escape sequence ESC @p c was received.  For ESC Y, @p row and
+     * @p column are the two characters following it, otherwise they are 0.
+     */
+    virtual void vt52Dispatch(wchar_t c, wchar_t row, wchar_t column) = 0;
+};
+
+/**
+ * A table-less implementation of the DEC / ECMA-48 parser state machine
+ * described by Paul Williams ( https://vt100.net/emu/dec_ansi_parser ),
+ * extended with the VT52 escape sequences.
+ *
+ * Each character is processed in constant time.  Parameters are accumulated
+ * as they arrive, with colon separated sub-parameters (as used by SGR) being
+ * marked as such.  The payloads of OSC and DCS strings are collected in a buffer
+ * which keeps its capacity between sequences, so long strings such as window
+ * titles cost no allocation once the buffer has grown.
+ *
+ * Recognized sequences are reported to a Vt102ParserHandler.
+ */
+class Vt102Parser
+{
+public:
+    /** The maximum number of parameters kept, further ones are ignored. */
+    static const int MAX_PARAMETERS = 32;
+    /** Parameters stop growing once they reach this value. */
+    static const int MAX_PARAMETER_VALUE = 4096;
+    /** The maximum length of an OSC or DCS payload, the rest is dropped. */
+    static const int MAX_PAYLOAD_LENGTH = 64 * 1024;
+
+    /** Constructs a parser which reports to @p handler */
+    explicit Vt102Parser(Vt102ParserHandler* handler);
+
+    /** Processes the next character of the input stream. */
+    void receiveChar(wchar_t cc);
+
+    /** Abandons any sequence in progress and returns to the ground state. */
+    void reset();
+
+    /** Selects between ANSI (ECMA-48) and VT52 escape sequences. */
+    void setAnsiMode(bool ansi);
+
+    /** Returns true if no control sequence is in progress. */
+    bool isIdle() const { return _state == Ground; }
+
+    /**
+     * Returns the number of parameters of the current sequence.  This is
+     * at least 1, since omitted parameters count as 0.
+     */
+    int parameterCount() const { return _parameterCount; }
+    /** Returns parameter @p index, or 0 if there is no such parameter. */
+    int parameter(int index) const
+    { return index < _parameterCount ? _parameters[index] : 0; }
+    /** Returns true if parameter @p index was preceded by a colon. */
+    bool isSubParameter(int index) const
+    { return index < _parameterCount && (_subParameters & (1u << index)); }
+
+    /** Returns the private marker ( '<', '=', '>' or '?' ) of the sequence, or 0 */
+    wchar_t privateMarker() const { return _privateMarker; }
+
+    /**
+     * Returns the number of intermediate characters of the sequence.  Only
+     * two of them are kept, but this counts them all.
+     */
+    int intermediateCount() const { return _intermediateCount; }
+    /** Returns intermediate character @p index, or 0 if it was not kept. */
+    wchar_t intermediate(int index) const
+    { return index < _intermediateCount && index < MAX_INTERMEDIATES ? _intermediates[index] : 0; }
+
+    /** Returns the payload of the current OSC or DCS string. */
+    const wchar_t* payload() const { return _payload.data(); }
+    /** Returns the length of payload() */
+    int payloadLength() const { return static_cast<int>(_payload.size()); }
+
+    /** Returns a readable rendition of the current sequence, for diagnostics. */
+    QString describeSequence() const;
+
+private:
+    enum State
+    {
+        Ground,
+        Escape,
+        EscapeIntermediate,
+        CsiEntry,
+        CsiParam,
+        CsiIntermediate,
+        CsiIgnore,
+        OscString,
+        DcsEntry,
+        DcsParam,
+        DcsIntermediate,
+        DcsPassthrough,
+        DcsIgnore,
+        SosPmApcString,
+        StringEscape,   // ESC seen inside a string, possibly the start of ST
+        Vt52Escape,
+        Vt52Row,
+        Vt52Column
+    };
+
+    static const int MAX_INTERMEDIATES = 2;
+
+    void receiveControl(wchar_t cc);
+    bool inString() const;
+
+    // clears the parameters, intermediates and payload of the last sequence
+    void clearSequence(wchar_t introducer);
+    void enterEscape();
+    void collectIntermediate(wchar_t cc);
+    void collectParameter(wchar_t cc);
+    void collectPayload(wchar_t cc);
+    void terminateString();
+
+    Vt102ParserHandler* _handler;
+    State _state;
+    State _stringState;  // the string state which StringEscape returns from
+    bool _ansi;
+
+    wchar_t _introducer; // '[', ']', 'P' or 0 for plain escape sequences
+    wchar_t _final;
+
+    int _parameters[MAX_PARAMETERS];
+    quint32 _subParameters;
+    int _parameterCount;
+    bool _parameterOverflow;
+
+    wchar_t _privateMarker;
+    wchar_t _intermediates[MAX_INTERMEDIATES];
+    int _intermediateCount;
+
+    std::vector<wchar_t> _payload;
+
+    wchar_t _vt52Row;
+};
+
+}
+
+#endif // VT102PARSER_H
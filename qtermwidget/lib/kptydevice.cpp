@@ -384,6 +384,23 @@ bool KPtyDevice::waitForBytesWritten(int msecs)
     return d->doWait(msecs, false);
 }
 
+const char *KPtyDevice::peekBuffered(int *length) const
+{
+    Q_D(const KPtyDevice);
+    if (!d->readBuffer.size()) {
+        *length = 0;
+        return nullptr;
+    }
+    *length = d->readBuffer.readSize();
+    return d->readBuffer.readPointer();
+}
+
+void KPtyDevice::skipBuffered(int length)
+{
+    Q_D(KPtyDevice);
+    d->readBuffer.free(qMin(length, d->readBuffer.size()));
+}
+
 void KPtyDevice::setSuspended(bool suspended)
 {
     Q_D(KPtyDevice);
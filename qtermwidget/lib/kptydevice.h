@@ -144,6 +144,23 @@ public:
     bool waitForBytesWritten(int msecs = -1) override;
     bool waitForReadyRead(int msecs = -1) override;
 
+    /**
+     * Returns a pointer to the next contiguous chunk of buffered input and
+     * stores its size in @p length, or returns nullptr if nothing is buffered.
+     *
+     * Unlike read(), no data is copied.  The pointer stays valid until
+     * skipBuffered() is called or the device reads more data from the pty.
+     * This bypasses the QIODevice buffer, so it is only meaningful for
+     * devices opened in Unbuffered mode (the default).
+     */
+    const char *peekBuffered(int *length) const;
+
+    /**
+     * Discards the first @p length bytes of buffered input, usually after
+     * they have been consumed through peekBuffered().
+     */
+    void skipBuffered(int length);
+
 
 Q_SIGNALS:
     /**
@@ -16,11 +16,14 @@
     Boston, MA 02110-1301, USA.
 */
 
+#include <algorithm>
+
 #include <QLayout>
 #include <QBoxLayout>
 #include <QtDebug>
 #include <QDir>
 #include <QMessageBox>
+#include <QMetaMethod>
 
 #include "ColorTables.h"
 #include "Session.h"
@@ -30,7 +33,9 @@
 #include "TerminalDisplay.h"
 #include "KeyboardTranslator.h"
 #include "ColorScheme.h"
+#include "HistoryExport.h"
 #include "SearchBar.h"
+#include "SessionPlayer.h"
 #include "qtermwidget.h"
 
 #ifdef Q_OS_MACOS
@@ -56,12 +61,23 @@ public:
 
     TerminalDisplay *m_terminalDisplay;
     Session *m_session;
+    QPointer<HistorySearch> m_historySearch;
+    // the search for all matches, to highlight them
+    QPointer<HistorySearch> m_matchSearch;
+    // the output changed since the matches were found
+    bool m_matchesOutdated;
+    HighlightFilter* m_highlightFilter;
+    QPointer<HistoryExport> m_historyExport;
+    SessionPlayer* m_player;
 
     Session* createSession(QWidget* parent);
     TerminalDisplay* createTerminalDisplay(Session *session, QWidget* parent);
 };
 
 TermWidgetImpl::TermWidgetImpl(QWidget* parent)
+    : m_matchesOutdated(false)
+    , m_highlightFilter(nullptr)
+    , m_player(nullptr)
 {
     this->m_session = createSession(parent);
     this->m_terminalDisplay = createTerminalDisplay(this->m_session, parent);
@@ -94,7 +110,7 @@ Session *TermWidgetImpl::createSession(QWidget* parent)
     session->setCodec(QTextCodec::codecForName("UTF-8"));
 
     session->setFlowControlEnabled(true);
-    session->setHistoryType(HistoryTypeBuffer(1000));
+    session->setHistoryType(CompactHistoryType(1000));
 
     session->setDarkBackground(true);
 
@@ -120,12 +136,14 @@ TerminalDisplay *TermWidgetImpl::createTerminalDisplay(Session *session, QWidget
 
 QTermWidget::QTermWidget(int startnow, QWidget *parent)
     : QWidget(parent)
+    , m_impl(nullptr)
 {
     init(startnow);
 }
 
 QTermWidget::QTermWidget(QWidget *parent)
     : QWidget(parent)
+    , m_impl(nullptr)
 {
     init(1);
 }
@@ -135,11 +153,78 @@ void QTermWidget::selectionChanged(bool textSelected)
     emit copyAvailable(textSelected);
 }
 
+static QRegExp searchRegExp(SearchBar* searchBar)
+{
+    QRegExp regExp(searchBar->searchText());
+    regExp.setPatternSyntax(searchBar->useRegularExpression() ? QRegExp::RegExp : QRegExp::FixedString);
+    regExp.setCaseSensitivity(searchBar->matchCase() ? Qt::CaseSensitive : Qt::CaseInsensitive);
+    return regExp;
+}
+
 void QTermWidget::find()
 {
+    findAllMatches();
     search(true, false);
 }
 
+void QTermWidget::findAllMatches()
+{
+    if (m_impl->m_matchSearch)
+        m_impl->m_matchSearch->cancel();
+
+    m_impl->m_terminalDisplay->clearSearchMatches();
+    m_impl->m_matchesOutdated = false;
+
+    if (m_searchBar->isHidden() || !m_searchBar->highlightAllMatches()
+        || m_searchBar->searchText().isEmpty())
+    {
+        m_searchBar->clearMatchCount();
+        return;
+    }
+
+    // The matches are counted and highlighted as they come in
+    HistorySearch *matchSearch =
+            new HistorySearch(m_impl->m_session->emulation(), searchRegExp(m_searchBar), true, 0, 0, this);
+    connect(matchSearch, &HistorySearch::matchesFound, this, [this] (const QList<HistorySearchMatch>& matches) {
+        QVector<TerminalDisplay::SearchMatch> displayMatches;
+        displayMatches.reserve(matches.size());
+        for (const HistorySearchMatch& match : matches)
+        {
+            TerminalDisplay::SearchMatch displayMatch;
+            displayMatch.start = QPoint(match.startColumn, match.startLine);
+            displayMatch.end = QPoint(match.endColumn, match.endLine);
+            displayMatches.append(displayMatch);
+        }
+        m_impl->m_terminalDisplay->addSearchMatches(displayMatches);
+        updateMatchCount();
+    });
+    connect(matchSearch, &HistorySearch::allMatchesFound, this, [this] (int) {
+        updateMatchCount();
+    });
+    m_impl->m_matchSearch = matchSearch;
+    matchSearch->findAllMatches();
+}
+
+void QTermWidget::updateMatchCount()
+{
+    const QVector<TerminalDisplay::SearchMatch>& matches = m_impl->m_terminalDisplay->searchMatches();
+
+    // the current match is the selected one, if any
+    int column, line;
+    m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionStart(column, line);
+    const QPoint selectionStart(column, line);
+    QVector<TerminalDisplay::SearchMatch>::const_iterator match =
+        std::lower_bound(matches.constBegin(), matches.constEnd(), selectionStart,
+                         [] (const TerminalDisplay::SearchMatch& m, const QPoint& position) {
+                             return m.start.y() < position.y()
+                                    || (m.start.y() == position.y() && m.start.x() < position.x());
+                         });
+    const int current = (match != matches.constEnd() && match->start == selectionStart)
+                        ? int(match - matches.constBegin()) + 1 : 0;
+
+    m_searchBar->setMatchCount(current, matches.size());
+}
+
 void QTermWidget::findNext()
 {
     search(true, true);
@@ -167,15 +252,20 @@ void QTermWidget::search(bool forwards, bool next)
     //qDebug() << "current selection starts at: " << startColumn << startLine;
     //qDebug() << "current cursor position: " << m_impl->m_terminalDisplay->screenWindow()->cursorPosition();
 
-    QRegExp regExp(m_searchBar->searchText());
-    regExp.setPatternSyntax(m_searchBar->useRegularExpression() ? QRegExp::RegExp : QRegExp::FixedString);
-    regExp.setCaseSensitivity(m_searchBar->matchCase() ? Qt::CaseSensitive : Qt::CaseInsensitive);
+    // A newer search makes the one still running obsolete
+    if (m_impl->m_historySearch)
+        m_impl->m_historySearch->cancel();
+
+    // Highlighted matches which have moved with the output are found again
+    if (m_impl->m_matchesOutdated)
+        findAllMatches();
 
     HistorySearch *historySearch =
-            new HistorySearch(m_impl->m_session->emulation(), regExp, forwards, startColumn, startLine, this);
+            new HistorySearch(m_impl->m_session->emulation(), searchRegExp(m_searchBar), forwards, startColumn, startLine, this);
     connect(historySearch, SIGNAL(matchFound(int, int, int, int)), this, SLOT(matchFound(int, int, int, int)));
     connect(historySearch, SIGNAL(noMatchFound()), this, SLOT(noMatchFound()));
     connect(historySearch, SIGNAL(noMatchFound()), m_searchBar, SLOT(noMatchFound()));
+    m_impl->m_historySearch = historySearch;
     historySearch->search();
 }
 
@@ -189,6 +279,7 @@ void QTermWidget::matchFound(int startColumn, int startLine, int endColumn, int
     sw->notifyOutputChanged();
     sw->setSelectionStart(startColumn, startLine - sw->currentLine(), false);
     sw->setSelectionEnd(endColumn, endLine - sw->currentLine());
+    updateMatchCount();
 }
 
 void QTermWidget::noMatchFound()
@@ -298,18 +389,40 @@ void QTermWidget::init(int startnow)
     connect(m_impl->m_session, SIGNAL(activity()), this, SIGNAL(activity()));
     connect(m_impl->m_session, SIGNAL(silence()), this, SIGNAL(silence()));
     connect(m_impl->m_session, &Session::profileChangeCommandReceived, this, &QTermWidget::profileChanged);
-    connect(m_impl->m_session, &Session::receivedData, this, &QTermWidget::receivedData);
 
     // That's OK, FilterChain's dtor takes care of UrlFilter.
     UrlFilter *urlFilter = new UrlFilter();
     connect(urlFilter, &UrlFilter::activated, this, &QTermWidget::urlActivated);
     m_impl->m_terminalDisplay->filterChain()->addFilter(urlFilter);
 
+    // without rules, the filter does nothing until loadHighlightRules()
+    m_impl->m_highlightFilter = new HighlightFilter();
+    m_impl->m_terminalDisplay->filterChain()->addFilter(m_impl->m_highlightFilter);
+
     m_searchBar = new SearchBar(this);
     m_searchBar->setSizePolicy(QSizePolicy::MinimumExpanding, QSizePolicy::Maximum);
     connect(m_searchBar, SIGNAL(searchCriteriaChanged()), this, SLOT(find()));
     connect(m_searchBar, SIGNAL(findNext()), this, SLOT(findNext()));
     connect(m_searchBar, SIGNAL(findPrevious()), this, SLOT(findPrevious()));
+    connect(m_searchBar, SIGNAL(highlightMatchesChanged(bool)), this, SLOT(findAllMatches()));
+    connect(m_impl->m_session->emulation(), &Emulation::outputChanged, this, [this] () {
+        m_impl->m_matchesOutdated = true;
+
+        // The highlighted matches, and those of a count which is still
+        // running, follow their text as the history drops lines
+        ScreenWindow* window = m_impl->m_terminalDisplay->screenWindow();
+        const int droppedLines = window ? window->screen()->droppedLines() : 0;
+        if (droppedLines > 0)
+        {
+            if (m_impl->m_matchSearch)
+                m_impl->m_matchSearch->dropLines(droppedLines);
+
+            const int matchCount = m_impl->m_terminalDisplay->searchMatches().size();
+            m_impl->m_terminalDisplay->dropSearchMatchLines(droppedLines);
+            if (m_impl->m_terminalDisplay->searchMatches().size() != matchCount)
+                updateMatchCount();
+        }
+    });
     m_layout->addWidget(m_searchBar);
     m_searchBar->hide();
 
@@ -497,8 +610,10 @@ void QTermWidget::setHistorySize(int lines)
 {
     if (lines < 0)
         m_impl->m_session->setHistoryType(HistoryTypeFile());
+    else if (lines == 0)
+        m_impl->m_session->setHistoryType(HistoryTypeNone());
     else
-        m_impl->m_session->setHistoryType(HistoryTypeBuffer(lines));
+        m_impl->m_session->setHistoryType(CompactHistoryType(lines));
 }
 
 void QTermWidget::setScrollBarPosition(ScrollBarPosition pos)
@@ -506,6 +621,26 @@ void QTermWidget::setScrollBarPosition(ScrollBarPosition pos)
     m_impl->m_terminalDisplay->setScrollBarPosition(pos);
 }
 
+void QTermWidget::setRenderBackend(RenderBackend backend)
+{
+    m_impl->m_terminalDisplay->setRenderBackend(backend);
+}
+
+QTermWidget::RenderBackend QTermWidget::renderBackend() const
+{
+    return m_impl->m_terminalDisplay->renderBackend();
+}
+
+void QTermWidget::setFilterUpdateMode(FilterUpdateMode mode)
+{
+    m_impl->m_terminalDisplay->setFilterUpdateMode(mode);
+}
+
+QTermWidget::FilterUpdateMode QTermWidget::filterUpdateMode() const
+{
+    return m_impl->m_terminalDisplay->filterUpdateMode();
+}
+
 void QTermWidget::scrollToEnd()
 {
     m_impl->m_terminalDisplay->scrollToEnd();
@@ -671,6 +806,19 @@ void QTermWidget::getSelectionEnd(int& row, int& column)
     m_impl->m_terminalDisplay->screenWindow()->screen()->getSelectionEnd(column, row);
 }
 
+void QTermWidget::getUpdateCounts(quint64& updates, quint64& coalesced, quint64& skipped)
+{
+    Emulation* emulation = m_impl->m_session->emulation();
+    updates = emulation->updateCount();
+    coalesced = emulation->coalescedUpdateCount();
+    skipped = emulation->skippedUpdateCount();
+}
+
+quint64 QTermWidget::fillRectCount() const
+{
+    return m_impl->m_terminalDisplay->fillRectCount();
+}
+
 QString QTermWidget::selectedText(bool preserveLineBreaks)
 {
     return m_impl->m_terminalDisplay->screenWindow()->screen()->selectedText(preserveLineBreaks);
@@ -700,6 +848,7 @@ Filter::HotSpot* QTermWidget::getHotSpotAt(const QPoint &pos) const
 
 Filter::HotSpot* QTermWidget::getHotSpotAt(int row, int column) const
 {
+    m_impl->m_terminalDisplay->processPendingFilters();
     return m_impl->m_terminalDisplay->filterChain()->hotSpotAt(row, column);
 }
 
@@ -708,6 +857,20 @@ QList<QAction*> QTermWidget::filterActions(const QPoint& position)
     return m_impl->m_terminalDisplay->filterActions(position);
 }
 
+bool QTermWidget::loadHighlightRules(const QString& fileName)
+{
+    if (!m_impl->m_highlightFilter->load(fileName))
+        return false;
+
+    m_impl->m_terminalDisplay->processFilters();
+    return true;
+}
+
+HighlightFilter* QTermWidget::highlightFilter() const
+{
+    return m_impl->m_highlightFilter;
+}
+
 int QTermWidget::getPtySlaveFd() const
 {
     return m_impl->m_session->getPtySlaveFd();
@@ -784,6 +947,97 @@ void QTermWidget::saveHistory(QIODevice *device)
     m_impl->m_session->emulation()->writeToStream(&decoder, 0, m_impl->m_session->emulation()->lineCount());
 }
 
+bool QTermWidget::exportHistory(QIODevice *device, HistoryFormat format)
+{
+    if (m_impl->m_historyExport)
+        return false;
+
+    HistoryExport* historyExport = new HistoryExport(m_impl->m_session->emulation(), device,
+                                                     static_cast<HistoryExport::Format>(format),
+                                                     m_impl->m_terminalDisplay->colorTable(), this);
+    connect(historyExport, &HistoryExport::progress, this, &QTermWidget::historyExportProgress);
+    // the next export may be started as soon as this one has finished
+    connect(historyExport, &HistoryExport::finished, this, [this, historyExport] (bool ok) {
+        m_impl->m_historyExport.clear();
+        emit historyExportFinished(ok, historyExport->skippedLines());
+    });
+    m_impl->m_historyExport = historyExport;
+    historyExport->start();
+    return true;
+}
+
+void QTermWidget::cancelHistoryExport()
+{
+    if (m_impl->m_historyExport)
+        m_impl->m_historyExport->cancel();
+}
+
+void QTermWidget::connectNotify(const QMetaMethod &signal)
+{
+    // the output of the session is only passed on while something listens,
+    // which saves decoding it into text for nothing
+    if (!m_impl)
+        return;
+
+    if (signal == QMetaMethod::fromSignal(&QTermWidget::receivedData))
+        connect(m_impl->m_session, &Session::receivedData, this, &QTermWidget::receivedData, Qt::UniqueConnection);
+    else if (signal == QMetaMethod::fromSignal(&QTermWidget::receivedBytes))
+        connect(m_impl->m_session, &Session::receivedBytes, this, &QTermWidget::receivedBytes, Qt::UniqueConnection);
+}
+
+void QTermWidget::disconnectNotify(const QMetaMethod &signal)
+{
+    if (!m_impl)
+        return;
+
+    // an invalid signal stands for disconnecting all of them
+    const QMetaMethod receivedDataSignal = QMetaMethod::fromSignal(&QTermWidget::receivedData);
+    if ((!signal.isValid() || signal == receivedDataSignal) && !isSignalConnected(receivedDataSignal))
+        disconnect(m_impl->m_session, &Session::receivedData, this, &QTermWidget::receivedData);
+
+    const QMetaMethod receivedBytesSignal = QMetaMethod::fromSignal(&QTermWidget::receivedBytes);
+    if ((!signal.isValid() || signal == receivedBytesSignal) && !isSignalConnected(receivedBytesSignal))
+        disconnect(m_impl->m_session, &Session::receivedBytes, this, &QTermWidget::receivedBytes);
+}
+
+bool QTermWidget::startRecording(const QString &fileName)
+{
+    return m_impl->m_session->startRecording(fileName);
+}
+
+void QTermWidget::stopRecording()
+{
+    m_impl->m_session->stopRecording();
+}
+
+bool QTermWidget::isRecording() const
+{
+    return m_impl->m_session->isRecording();
+}
+
+bool QTermWidget::replayRecording(const QString &fileName, qreal speed)
+{
+    if (!m_impl->m_player) {
+        m_impl->m_player = new SessionPlayer(m_impl->m_session->emulation(), this);
+        connect(m_impl->m_player, &SessionPlayer::finished, this, &QTermWidget::replayFinished);
+    }
+
+    m_impl->m_player->setSpeed(speed);
+    return m_impl->m_player->start(fileName);
+}
+
+void QTermWidget::setReplaySpeed(qreal speed)
+{
+    if (m_impl->m_player)
+        m_impl->m_player->setSpeed(speed);
+}
+
+void QTermWidget::stopReplay()
+{
+    if (m_impl->m_player)
+        m_impl->m_player->stop();
+}
+
 void QTermWidget::setDrawLineChars(bool drawLineChars)
 {
     m_impl->m_terminalDisplay->setDrawLineChars(drawLineChars);
@@ -48,6 +48,49 @@ public:
         ScrollBarRight = 2
     };
 
+    /**
+     * This enum describes the formats in which the history can be exported.
+     */
+    enum HistoryFormat {
+        /** Plain text, as written by saveHistory(). */
+        PlainTextHistory = 0,
+        /** A HTML document with the colors of the text. */
+        HtmlHistory = 1,
+        /** Text with the colors as ANSI escape sequences. */
+        AnsiHistory = 2,
+        /** One JSON object per line, with the time at which the line was output. */
+        JsonLinesHistory = 3
+    };
+
+    /**
+     * This enum describes how the terminal is drawn.
+     */
+    enum RenderBackend {
+        /** Draw with QPainter, the default. */
+        RasterBackend = 0,
+        /**
+         * Draw the text with OpenGL 3.3 or OpenGL ES 3.0.  Hotspots, search
+         * matches, background images and opacity are not drawn.  Falls back to
+         * RasterBackend if OpenGL is not available.
+         */
+        OpenGLBackend = 1
+    };
+
+    /**
+     * This enum describes when the filters, which find the URLs and the text of
+     * the highlight rules, run after the output has changed.
+     */
+    enum FilterUpdateMode {
+        /** The filters run on every change of the output. */
+        ImmediateFilterUpdates = 0,
+        /**
+         * The filters run once the output has been idle for a moment, and at most a
+         * few times per second while it keeps changing, the default.  They also run
+         * when the hotspots are needed, such as when the mouse moves over the terminal.
+         */
+        DeferredFilterUpdates = 1
+    };
+
     using KeyboardCursorShape = Konsole::Emulation::KeyboardCursorShape;
 
     //Creation of widget
@@ -116,11 +159,19 @@ public:
     static void addCustomColorSchemeDir(const QString& custom_dir);
 
     // History size for scrolling
-    void setHistorySize(int lines); //infinite if lines < 0
+    void setHistorySize(int lines); //infinite if lines < 0, disabled if 0
 
     // Presence of scrollbar
     void setScrollBarPosition(ScrollBarPosition);
 
+    // How the terminal is drawn, RasterBackend by default
+    void setRenderBackend(RenderBackend backend);
+    RenderBackend renderBackend() const;
+
+    // When the filters run after the output has changed, DeferredFilterUpdates by default
+    void setFilterUpdateMode(FilterUpdateMode mode);
+    FilterUpdateMode filterUpdateMode() const;
+
     // Wrapped, scroll to end.
     void scrollToEnd();
 
@@ -162,6 +213,19 @@ public:
     void getSelectionStart(int& row, int& column);
     void getSelectionEnd(int& row, int& column);
 
+    /**
+     * Returns the number of updates of the display made so far, the number of
+     * requests for an update which were merged into one already scheduled,
+     * and the number of updates skipped while the terminal was hidden.
+     */
+    void getUpdateCounts(quint64& updates, quint64& coalesced, quint64& skipped);
+
+    /**
+     * Returns the number of rectangles filled with a background color by the
+     * display so far.
+     */
+    quint64 fillRectCount() const;
+
     /**
      * Returns the currently selected text.
      * @param preserveLineBreaks Specifies whether new line characters should
@@ -193,6 +257,56 @@ public:
      * */
     QList<QAction*> filterActions(const QPoint& position);
 
+    /**
+     * Loads the rules for highlighting text in the terminal from @p fileName,
+     * replacing the current rules.  See Konsole::HighlightFilter for the format.
+     *
+     * @return false if the file cannot be read.
+     */
+    bool loadHighlightRules(const QString& fileName);
+
+    /**
+     * Returns the filter which highlights text according to the rules, to set
+     * the rules directly or to read their statistics.
+     */
+    Konsole::HighlightFilter* highlightFilter() const;
+
+    /**
+     * Exports the whole history, followed by the screen, to @p device in
+     * @p format without blocking, unlike saveHistory().  The progress is reported
+     * by historyExportProgress() and the end of the export by
+     * historyExportFinished(), the device must not be used until then.
+     *
+     * @return false if another export is still running.
+     */
+    bool exportHistory(QIODevice* device, HistoryFormat format);
+
+    /** Cancels the export started by exportHistory(). */
+    void cancelHistoryExport();
+
+    /**
+     * Records the output and the input of the terminal, with their timing, to
+     * @p fileName in the asciicast v2 format, until stopRecording() is called.
+     *
+     * @return false if the file cannot be created.
+     */
+    bool startRecording(const QString& fileName);
+    void stopRecording();
+    bool isRecording() const;
+
+    /**
+     * Plays the output recorded in @p fileName in the terminal, at @p speed
+     * times the recorded speed (1 to 100), or as fast as possible if @p speed
+     * is 0.  replayFinished() is emitted at the end.  This is meant for
+     * terminals which do not run a program, see startTerminalTeletype().
+     *
+     * @return false if the file is not a recording which can be played.
+     */
+    bool replayRecording(const QString& fileName, qreal speed = 1);
+    /** Changes the speed of the recording being played, see replayRecording(). */
+    void setReplaySpeed(qreal speed);
+    void stopReplay();
+
     /**
      * Returns a pty slave file descriptor.
      * This can be used for display and control
@@ -272,10 +386,30 @@ signals:
 
     /**
      * Signals that we received new data from the process running in the
-     * terminal emulator
+     * terminal emulator.  The data is decoded with the text codec of the
+     * terminal and emitted once per screen update, and only decoded while
+     * this signal is connected.
      */
     void receivedData(const QString &text);
 
+    /**
+     * Signals each block of bytes read from the process running in the
+     * terminal emulator, before it is processed.  @p data is only valid during
+     * the emission, so the connections have to be direct.
+     */
+    void receivedBytes(const char *data, int length);
+
+    void historyExportProgress(int exportedLines, int totalLines);
+    /**
+     * Signals the end of the export started by exportHistory().  @p skippedLines
+     * lines were dropped from the history before they could be exported, the
+     * output marks where they are missing.
+     */
+    void historyExportFinished(bool ok, int skippedLines);
+
+    /** Emitted at the end of replayRecording() with the bytes played and the time it took. */
+    void replayFinished(qint64 bytes, qint64 msecs);
+
 public slots:
     // Copy selection to clipboard
     void copyClipboard();
@@ -306,6 +440,8 @@ public slots:
     void saveHistory(QIODevice *device);
 protected:
     void resizeEvent(QResizeEvent *) override;
+    void connectNotify(const QMetaMethod &signal) override;
+    void disconnectNotify(const QMetaMethod &signal) override;
 
 protected slots:
     void sessionFinished();
@@ -315,6 +451,7 @@ private slots:
     void find();
     void findNext();
     void findPrevious();
+    void findAllMatches();
     void matchFound(int startColumn, int startLine, int endColumn, int endLine);
     void noMatchFound();
     /**
@@ -325,6 +462,7 @@ private slots:
 
 private:
     void search(bool forwards, bool next);
+    void updateMatchCount();
     void setZoom(int step);
     void init(int startnow);
     TermWidgetImpl * m_impl;